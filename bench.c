@@ -0,0 +1,603 @@
+// Throughput benchmark of the engines. Every kernel is a small guest program
+// that loops forever and is stopped by the instruction limit of the hart, so
+// all kernels and engines run for the same number of instructions. The
+// kernels are assembled here, which keeps the benchmark independent of a
+// RISC-V toolchain.
+//
+// Every kernel and engine pair prints one JSON object per line with the best
+// of several runs, which is far less noisy than the mean.
+#include "cpu.h"
+#include "mmu.h"
+#include "types.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_RAM_SIZE (16 << 20)
+#define BENCH_CODE 0x0
+#define BENCH_DATA 0x100000
+#define BENCH_MAX_CODE 256
+
+// Registers used by the kernels
+#define ZERO 0
+#define T0 5
+#define T1 6
+#define T2 7
+#define S0 8
+#define S1 9
+#define A0 10
+#define A1 11
+#define A2 12
+#define A3 13
+#define S2 18
+#define S3 19
+#define FT0 0
+#define FT1 1
+#define FA0 10
+
+struct Assembler {
+  u32 code[BENCH_MAX_CODE];
+  u32 length;
+};
+
+static u32 here(const struct Assembler *as) {
+  return as->length;
+}
+
+static void emit(struct Assembler *as, u32 inst) {
+  if (as->length == BENCH_MAX_CODE) {
+    fprintf(stderr, "Kernel is too large\n");
+    exit(2);
+  }
+  as->code[as->length++] = inst;
+}
+
+static void r_type(struct Assembler *as, u32 funct7, u32 funct3, u32 opcode,
+                   u32 rd, u32 rs1, u32 rs2) {
+  emit(as, funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 |
+               opcode);
+}
+
+static void i_type(struct Assembler *as, u32 funct3, u32 opcode, u32 rd,
+                   u32 rs1, i32 imm) {
+  emit(as, (u32)imm << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode);
+}
+
+static void s_type(struct Assembler *as, u32 funct3, u32 rs1, u32 rs2,
+                   i32 imm) {
+  emit(as, ((u32)imm >> 5) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 |
+               ((u32)imm & 0x1F) << 7 | 0x23);
+}
+
+static u32 b_type(u32 funct3, u32 rs1, u32 rs2, i32 offset) {
+  u32 imm = offset;
+  return ((imm >> 12) & 1) << 31 | ((imm >> 5) & 0x3F) << 25 | rs2 << 20 |
+         rs1 << 15 | funct3 << 12 | ((imm >> 1) & 0xF) << 8 |
+         ((imm >> 11) & 1) << 7 | 0x63;
+}
+
+static void lui(struct Assembler *as, u32 rd, u32 imm) {
+  emit(as, (imm & 0xFFFFF000) | rd << 7 | 0x37);
+}
+
+static void addi(struct Assembler *as, u32 rd, u32 rs1, i32 imm) {
+  i_type(as, 0, 0x13, rd, rs1, imm);
+}
+
+static void andi(struct Assembler *as, u32 rd, u32 rs1, i32 imm) {
+  i_type(as, 7, 0x13, rd, rs1, imm);
+}
+
+static void slli(struct Assembler *as, u32 rd, u32 rs1, u32 shamt) {
+  i_type(as, 1, 0x13, rd, rs1, shamt);
+}
+
+static void srli(struct Assembler *as, u32 rd, u32 rs1, u32 shamt) {
+  i_type(as, 5, 0x13, rd, rs1, shamt);
+}
+
+static void add(struct Assembler *as, u32 rd, u32 rs1, u32 rs2) {
+  r_type(as, 0, 0, 0x33, rd, rs1, rs2);
+}
+
+static void xor(struct Assembler *as, u32 rd, u32 rs1, u32 rs2) {
+  r_type(as, 0, 4, 0x33, rd, rs1, rs2);
+}
+
+static void and(struct Assembler *as, u32 rd, u32 rs1, u32 rs2) {
+  r_type(as, 0, 7, 0x33, rd, rs1, rs2);
+}
+
+static void subw(struct Assembler *as, u32 rd, u32 rs1, u32 rs2) {
+  r_type(as, 0x20, 0, 0x3B, rd, rs1, rs2);
+}
+
+static void mul(struct Assembler *as, u32 rd, u32 rs1, u32 rs2) {
+  r_type(as, 1, 0, 0x33, rd, rs1, rs2);
+}
+
+static void mulhu(struct Assembler *as, u32 rd, u32 rs1, u32 rs2) {
+  r_type(as, 1, 3, 0x33, rd, rs1, rs2);
+}
+
+static void divu(struct Assembler *as, u32 rd, u32 rs1, u32 rs2) {
+  r_type(as, 1, 5, 0x33, rd, rs1, rs2);
+}
+
+static void remu(struct Assembler *as, u32 rd, u32 rs1, u32 rs2) {
+  r_type(as, 1, 7, 0x33, rd, rs1, rs2);
+}
+
+static void fld(struct Assembler *as, u32 rd, u32 rs1, i32 imm) {
+  i_type(as, 3, 0x07, rd, rs1, imm);
+}
+
+static void fsd(struct Assembler *as, u32 rs2, u32 rs1, i32 imm) {
+  emit(as, ((u32)imm >> 5) << 25 | rs2 << 20 | rs1 << 15 | 3 << 12 |
+               ((u32)imm & 0x1F) << 7 | 0x27);
+}
+
+// Rounds with frm
+static void fmadd_d(struct Assembler *as, u32 rd, u32 rs1, u32 rs2,
+                    u32 rs3) {
+  emit(as, rs3 << 27 | 1 << 25 | rs2 << 20 | rs1 << 15 | 7 << 12 | rd << 7 |
+               0x43);
+}
+
+static void lbu(struct Assembler *as, u32 rd, u32 rs1, i32 imm) {
+  i_type(as, 4, 0x03, rd, rs1, imm);
+}
+
+static void ld(struct Assembler *as, u32 rd, u32 rs1, i32 imm) {
+  i_type(as, 3, 0x03, rd, rs1, imm);
+}
+
+static void sb(struct Assembler *as, u32 rs2, u32 rs1, i32 imm) {
+  s_type(as, 0, rs1, rs2, imm);
+}
+
+static void sd(struct Assembler *as, u32 rs2, u32 rs1, i32 imm) {
+  s_type(as, 3, rs1, rs2, imm);
+}
+
+// Branches and jumps to an instruction index. Forward ones are emitted
+// without a target and fixed up with patch_branch() once it is known.
+static void branch(struct Assembler *as, u32 funct3, u32 rs1, u32 rs2,
+                   u32 target) {
+  emit(as, b_type(funct3, rs1, rs2, 4 * ((i32)target - (i32)here(as))));
+}
+
+static void beq(struct Assembler *as, u32 rs1, u32 rs2, u32 target) {
+  branch(as, 0, rs1, rs2, target);
+}
+
+static void bne(struct Assembler *as, u32 rs1, u32 rs2, u32 target) {
+  branch(as, 1, rs1, rs2, target);
+}
+
+static void bgeu(struct Assembler *as, u32 rs1, u32 rs2, u32 target) {
+  branch(as, 7, rs1, rs2, target);
+}
+
+static void patch_branch(struct Assembler *as, u32 at, u32 target) {
+  u32 inst = as->code[at];
+  as->code[at] = b_type((inst >> 12) & 7, (inst >> 15) & 0x1F,
+                        (inst >> 20) & 0x1F, 4 * ((i32)target - (i32)at));
+}
+
+static void jump(struct Assembler *as, u32 target) {
+  u32 imm = 4 * ((i32)target - (i32)here(as));
+  emit(as, ((imm >> 20) & 1) << 31 | ((imm >> 1) & 0x3FF) << 21 |
+               ((imm >> 11) & 1) << 20 | ((imm >> 12) & 0xFF) << 12 | 0x6F);
+}
+
+// Loads a 32 bit constant, sign extended like lui does
+static void li(struct Assembler *as, u32 rd, u32 value) {
+  u32 low = value & 0xFFF;
+  lui(as, rd, value + ((low & 0x800) << 1));
+  addi(as, rd, rd, (i32)(low << 20) >> 20);
+}
+
+// Guest data set up before every run
+struct Kernel {
+  const char *name;
+  void (*assemble)(struct Assembler *as);
+  void (*prepare)(struct Memory *mem);
+};
+
+// Dependent adds, the best case for every engine
+static void assemble_fib(struct Assembler *as) {
+  addi(as, A0, ZERO, 0);
+  addi(as, A1, ZERO, 1);
+  u32 loop = here(as);
+  add(as, A2, A0, A1);
+  addi(as, A0, A1, 0);
+  addi(as, A1, A2, 0);
+  jump(as, loop);
+}
+
+#define MEMCPY_SIZE (64 << 10)
+
+// Copies 64 KiB over and over, 16 bytes per iteration
+static void assemble_memcpy(struct Assembler *as) {
+  li(as, S0, BENCH_DATA);
+  li(as, S1, BENCH_DATA + MEMCPY_SIZE);
+  li(as, S2, BENCH_DATA + MEMCPY_SIZE);
+  u32 outer = here(as);
+  addi(as, T0, S0, 0);
+  addi(as, T1, S1, 0);
+  u32 loop = here(as);
+  ld(as, T2, T0, 0);
+  sd(as, T2, T1, 0);
+  ld(as, A0, T0, 8);
+  sd(as, A0, T1, 8);
+  addi(as, T0, T0, 16);
+  addi(as, T1, T1, 16);
+  bne(as, T0, S2, loop);
+  jump(as, outer);
+}
+
+#define SIEVE_SIZE (64 << 10)
+
+// Sieve of Eratosthenes over a byte per number, mostly byte loads and stores
+// and short loops
+static void assemble_sieve(struct Assembler *as) {
+  li(as, S0, BENCH_DATA);
+  li(as, S1, SIEVE_SIZE);
+  li(as, S2, BENCH_DATA + SIEVE_SIZE);
+  addi(as, S3, ZERO, 1);
+  u32 outer = here(as);
+  // Clear the flags
+  addi(as, T0, S0, 0);
+  u32 clear = here(as);
+  sd(as, ZERO, T0, 0);
+  addi(as, T0, T0, 8);
+  bne(as, T0, S2, clear);
+  addi(as, A0, ZERO, 2);
+  u32 next_prime = here(as);
+  bgeu(as, A0, S1, outer);
+  add(as, T0, S0, A0);
+  lbu(as, T1, T0, 0);
+  u32 composite = here(as);
+  bne(as, T1, ZERO, 0);
+  add(as, A1, A0, A0);
+  u32 mark = here(as);
+  bgeu(as, A1, S1, 0);
+  add(as, T0, S0, A1);
+  sb(as, S3, T0, 0);
+  add(as, A1, A1, A0);
+  jump(as, mark);
+  patch_branch(as, composite, here(as));
+  patch_branch(as, mark, here(as));
+  addi(as, A0, A0, 1);
+  jump(as, next_prime);
+}
+
+#define CRC_SIZE (4 << 10)
+#define CRC_POLY 0xEDB88320
+
+// Bitwise CRC-32 of 4 KiB, branch free and heavy on ALU instructions
+static void assemble_crc(struct Assembler *as) {
+  li(as, S0, BENCH_DATA);
+  li(as, S1, BENCH_DATA + CRC_SIZE);
+  li(as, S2, CRC_POLY);
+  slli(as, S2, S2, 32);
+  srli(as, S2, S2, 32);
+  u32 outer = here(as);
+  addi(as, T0, S0, 0);
+  addi(as, A0, ZERO, -1);
+  srli(as, A0, A0, 32);
+  u32 loop = here(as);
+  lbu(as, T1, T0, 0);
+  xor(as, A0, A0, T1);
+  for (int bit = 0; bit < 8; bit++) {
+    // crc = (crc >> 1) ^ (-(crc & 1) & poly)
+    andi(as, T1, A0, 1);
+    subw(as, T1, ZERO, T1);
+    and(as, T1, T1, S2);
+    srli(as, A0, A0, 1);
+    xor(as, A0, A0, T1);
+  }
+  addi(as, T0, T0, 1);
+  bne(as, T0, S1, loop);
+  jump(as, outer);
+}
+
+static u64 xorshift(u64 *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static void prepare_crc(struct Memory *mem) {
+  u64 state = 1;
+  for (u64 i = 0; i < CRC_SIZE; i += sizeof(u64)) {
+    memory_write64(mem, BENCH_DATA + i, xorshift(&state));
+  }
+}
+
+#define CHASE_NODES (16 << 10)
+#define CHASE_NODE_SIZE 64
+
+// Walks a linked list of 1 MiB in random order, so every load depends on the
+// previous one and is bound by the latency of the host caches
+static void assemble_chase(struct Assembler *as) {
+  li(as, A0, BENCH_DATA);
+  u32 loop = here(as);
+  for (int i = 0; i < 4; i++) {
+    ld(as, A0, A0, 0);
+  }
+  jump(as, loop);
+}
+
+static void prepare_chase(struct Memory *mem) {
+  u32 *order = malloc(CHASE_NODES * sizeof(u32));
+  if (!order) {
+    perror("malloc");
+    exit(2);
+  }
+  for (u32 i = 0; i < CHASE_NODES; i++) {
+    order[i] = i;
+  }
+  u64 state = 1;
+  for (u32 i = CHASE_NODES - 1; i > 0; i--) {
+    u32 j = xorshift(&state) % (i + 1);
+    u32 node = order[i];
+    order[i] = order[j];
+    order[j] = node;
+  }
+  // A single cycle through all nodes, BENCH_DATA is one of them
+  for (u32 i = 0; i < CHASE_NODES; i++) {
+    u64 node = BENCH_DATA + (u64)order[i] * CHASE_NODE_SIZE;
+    u64 next = BENCH_DATA + (u64)order[(i + 1) % CHASE_NODES] * CHASE_NODE_SIZE;
+    memory_write64(mem, node, next);
+  }
+  free(order);
+}
+
+// Two branches per iteration on the bits of a xorshift generator, which the
+// host can not predict
+static void assemble_branchy(struct Assembler *as) {
+  addi(as, A0, ZERO, 1);
+  u32 loop = here(as);
+  slli(as, T0, A0, 13);
+  xor(as, A0, A0, T0);
+  srli(as, T0, A0, 7);
+  xor(as, A0, A0, T0);
+  slli(as, T0, A0, 17);
+  xor(as, A0, A0, T0);
+  andi(as, T0, A0, 1);
+  u32 odd = here(as);
+  beq(as, T0, ZERO, 0);
+  addi(as, A1, A1, 1);
+  patch_branch(as, odd, here(as));
+  andi(as, T0, A0, 2);
+  u32 second = here(as);
+  bne(as, T0, ZERO, 0);
+  addi(as, A2, A2, 1);
+  jump(as, loop);
+  patch_branch(as, second, here(as));
+  addi(as, A3, A3, 1);
+  jump(as, loop);
+}
+
+#define MULDIV_MULTIPLIER 0x4C957F2D
+#define MULDIV_DIVISOR 1000003
+
+// A linear congruential generator whose output is hashed with a high multiply
+// and reduced with a division and a remainder, like hash tables do
+static void assemble_muldiv(struct Assembler *as) {
+  li(as, S0, MULDIV_MULTIPLIER);
+  li(as, S1, MULDIV_DIVISOR);
+  addi(as, A0, ZERO, 1);
+  u32 loop = here(as);
+  mul(as, A0, A0, S0);
+  addi(as, A0, A0, 1);
+  mulhu(as, T0, A0, S0);
+  divu(as, T1, A0, S1);
+  remu(as, T2, A0, S1);
+  add(as, A1, A1, T0);
+  add(as, A1, A1, T1);
+  add(as, A1, A1, T2);
+  jump(as, loop);
+}
+
+#define AXPY_LENGTH 512
+#define AXPY_X BENCH_DATA
+#define AXPY_Y (AXPY_X + AXPY_LENGTH * sizeof(double))
+#define AXPY_A (AXPY_Y + AXPY_LENGTH * sizeof(double))
+
+// y = a * x + y over 4 KiB vectors of doubles, a fused multiply-add per
+// element
+static void assemble_axpy(struct Assembler *as) {
+  li(as, T0, AXPY_A);
+  fld(as, FA0, T0, 0);
+  li(as, S2, AXPY_Y);
+  u32 outer = here(as);
+  li(as, S0, AXPY_X);
+  li(as, S1, AXPY_Y);
+  u32 loop = here(as);
+  fld(as, FT0, S0, 0);
+  fld(as, FT1, S1, 0);
+  fmadd_d(as, FT1, FA0, FT0, FT1);
+  fsd(as, FT1, S1, 0);
+  addi(as, S0, S0, 8);
+  addi(as, S1, S1, 8);
+  bne(as, S0, S2, loop);
+  jump(as, outer);
+}
+
+static void prepare_axpy(struct Memory *mem) {
+  for (u32 i = 0; i < AXPY_LENGTH; i++) {
+    double x = i * 0.25;
+    u64 bits;
+    memcpy(&bits, &x, sizeof(bits));
+    memory_write64(mem, AXPY_X + i * sizeof(double), bits);
+  }
+  double a = 0.5;
+  u64 bits;
+  memcpy(&bits, &a, sizeof(bits));
+  memory_write64(mem, AXPY_A, bits);
+}
+
+static const struct Kernel kernels[] = {
+    {"fib", assemble_fib, NULL},
+    {"memcpy", assemble_memcpy, NULL},
+    {"sieve", assemble_sieve, NULL},
+    {"crc", assemble_crc, prepare_crc},
+    {"chase", assemble_chase, prepare_chase},
+    {"branchy", assemble_branchy, NULL},
+    {"muldiv", assemble_muldiv, NULL},
+    {"axpy", assemble_axpy, prepare_axpy},
+};
+
+struct EngineName {
+  const char *name;
+  enum Engine engine;
+};
+
+static const struct EngineName engines[] = {
+    {"switch", ENGINE_SWITCH},
+    {"cached", ENGINE_CACHED},
+    {"threaded", ENGINE_THREADED},
+#if defined(__x86_64__)
+    {"jit", ENGINE_JIT},
+#endif
+};
+
+#define ARRAY_LENGTH(_array) (sizeof(_array) / sizeof((_array)[0]))
+
+// One run of a kernel
+struct Sample {
+  u64 instructions;
+  double seconds;
+  u64 cycles;
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Reference cycles of the time stamp counter, 0 where there is none
+static u64 cycles(void) {
+#if defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void run(const struct Kernel *kernel, const struct Assembler *as,
+                struct Memory *mem, enum Engine engine, u64 budget,
+                struct Sample *sample) {
+  memory_zero(mem, mem->ram_base, mem->size);
+  memory_write(mem, BENCH_CODE, (void *)as->code,
+               as->length * sizeof(as->code[0]));
+  if (kernel->prepare) {
+    kernel->prepare(mem);
+  }
+  struct CPU cpu;
+  cpu_init(&cpu, 0, BENCH_CODE);
+  cpu.instret_limit = budget;
+  double start = now();
+  u64 start_cycles = cycles();
+  cpu_loop(&cpu, mem, engine, NULL, NULL, NULL);
+  sample->cycles = cycles() - start_cycles;
+  sample->seconds = now() - start;
+  sample->instructions = cpu.instret;
+}
+
+static void report(const char *kernel, const char *engine,
+                   const struct Sample *best) {
+  double instructions = best->instructions;
+  printf("{\"kernel\": \"%s\", \"engine\": \"%s\", \"instructions\": %lu, "
+         "\"seconds\": %.6f, \"mips\": %.2f, \"ns_per_instruction\": %.4f, "
+         "\"cycles_per_instruction\": %.3f}\n",
+         kernel, engine, best->instructions, best->seconds,
+         instructions / best->seconds * 1e-6,
+         best->seconds * 1e9 / instructions, best->cycles / instructions);
+  fflush(stdout);
+}
+
+static bool parse_number(const char *text, u64 *value) {
+  char *end;
+  *value = strtoull(text, &end, 0);
+  return '\0' != *text && '\0' == *end;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-n instructions] [-r runs] [-k kernel] [-e engine]\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  u64 budget = 50000000;
+  u64 runs = 3;
+  const char *only_kernel = NULL;
+  const char *only_engine = NULL;
+  int c;
+  while (-1 != (c = getopt(argc, argv, "n:r:k:e:"))) {
+    switch (c) {
+    case 'n':
+      if (!parse_number(optarg, &budget) || 0 == budget) {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'r':
+      if (!parse_number(optarg, &runs) || 0 == runs) {
+        usage(argv[0]);
+        return 2;
+      }
+      break;
+    case 'k':
+      only_kernel = optarg;
+      break;
+    case 'e':
+      only_engine = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (optind != argc) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  struct Memory mem;
+  if (!ram_init(&mem, 0, BENCH_RAM_SIZE, RAM_PAGES_DEFAULT)) {
+    return 2;
+  }
+  for (u32 k = 0; k < ARRAY_LENGTH(kernels); k++) {
+    const struct Kernel *kernel = &kernels[k];
+    if (only_kernel && 0 != strcmp(only_kernel, kernel->name)) {
+      continue;
+    }
+    struct Assembler as = {.length = 0};
+    kernel->assemble(&as);
+    for (u32 e = 0; e < ARRAY_LENGTH(engines); e++) {
+      if (only_engine && 0 != strcmp(only_engine, engines[e].name)) {
+        continue;
+      }
+      struct Sample best = {0, 0, 0};
+      for (u64 i = 0; i < runs; i++) {
+        struct Sample sample;
+        run(kernel, &as, &mem, engines[e].engine, budget, &sample);
+        if (0 == i || sample.seconds < best.seconds) {
+          best = sample;
+        }
+      }
+      report(kernel->name, engines[e].name, &best);
+    }
+  }
+  return 0;
+}
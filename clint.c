@@ -0,0 +1,310 @@
+// Core local interruptor: the timer and the software interrupts of the
+// machine level, see struct Clint.
+#include "clint.h"
+#include "cpu.h"
+#include "csr.h"
+#include "mmu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CLINT_MSIP 0x0
+#define CLINT_MTIMECMP 0x4000
+#define CLINT_MTIME 0xBFF8
+
+#define CLINT_NOT_QUEUED (~0U)
+// The timer thread looks at the heap again after at most this long, which
+// keeps the deadline passed to the host far from overflowing
+#define CLINT_MAX_WAIT_NS (60 * 1000000000ULL)
+
+static u64 host_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Must be called with the lock held
+static u64 mtime_locked(const struct Clint *clint) {
+  return (host_ns() - clint->start_ns) / CLINT_TICK_NS;
+}
+
+static bool heap_less(const struct Clint *clint, u32 a, u32 b) {
+  return clint->cpus[clint->heap[a]].mtimecmp <
+         clint->cpus[clint->heap[b]].mtimecmp;
+}
+
+static void heap_swap(struct Clint *clint, u32 a, u32 b) {
+  u32 hart = clint->heap[a];
+  clint->heap[a] = clint->heap[b];
+  clint->heap[b] = hart;
+  clint->position[clint->heap[a]] = a;
+  clint->position[clint->heap[b]] = b;
+}
+
+static void sift_up(struct Clint *clint, u32 index) {
+  while (index > 0) {
+    u32 parent = (index - 1) / 2;
+    if (!heap_less(clint, index, parent)) {
+      break;
+    }
+    heap_swap(clint, index, parent);
+    index = parent;
+  }
+}
+
+static void sift_down(struct Clint *clint, u32 index) {
+  for (;;) {
+    u32 smallest = index;
+    u32 left = 2 * index + 1;
+    u32 right = left + 1;
+    if (left < clint->heap_length && heap_less(clint, left, smallest)) {
+      smallest = left;
+    }
+    if (right < clint->heap_length && heap_less(clint, right, smallest)) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      return;
+    }
+    heap_swap(clint, index, smallest);
+    index = smallest;
+  }
+}
+
+static void heap_remove(struct Clint *clint, u32 hart) {
+  u32 index = clint->position[hart];
+  if (CLINT_NOT_QUEUED == index) {
+    return;
+  }
+  u32 last = --clint->heap_length;
+  if (index != last) {
+    heap_swap(clint, index, last);
+  }
+  clint->position[hart] = CLINT_NOT_QUEUED;
+  if (index != last) {
+    sift_up(clint, index);
+    sift_down(clint, index);
+  }
+}
+
+// Inserts the hart or moves it after its mtimecmp changed
+static void heap_update(struct Clint *clint, u32 hart) {
+  u32 index = clint->position[hart];
+  if (CLINT_NOT_QUEUED == index) {
+    index = clint->heap_length++;
+    clint->heap[index] = hart;
+    clint->position[hart] = index;
+  }
+  sift_up(clint, index);
+  sift_down(clint, clint->position[hart]);
+}
+
+// The timer interrupt is pending while mtime is at or past mtimecmp. Must be
+// called with the lock held whenever either of them changes.
+static void update_timer(struct Clint *clint, u32 hart, u64 mtime) {
+  struct CPU *cpu = &clint->cpus[hart];
+  if (cpu->mtimecmp <= mtime) {
+    heap_remove(clint, hart);
+    cpu_raise_interrupt(cpu, MIP_MTIP);
+    return;
+  }
+  cpu_lower_interrupt(cpu, MIP_MTIP);
+  bool was_first = clint->heap_length > 0 && hart == clint->heap[0];
+  heap_update(clint, hart);
+  if (was_first || hart == clint->heap[0]) {
+    pthread_cond_signal(&clint->wake);
+  }
+}
+
+static void *timer_thread(void *opaque) {
+  struct Clint *clint = opaque;
+  pthread_mutex_lock(&clint->lock);
+  while (clint->running) {
+    if (0 == clint->heap_length) {
+      pthread_cond_wait(&clint->wake, &clint->lock);
+      continue;
+    }
+    u32 hart = clint->heap[0];
+    u64 now = host_ns();
+    u64 mtime = (now - clint->start_ns) / CLINT_TICK_NS;
+    u64 mtimecmp = clint->cpus[hart].mtimecmp;
+    if (mtimecmp <= mtime) {
+      heap_remove(clint, hart);
+      cpu_raise_interrupt(&clint->cpus[hart], MIP_MTIP);
+      continue;
+    }
+    u64 wait_ns = CLINT_MAX_WAIT_NS;
+    if (mtimecmp - mtime < CLINT_MAX_WAIT_NS / CLINT_TICK_NS) {
+      wait_ns = (mtimecmp - mtime) * CLINT_TICK_NS;
+    }
+    u64 deadline = now + wait_ns;
+    struct timespec ts = {deadline / 1000000000ULL, deadline % 1000000000ULL};
+    pthread_cond_timedwait(&clint->wake, &clint->lock, &ts);
+  }
+  pthread_mutex_unlock(&clint->lock);
+  return NULL;
+}
+
+// mtimecmp and mtime may be accessed in halves
+static u64 merge(u64 old, u64 offset, u64 value, u8 length) {
+  if (sizeof(u64) == length) {
+    return value;
+  }
+  u32 shift = (offset & 4) * 8;
+  u64 mask = 0xFFFFFFFFULL << shift;
+  return (old & ~mask) | ((value << shift) & mask);
+}
+
+static u64 clint_read(void *opaque, u64 offset, u8 length) {
+  struct Clint *clint = opaque;
+  if (length < sizeof(u32)) {
+    return 0;
+  }
+  u64 value = 0;
+  pthread_mutex_lock(&clint->lock);
+  if (offset < CLINT_MTIMECMP) {
+    u64 hart = (offset - CLINT_MSIP) / sizeof(u32);
+    if (hart < clint->num_harts) {
+      u64 mip = __atomic_load_n(&clint->cpus[hart].csr.mip, __ATOMIC_RELAXED);
+      value = (mip & MIP_MSIP) ? 1 : 0;
+    }
+    pthread_mutex_unlock(&clint->lock);
+    return value;
+  }
+  if (offset < CLINT_MTIME) {
+    u64 hart = (offset - CLINT_MTIMECMP) / sizeof(u64);
+    if (hart < clint->num_harts) {
+      value = clint->cpus[hart].mtimecmp;
+    }
+  } else if (offset - CLINT_MTIME < sizeof(u64)) {
+    value = mtime_locked(clint);
+  }
+  pthread_mutex_unlock(&clint->lock);
+  return value >> (offset & 4) * 8;
+}
+
+static void clint_write(void *opaque, u64 offset, u64 value, u8 length) {
+  struct Clint *clint = opaque;
+  if (length < sizeof(u32)) {
+    return;
+  }
+  pthread_mutex_lock(&clint->lock);
+  if (offset < CLINT_MTIMECMP) {
+    u64 hart = (offset - CLINT_MSIP) / sizeof(u32);
+    if (hart < clint->num_harts) {
+      if (value & 1) {
+        cpu_raise_interrupt(&clint->cpus[hart], MIP_MSIP);
+      } else {
+        cpu_lower_interrupt(&clint->cpus[hart], MIP_MSIP);
+      }
+    }
+  } else if (offset < CLINT_MTIME) {
+    u64 hart = (offset - CLINT_MTIMECMP) / sizeof(u64);
+    if (hart < clint->num_harts) {
+      struct CPU *cpu = &clint->cpus[hart];
+      cpu->mtimecmp = merge(cpu->mtimecmp, offset, value, length);
+      update_timer(clint, hart, mtime_locked(clint));
+    }
+  } else if (offset - CLINT_MTIME < sizeof(u64)) {
+    u64 mtime = merge(mtime_locked(clint), offset, value, length);
+    clint->start_ns = host_ns() - mtime * CLINT_TICK_NS;
+    for (u32 i = 0; i < clint->num_harts; i++) {
+      update_timer(clint, i, mtime);
+    }
+  }
+  pthread_mutex_unlock(&clint->lock);
+}
+
+bool clint_init(struct Clint *clint, struct Memory *mem, struct CPU *cpus,
+                u64 num_harts) {
+  if (num_harts > CLINT_MAX_HARTS) {
+    fprintf(stderr, "The CLINT supports at most %d harts\n", CLINT_MAX_HARTS);
+    return false;
+  }
+  clint->running = false;
+  clint->cpus = cpus;
+  clint->num_harts = num_harts;
+  clint->start_ns = host_ns();
+  clint->heap_length = 0;
+  clint->heap = calloc(num_harts, sizeof(u32));
+  clint->position = calloc(num_harts, sizeof(u32));
+  if (!clint->heap || !clint->position) {
+    perror("calloc");
+    free(clint->heap);
+    free(clint->position);
+    return false;
+  }
+  for (u64 i = 0; i < num_harts; i++) {
+    clint->position[i] = CLINT_NOT_QUEUED;
+    cpus[i].clint = clint;
+  }
+  pthread_mutex_init(&clint->lock, NULL);
+  // Deadlines are on the monotonic clock like mtime
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&clint->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  if (!mem) {
+    return true;
+  }
+  struct Device device = {
+      .name = "clint",
+      .base = CLINT_BASE,
+      .size = CLINT_SIZE,
+      .opaque = clint,
+      .read = clint_read,
+      .write = clint_write,
+  };
+  return memory_add_device(mem, &device);
+}
+
+bool clint_start(struct Clint *clint) {
+  clint->running = true;
+  int rc = pthread_create(&clint->timer_thread, NULL, timer_thread, clint);
+  if (0 != rc) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+    clint->running = false;
+    return false;
+  }
+  return true;
+}
+
+u64 clint_mtime(struct Clint *clint) {
+  pthread_mutex_lock(&clint->lock);
+  u64 mtime = mtime_locked(clint);
+  pthread_mutex_unlock(&clint->lock);
+  return mtime;
+}
+
+void clint_save_state(struct Clint *clint, struct ClintState *state) {
+  state->mtime = clint_mtime(clint);
+}
+
+void clint_restore_state(struct Clint *clint, const struct ClintState *state) {
+  pthread_mutex_lock(&clint->lock);
+  clint->start_ns = host_ns() - state->mtime * CLINT_TICK_NS;
+  clint->heap_length = 0;
+  for (u32 i = 0; i < clint->num_harts; i++) {
+    clint->position[i] = CLINT_NOT_QUEUED;
+  }
+  for (u32 i = 0; i < clint->num_harts; i++) {
+    update_timer(clint, i, state->mtime);
+  }
+  pthread_mutex_unlock(&clint->lock);
+}
+
+void clint_destroy(struct Clint *clint) {
+  if (clint->running) {
+    pthread_mutex_lock(&clint->lock);
+    clint->running = false;
+    pthread_cond_signal(&clint->wake);
+    pthread_mutex_unlock(&clint->lock);
+    pthread_join(clint->timer_thread, NULL);
+  }
+  pthread_cond_destroy(&clint->wake);
+  pthread_mutex_destroy(&clint->lock);
+  free(clint->heap);
+  free(clint->position);
+}
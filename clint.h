@@ -0,0 +1,59 @@
+#ifndef CLINT_H
+#define CLINT_H
+#include "cpu.h"
+#include "mmu.h"
+#include "types.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+// Core local interruptor, at the same address as on the QEMU virt machine
+#define CLINT_BASE 0x2000000
+#define CLINT_SIZE 0x10000
+// mtime counts at the same frequency as on the QEMU virt machine
+#define CLINT_FREQUENCY 10000000
+#define CLINT_TICK_NS (1000000000 / CLINT_FREQUENCY)
+// One msip and one mtimecmp per hart fit in front of mtime
+#define CLINT_MAX_HARTS 4095
+
+// mtime follows the monotonic clock of the host. The timer thread keeps the
+// harts in a min-heap ordered by their mtimecmp and sleeps until the first
+// one is due, then raises its timer interrupt. The harts never look at the
+// time themselves, see struct CPU.
+struct Clint {
+  pthread_mutex_t lock;
+  // Signalled when the first deadline moves or the thread has to stop
+  pthread_cond_t wake;
+  pthread_t timer_thread;
+  bool running;
+  struct CPU *cpus;
+  u64 num_harts;
+  // Host time in ns at which mtime was 0, wraps around for an mtime that
+  // was set ahead of the host clock
+  u64 start_ns;
+  // Indices of the harts with a deadline, heap[0] is due first
+  u32 *heap;
+  u32 heap_length;
+  // Index of every hart in heap, CLINT_NOT_QUEUED if it has none
+  u32 *position;
+};
+
+// mtime as seen by the guest, for snapshots. mtimecmp is kept by the harts.
+struct ClintState {
+  u64 mtime;
+};
+
+// Sets up the CLINT for the harts, which keep a pointer to it. mem is NULL if
+// the registers are left out of the address space, the time CSR still works
+// then.
+bool clint_init(struct Clint *clint, struct Memory *mem, struct CPU *cpus,
+                u64 num_harts);
+// The timer thread does not survive a fork, so it is started by the process
+// running the harts
+bool clint_start(struct Clint *clint);
+u64 clint_mtime(struct Clint *clint);
+void clint_save_state(struct Clint *clint, struct ClintState *state);
+// Also reschedules the timers from the mtimecmp of the harts, which have to
+// be stopped
+void clint_restore_state(struct Clint *clint, const struct ClintState *state);
+void clint_destroy(struct Clint *clint);
+#endif // CLINT_H
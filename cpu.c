@@ -0,0 +1,2419 @@
+#include "cpu.h"
+#include "csr.h"
+#include "fpu.h"
+#include "gdb.h"
+#include "jit.h"
+#include "mmu.h"
+#include "profile.h"
+#include "rvc.h"
+#include "tcache.h"
+#include "trace.h"
+#include "types.h"
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Register access for the pre-decoded instruction being executed. Writes to
+// x0 are allowed to happen and are undone after every instruction.
+#define RD cpu->registers[inst->rd]
+#define RS1 cpu->registers[inst->rs1]
+#define RS2 cpu->registers[inst->rs2]
+#define IMM ((i64)inst->imm)
+
+// a7 of the exit system call, see inst_ecall()
+#define SYS_EXIT 93
+
+#define RD_REGISTER(_inst, _raw) (_inst)->rd = ((_raw) >> 7) & 0x1F;
+
+#define RS1_REGISTER(_inst, _raw) (_inst)->rs1 = ((_raw) >> 15) & 0x1F;
+
+#define RS2_REGISTER(_inst, _raw) (_inst)->rs2 = ((_raw) >> 20) & 0x1F;
+
+#define R_TYPE_DEF(_inst, _raw)                                                \
+  RD_REGISTER(_inst, _raw);                                                    \
+  RS1_REGISTER(_inst, _raw);                                                   \
+  RS2_REGISTER(_inst, _raw);                                                   \
+  (_inst)->imm = 0;
+
+#define I_TYPE_DEF(_inst, _raw)                                                \
+  RD_REGISTER(_inst, _raw);                                                    \
+  RS1_REGISTER(_inst, _raw);                                                   \
+  (_inst)->rs2 = 0;                                                            \
+  (_inst)->imm = sign_extend((_raw) >> 20, 11);
+
+// Same as I_TYPE_DEF but the immediate is only the shift amount
+#define SHIFT_TYPE_DEF(_inst, _raw)                                            \
+  I_TYPE_DEF(_inst, _raw);                                                     \
+  (_inst)->imm = ((_raw) >> 20) & 0x3F;
+
+#define U_TYPE_DEF(_inst, _raw)                                                \
+  RD_REGISTER(_inst, _raw);                                                    \
+  (_inst)->rs1 = 0;                                                            \
+  (_inst)->rs2 = 0;                                                            \
+  (_inst)->imm = (i32)((_raw) & ~(0x1000 - 1));
+
+#define B_TYPE_DEF(_inst, _raw)                                                \
+  (_inst)->rd = 0;                                                             \
+  RS1_REGISTER(_inst, _raw);                                                   \
+  RS2_REGISTER(_inst, _raw);                                                   \
+  (_inst)->imm = sign_extend(                                                  \
+      (((_raw) & 0xf00) >> 7) | (((_raw) & 0x7e000000) >> 20) |               \
+          (((_raw) & 0x80) << 4) | (((_raw) >> 31) << 12),                     \
+      12);
+
+#define J_TYPE_DEF(_inst, _raw)                                                \
+  {                                                                            \
+    u32 _dont_use = 0;                                                         \
+    _dont_use |= ((_raw) & (0x1 << 31));                                       \
+    _dont_use |= ((_raw) & (0xFF << 12)) << 11;                                \
+    _dont_use |= ((_raw) & (0x1 << 20)) << 2;                                  \
+    _dont_use |= ((_raw) & (0x3FF << 21)) >> 9;                                \
+    _dont_use = ((i32)_dont_use) >> 11;                                        \
+    (_inst)->imm = sign_extend(_dont_use, 20);                                 \
+  }                                                                            \
+  RD_REGISTER(_inst, _raw);                                                    \
+  (_inst)->rs1 = 0;                                                            \
+  (_inst)->rs2 = 0;
+
+#define S_TYPE_DEF(_inst, _raw)                                                \
+  (_inst)->rd = 0;                                                             \
+  RS1_REGISTER(_inst, _raw);                                                   \
+  RS2_REGISTER(_inst, _raw);                                                   \
+  (_inst)->imm =                                                               \
+      sign_extend((((_raw) >> 7) & 0x1F) | (((_raw) >> 25) << 5), 11);
+
+i32 sign_extend(u32 n, u8 len) {
+  n &= ~(0xFFFFFFFF << (len + 1));
+  if (n & (1 << len)) {
+    n |= 0xFFFFFFFF << len;
+  }
+  return (i32)n;
+}
+
+// Loads and stores through the MMU. If the access faults the exception is
+// raised and false is returned, in which case the destination register must
+// be left untouched.
+#define CPU_ACCESSORS(_bits)                                                   \
+  static inline bool load##_bits(struct CPU *cpu, struct Memory *mem,          \
+                                 u64 address, u##_bits *value) {               \
+    enum MmuResult result = mmu_read##_bits(&cpu->mmu, mem, address, value);   \
+    if (likely(MMU_OK == result)) {                                            \
+      return true;                                                             \
+    }                                                                          \
+    cpu_mmu_fault(cpu, mem, result, ACCESS_READ);                              \
+    return false;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline void store##_bits(struct CPU *cpu, struct Memory *mem,         \
+                                  u64 address, u##_bits value) {               \
+    enum MmuResult result = mmu_write##_bits(&cpu->mmu, mem, address, value);  \
+    if (unlikely(MMU_OK != result)) {                                          \
+      cpu_mmu_fault(cpu, mem, result, ACCESS_WRITE);                           \
+    }                                                                          \
+  }
+
+CPU_ACCESSORS(8)
+CPU_ACCESSORS(16)
+CPU_ACCESSORS(32)
+CPU_ACCESSORS(64)
+#undef CPU_ACCESSORS
+
+static void inst_illegal(struct CPU *cpu, struct Memory *mem,
+                         const struct Inst *inst) {
+  (void)mem;
+  // The raw instruction is kept in the immediate
+  cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, (u32)inst->imm);
+}
+
+static void inst_slli(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 << IMM;
+#ifdef DEBUG
+  printf("%lx: slli x%d,x%d,%ld\n", cpu->pc, inst->rd, inst->rs1, IMM);
+#endif
+}
+
+static void inst_addi(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = (i64)RS1 + IMM;
+#ifdef DEBUG
+  printf("%lx: addi x%d,x%d,%ld\n", cpu->pc, inst->rd, inst->rs1, IMM);
+#endif
+}
+
+static void inst_slti(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  if ((i64)RS1 < IMM) {
+    RD = 1;
+  } else {
+    RD = 0;
+  }
+}
+
+static void inst_sltiu(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  if (RS1 < (u64)IMM) {
+    RD = 1;
+  } else {
+    RD = 0;
+  }
+}
+
+static void inst_andi(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 & IMM;
+}
+
+static void inst_ori(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 | IMM;
+}
+
+static void inst_xori(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 ^ IMM;
+}
+
+static void inst_srli(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 >> IMM;
+}
+
+static void inst_srai(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = (i64)RS1 >> IMM;
+}
+
+static void inst_add(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 + RS2;
+}
+
+static void inst_sub(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 - RS2;
+}
+
+static void inst_sltu(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  if (RS1 < RS2) {
+    RD = 1;
+  } else {
+    RD = 0;
+  }
+}
+
+static void inst_and(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 & RS2;
+}
+
+static void inst_or(struct CPU *cpu, struct Memory *mem,
+                    const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 | RS2;
+}
+
+static void inst_xor(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 ^ RS2;
+}
+
+void cpu_dump_state(struct CPU *cpu) {
+  printf("CPU dump:\n");
+  for (int i = 0; i < 32; i++) {
+    printf("reg %d: %ld\n", i, cpu->registers[i]);
+  }
+}
+
+#define FUNCT3_SB 0x0
+#define FUNCT3_SH 0x1
+#define FUNCT3_SW 0x2
+#define FUNCT3_SD 0x3
+
+#define FUNCT3_LW 0x2
+#define FUNCT3_LD 0x3
+#define FUNCT3_LBU 0x4
+
+#define FUNCT3_BEQ 0x0
+#define FUNCT3_BNE 0x1
+#define FUNCT3_BGE 0x5
+#define FUNCT3_BLTU 0x6
+#define FUNCT3_BGEU 0x7
+
+#define FUNCT3_JALR 0x0
+#define FUNCT3_ADDI 0x0
+#define FUNCT3_SLLI 0x1
+#define FUNCT3_SLTI 0x2
+#define FUNCT3_SLTIU 0x3
+#define FUNCT3_XORI 0x4
+#define FUNCT3_SR 0x5
+#define FUNCT3_ORI 0x6
+#define FUNCT3_ANDI 0x7
+
+#define FUNCT3_SLLIW 0x1
+#define FUNCT3_SRW 0x5
+
+#define FUNCT3_ADD 0x0
+#define FUNCT3_SLTU 0x3
+#define FUNCT3_AND 0x7
+#define FUNCT3_OR 0x6
+#define FUNCT3_XOR 0x4
+
+#define FUNCT7_SUB (0x1 << 5)
+
+static bool decode_illegal(const u32 raw, struct Inst *inst) {
+  inst->op = OP_illegal;
+  inst->rd = 0;
+  inst->rs1 = 0;
+  inst->rs2 = 0;
+  inst->imm = raw;
+  return true;
+}
+
+static bool opcode_h13(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  u8 funct7 = (raw >> 26 /* shamt is sligthly bigger for 64 bit */) &
+              0x3F; // Only used for certain funct3
+  I_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_ADDI:
+    inst->op = OP_addi;
+    break;
+  case FUNCT3_SLTI:
+    inst->op = OP_slti;
+    break;
+  case FUNCT3_SLTIU:
+    inst->op = OP_sltiu;
+    break;
+  case FUNCT3_XORI:
+    inst->op = OP_xori;
+    break;
+  case FUNCT3_ORI:
+    inst->op = OP_ori;
+    break;
+  case FUNCT3_ANDI:
+    inst->op = OP_andi;
+    break;
+  case FUNCT3_SLLI: {
+    if (0 != funct7) {
+      return decode_illegal(raw, inst);
+    }
+    SHIFT_TYPE_DEF(inst, raw);
+    inst->op = OP_slli;
+    break;
+  }
+  case FUNCT3_SR: {
+    SHIFT_TYPE_DEF(inst, raw);
+    if (0 == funct7) {
+      inst->op = OP_srli;
+    } else {
+      inst->op = OP_srai;
+    }
+    break;
+  }
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+static void inst_lui(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  RD = IMM;
+#ifdef DEBUG
+  printf("%lx: lui x%d,%ld\n", cpu->pc, inst->rd, IMM >> 12);
+#endif
+}
+
+static void inst_jalr(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  u64 target_address = RS1 + IMM;
+  target_address &= ~(1); // Setting the least significant bit to zero
+
+  RD = cpu->pc + inst->length;
+
+#ifdef DEBUG
+  printf("%lx: jalr x%d,%ld(x%d)\n", cpu->pc, inst->rd, IMM, inst->rs1);
+#endif
+  cpu->pc = target_address;
+  cpu->did_branch = true;
+}
+
+static bool opcode_h67(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  I_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_JALR:
+    inst->op = OP_jalr;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return true;
+}
+
+static void inst_sb(struct CPU *cpu, struct Memory *mem,
+                    const struct Inst *inst) {
+  u64 destination = RS1 + IMM;
+  store8(cpu, mem, destination, RS2);
+}
+
+static void inst_sh(struct CPU *cpu, struct Memory *mem,
+                    const struct Inst *inst) {
+  u64 destination = RS1 + IMM;
+  store16(cpu, mem, destination, RS2);
+}
+
+static void inst_sw(struct CPU *cpu, struct Memory *mem,
+                    const struct Inst *inst) {
+  u64 destination = RS1 + IMM;
+  store32(cpu, mem, destination, RS2);
+#ifdef DEBUG
+  printf("%lx: sw x%d,%ld(x%d)\n", cpu->pc, inst->rs2, IMM, inst->rs1);
+#endif
+}
+
+static void inst_sd(struct CPU *cpu, struct Memory *mem,
+                    const struct Inst *inst) {
+  u64 destination = RS1 + IMM;
+  store64(cpu, mem, destination, RS2);
+#ifdef DEBUG
+  printf("%lx: sd x%d,%ld(x%d)\n", cpu->pc, inst->rs2, IMM, inst->rs1);
+#endif
+}
+
+static bool opcode_h23(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  S_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_SB:
+    inst->op = OP_sb;
+    break;
+  case FUNCT3_SH:
+    inst->op = OP_sh;
+    break;
+  case FUNCT3_SW:
+    inst->op = OP_sw;
+    break;
+  case FUNCT3_SD:
+    inst->op = OP_sd;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+static void inst_jal(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  u64 jump_target_address = cpu->pc + IMM;
+  RD = cpu->pc + inst->length;
+#ifdef DEBUG
+  printf("%lx: jal x%d, %lx\n", cpu->pc, inst->rd, jump_target_address);
+#endif
+  cpu->pc = jump_target_address;
+  cpu->did_branch = true;
+}
+
+static void inst_beq(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  if (RS1 != RS2)
+    return;
+
+  u64 jump_target_address = cpu->pc + IMM;
+  cpu->pc = jump_target_address;
+  cpu->did_branch = true;
+}
+
+static void inst_bge(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  u64 jump_target_address = cpu->pc + IMM;
+#ifdef DEBUG
+  printf("%lx: bge x%d,x%d,%lx\n", cpu->pc, inst->rs1, inst->rs2,
+         jump_target_address);
+#endif
+  if ((i64)RS1 >= (i64)RS2) {
+    cpu->pc = jump_target_address;
+    cpu->did_branch = true;
+  }
+}
+
+static void inst_bgeu(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  u64 jump_target_address = cpu->pc + IMM;
+#ifdef DEBUG
+  printf("%lx: bgeu x%d,x%d,%lx\n", cpu->pc, inst->rs1, inst->rs2,
+         jump_target_address);
+#endif
+  if (RS1 >= RS2) {
+    cpu->pc = jump_target_address;
+    cpu->did_branch = true;
+  }
+}
+
+static void inst_bne(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  u64 jump_target_address = cpu->pc + IMM;
+#ifdef DEBUG
+  printf("%lx: bne x%d,x%d,%lx\n", cpu->pc, inst->rs1, inst->rs2,
+         jump_target_address);
+#endif
+  if (RS1 != RS2) {
+    cpu->pc = jump_target_address;
+    cpu->did_branch = true;
+  }
+}
+
+static void inst_bltu(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  u64 jump_target_address = cpu->pc + IMM;
+#ifdef DEBUG
+  printf("%lx: bltu x%d,x%d,%lx\n", cpu->pc, inst->rs1, inst->rs2,
+         jump_target_address);
+#endif
+  if (RS1 < RS2) {
+    cpu->pc = jump_target_address;
+    cpu->did_branch = true;
+  }
+}
+
+static bool opcode_h63(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  B_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_BNE:
+    inst->op = OP_bne;
+    break;
+  case FUNCT3_BEQ:
+    inst->op = OP_beq;
+    break;
+  case FUNCT3_BGE:
+    inst->op = OP_bge;
+    break;
+  case FUNCT3_BLTU:
+    inst->op = OP_bltu;
+    break;
+  case FUNCT3_BGEU:
+    inst->op = OP_bgeu;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return true;
+}
+
+static void inst_lw(struct CPU *cpu, struct Memory *mem,
+                    const struct Inst *inst) {
+  u64 location = RS1 + IMM;
+  u32 value;
+  if (load32(cpu, mem, location, &value)) {
+    RD = (i64)(i32)value;
+  }
+#ifdef DEBUG
+  printf("%lx: lw x%d, %ld(x%d)\n", cpu->pc, inst->rd, IMM, inst->rs1);
+#endif
+}
+
+static void inst_ld(struct CPU *cpu, struct Memory *mem,
+                    const struct Inst *inst) {
+  u64 location = RS1 + IMM;
+  u64 value;
+  if (load64(cpu, mem, location, &value)) {
+    RD = value;
+  }
+#ifdef DEBUG
+  printf("%lx: ld x%d, %ld(x%d)\n", cpu->pc, inst->rd, IMM, inst->rs1);
+#endif
+}
+
+static void inst_lbu(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  u64 location = RS1 + IMM;
+  u8 value;
+  if (load8(cpu, mem, location, &value)) {
+    RD = value;
+  }
+#ifdef DEBUG
+  printf("%lx: lbu x%d, %ld(x%d)\n", cpu->pc, inst->rd, IMM, inst->rs1);
+#endif
+}
+
+static bool opcode_h03(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  I_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_LW:
+    inst->op = OP_lw;
+    break;
+  case FUNCT3_LD:
+    inst->op = OP_ld;
+    break;
+  case FUNCT3_LBU:
+    inst->op = OP_lbu;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+// The atomic instructions operate on host memory with the host atomics and
+// are always sequentially consistent, which is at least as strong as any
+// combination of the aq and rl bits. They need natural alignment and RAM,
+// everything else traps. Returns NULL if the trap has been taken.
+static void *atomic_address(struct CPU *cpu, struct Memory *mem, u64 address,
+                            u8 length, enum Access access) {
+  if (address & (length - 1)) {
+    cpu_trap(cpu,
+             ACCESS_READ == access ? EXC_LOAD_ADDRESS_MISALIGNED
+                                   : EXC_STORE_ADDRESS_MISALIGNED,
+             address);
+    return NULL;
+  }
+  void *host;
+  enum MmuResult result =
+      mmu_host_address(&cpu->mmu, mem, address, length, access, &host);
+  if (MMU_OK != result) {
+    cpu_mmu_fault(cpu, mem, result, access);
+    return NULL;
+  }
+  return host;
+}
+
+static void atomic_written(struct Memory *mem, const void *host, u8 length) {
+  u64 offset = (const u8 *)host - mem->ram;
+  if (unlikely(memory_page_gen(mem, offset) & 1)) {
+    memory_invalidate_code(mem, mem->ram_base + offset, length);
+  }
+}
+
+// The reservation remembers the loaded value and SC only succeeds if memory
+// still holds it. Like in most emulators a store of the same value by another
+// hart in between goes unnoticed.
+#define LR_SC(_suffix, _bits)                                                  \
+  static void inst_lr_##_suffix(struct CPU *cpu, struct Memory *mem,           \
+                                const struct Inst *inst) {                     \
+    u##_bits *host =                                                           \
+        atomic_address(cpu, mem, RS1, sizeof(u##_bits), ACCESS_READ);          \
+    if (!host) {                                                               \
+      return;                                                                  \
+    }                                                                          \
+    u##_bits value = __atomic_load_n(host, __ATOMIC_SEQ_CST);                  \
+    cpu->reservation = host;                                                   \
+    cpu->reservation_value = value;                                            \
+    cpu->reservation_size = sizeof(value);                                     \
+    RD = (i64)(i##_bits)value;                                                 \
+  }                                                                            \
+                                                                               \
+  static void inst_sc_##_suffix(struct CPU *cpu, struct Memory *mem,           \
+                                const struct Inst *inst) {                     \
+    u##_bits *host =                                                           \
+        atomic_address(cpu, mem, RS1, sizeof(u##_bits), ACCESS_WRITE);         \
+    if (!host) {                                                               \
+      return;                                                                  \
+    }                                                                          \
+    u##_bits expected = cpu->reservation_value;                                \
+    bool success = host == cpu->reservation &&                                 \
+                   sizeof(u##_bits) == cpu->reservation_size &&                \
+                   __atomic_compare_exchange_n(host, &expected, RS2, false,    \
+                                               __ATOMIC_SEQ_CST,               \
+                                               __ATOMIC_SEQ_CST);              \
+    cpu->reservation = NULL;                                                   \
+    if (success) {                                                             \
+      atomic_written(mem, host, sizeof(u##_bits));                             \
+    }                                                                          \
+    RD = !success;                                                             \
+  }
+
+// AMOs that map to a single host read-modify-write
+#define AMO_FETCH(_name, _suffix, _bits, _builtin)                             \
+  static void inst_##_name##_##_suffix(struct CPU *cpu, struct Memory *mem,    \
+                                       const struct Inst *inst) {              \
+    u##_bits *host =                                                           \
+        atomic_address(cpu, mem, RS1, sizeof(u##_bits), ACCESS_WRITE);         \
+    if (!host) {                                                               \
+      return;                                                                  \
+    }                                                                          \
+    u##_bits old = _builtin(host, (u##_bits)RS2, __ATOMIC_SEQ_CST);            \
+    atomic_written(mem, host, sizeof(u##_bits));                               \
+    RD = (i64)(i##_bits)old;                                                   \
+  }
+
+// AMOs without a host equivalent are a compare and swap loop. _pick selects
+// the new value from the old one and the operand.
+#define AMO_CAS(_name, _suffix, _bits, _type, _pick)                           \
+  static void inst_##_name##_##_suffix(struct CPU *cpu, struct Memory *mem,    \
+                                       const struct Inst *inst) {              \
+    u##_bits *host =                                                           \
+        atomic_address(cpu, mem, RS1, sizeof(u##_bits), ACCESS_WRITE);         \
+    if (!host) {                                                               \
+      return;                                                                  \
+    }                                                                          \
+    _type operand = (_type)RS2;                                                \
+    u##_bits old = __atomic_load_n(host, __ATOMIC_RELAXED);                    \
+    u##_bits value;                                                            \
+    do {                                                                       \
+      value = _pick((_type)old, operand) ? (u##_bits)old : (u##_bits)operand;  \
+    } while (!__atomic_compare_exchange_n(host, &old, value, true,             \
+                                          __ATOMIC_SEQ_CST,                    \
+                                          __ATOMIC_RELAXED));                  \
+    atomic_written(mem, host, sizeof(u##_bits));                               \
+    RD = (i64)(i##_bits)old;                                                   \
+  }
+
+#define AMO_LESS(_a, _b) ((_a) < (_b))
+#define AMO_GREATER(_a, _b) ((_a) > (_b))
+
+#define AMO_WIDTH(_suffix, _bits)                                              \
+  LR_SC(_suffix, _bits)                                                        \
+  AMO_FETCH(amoswap, _suffix, _bits, __atomic_exchange_n)                      \
+  AMO_FETCH(amoadd, _suffix, _bits, __atomic_fetch_add)                        \
+  AMO_FETCH(amoxor, _suffix, _bits, __atomic_fetch_xor)                        \
+  AMO_FETCH(amoand, _suffix, _bits, __atomic_fetch_and)                        \
+  AMO_FETCH(amoor, _suffix, _bits, __atomic_fetch_or)                          \
+  AMO_CAS(amomin, _suffix, _bits, i##_bits, AMO_LESS)                          \
+  AMO_CAS(amomax, _suffix, _bits, i##_bits, AMO_GREATER)                       \
+  AMO_CAS(amominu, _suffix, _bits, u##_bits, AMO_LESS)                         \
+  AMO_CAS(amomaxu, _suffix, _bits, u##_bits, AMO_GREATER)
+
+AMO_WIDTH(w, 32)
+AMO_WIDTH(d, 64)
+#undef AMO_WIDTH
+#undef AMO_GREATER
+#undef AMO_LESS
+#undef AMO_CAS
+#undef AMO_FETCH
+#undef LR_SC
+
+#define FUNCT3_AMO_W 0x2
+#define FUNCT3_AMO_D 0x3
+
+#define FUNCT5_AMOADD 0x00
+#define FUNCT5_AMOSWAP 0x01
+#define FUNCT5_LR 0x02
+#define FUNCT5_SC 0x03
+#define FUNCT5_AMOXOR 0x04
+#define FUNCT5_AMOOR 0x08
+#define FUNCT5_AMOAND 0x0C
+#define FUNCT5_AMOMIN 0x10
+#define FUNCT5_AMOMAX 0x14
+#define FUNCT5_AMOMINU 0x18
+#define FUNCT5_AMOMAXU 0x1C
+
+// The aq and rl bits are ignored, see atomic_address()
+static bool opcode_h2F(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  u8 funct5 = raw >> 27;
+  R_TYPE_DEF(inst, raw);
+  if (FUNCT3_AMO_W != funct3 && FUNCT3_AMO_D != funct3) {
+    return decode_illegal(raw, inst);
+  }
+  bool wide = FUNCT3_AMO_D == funct3;
+  switch (funct5) {
+  case FUNCT5_LR:
+    if (0 != inst->rs2) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = wide ? OP_lr_d : OP_lr_w;
+    break;
+  case FUNCT5_SC:
+    inst->op = wide ? OP_sc_d : OP_sc_w;
+    break;
+  case FUNCT5_AMOSWAP:
+    inst->op = wide ? OP_amoswap_d : OP_amoswap_w;
+    break;
+  case FUNCT5_AMOADD:
+    inst->op = wide ? OP_amoadd_d : OP_amoadd_w;
+    break;
+  case FUNCT5_AMOXOR:
+    inst->op = wide ? OP_amoxor_d : OP_amoxor_w;
+    break;
+  case FUNCT5_AMOAND:
+    inst->op = wide ? OP_amoand_d : OP_amoand_w;
+    break;
+  case FUNCT5_AMOOR:
+    inst->op = wide ? OP_amoor_d : OP_amoor_w;
+    break;
+  case FUNCT5_AMOMIN:
+    inst->op = wide ? OP_amomin_d : OP_amomin_w;
+    break;
+  case FUNCT5_AMOMAX:
+    inst->op = wide ? OP_amomax_d : OP_amomax_w;
+    break;
+  case FUNCT5_AMOMINU:
+    inst->op = wide ? OP_amominu_d : OP_amominu_w;
+    break;
+  case FUNCT5_AMOMAXU:
+    inst->op = wide ? OP_amomaxu_d : OP_amomaxu_w;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+// RV64M. The high halves of the products come from a 128 bit product, which
+// is a single mul or imul on x86-64.
+__extension__ typedef __int128 i128;
+__extension__ typedef unsigned __int128 u128;
+
+static void inst_mul(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)mem;
+  RD = RS1 * RS2;
+}
+
+static void inst_mulh(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = (u64)(((i128)(i64)RS1 * (i64)RS2) >> 64);
+}
+
+static void inst_mulhsu(struct CPU *cpu, struct Memory *mem,
+                        const struct Inst *inst) {
+  (void)mem;
+  RD = (u64)(((i128)(i64)RS1 * (i128)RS2) >> 64);
+}
+
+static void inst_mulhu(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  RD = (u64)(((u128)RS1 * RS2) >> 64);
+}
+
+static void inst_mulw(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = (i64)(i32)(RS1 * RS2);
+}
+
+// Division by zero and the overflow of the most negative number divided by -1
+// do not trap. Both divide by 1 instead and the result is fixed up with a
+// mask, so there is no branch on the operands. Dividing by zero gives all ones
+// and leaves the dividend as the remainder, the overflow gives the dividend
+// and a remainder of zero.
+#define SIGNED_DIVISION(_div, _rem, _bits)                                     \
+  static inline i##_bits _div##_divisor(i##_bits a, i##_bits b,                \
+                                        u##_bits *zero) {                      \
+    *zero = -(u##_bits)(0 == b);                                               \
+    u##_bits overflow = -(u##_bits)((INT##_bits##_MIN == a) & (-1 == b));     \
+    u##_bits special = *zero | overflow;                                       \
+    return (i##_bits)(((u##_bits)b & ~special) | (special & 1));               \
+  }                                                                            \
+                                                                               \
+  static void inst_##_div(struct CPU *cpu, struct Memory *mem,                 \
+                          const struct Inst *inst) {                           \
+    (void)mem;                                                                 \
+    i##_bits a = RS1;                                                          \
+    u##_bits zero;                                                             \
+    i##_bits divisor = _div##_divisor(a, RS2, &zero);                          \
+    RD = (i64)(i##_bits)((u##_bits)(a / divisor) | zero);                      \
+  }                                                                            \
+                                                                               \
+  static void inst_##_rem(struct CPU *cpu, struct Memory *mem,                 \
+                          const struct Inst *inst) {                           \
+    (void)mem;                                                                 \
+    i##_bits a = RS1;                                                          \
+    u##_bits zero;                                                             \
+    i##_bits divisor = _div##_divisor(a, RS2, &zero);                          \
+    RD = (i64)(i##_bits)((u##_bits)(a % divisor) | ((u##_bits)a & zero));      \
+  }
+
+#define UNSIGNED_DIVISION(_div, _rem, _bits)                                   \
+  static void inst_##_div(struct CPU *cpu, struct Memory *mem,                 \
+                          const struct Inst *inst) {                           \
+    (void)mem;                                                                 \
+    u##_bits a = RS1;                                                          \
+    u##_bits b = RS2;                                                          \
+    u##_bits zero = -(u##_bits)(0 == b);                                       \
+    RD = (i64)(i##_bits)((a / (b | (zero & 1))) | zero);                       \
+  }                                                                            \
+                                                                               \
+  static void inst_##_rem(struct CPU *cpu, struct Memory *mem,                 \
+                          const struct Inst *inst) {                           \
+    (void)mem;                                                                 \
+    u##_bits a = RS1;                                                          \
+    u##_bits b = RS2;                                                          \
+    u##_bits zero = -(u##_bits)(0 == b);                                       \
+    RD = (i64)(i##_bits)((a % (b | (zero & 1))) | (a & zero));                 \
+  }
+
+SIGNED_DIVISION(div, rem, 64)
+SIGNED_DIVISION(divw, remw, 32)
+UNSIGNED_DIVISION(divu, remu, 64)
+UNSIGNED_DIVISION(divuw, remuw, 32)
+#undef UNSIGNED_DIVISION
+#undef SIGNED_DIVISION
+
+#define FUNCT7_MULDIV 0x1
+
+#define FUNCT3_MUL 0x0
+#define FUNCT3_MULH 0x1
+#define FUNCT3_MULHSU 0x2
+#define FUNCT3_MULHU 0x3
+#define FUNCT3_DIV 0x4
+#define FUNCT3_DIVU 0x5
+#define FUNCT3_REM 0x6
+#define FUNCT3_REMU 0x7
+
+static bool decode_muldiv(const u32 raw, struct Inst *inst) {
+  static const u8 ops[8] = {OP_mul,  OP_mulh, OP_mulhsu, OP_mulhu,
+                            OP_div,  OP_divu, OP_rem,    OP_remu};
+  inst->op = ops[(raw >> 12) & 0x7];
+  return false;
+}
+
+// Only the forms of the multiply and divide instructions that exist on RV32
+// have a W version
+static bool decode_muldiv_w(const u32 raw, struct Inst *inst) {
+  switch ((raw >> 12) & 0x7) {
+  case FUNCT3_MUL:
+    inst->op = OP_mulw;
+    break;
+  case FUNCT3_DIV:
+    inst->op = OP_divw;
+    break;
+  case FUNCT3_DIVU:
+    inst->op = OP_divuw;
+    break;
+  case FUNCT3_REM:
+    inst->op = OP_remw;
+    break;
+  case FUNCT3_REMU:
+    inst->op = OP_remuw;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+#define FUNCT3_ADDW 0x0
+#define FUNCT3_SLLW 0x1
+
+#define FUNCT3_SRLW_SRAW 0x5
+
+#define FUNCT7_ADDW 0x0
+#define FUNCT7_SUBW (0x1 << 5)
+
+static void inst_addw(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = (i64)(i32)(RS1 + RS2);
+}
+
+static void inst_subw(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  RD = (i64)(i32)(RS1 - RS2);
+}
+
+static void inst_sllw(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  u32 to_shift = RS1;
+  u8 shift_amount = RS2 & 0x1F;
+  i32 result = (to_shift << shift_amount);
+  RD = (i64)result;
+}
+
+static void inst_srlw(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  u32 to_be_shifted = RS1;
+  u8 shift_amount = RS2 & 0x1F;
+  i32 result = to_be_shifted >> shift_amount;
+  RD = (i64)result;
+}
+
+static void inst_sraw(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  i32 to_be_shifted = RS1;
+  u8 shift_amount = RS2 & 0x1F;
+  i32 result = to_be_shifted >> shift_amount;
+  RD = (i64)result;
+}
+
+static bool opcode_h3B(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  u8 funct7 = (raw >> 25);
+  R_TYPE_DEF(inst, raw);
+  if (FUNCT7_MULDIV == funct7) {
+    return decode_muldiv_w(raw, inst);
+  }
+  switch (funct3) {
+  case FUNCT3_SLLW:
+    if (0 != funct7) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = OP_sllw;
+    break;
+  case FUNCT3_ADDW:
+    if (FUNCT7_ADDW == funct7) {
+      inst->op = OP_addw;
+    } else if (FUNCT7_SUBW == funct7) {
+      inst->op = OP_subw;
+    } else {
+      return decode_illegal(raw, inst);
+    }
+    break;
+  case FUNCT3_SRLW_SRAW:
+    if (0 == funct7) {
+      inst->op = OP_srlw;
+    } else if ((1 << 5) == funct7) {
+      inst->op = OP_sraw;
+    } else {
+      return decode_illegal(raw, inst);
+    }
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+#define FUNCT3_ADDIW 0x0
+
+static void inst_addiw(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  RD = (i64)(i32)(RS1 + IMM);
+}
+
+static void inst_srliw(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  u32 to_be_shifted = RS1;
+  u32 result = to_be_shifted >> (IMM & 0x1F);
+  RD = (i64)(i32)result;
+}
+
+static void inst_sraiw(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  i32 to_be_shifted = RS1;
+  i32 result = to_be_shifted >> (IMM & 0x1F);
+  RD = (i64)result;
+}
+
+static void inst_slliw(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  u32 to_shift = RS1;
+  u32 result = to_shift << (IMM & 0x1F);
+  RD = (i64)(i32)result;
+#ifdef DEBUG
+  printf("%lx: slliw x%d,x%d,%ld\n", cpu->pc, inst->rd, inst->rs1, IMM);
+#endif
+}
+
+static bool opcode_h1B(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  u8 funct7 = (raw >> 25) & 0x3F; // Only used for certain funct3
+  I_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_ADDIW:
+    inst->op = OP_addiw;
+    break;
+  case FUNCT3_SLLIW:
+    SHIFT_TYPE_DEF(inst, raw);
+    inst->op = OP_slliw;
+    break;
+  case FUNCT3_SRW: {
+    SHIFT_TYPE_DEF(inst, raw);
+    if (0 == funct7) {
+      inst->op = OP_srliw;
+    } else {
+      inst->op = OP_sraiw;
+    }
+    break;
+  }
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+static bool opcode_h33(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  u8 funct7 = (raw >> 25) & 0x3F; // Only used for certain funct3
+  R_TYPE_DEF(inst, raw);
+  if (FUNCT7_MULDIV == funct7) {
+    return decode_muldiv(raw, inst);
+  }
+  if (FUNCT7_SUB == funct7 && FUNCT3_ADD == funct3) {
+    inst->op = OP_sub;
+    return false;
+  }
+  if (0 != funct7) {
+    return decode_illegal(raw, inst);
+  }
+  switch (funct3) {
+  case FUNCT3_ADD:
+    inst->op = OP_add;
+    break;
+  case FUNCT3_SLTU:
+    inst->op = OP_sltu;
+    break;
+  case FUNCT3_XOR:
+    inst->op = OP_xor;
+    break;
+  case FUNCT3_AND:
+    inst->op = OP_and;
+    break;
+  case FUNCT3_OR:
+    inst->op = OP_or;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+// RV64F and RV64D on the host FPU, which rounds like RISC-V in every mode but
+// RMM. The exception flags stay in the host until they are read, see fpu.h.
+#define FRS1 cpu->fregisters[inst->rs1]
+#define FRS2 cpu->fregisters[inst->rs2]
+#define FRS3 cpu->fregisters[inst->rs3]
+
+// Single precision values must be NaN-boxed, anything else reads as the
+// canonical NaN
+static inline u32 unbox_s(u64 value) {
+  if (likely(0xFFFFFFFF == value >> 32)) {
+    return value;
+  }
+  return CANONICAL_NAN_S;
+}
+
+static inline u64 box_s(u32 bits) {
+  return 0xFFFFFFFF00000000ULL | bits;
+}
+
+static inline float get_s(u64 value) {
+  u32 bits = unbox_s(value);
+  float result;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+static inline double get_d(u64 value) {
+  double result;
+  memcpy(&result, &value, sizeof(result));
+  return result;
+}
+
+// The host keeps the payload of NaN operands while RISC-V always returns the
+// canonical NaN
+static inline u64 from_s(float value) {
+  if (unlikely(isnan(value))) {
+    return box_s(CANONICAL_NAN_S);
+  }
+  u32 bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return box_s(bits);
+}
+
+static inline u64 from_d(double value) {
+  if (unlikely(isnan(value))) {
+    return CANONICAL_NAN_D;
+  }
+  u64 bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// Every write to a floating point register makes the FPU state dirty
+static inline void set_fd(struct CPU *cpu, const struct Inst *inst,
+                          u64 value) {
+  cpu->fregisters[inst->rd] = value;
+  cpu->csr.mstatus |= MSTATUS_FS;
+}
+
+// The floating point instructions are illegal while the FPU is off. Returns
+// false if the trap has been taken.
+static inline bool fp_enabled(struct CPU *cpu) {
+  if (unlikely(0 == (cpu->csr.mstatus & MSTATUS_FS))) {
+    cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, 0);
+    return false;
+  }
+  return true;
+}
+
+// Resolves the rounding mode of an instruction that rounds, where a dynamic
+// one is illegal if frm holds an invalid mode
+static inline bool fp_rounding(struct CPU *cpu, const struct Inst *inst,
+                               u8 *rm) {
+  if (!fp_enabled(cpu)) {
+    return false;
+  }
+  *rm = FRM_DYN == inst->rm ? cpu->csr.frm : inst->rm;
+  if (unlikely(*rm > FRM_RMM)) {
+    cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, 0);
+    return false;
+  }
+  return true;
+}
+
+// The host always runs in the mode of frm. A static rounding mode that is
+// different switches it for the one instruction, which fp_end() undoes.
+static inline bool fp_begin(struct CPU *cpu, const struct Inst *inst) {
+  u8 rm;
+  if (!fp_rounding(cpu, inst, &rm)) {
+    return false;
+  }
+  if (unlikely(rm != cpu->csr.frm)) {
+    fpu_set_rounding(rm);
+  }
+  return true;
+}
+
+static inline void fp_end(struct CPU *cpu, const struct Inst *inst) {
+  if (unlikely(FRM_DYN != inst->rm && inst->rm != cpu->csr.frm)) {
+    fpu_set_rounding(cpu->csr.frm);
+  }
+}
+
+static void inst_flw(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  u32 value;
+  if (fp_enabled(cpu) && load32(cpu, mem, RS1 + IMM, &value)) {
+    set_fd(cpu, inst, box_s(value));
+  }
+}
+
+static void inst_fld(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  u64 value;
+  if (fp_enabled(cpu) && load64(cpu, mem, RS1 + IMM, &value)) {
+    set_fd(cpu, inst, value);
+  }
+}
+
+// Stores and moves copy the bits, so they never canonicalize a NaN
+static void inst_fsw(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  if (fp_enabled(cpu)) {
+    store32(cpu, mem, RS1 + IMM, FRS2);
+  }
+}
+
+static void inst_fsd(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  if (fp_enabled(cpu)) {
+    store64(cpu, mem, RS1 + IMM, FRS2);
+  }
+}
+
+#define FP_ARITHMETIC(_name, _format, _expression)                             \
+  static void inst_##_name(struct CPU *cpu, struct Memory *mem,                \
+                           const struct Inst *inst) {                          \
+    (void)mem;                                                                 \
+    if (!fp_begin(cpu, inst)) {                                                \
+      return;                                                                  \
+    }                                                                          \
+    set_fd(cpu, inst, from_##_format(_expression));                            \
+    fp_end(cpu, inst);                                                         \
+  }
+
+// Instructions that work on the bits and do not round
+#define FP_BITS(_name, _expression)                                            \
+  static void inst_##_name(struct CPU *cpu, struct Memory *mem,                \
+                           const struct Inst *inst) {                          \
+    (void)mem;                                                                 \
+    if (fp_enabled(cpu)) {                                                     \
+      set_fd(cpu, inst, _expression);                                          \
+    }                                                                          \
+  }
+
+// Instructions that write an integer register
+#define FP_TO_INTEGER(_name, _expression)                                      \
+  static void inst_##_name(struct CPU *cpu, struct Memory *mem,                \
+                           const struct Inst *inst) {                          \
+    (void)mem;                                                                 \
+    if (fp_enabled(cpu)) {                                                     \
+      RD = _expression;                                                        \
+    }                                                                          \
+  }
+
+// Unlike feq, flt and fle raise the invalid flag for quiet NaNs as well
+#define FP_ORDERED(_name, _format, _operator)                                  \
+  static void inst_##_name(struct CPU *cpu, struct Memory *mem,                \
+                           const struct Inst *inst) {                          \
+    (void)mem;                                                                 \
+    if (!fp_enabled(cpu)) {                                                    \
+      return;                                                                  \
+    }                                                                          \
+    FLOAT_##_format a = get_##_format(FRS1);                                   \
+    FLOAT_##_format b = get_##_format(FRS2);                                   \
+    if (isunordered(a, b)) {                                                   \
+      feraiseexcept(FE_INVALID);                                               \
+      RD = 0;                                                                  \
+      return;                                                                  \
+    }                                                                          \
+    RD = a _operator b;                                                        \
+  }
+
+#define FP_CONVERT(_name, _format, _convert)                                   \
+  static void inst_##_name(struct CPU *cpu, struct Memory *mem,                \
+                           const struct Inst *inst) {                          \
+    (void)mem;                                                                 \
+    u8 rm;                                                                     \
+    if (fp_rounding(cpu, inst, &rm)) {                                         \
+      RD = _convert(get_##_format(FRS1), rm);                                  \
+    }                                                                          \
+  }
+
+#define FLOAT_s float
+#define FLOAT_d double
+#define SQRT_s sqrtf
+#define SQRT_d sqrt
+#define FMA_s fmaf
+#define FMA_d fma
+#define BOX_s(_bits) box_s(_bits)
+#define BOX_d(_bits) (_bits)
+// The bits of a register in the format
+#define BITS_s(_value) unbox_s(_value)
+#define BITS_d(_value) (_value)
+
+#define FP_FORMAT(_f, _sign)                                                   \
+  FP_ARITHMETIC(fadd_##_f, _f, get_##_f(FRS1) + get_##_f(FRS2))                \
+  FP_ARITHMETIC(fsub_##_f, _f, get_##_f(FRS1) - get_##_f(FRS2))                \
+  FP_ARITHMETIC(fmul_##_f, _f, get_##_f(FRS1) * get_##_f(FRS2))                \
+  FP_ARITHMETIC(fdiv_##_f, _f, get_##_f(FRS1) / get_##_f(FRS2))                \
+  FP_ARITHMETIC(fsqrt_##_f, _f, SQRT_##_f(get_##_f(FRS1)))                     \
+  FP_ARITHMETIC(fmadd_##_f, _f,                                                \
+                FMA_##_f(get_##_f(FRS1), get_##_f(FRS2), get_##_f(FRS3)))      \
+  FP_ARITHMETIC(fmsub_##_f, _f,                                                \
+                FMA_##_f(get_##_f(FRS1), get_##_f(FRS2), -get_##_f(FRS3)))     \
+  FP_ARITHMETIC(fnmsub_##_f, _f,                                               \
+                FMA_##_f(-get_##_f(FRS1), get_##_f(FRS2), get_##_f(FRS3)))     \
+  FP_ARITHMETIC(fnmadd_##_f, _f,                                               \
+                FMA_##_f(-get_##_f(FRS1), get_##_f(FRS2), -get_##_f(FRS3)))    \
+  FP_BITS(fsgnj_##_f,                                                          \
+          BOX_##_f((BITS_##_f(FRS1) & ~_sign) | (BITS_##_f(FRS2) & _sign)))    \
+  FP_BITS(fsgnjn_##_f,                                                         \
+          BOX_##_f((BITS_##_f(FRS1) & ~_sign) | (~BITS_##_f(FRS2) & _sign)))   \
+  FP_BITS(fsgnjx_##_f,                                                         \
+          BOX_##_f(BITS_##_f(FRS1) ^ (BITS_##_f(FRS2) & _sign)))               \
+  FP_BITS(fmin_##_f, BOX_##_f(fpu_min_max_##_f(BITS_##_f(FRS1),                \
+                                               BITS_##_f(FRS2), false)))       \
+  FP_BITS(fmax_##_f, BOX_##_f(fpu_min_max_##_f(BITS_##_f(FRS1),                \
+                                               BITS_##_f(FRS2), true)))        \
+  FP_TO_INTEGER(feq_##_f, get_##_f(FRS1) == get_##_f(FRS2))                    \
+  FP_TO_INTEGER(fclass_##_f, fpu_class_##_f(BITS_##_f(FRS1)))                  \
+  FP_ORDERED(flt_##_f, _f, <)                                                  \
+  FP_ORDERED(fle_##_f, _f, <=)                                                 \
+  FP_CONVERT(fcvt_w_##_f, _f, fpu_to_i32)                                      \
+  FP_CONVERT(fcvt_wu_##_f, _f, fpu_to_u32)                                     \
+  FP_CONVERT(fcvt_l_##_f, _f, fpu_to_i64)                                      \
+  FP_CONVERT(fcvt_lu_##_f, _f, fpu_to_u64)                                     \
+  FP_ARITHMETIC(fcvt_##_f##_w, _f, (FLOAT_##_f)(i32)RS1)                       \
+  FP_ARITHMETIC(fcvt_##_f##_wu, _f, (FLOAT_##_f)(u32)RS1)                      \
+  FP_ARITHMETIC(fcvt_##_f##_l, _f, (FLOAT_##_f)(i64)RS1)                       \
+  FP_ARITHMETIC(fcvt_##_f##_lu, _f, (FLOAT_##_f)RS1)
+
+FP_FORMAT(s, 0x80000000U)
+FP_FORMAT(d, 0x8000000000000000ULL)
+FP_ARITHMETIC(fcvt_s_d, s, (float)get_d(FRS1))
+FP_ARITHMETIC(fcvt_d_s, d, get_s(FRS1))
+FP_TO_INTEGER(fmv_x_w, (i64)(i32)FRS1)
+FP_TO_INTEGER(fmv_x_d, FRS1)
+FP_BITS(fmv_w_x, box_s(RS1))
+FP_BITS(fmv_d_x, RS1)
+#undef FP_FORMAT
+#undef BITS_d
+#undef BITS_s
+#undef BOX_d
+#undef BOX_s
+#undef FMA_d
+#undef FMA_s
+#undef SQRT_d
+#undef SQRT_s
+#undef FLOAT_d
+#undef FLOAT_s
+#undef FP_CONVERT
+#undef FP_ORDERED
+#undef FP_TO_INTEGER
+#undef FP_BITS
+#undef FP_ARITHMETIC
+
+#define FUNCT3_FLW 0x2
+#define FUNCT3_FLD 0x3
+
+#define FMT_S 0x0
+#define FMT_D 0x1
+
+#define FUNCT5_FADD 0x00
+#define FUNCT5_FSUB 0x01
+#define FUNCT5_FMUL 0x02
+#define FUNCT5_FDIV 0x03
+#define FUNCT5_FSGNJ 0x04
+#define FUNCT5_FMINMAX 0x05
+#define FUNCT5_FCVT_FP 0x08
+#define FUNCT5_FSQRT 0x0B
+#define FUNCT5_FCMP 0x14
+#define FUNCT5_FCVT_TO_INT 0x18
+#define FUNCT5_FCVT_FROM_INT 0x1A
+#define FUNCT5_FMV_TO_INT 0x1C
+#define FUNCT5_FMV_FROM_INT 0x1E
+
+// The rounding modes 5 and 6 are reserved
+static inline bool valid_rm(u8 rm) {
+  return rm <= FRM_RMM || FRM_DYN == rm;
+}
+
+static bool opcode_h07(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  I_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_FLW:
+    inst->op = OP_flw;
+    break;
+  case FUNCT3_FLD:
+    inst->op = OP_fld;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+static bool opcode_h27(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  S_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_FLW:
+    inst->op = OP_fsw;
+    break;
+  case FUNCT3_FLD:
+    inst->op = OP_fsd;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+// fmadd, fmsub, fnmsub and fnmadd, which are the only R4 type instructions
+static bool decode_fused(const u32 raw, struct Inst *inst) {
+  static const u8 ops[2][4] = {
+      {OP_fmadd_s, OP_fmsub_s, OP_fnmsub_s, OP_fnmadd_s},
+      {OP_fmadd_d, OP_fmsub_d, OP_fnmsub_d, OP_fnmadd_d},
+  };
+  u8 fmt = (raw >> 25) & 0x3;
+  R_TYPE_DEF(inst, raw);
+  inst->rs3 = raw >> 27;
+  inst->rm = (raw >> 12) & 0x7;
+  if (fmt > FMT_D || !valid_rm(inst->rm)) {
+    return decode_illegal(raw, inst);
+  }
+  inst->op = ops[fmt][(raw >> 2) & 0x3];
+  return false;
+}
+
+// Selects the single or double precision version of an instruction
+#define FP_OP(_name) (double_precision ? OP_##_name##_d : OP_##_name##_s)
+
+static bool opcode_h53(const u32 raw, struct Inst *inst) {
+  u8 funct5 = raw >> 27;
+  u8 fmt = (raw >> 25) & 0x3;
+  R_TYPE_DEF(inst, raw);
+  inst->rm = (raw >> 12) & 0x7;
+  if (fmt > FMT_D) {
+    return decode_illegal(raw, inst);
+  }
+  bool double_precision = FMT_D == fmt;
+  // Only some of the instructions round, the others use the field to select
+  // the operation
+  u8 rm = inst->rm;
+  switch (funct5) {
+  case FUNCT5_FADD:
+    inst->op = FP_OP(fadd);
+    break;
+  case FUNCT5_FSUB:
+    inst->op = FP_OP(fsub);
+    break;
+  case FUNCT5_FMUL:
+    inst->op = FP_OP(fmul);
+    break;
+  case FUNCT5_FDIV:
+    inst->op = FP_OP(fdiv);
+    break;
+  case FUNCT5_FSQRT:
+    if (0 != inst->rs2) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = FP_OP(fsqrt);
+    break;
+  case FUNCT5_FSGNJ: {
+    static const u8 ops[2][3] = {
+        {OP_fsgnj_s, OP_fsgnjn_s, OP_fsgnjx_s},
+        {OP_fsgnj_d, OP_fsgnjn_d, OP_fsgnjx_d},
+    };
+    if (rm > 2) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = ops[double_precision][rm];
+    return false;
+  }
+  case FUNCT5_FMINMAX:
+    if (rm > 1) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = 0 == rm ? FP_OP(fmin) : FP_OP(fmax);
+    return false;
+  case FUNCT5_FCVT_FP:
+    // The source is the other format
+    if (inst->rs2 != !double_precision) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = double_precision ? OP_fcvt_d_s : OP_fcvt_s_d;
+    break;
+  case FUNCT5_FCMP: {
+    static const u8 ops[2][3] = {
+        {OP_fle_s, OP_flt_s, OP_feq_s},
+        {OP_fle_d, OP_flt_d, OP_feq_d},
+    };
+    if (rm > 2) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = ops[double_precision][rm];
+    return false;
+  }
+  case FUNCT5_FCVT_TO_INT: {
+    static const u8 ops[2][4] = {
+        {OP_fcvt_w_s, OP_fcvt_wu_s, OP_fcvt_l_s, OP_fcvt_lu_s},
+        {OP_fcvt_w_d, OP_fcvt_wu_d, OP_fcvt_l_d, OP_fcvt_lu_d},
+    };
+    if (inst->rs2 > 3) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = ops[double_precision][inst->rs2];
+    break;
+  }
+  case FUNCT5_FCVT_FROM_INT: {
+    static const u8 ops[2][4] = {
+        {OP_fcvt_s_w, OP_fcvt_s_wu, OP_fcvt_s_l, OP_fcvt_s_lu},
+        {OP_fcvt_d_w, OP_fcvt_d_wu, OP_fcvt_d_l, OP_fcvt_d_lu},
+    };
+    if (inst->rs2 > 3) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = ops[double_precision][inst->rs2];
+    break;
+  }
+  case FUNCT5_FMV_TO_INT:
+    if (0 != inst->rs2 || rm > 1) {
+      return decode_illegal(raw, inst);
+    }
+    if (0 == rm) {
+      inst->op = double_precision ? OP_fmv_x_d : OP_fmv_x_w;
+    } else {
+      inst->op = FP_OP(fclass);
+    }
+    return false;
+  case FUNCT5_FMV_FROM_INT:
+    if (0 != inst->rs2 || 0 != rm) {
+      return decode_illegal(raw, inst);
+    }
+    inst->op = double_precision ? OP_fmv_d_x : OP_fmv_w_x;
+    return false;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  // The instruction rounds
+  if (!valid_rm(rm)) {
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+#undef FP_OP
+
+// Plain loads and stores are host loads and stores, so a full host fence
+// orders them for every combination of the predecessor and successor sets.
+static void inst_fence(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)cpu;
+  (void)mem;
+  (void)inst;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Stores to decoded code are already detected through the code generation
+// of their page, so there is nothing left to synchronize.
+static void inst_fence_i(struct CPU *cpu, struct Memory *mem,
+                         const struct Inst *inst) {
+  (void)cpu;
+  (void)mem;
+  (void)inst;
+}
+
+static void inst_ecall(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)inst;
+  // Programs without a trap handler end the run with the exit system call
+  if (0 == cpu->csr.mtvec && 0 == cpu->csr.stvec &&
+      SYS_EXIT == cpu->registers[17]) {
+    memory_halt(mem, cpu->registers[10] & 0xFF);
+    cpu->did_branch = true;
+    return;
+  }
+  cpu_trap(cpu, EXC_ECALL_FROM_U + cpu->priv, 0);
+}
+
+static void inst_ebreak(struct CPU *cpu, struct Memory *mem,
+                        const struct Inst *inst) {
+  (void)mem;
+  (void)inst;
+  cpu_trap(cpu, EXC_BREAKPOINT, cpu->pc);
+}
+
+static void inst_mret(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  (void)inst;
+  if (PRIV_M != cpu->priv) {
+    cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, 0);
+    return;
+  }
+  cpu_mret(cpu);
+}
+
+static void inst_sret(struct CPU *cpu, struct Memory *mem,
+                      const struct Inst *inst) {
+  (void)mem;
+  (void)inst;
+  if (PRIV_U == cpu->priv ||
+      (PRIV_S == cpu->priv && (cpu->csr.mstatus & MSTATUS_TSR))) {
+    cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, 0);
+    return;
+  }
+  cpu_sret(cpu);
+}
+
+// Waiting is only allowed in machine mode and in supervisor mode unless TW is
+// set, see cpu_wait_for_interrupt()
+static void inst_wfi(struct CPU *cpu, struct Memory *mem,
+                     const struct Inst *inst) {
+  (void)inst;
+  if (PRIV_U == cpu->priv ||
+      (PRIV_S == cpu->priv && (cpu->csr.mstatus & MSTATUS_TW))) {
+    cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, 0);
+    return;
+  }
+  cpu_wait_for_interrupt(cpu, mem);
+}
+
+// Decoded blocks are tagged with their physical address so only the TLB
+// needs to be flushed.
+static void inst_sfence_vma(struct CPU *cpu, struct Memory *mem,
+                            const struct Inst *inst) {
+  (void)mem;
+  if (PRIV_U == cpu->priv ||
+      (PRIV_S == cpu->priv && (cpu->csr.mstatus & MSTATUS_TVM))) {
+    cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, 0);
+    return;
+  }
+  if (0 == inst->rs1) {
+    mmu_flush(&cpu->mmu);
+  } else {
+    mmu_flush_page(&cpu->mmu, RS1);
+  }
+}
+
+enum CsrOp {
+  CSR_OP_WRITE,
+  CSR_OP_SET,
+  CSR_OP_CLEAR,
+};
+
+// The CSR number is kept in the immediate. csrrw does not read the CSR if rd
+// is x0 and the set and clear forms do not write it if the operand comes from
+// x0 or is a zero immediate.
+static void csr_instruction(struct CPU *cpu, const struct Inst *inst,
+                            enum CsrOp op, u64 operand) {
+  u16 csr = inst->imm;
+  u64 old = 0;
+  if ((CSR_OP_WRITE != op || 0 != inst->rd) && !csr_read(cpu, csr, &old)) {
+    cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, 0);
+    return;
+  }
+  if (CSR_OP_WRITE == op || 0 != inst->rs1) {
+    u64 value = operand;
+    if (CSR_OP_SET == op) {
+      value = old | operand;
+    } else if (CSR_OP_CLEAR == op) {
+      value = old & ~operand;
+    }
+    if (!csr_write(cpu, csr, value)) {
+      cpu_trap(cpu, EXC_ILLEGAL_INSTRUCTION, 0);
+      return;
+    }
+  }
+  RD = old;
+}
+
+static void inst_csrrw(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  csr_instruction(cpu, inst, CSR_OP_WRITE, RS1);
+}
+
+static void inst_csrrs(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  csr_instruction(cpu, inst, CSR_OP_SET, RS1);
+}
+
+static void inst_csrrc(struct CPU *cpu, struct Memory *mem,
+                       const struct Inst *inst) {
+  (void)mem;
+  csr_instruction(cpu, inst, CSR_OP_CLEAR, RS1);
+}
+
+// The immediate forms keep the zero extended immediate in rs1
+static void inst_csrrwi(struct CPU *cpu, struct Memory *mem,
+                        const struct Inst *inst) {
+  (void)mem;
+  csr_instruction(cpu, inst, CSR_OP_WRITE, inst->rs1);
+}
+
+static void inst_csrrsi(struct CPU *cpu, struct Memory *mem,
+                        const struct Inst *inst) {
+  (void)mem;
+  csr_instruction(cpu, inst, CSR_OP_SET, inst->rs1);
+}
+
+static void inst_csrrci(struct CPU *cpu, struct Memory *mem,
+                        const struct Inst *inst) {
+  (void)mem;
+  csr_instruction(cpu, inst, CSR_OP_CLEAR, inst->rs1);
+}
+
+// Stops the machine before the instruction at the breakpoint, which runs once
+// the debugger lets the hart continue, see struct Gdb
+static void inst_breakpoint(struct CPU *cpu, struct Memory *mem,
+                            const struct Inst *inst) {
+  (void)inst;
+  gdb_breakpoint_hit(mem->gdb, cpu);
+  cpu->did_branch = true;
+}
+
+#define FUNCT3_FENCE 0x0
+#define FUNCT3_FENCE_I 0x1
+
+static bool opcode_h0F(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  I_TYPE_DEF(inst, raw);
+  switch (funct3) {
+  case FUNCT3_FENCE:
+    inst->op = OP_fence;
+    break;
+  case FUNCT3_FENCE_I:
+    inst->op = OP_fence_i;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return false;
+}
+
+#define FUNCT3_PRIV 0x0
+#define FUNCT3_CSRRW 0x1
+#define FUNCT3_CSRRS 0x2
+#define FUNCT3_CSRRC 0x3
+#define FUNCT3_CSRRWI 0x5
+#define FUNCT3_CSRRSI 0x6
+#define FUNCT3_CSRRCI 0x7
+
+#define RAW_ECALL 0x00000073
+#define RAW_EBREAK 0x00100073
+#define RAW_SRET 0x10200073
+#define RAW_MRET 0x30200073
+#define RAW_WFI 0x10500073
+#define FUNCT7_SFENCE_VMA 0x09
+
+static bool opcode_h73(const u32 raw, struct Inst *inst) {
+  u8 funct3 = (raw >> 12) & 0x7;
+  R_TYPE_DEF(inst, raw);
+  if (FUNCT3_PRIV == funct3) {
+    if (RAW_ECALL == raw) {
+      inst->op = OP_ecall;
+    } else if (RAW_EBREAK == raw) {
+      inst->op = OP_ebreak;
+    } else if (RAW_SRET == raw) {
+      inst->op = OP_sret;
+    } else if (RAW_MRET == raw) {
+      inst->op = OP_mret;
+    } else if (RAW_WFI == raw) {
+      inst->op = OP_wfi;
+    } else if (FUNCT7_SFENCE_VMA == (raw >> 25) && 0 == inst->rd) {
+      inst->op = OP_sfence_vma;
+    } else {
+      return decode_illegal(raw, inst);
+    }
+    return true;
+  }
+  inst->imm = raw >> 20;
+  switch (funct3) {
+  case FUNCT3_CSRRW:
+    inst->op = OP_csrrw;
+    break;
+  case FUNCT3_CSRRS:
+    inst->op = OP_csrrs;
+    break;
+  case FUNCT3_CSRRC:
+    inst->op = OP_csrrc;
+    break;
+  case FUNCT3_CSRRWI:
+    inst->op = OP_csrrwi;
+    break;
+  case FUNCT3_CSRRSI:
+    inst->op = OP_csrrsi;
+    break;
+  case FUNCT3_CSRRCI:
+    inst->op = OP_csrrci;
+    break;
+  default:
+    return decode_illegal(raw, inst);
+  }
+  return true;
+}
+
+static bool decode(const u32 raw, struct Inst *inst) {
+  u8 opcode = raw & 0x7F;
+  switch (opcode) {
+  case 0x3:
+    return opcode_h03(raw, inst);
+  case 0x7:
+    return opcode_h07(raw, inst);
+  case 0xF:
+    return opcode_h0F(raw, inst);
+  case 0x13:
+    return opcode_h13(raw, inst);
+  case 0x1B:
+    return opcode_h1B(raw, inst);
+  case 0x23:
+    return opcode_h23(raw, inst);
+  case 0x27:
+    return opcode_h27(raw, inst);
+  case 0x2F:
+    return opcode_h2F(raw, inst);
+  case 0x33:
+    return opcode_h33(raw, inst);
+  case 0x37:
+    U_TYPE_DEF(inst, raw);
+    inst->op = OP_lui;
+    return false;
+  case 0x3B:
+    return opcode_h3B(raw, inst);
+  case 0x43:
+  case 0x47:
+  case 0x4B:
+  case 0x4F:
+    return decode_fused(raw, inst);
+  case 0x53:
+    return opcode_h53(raw, inst);
+  case 0x63:
+    return opcode_h63(raw, inst);
+  case 0x67:
+    return opcode_h67(raw, inst);
+  case 0x6F:
+    J_TYPE_DEF(inst, raw);
+    inst->op = OP_jal;
+    return true;
+  case 0x73:
+    return opcode_h73(raw, inst);
+  default:
+    return decode_illegal(raw, inst);
+  }
+}
+
+#define HANDLER_ENTRY(_name, _kind) inst_##_name,
+static const inst_handler_t inst_handlers[OP_COUNT] = {
+    INSTRUCTION_LIST(HANDLER_ENTRY)};
+#undef HANDLER_ENTRY
+
+bool decode_instruction(const u32 raw, struct Inst *inst) {
+  bool ends_block;
+  inst->rs3 = 0;
+  inst->rm = 0;
+  if (rvc_is_compressed(raw)) {
+    u32 expanded = rvc_expand(raw);
+    ends_block = decode(expanded, inst);
+    if (OP_illegal == inst->op) {
+      // The trap reports the instruction as the guest wrote it
+      inst->imm = (u16)raw;
+    }
+    inst->length = sizeof(u16);
+  } else {
+    ends_block = decode(raw, inst);
+    inst->length = sizeof(u32);
+  }
+  inst->dispatch.handler = inst_handlers[inst->op];
+  return ends_block;
+}
+
+void decode_breakpoint(struct Inst *inst) {
+  memset(inst, 0, sizeof(*inst));
+  inst->op = OP_breakpoint;
+  inst->dispatch.handler = inst_handlers[OP_breakpoint];
+}
+
+static inline void execute_instruction(struct CPU *cpu, struct Memory *mem,
+                                       const struct Inst *inst) {
+  inst->dispatch.handler(cpu, mem, inst);
+  cpu->registers[0] = 0;
+}
+
+bool cpu_fetch_address_slow(struct CPU *cpu, struct Memory *mem,
+                            u64 *physical) {
+  enum MmuResult result =
+      mmu_translate(&cpu->mmu, mem, cpu->pc, ACCESS_EXECUTE, physical);
+  if (MMU_OK == result && !ram_contains(mem, *physical, sizeof(u16))) {
+    // Code can only be executed from RAM
+    cpu->mmu.fault_address = cpu->pc;
+    result = MMU_ACCESS_FAULT;
+  }
+  if (MMU_OK != result) {
+    cpu_mmu_fault(cpu, mem, result, ACCESS_EXECUTE);
+    return false;
+  }
+  return true;
+}
+
+bool cpu_fetch_instruction(struct CPU *cpu, struct Memory *mem, u64 physical,
+                           u32 *raw) {
+  u16 low = memory_read16(mem, physical);
+  if (rvc_is_compressed(low)) {
+    *raw = low;
+    return true;
+  }
+  u64 high_pc = cpu->pc + sizeof(u16);
+  if (likely(0 != (high_pc & (PAGE_SIZE - 1)))) {
+    // RAM is made of whole pages, so the rest of the page is in it as well
+    *raw = memory_read32(mem, physical);
+    return true;
+  }
+  u64 high;
+  enum MmuResult result =
+      mmu_translate(&cpu->mmu, mem, high_pc, ACCESS_EXECUTE, &high);
+  if (MMU_OK == result && !ram_contains(mem, high, sizeof(u16))) {
+    cpu->mmu.fault_address = high_pc;
+    result = MMU_ACCESS_FAULT;
+  }
+  if (MMU_OK != result) {
+    cpu_mmu_fault(cpu, mem, result, ACCESS_EXECUTE);
+    return false;
+  }
+  *raw = low | (u32)memory_read16(mem, high) << 16;
+  return true;
+}
+
+#define IS_FLOAT_NEXT false
+#define IS_FLOAT_TRAP false
+#define IS_FLOAT_BRANCH false
+#define IS_FLOAT_FLOAT true
+#define FLOAT_ENTRY(_name, _kind) IS_FLOAT_##_kind,
+static const bool op_is_float[OP_COUNT] = {INSTRUCTION_LIST(FLOAT_ENTRY)};
+#undef FLOAT_ENTRY
+
+#define IS_BRANCH_NEXT false
+#define IS_BRANCH_TRAP false
+#define IS_BRANCH_BRANCH true
+#define IS_BRANCH_FLOAT false
+#define BRANCH_ENTRY(_name, _kind) IS_BRANCH_##_kind,
+static const bool op_is_branch[OP_COUNT] = {INSTRUCTION_LIST(BRANCH_ENTRY)};
+#undef BRANCH_ENTRY
+
+u8 written_register(const struct Inst *inst) {
+  switch (inst->op) {
+  case OP_flw:
+  case OP_fld:
+    return 0;
+  case OP_feq_s:
+  case OP_flt_s:
+  case OP_fle_s:
+  case OP_fclass_s:
+  case OP_fcvt_w_s:
+  case OP_fcvt_wu_s:
+  case OP_fcvt_l_s:
+  case OP_fcvt_lu_s:
+  case OP_feq_d:
+  case OP_flt_d:
+  case OP_fle_d:
+  case OP_fclass_d:
+  case OP_fcvt_w_d:
+  case OP_fcvt_wu_d:
+  case OP_fcvt_l_d:
+  case OP_fcvt_lu_d:
+  case OP_fmv_x_w:
+  case OP_fmv_x_d:
+    return inst->rd;
+  default:
+    return op_is_float[inst->op] ? 0 : inst->rd;
+  }
+}
+
+// Appends the execution of the block to the trace. inst is where it stopped,
+// the OP_BLOCK_END record if it ran to the end. Only the last instruction
+// may branch, so any other one that stopped it trapped. The last one counts
+// as executed even if it trapped, which the engines can not tell apart from
+// a branch.
+static void trace_block(struct Trace *trace, const struct CPU *cpu,
+                        const struct Block *block, const struct Inst *inst) {
+  u32 count = (u32)(inst - block->insts) + op_is_branch[inst->op];
+  u32 mask = count == block->length ? block->trace_mask
+                                    : tcache_written(block, count);
+  trace_execute(trace, block->trace_id, count, block->length, mask,
+                cpu->registers);
+}
+
+static void step(struct CPU *cpu, struct Memory *mem,
+                 struct Profile *profile) {
+  struct Inst inst;
+  u64 physical;
+  cpu->did_branch = false;
+  u32 raw;
+  if (!cpu_fetch_address(cpu, mem, &physical) ||
+      !cpu_fetch_instruction(cpu, mem, physical, &raw)) {
+    return;
+  }
+  decode_instruction(raw, &inst);
+  if (profile) {
+    profile_instruction(profile, cpu->pc, inst.op);
+  }
+  execute_instruction(cpu, mem, &inst);
+  if (!cpu->did_branch) {
+    cpu->pc += inst.length;
+  }
+}
+
+void cpu_step(struct CPU *cpu, struct Memory *mem) {
+  fenv_t host;
+  fpu_enter(cpu, &host);
+  step(cpu, mem, NULL);
+  fpu_leave(cpu, &host);
+}
+
+// Parks the hart while the debugger has the machine stopped and executes the
+// single steps it asks for in the meantime, without taking interrupts. The
+// debugger sees fflags and frm in the struct CPU, the host FPU is loaded from
+// them again before the hart runs, see fpu.h.
+static void debug_stop(struct CPU *cpu, struct Memory *mem) {
+  fpu_read_fflags(cpu);
+  while (GDB_STEP == gdb_park(mem->gdb, cpu)) {
+    fpu_write_fflags(cpu, cpu->csr.fflags);
+    fpu_set_rounding(cpu->csr.frm);
+    step(cpu, mem, NULL);
+    cpu->instret++;
+    fpu_read_fflags(cpu);
+  }
+  fpu_write_fflags(cpu, cpu->csr.fflags);
+  fpu_set_rounding(cpu->csr.frm);
+}
+
+// Blocks the hart until cpu_resume()
+static void park(struct Memory *mem) {
+  pthread_mutex_lock(&mem->pause_lock);
+  mem->parked_harts++;
+  pthread_cond_broadcast(&mem->pause_changed);
+  while (mem->pause) {
+    pthread_cond_wait(&mem->pause_changed, &mem->pause_lock);
+  }
+  mem->parked_harts--;
+  pthread_mutex_unlock(&mem->pause_lock);
+}
+
+void cpu_pause(struct Memory *mem, struct CPU *cpus, u64 num_harts) {
+  pthread_mutex_lock(&mem->pause_lock);
+  __atomic_store_n(&mem->pause, true, __ATOMIC_SEQ_CST);
+  for (u64 i = 0; i < num_harts; i++) {
+    cpu_check_interrupts(&cpus[i]);
+  }
+  while (mem->parked_harts < mem->running_harts) {
+    pthread_cond_wait(&mem->pause_changed, &mem->pause_lock);
+  }
+  pthread_mutex_unlock(&mem->pause_lock);
+}
+
+void cpu_resume(struct Memory *mem) {
+  pthread_mutex_lock(&mem->pause_lock);
+  __atomic_store_n(&mem->pause, false, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&mem->pause_changed);
+  pthread_mutex_unlock(&mem->pause_lock);
+}
+
+// Checked before every block. Interrupts are only looked at once another
+// thread or the hart itself cleared instret_stop, see struct CPU. Pausing
+// the harts and the debugger stop the machine the same way.
+static bool stopped(struct CPU *cpu, struct Memory *mem) {
+  if (memory_halted(mem) || cpu->instret >= cpu->instret_limit) {
+    return true;
+  }
+  // Re-armed before mip is read so that an interrupt raised in between
+  // clears it again
+  __atomic_store_n(&cpu->instret_stop, cpu->instret_limit, __ATOMIC_SEQ_CST);
+  if (unlikely(memory_pausing(mem))) {
+    park(mem);
+    if (memory_halted(mem)) {
+      return true;
+    }
+  }
+  if (unlikely(mem->gdb) && gdb_stopping(mem->gdb)) {
+    debug_stop(cpu, mem);
+    if (memory_halted(mem) || cpu->instret >= cpu->instret_limit) {
+      return true;
+    }
+  }
+  cpu_take_interrupt(cpu);
+  return false;
+}
+
+static inline bool running(struct CPU *cpu, struct Memory *mem) {
+  if (likely(cpu->instret < cpu->instret_stop && !memory_halted(mem))) {
+    return true;
+  }
+  return !stopped(cpu, mem);
+}
+
+static void cpu_loop_switch(struct CPU *cpu, struct Memory *mem,
+                            struct Profile *profile) {
+  while (running(cpu, mem)) {
+    step(cpu, mem, profile);
+    cpu->instret++;
+  }
+}
+
+static void cpu_loop_cached(struct CPU *cpu, struct Memory *mem,
+                            struct TCache *cache, struct Trace *trace) {
+  while (running(cpu, mem)) {
+    struct Block *block = tcache_lookup(cache, cpu, mem);
+    if (!block) {
+      continue;
+    }
+    block->executions++;
+    cpu->instret += block->length;
+    const struct Inst *inst = block->insts;
+    const struct Inst *const end = inst + block->length;
+    cpu->did_branch = false;
+    for (; inst < end; inst++) {
+      execute_instruction(cpu, mem, inst);
+      if (cpu->did_branch)
+        break;
+      cpu->pc += inst->length;
+    }
+    if (trace) {
+      trace_block(trace, cpu, block, inst);
+    }
+  }
+}
+
+static void cpu_loop_jit(struct CPU *cpu, struct Memory *mem,
+                         struct TCache *cache, struct Jit *jit,
+                         struct Trace *trace) {
+  u8 *exit = NULL;
+  while (running(cpu, mem)) {
+    struct Block *block = tcache_lookup(cache, cpu, mem);
+    if (!block) {
+      exit = NULL;
+      continue;
+    }
+    cpu->did_branch = false;
+    block->executions++;
+    if (!block->native && JIT_THRESHOLD == ++block->hits) {
+      // Compiling may flush the code buffer the exit lives in
+      exit = NULL;
+      jit_compile(jit, cache, mem, block);
+      if (block->native && cache->log) {
+        tcache_record(cache, block);
+      }
+    }
+    if (block->native) {
+      // Chained blocks would not be counted by the profile
+      if (exit && !cache->profile) {
+        jit_chain(exit, block->native);
+      }
+      // Native code leaves the flushing to the dispatcher, it comes back
+      // here once the buffer is full
+      if (trace && trace->next >= trace->end) {
+        trace_flush(trace);
+      }
+      // Native code counts its own instructions
+      exit = jit_run(jit, cpu, mem, block->native);
+      continue;
+    }
+    exit = NULL;
+    cpu->instret += block->length;
+    const struct Inst *inst = block->insts;
+    const struct Inst *const end = inst + block->length;
+    for (; inst < end; inst++) {
+      execute_instruction(cpu, mem, inst);
+      if (cpu->did_branch)
+        break;
+      cpu->pc += inst->length;
+    }
+    if (trace) {
+      trace_block(trace, cpu, block, inst);
+    }
+  }
+}
+
+// Direct threaded engine. Every record in a block holds the address of the
+// label implementing it and every label ends with its own indirect jump to
+// the next record, which gives the branch predictor one dispatch site per
+// instruction instead of a single shared one. The labels call the same
+// handlers as the other engines, which the compiler inlines here.
+//
+// Labels as values are a GNU extension.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define DISPATCH() goto *inst->dispatch.label
+
+#define THREADED_NEXT()                                                        \
+  cpu->pc += inst->length;                                                     \
+  inst++;                                                                      \
+  DISPATCH();
+
+#define THREADED_TRAP()                                                        \
+  if (cpu->did_branch) {                                                       \
+    goto next_block;                                                           \
+  }                                                                            \
+  THREADED_NEXT();
+
+#define THREADED_BRANCH()                                                      \
+  if (!cpu->did_branch) {                                                      \
+    cpu->pc += inst->length;                                                   \
+  }                                                                            \
+  goto next_block;
+
+#define THREADED_FLOAT() THREADED_TRAP()
+
+#define THREADED_LABEL(_name, _kind)                                           \
+  do_##_name : inst_##_name(cpu, mem, inst);                                   \
+  cpu->registers[0] = 0;                                                       \
+  THREADED_##_kind();
+
+#define LABEL_ENTRY(_name, _kind) &&do_##_name,
+
+// The labels only exist in here, called without a hart this only hands them
+// to the cache, which has to happen before it decodes anything.
+static void cpu_loop_threaded(struct CPU *cpu, struct Memory *mem,
+                              struct TCache *cache, struct Trace *trace) {
+  static const void *const labels[OP_COUNT] = {
+      INSTRUCTION_LIST(LABEL_ENTRY) && do_block_end};
+  if (!cpu) {
+    cache->labels = labels;
+    return;
+  }
+  struct Block *block = NULL;
+  const struct Inst *inst = NULL;
+
+next_block:
+  // Every label that leaves a block comes here with inst where it stopped
+  if (trace && block) {
+    trace_block(trace, cpu, block, inst);
+  }
+  if (!running(cpu, mem)) {
+    return;
+  }
+  block = tcache_lookup(cache, cpu, mem);
+  if (!block) {
+    goto next_block;
+  }
+  block->executions++;
+  cpu->instret += block->length;
+  inst = block->insts;
+  cpu->did_branch = false;
+  DISPATCH();
+
+  INSTRUCTION_LIST(THREADED_LABEL)
+
+do_block_end:
+  goto next_block;
+}
+#undef LABEL_ENTRY
+#undef THREADED_LABEL
+#undef THREADED_FLOAT
+#undef THREADED_BRANCH
+#undef THREADED_TRAP
+#undef THREADED_NEXT
+#undef DISPATCH
+#pragma GCC diagnostic pop
+
+struct CpuCache {
+  enum Engine engine;
+  struct TCache *tcache;
+  struct Jit jit;
+};
+
+struct CpuCache *cpu_cache_create(enum Engine engine, struct Profile *profile,
+                                  struct Trace *trace) {
+  struct CpuCache *cache = calloc(1, sizeof(struct CpuCache));
+  if (!cache) {
+    perror("calloc");
+    return NULL;
+  }
+  cache->engine = engine;
+  // The switch engine decodes every instruction again
+  if (ENGINE_SWITCH == engine) {
+    return cache;
+  }
+  cache->tcache = tcache_create(NULL, profile, trace);
+  if (!cache->tcache) {
+    free(cache);
+    return NULL;
+  }
+  if (ENGINE_THREADED == engine) {
+    cpu_loop_threaded(NULL, NULL, cache->tcache, NULL);
+  }
+  if (ENGINE_JIT == engine && !jit_init(&cache->jit)) {
+    tcache_destroy(cache->tcache);
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+void cpu_cache_destroy(struct CpuCache *cache) {
+  if (ENGINE_JIT == cache->engine) {
+    jit_destroy(&cache->jit);
+  }
+  if (cache->tcache) {
+    tcache_destroy(cache->tcache);
+  }
+  free(cache);
+}
+
+void cpu_cache_record(struct CpuCache *cache, struct TCacheLog *log) {
+  if (cache->tcache) {
+    cache->tcache->log = log;
+  }
+}
+
+void cpu_cache_replay(struct CpuCache *cache, struct Memory *mem,
+                      struct TCacheLog *log) {
+  for (u64 i = 0; cache->tcache && i < log->length; i++) {
+    const struct TCacheLogEntry *entry = &log->entries[i];
+    struct Block *block =
+        tcache_decode(cache->tcache, mem, entry->pc, entry->physical);
+    if (block && entry->native && ENGINE_JIT == cache->engine &&
+        !block->native) {
+      jit_compile(&cache->jit, cache->tcache, mem, block);
+    }
+  }
+  log->length = 0;
+}
+
+static void run_engine(struct CPU *cpu, struct Memory *mem, enum Engine engine,
+                       struct Profile *profile, struct Trace *trace,
+                       struct CpuCache *cache) {
+  // Breakpoints and traces are put into the decoded blocks, the switch engine
+  // has none
+  if ((mem->gdb || trace) && ENGINE_SWITCH == engine) {
+    engine = ENGINE_CACHED;
+  }
+  struct CpuCache *own = NULL;
+  if (!cache) {
+    cache = own = cpu_cache_create(engine, profile, trace);
+    if (!cache) {
+      return;
+    }
+  }
+  assert(engine == cache->engine);
+  assert(!cache->tcache || trace == cache->tcache->trace);
+  switch (engine) {
+  case ENGINE_SWITCH:
+    cpu_loop_switch(cpu, mem, profile);
+    break;
+  case ENGINE_CACHED:
+    cpu_loop_cached(cpu, mem, cache->tcache, trace);
+    break;
+  case ENGINE_THREADED:
+    cpu_loop_threaded(cpu, mem, cache->tcache, trace);
+    break;
+  case ENGINE_JIT:
+    cpu_loop_jit(cpu, mem, cache->tcache, &cache->jit, trace);
+    break;
+  }
+  if (own) {
+    cpu_cache_destroy(own);
+  }
+}
+
+void cpu_loop(struct CPU *cpu, struct Memory *mem, enum Engine engine,
+              struct Profile *profile, struct Trace *trace,
+              struct CpuCache *cache) {
+  fenv_t host;
+  fpu_enter(cpu, &host);
+  // instret_limit may have changed since the last time
+  cpu_check_interrupts(cpu);
+  pthread_mutex_lock(&mem->pause_lock);
+  mem->running_harts++;
+  pthread_mutex_unlock(&mem->pause_lock);
+  run_engine(cpu, mem, engine, profile, trace, cache);
+  pthread_mutex_lock(&mem->pause_lock);
+  mem->running_harts--;
+  pthread_cond_broadcast(&mem->pause_changed);
+  pthread_mutex_unlock(&mem->pause_lock);
+  fpu_leave(cpu, &host);
+}
+
+void cpu_init(struct CPU *cpu, u64 hart_id, u64 pc) {
+  for (int i = 0; i < 32; i++) {
+    cpu->registers[i] = 0;
+  }
+  cpu->registers[10] = hart_id;
+  cpu->did_branch = false;
+  cpu->pc = pc;
+  cpu->priv = PRIV_M;
+  cpu->reservation = NULL;
+  cpu->reservation_value = 0;
+  cpu->reservation_size = 0;
+  cpu->hart_id = hart_id;
+  cpu->instret = 0;
+  cpu->instret_limit = ~0ULL;
+  cpu->instret_stop = 0;
+  cpu->mtimecmp = ~0ULL;
+  cpu->clint = NULL;
+  memset(cpu->plic_enable, 0, sizeof(cpu->plic_enable));
+  memset(cpu->plic_threshold, 0, sizeof(cpu->plic_threshold));
+  cpu->waiting = false;
+  cpu->wake_seq = 0;
+  for (int i = 0; i < 32; i++) {
+    cpu->fregisters[i] = 0;
+  }
+  memset(&cpu->csr, 0, sizeof(cpu->csr));
+  // The FPU starts out on so that programs without a boot loader can use it
+  cpu->csr.mstatus = MSTATUS_UXL | MSTATUS_SXL | MSTATUS_FS_INITIAL;
+  mmu_init(&cpu->mmu);
+}
@@ -0,0 +1,363 @@
+#ifndef CPU_H
+#define CPU_H
+#include "mmu.h"
+#include "types.h"
+#include <stdbool.h>
+
+struct Clint;
+struct CpuCache;
+struct Profile;
+struct TCacheLog;
+struct Trace;
+
+// Machine and supervisor CSRs that are plain storage, see csr.c
+struct Csrs {
+  u64 mstatus;
+  u64 medeleg;
+  u64 mideleg;
+  u64 mie;
+  u64 mip;
+  u64 mtvec;
+  u64 mcounteren;
+  u64 mscratch;
+  u64 mepc;
+  u64 mcause;
+  u64 mtval;
+  u64 stvec;
+  u64 scounteren;
+  u64 sscratch;
+  u64 sepc;
+  u64 scause;
+  u64 stval;
+  // Exception flags of the floating point instructions collected from the
+  // host so far, see fpu.h
+  u8 fflags;
+  u8 frm;
+};
+
+// A hart. Every hart runs on its own host thread and only shares the struct
+// Memory with the others.
+struct CPU {
+  u64 registers[32];
+  // Single precision values are NaN-boxed in the lower half
+  u64 fregisters[32];
+  u64 pc;
+  // Set when the instruction changed the pc, either as a jump or by taking
+  // a trap
+  bool did_branch;
+  u8 priv;
+  // Reservation of the last LR, NULL if there is none
+  void *reservation;
+  u64 reservation_value;
+  u8 reservation_size;
+  u64 hart_id;
+  // Number of instructions executed. The engines with a translation cache
+  // add whole blocks when they enter them, so a block left early because of
+  // a trap is counted as if it ran to the end.
+  u64 instret;
+  // cpu_loop() returns once instret reaches it or the memory is halted
+  u64 instret_limit;
+  // Before every block the engines compare instret with this copy of
+  // instret_limit, which is all they check. Other threads set it to 0 when
+  // they raise an interrupt, so the hart leaves the fast path and looks at
+  // mip without polling it.
+  u64 instret_stop;
+  // Kept with the hart rather than in the CLINT so that it is saved and
+  // reset along with the rest of the hart
+  u64 mtimecmp;
+  // Provides the time CSR, NULL if there is none
+  struct Clint *clint;
+  // Enable bits and threshold of the PLIC contexts of machine and supervisor
+  // mode, kept with the hart for the same reason as mtimecmp
+  u32 plic_enable[2];
+  u32 plic_threshold[2];
+  // Set while the hart waits in wfi for wake_seq to change, see
+  // cpu_wait_for_interrupt()
+  bool waiting;
+  u32 wake_seq;
+  struct Csrs csr;
+  struct Mmu mmu;
+};
+
+// Every instruction handler together with how it affects the control flow.
+// NEXT handlers always continue with the following instruction, TRAP handlers
+// do the same unless they raise an exception and BRANCH handlers may set the
+// pc and therefore end a block. FLOAT handlers are floating point
+// instructions, which trap like TRAP handlers while the FPU is off but do not
+// access memory. breakpoint is not an instruction, it takes the place of the
+// one at a breakpoint of the debugger, see decode_breakpoint().
+#define INSTRUCTION_LIST(X)                                                    \
+  X(illegal, BRANCH)                                                           \
+  X(lui, NEXT)                                                                 \
+  X(addi, NEXT)                                                                \
+  X(slti, NEXT)                                                                \
+  X(sltiu, NEXT)                                                               \
+  X(xori, NEXT)                                                                \
+  X(ori, NEXT)                                                                 \
+  X(andi, NEXT)                                                                \
+  X(slli, NEXT)                                                                \
+  X(srli, NEXT)                                                                \
+  X(srai, NEXT)                                                                \
+  X(add, NEXT)                                                                 \
+  X(sub, NEXT)                                                                 \
+  X(sltu, NEXT)                                                                \
+  X(xor, NEXT)                                                                 \
+  X(or, NEXT)                                                                  \
+  X(and, NEXT)                                                                 \
+  X(addiw, NEXT)                                                               \
+  X(slliw, NEXT)                                                               \
+  X(srliw, NEXT)                                                               \
+  X(sraiw, NEXT)                                                               \
+  X(addw, NEXT)                                                                \
+  X(subw, NEXT)                                                                \
+  X(sllw, NEXT)                                                                \
+  X(srlw, NEXT)                                                                \
+  X(sraw, NEXT)                                                                \
+  X(mul, NEXT)                                                                 \
+  X(mulh, NEXT)                                                                \
+  X(mulhsu, NEXT)                                                              \
+  X(mulhu, NEXT)                                                               \
+  X(div, NEXT)                                                                 \
+  X(divu, NEXT)                                                                \
+  X(rem, NEXT)                                                                 \
+  X(remu, NEXT)                                                                \
+  X(mulw, NEXT)                                                                \
+  X(divw, NEXT)                                                                \
+  X(divuw, NEXT)                                                               \
+  X(remw, NEXT)                                                                \
+  X(remuw, NEXT)                                                               \
+  X(lw, TRAP)                                                                  \
+  X(ld, TRAP)                                                                  \
+  X(lbu, TRAP)                                                                 \
+  X(sb, TRAP)                                                                  \
+  X(sh, TRAP)                                                                  \
+  X(sw, TRAP)                                                                  \
+  X(sd, TRAP)                                                                  \
+  X(lr_w, TRAP)                                                                \
+  X(sc_w, TRAP)                                                                \
+  X(amoswap_w, TRAP)                                                           \
+  X(amoadd_w, TRAP)                                                            \
+  X(amoxor_w, TRAP)                                                            \
+  X(amoand_w, TRAP)                                                            \
+  X(amoor_w, TRAP)                                                             \
+  X(amomin_w, TRAP)                                                            \
+  X(amomax_w, TRAP)                                                            \
+  X(amominu_w, TRAP)                                                           \
+  X(amomaxu_w, TRAP)                                                           \
+  X(lr_d, TRAP)                                                                \
+  X(sc_d, TRAP)                                                                \
+  X(amoswap_d, TRAP)                                                           \
+  X(amoadd_d, TRAP)                                                            \
+  X(amoxor_d, TRAP)                                                            \
+  X(amoand_d, TRAP)                                                            \
+  X(amoor_d, TRAP)                                                             \
+  X(amomin_d, TRAP)                                                            \
+  X(amomax_d, TRAP)                                                            \
+  X(amominu_d, TRAP)                                                           \
+  X(amomaxu_d, TRAP)                                                           \
+  X(flw, TRAP)                                                                 \
+  X(fld, TRAP)                                                                 \
+  X(fsw, TRAP)                                                                 \
+  X(fsd, TRAP)                                                                 \
+  X(fadd_s, FLOAT)                                                             \
+  X(fsub_s, FLOAT)                                                             \
+  X(fmul_s, FLOAT)                                                             \
+  X(fdiv_s, FLOAT)                                                             \
+  X(fsqrt_s, FLOAT)                                                            \
+  X(fmin_s, FLOAT)                                                             \
+  X(fmax_s, FLOAT)                                                             \
+  X(fsgnj_s, FLOAT)                                                            \
+  X(fsgnjn_s, FLOAT)                                                           \
+  X(fsgnjx_s, FLOAT)                                                           \
+  X(fmadd_s, FLOAT)                                                            \
+  X(fmsub_s, FLOAT)                                                            \
+  X(fnmsub_s, FLOAT)                                                           \
+  X(fnmadd_s, FLOAT)                                                           \
+  X(feq_s, FLOAT)                                                              \
+  X(flt_s, FLOAT)                                                              \
+  X(fle_s, FLOAT)                                                              \
+  X(fclass_s, FLOAT)                                                           \
+  X(fcvt_w_s, FLOAT)                                                           \
+  X(fcvt_s_w, FLOAT)                                                           \
+  X(fcvt_wu_s, FLOAT)                                                          \
+  X(fcvt_s_wu, FLOAT)                                                          \
+  X(fcvt_l_s, FLOAT)                                                           \
+  X(fcvt_s_l, FLOAT)                                                           \
+  X(fcvt_lu_s, FLOAT)                                                          \
+  X(fcvt_s_lu, FLOAT)                                                          \
+  X(fadd_d, FLOAT)                                                             \
+  X(fsub_d, FLOAT)                                                             \
+  X(fmul_d, FLOAT)                                                             \
+  X(fdiv_d, FLOAT)                                                             \
+  X(fsqrt_d, FLOAT)                                                            \
+  X(fmin_d, FLOAT)                                                             \
+  X(fmax_d, FLOAT)                                                             \
+  X(fsgnj_d, FLOAT)                                                            \
+  X(fsgnjn_d, FLOAT)                                                           \
+  X(fsgnjx_d, FLOAT)                                                           \
+  X(fmadd_d, FLOAT)                                                            \
+  X(fmsub_d, FLOAT)                                                            \
+  X(fnmsub_d, FLOAT)                                                           \
+  X(fnmadd_d, FLOAT)                                                           \
+  X(feq_d, FLOAT)                                                              \
+  X(flt_d, FLOAT)                                                              \
+  X(fle_d, FLOAT)                                                              \
+  X(fclass_d, FLOAT)                                                           \
+  X(fcvt_w_d, FLOAT)                                                           \
+  X(fcvt_d_w, FLOAT)                                                           \
+  X(fcvt_wu_d, FLOAT)                                                          \
+  X(fcvt_d_wu, FLOAT)                                                          \
+  X(fcvt_l_d, FLOAT)                                                           \
+  X(fcvt_d_l, FLOAT)                                                           \
+  X(fcvt_lu_d, FLOAT)                                                          \
+  X(fcvt_d_lu, FLOAT)                                                          \
+  X(fmv_x_w, FLOAT)                                                            \
+  X(fmv_w_x, FLOAT)                                                            \
+  X(fmv_x_d, FLOAT)                                                            \
+  X(fmv_d_x, FLOAT)                                                            \
+  X(fcvt_s_d, FLOAT)                                                           \
+  X(fcvt_d_s, FLOAT)                                                           \
+  X(jal, BRANCH)                                                               \
+  X(jalr, BRANCH)                                                              \
+  X(beq, BRANCH)                                                               \
+  X(bne, BRANCH)                                                               \
+  X(bge, BRANCH)                                                               \
+  X(bltu, BRANCH)                                                              \
+  X(bgeu, BRANCH)                                                              \
+  X(fence, NEXT)                                                               \
+  X(fence_i, NEXT)                                                             \
+  X(ecall, BRANCH)                                                             \
+  X(ebreak, BRANCH)                                                            \
+  X(mret, BRANCH)                                                              \
+  X(sret, BRANCH)                                                              \
+  X(wfi, TRAP)                                                                 \
+  X(sfence_vma, BRANCH)                                                        \
+  X(csrrw, BRANCH)                                                             \
+  X(csrrs, BRANCH)                                                             \
+  X(csrrc, BRANCH)                                                             \
+  X(csrrwi, BRANCH)                                                            \
+  X(csrrsi, BRANCH)                                                            \
+  X(csrrci, BRANCH)                                                            \
+  X(breakpoint, BRANCH)
+
+#define OP_ENUM(_name, _kind) OP_##_name,
+enum InstOp {
+  INSTRUCTION_LIST(OP_ENUM)
+  // Not an instruction, terminates every decoded block
+  OP_BLOCK_END,
+  OP_COUNT
+};
+#undef OP_ENUM
+
+struct Inst;
+
+typedef void (*inst_handler_t)(struct CPU *cpu, struct Memory *mem,
+                               const struct Inst *inst);
+
+// A pre-decoded instruction. All the field extraction and sign extension is
+// done once by decode_instruction() so that executing it is only a call
+// through the handler, or for the threaded engine a jump to its label.
+struct Inst {
+  union {
+    inst_handler_t handler;
+    const void *label;
+  } dispatch;
+  i32 imm;
+  u8 op;
+  u8 rd;
+  u8 rs1;
+  u8 rs2;
+  // Only used by the floating point instructions
+  u8 rs3;
+  u8 rm;
+  // Size of the instruction in memory, 2 if it was expanded from a
+  // compressed one and 4 otherwise
+  u8 length;
+};
+
+enum Engine {
+  // Fetches and decodes every instruction. Slow but simple, this is the
+  // reference the other engines are compared against.
+  ENGINE_SWITCH,
+  // Replays blocks from the translation cache by calling the handlers.
+  ENGINE_CACHED,
+  // Replays blocks from the translation cache with direct threaded dispatch.
+  ENGINE_THREADED,
+  // Like ENGINE_CACHED but hot blocks are compiled to native code.
+  ENGINE_JIT,
+};
+
+// Harts start in machine mode at pc with their hart id in a0 and without an
+// instruction limit.
+void cpu_init(struct CPU *cpu, u64 hart_id, u64 pc);
+void cpu_dump_state(struct CPU *cpu);
+
+// Returns true if the instruction may change the control flow, which means it
+// has to be the last instruction of a block. Compressed instructions are
+// expanded first and only their low 16 bits of raw are looked at.
+bool decode_instruction(const u32 raw, struct Inst *inst);
+// Decodes the stop at a breakpoint of the debugger, which ends the block like
+// a branch that leaves the pc where it is.
+void decode_breakpoint(struct Inst *inst);
+// Returns the integer register written by the instruction, 0 if there is
+// none. Writes to the floating point registers are not counted.
+u8 written_register(const struct Inst *inst);
+
+bool cpu_fetch_address_slow(struct CPU *cpu, struct Memory *mem,
+                            u64 *physical);
+
+// Translates cpu->pc for an instruction fetch. Only the first parcel of the
+// instruction is checked, see cpu_fetch_instruction(). On failure the fault is
+// raised and false is returned.
+static inline bool cpu_fetch_address(struct CPU *cpu, struct Memory *mem,
+                                     u64 *physical) {
+  const struct TlbEntry *entry = tlb_entry(cpu->mmu.fetch, cpu->pc);
+  if (likely((cpu->pc & TLB_MASK(sizeof(u16))) ==
+             entry->tag[ACCESS_EXECUTE])) {
+    u8 *host = (u8 *)(uintptr_t)(cpu->pc + entry->addend);
+    *physical = mem->ram_base + (host - mem->ram);
+    return true;
+  }
+  return cpu_fetch_address_slow(cpu, mem, physical);
+}
+
+// Reads the instruction at cpu->pc, whose first parcel is at physical. A 32
+// bit instruction in the last two bytes of a page continues on the next page,
+// which is translated on its own and may fault like cpu_fetch_address().
+bool cpu_fetch_instruction(struct CPU *cpu, struct Memory *mem, u64 physical,
+                           u32 *raw);
+
+// Fetches, decodes and executes a single instruction without going through
+// the translation cache.
+void cpu_step(struct CPU *cpu, struct Memory *mem);
+// Runs the hart with the given engine until it reaches cpu->instret_limit
+// or the memory is halted.
+// If profile is set, the executed instructions are counted in it and if
+// trace is set every executed block is written to it, see struct Trace.
+// Both go by the decoded blocks, so ENGINE_SWITCH falls back to
+// ENGINE_CACHED for a trace, the same as it does with a debugger, see struct
+// Gdb.
+// The decoded and compiled blocks are kept in cache if it is set, which then
+// has to be for the same engine, profile and trace, and are thrown away
+// otherwise.
+void cpu_loop(struct CPU *cpu, struct Memory *mem, enum Engine engine,
+              struct Profile *profile, struct Trace *trace,
+              struct CpuCache *cache);
+
+// Translation cache and native code of a hart for an engine, which a fork
+// server keeps across its jobs so that they do not start cold.
+struct CpuCache *cpu_cache_create(enum Engine engine, struct Profile *profile,
+                                  struct Trace *trace);
+void cpu_cache_destroy(struct CpuCache *cache);
+// Records the blocks decoded and compiled from now on in log
+void cpu_cache_record(struct CpuCache *cache, struct TCacheLog *log);
+// Decodes and compiles the blocks in log and empties it
+void cpu_cache_replay(struct CpuCache *cache, struct Memory *mem,
+                      struct TCacheLog *log);
+// Parks every hart inside of cpu_loop() at its next block and returns once
+// all of them are, so that another thread can look at their state. Harts
+// entering cpu_loop() in the meantime park before their first block. Only a
+// single thread may pause the harts at a time.
+void cpu_pause(struct Memory *mem, struct CPU *cpus, u64 num_harts);
+void cpu_resume(struct Memory *mem);
+#endif // CPU_H
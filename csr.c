@@ -0,0 +1,501 @@
+// Control and status registers of the machine and supervisor levels and the
+// traps that are delivered through them.
+#include "csr.h"
+#include "clint.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "gdb.h"
+#include "mmu.h"
+#include <assert.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MISA_RV64 (2ULL << 62)
+#define MISA_EXTENSION(_letter) (1ULL << ((_letter) - 'A'))
+
+#define MSTATUS_WRITABLE                                                       \
+  (MSTATUS_SIE | MSTATUS_MIE | MSTATUS_SPIE | MSTATUS_MPIE | MSTATUS_SPP |     \
+   MSTATUS_MPP | MSTATUS_FS | MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR |       \
+   MSTATUS_TVM | MSTATUS_TW | MSTATUS_TSR)
+// The bits of mstatus visible through sstatus
+#define SSTATUS_MASK                                                           \
+  (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_FS | MSTATUS_SUM |       \
+   MSTATUS_MXR | MSTATUS_UXL | MSTATUS_SD)
+
+// Only the direct and vectored trap vector modes exist
+#define TVEC_MASK (~(u64)2)
+// With compressed instructions every pc is 2 byte aligned
+#define EPC_MASK (~(u64)1)
+#define MIE_MASK (MIP_SUPERVISOR | MIP_MSIP | MIP_MTIP | MIP_MEIP)
+
+void cpu_update_mmu(struct CPU *cpu) {
+  u64 mstatus = cpu->csr.mstatus;
+  u8 data_priv = cpu->priv;
+  if (PRIV_M == cpu->priv && (mstatus & MSTATUS_MPRV)) {
+    data_priv = (mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT;
+  }
+  mmu_set_mode(&cpu->mmu, cpu->priv, data_priv, mstatus & MSTATUS_SUM,
+               mstatus & MSTATUS_MXR);
+}
+
+// The privilege needed for a CSR is encoded in bits 9:8 of its number and
+// bits 11:10 are 3 for read-only CSRs.
+static bool csr_allowed(const struct CPU *cpu, u16 csr, bool write) {
+  if (cpu->priv < ((csr >> 8) & 3)) {
+    return false;
+  }
+  if (write && 3 == (csr >> 10)) {
+    return false;
+  }
+  // TVM traps accesses to satp from supervisor mode
+  if (CSR_SATP == csr && PRIV_S == cpu->priv &&
+      (cpu->csr.mstatus & MSTATUS_TVM)) {
+    return false;
+  }
+  // The floating point CSRs are only there while the FPU is on
+  if (csr <= CSR_FCSR && 0 == (cpu->csr.mstatus & MSTATUS_FS)) {
+    return false;
+  }
+  // The counters below machine mode are enabled by mcounteren and in user
+  // mode also by scounteren
+  if (CSR_TIME == csr) {
+    u32 bit = 1U << (csr & 0x1F);
+    if (!cpu->clint) {
+      return false;
+    }
+    if (cpu->priv < PRIV_M && 0 == (cpu->csr.mcounteren & bit)) {
+      return false;
+    }
+    if (cpu->priv < PRIV_S && 0 == (cpu->csr.scounteren & bit)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static u64 read_mip(const struct Csrs *c) {
+  return __atomic_load_n(&c->mip, __ATOMIC_RELAXED);
+}
+
+// Only the bits in mask are written, the others may change at the same time
+// on other threads
+static void write_mip(struct CPU *cpu, u64 mask, u64 value) {
+  __atomic_fetch_and(&cpu->csr.mip, ~(mask & ~value), __ATOMIC_SEQ_CST);
+  __atomic_fetch_or(&cpu->csr.mip, mask & value, __ATOMIC_SEQ_CST);
+  cpu_check_interrupts(cpu);
+}
+
+// SD summarizes FS, which is the only extension state
+static u64 read_mstatus(const struct Csrs *c) {
+  if (MSTATUS_FS == (c->mstatus & MSTATUS_FS)) {
+    return c->mstatus | MSTATUS_SD;
+  }
+  return c->mstatus;
+}
+
+bool csr_read(struct CPU *cpu, u16 csr, u64 *value) {
+  if (!csr_allowed(cpu, csr, false)) {
+    return false;
+  }
+  struct Csrs *c = &cpu->csr;
+  switch (csr) {
+  case CSR_FFLAGS:
+    *value = fpu_read_fflags(cpu);
+    break;
+  case CSR_FRM:
+    *value = c->frm;
+    break;
+  case CSR_FCSR:
+    *value = (u64)c->frm << 5 | fpu_read_fflags(cpu);
+    break;
+  case CSR_SSTATUS:
+    *value = read_mstatus(c) & SSTATUS_MASK;
+    break;
+  case CSR_SIE:
+    *value = c->mie & c->mideleg;
+    break;
+  case CSR_STVEC:
+    *value = c->stvec;
+    break;
+  case CSR_SCOUNTEREN:
+    *value = c->scounteren;
+    break;
+  case CSR_SSCRATCH:
+    *value = c->sscratch;
+    break;
+  case CSR_SEPC:
+    *value = c->sepc;
+    break;
+  case CSR_SCAUSE:
+    *value = c->scause;
+    break;
+  case CSR_STVAL:
+    *value = c->stval;
+    break;
+  case CSR_SIP:
+    *value = read_mip(c) & c->mideleg;
+    break;
+  case CSR_SATP:
+    *value = cpu->mmu.satp;
+    break;
+  case CSR_MSTATUS:
+    *value = read_mstatus(c);
+    break;
+  case CSR_MISA:
+    *value = MISA_RV64 | MISA_EXTENSION('A') | MISA_EXTENSION('C') |
+             MISA_EXTENSION('D') | MISA_EXTENSION('F') | MISA_EXTENSION('I') |
+             MISA_EXTENSION('M') | MISA_EXTENSION('S') | MISA_EXTENSION('U');
+    break;
+  case CSR_MEDELEG:
+    *value = c->medeleg;
+    break;
+  case CSR_MIDELEG:
+    *value = c->mideleg;
+    break;
+  case CSR_MIE:
+    *value = c->mie;
+    break;
+  case CSR_MTVEC:
+    *value = c->mtvec;
+    break;
+  case CSR_MCOUNTEREN:
+    *value = c->mcounteren;
+    break;
+  case CSR_MSCRATCH:
+    *value = c->mscratch;
+    break;
+  case CSR_MEPC:
+    *value = c->mepc;
+    break;
+  case CSR_MCAUSE:
+    *value = c->mcause;
+    break;
+  case CSR_MTVAL:
+    *value = c->mtval;
+    break;
+  case CSR_MIP:
+    *value = read_mip(c);
+    break;
+  case CSR_TIME:
+    *value = clint_mtime(cpu->clint);
+    break;
+  case CSR_MVENDORID:
+  case CSR_MARCHID:
+  case CSR_MIMPID:
+    *value = 0;
+    break;
+  case CSR_MHARTID:
+    *value = cpu->hart_id;
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+static void write_mstatus(struct CPU *cpu, u64 value) {
+  u64 mpp = (value & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT;
+  if (2 == mpp) {
+    // Reserved, keep the old mode
+    value = (value & ~MSTATUS_MPP) | (cpu->csr.mstatus & MSTATUS_MPP);
+  }
+  cpu->csr.mstatus =
+      (value & MSTATUS_WRITABLE) | MSTATUS_UXL | MSTATUS_SXL;
+  cpu_update_mmu(cpu);
+  cpu_check_interrupts(cpu);
+}
+
+bool csr_write(struct CPU *cpu, u16 csr, u64 value) {
+  if (!csr_allowed(cpu, csr, true)) {
+    return false;
+  }
+  struct Csrs *c = &cpu->csr;
+  switch (csr) {
+  case CSR_FFLAGS:
+    fpu_write_fflags(cpu, value);
+    c->mstatus |= MSTATUS_FS;
+    break;
+  case CSR_FRM:
+    fpu_write_frm(cpu, value);
+    c->mstatus |= MSTATUS_FS;
+    break;
+  case CSR_FCSR:
+    fpu_write_fflags(cpu, value);
+    fpu_write_frm(cpu, value >> 5);
+    c->mstatus |= MSTATUS_FS;
+    break;
+  case CSR_SSTATUS:
+    write_mstatus(cpu, (c->mstatus & ~SSTATUS_MASK) | (value & SSTATUS_MASK));
+    break;
+  case CSR_SIE:
+    c->mie = (c->mie & ~c->mideleg) | (value & c->mideleg & MIE_MASK);
+    cpu_check_interrupts(cpu);
+    break;
+  case CSR_STVEC:
+    c->stvec = value & TVEC_MASK;
+    break;
+  case CSR_SCOUNTEREN:
+    c->scounteren = value;
+    break;
+  case CSR_SSCRATCH:
+    c->sscratch = value;
+    break;
+  case CSR_SEPC:
+    c->sepc = value & EPC_MASK;
+    break;
+  case CSR_SCAUSE:
+    c->scause = value;
+    break;
+  case CSR_STVAL:
+    c->stval = value;
+    break;
+  case CSR_SIP:
+    // Only the software interrupt can be set from supervisor mode
+    write_mip(cpu, MIP_SSIP & c->mideleg, value);
+    break;
+  case CSR_SATP: {
+    // Writes with an unsupported mode have no effect
+    u64 mode = value >> SATP_MODE_SHIFT;
+    if (SATP_MODE_BARE == mode || SATP_MODE_SV39 == mode ||
+        SATP_MODE_SV48 == mode) {
+      mmu_set_satp(&cpu->mmu, value);
+    }
+    break;
+  }
+  case CSR_MSTATUS:
+    write_mstatus(cpu, value);
+    break;
+  case CSR_MISA:
+    break;
+  case CSR_MEDELEG:
+    c->medeleg = value;
+    break;
+  case CSR_MIDELEG:
+    // The machine interrupts always go to machine mode
+    c->mideleg = value & MIP_SUPERVISOR;
+    cpu_check_interrupts(cpu);
+    break;
+  case CSR_MIE:
+    c->mie = value & MIE_MASK;
+    cpu_check_interrupts(cpu);
+    break;
+  case CSR_MTVEC:
+    c->mtvec = value & TVEC_MASK;
+    break;
+  case CSR_MCOUNTEREN:
+    c->mcounteren = value;
+    break;
+  case CSR_MSCRATCH:
+    c->mscratch = value;
+    break;
+  case CSR_MEPC:
+    c->mepc = value & EPC_MASK;
+    break;
+  case CSR_MCAUSE:
+    c->mcause = value;
+    break;
+  case CSR_MTVAL:
+    c->mtval = value;
+    break;
+  case CSR_MIP:
+    write_mip(cpu, MIP_SUPERVISOR, value);
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+// Without a trap vector there is nothing that could handle the trap, which is
+// how bare metal programs without a handler end.
+static void unhandled_trap(struct CPU *cpu, u64 cause, u64 tval) {
+  if (cause & CAUSE_INTERRUPT) {
+    printf("Unhandled interrupt %d at %lx\n", (int)(cause & ~CAUSE_INTERRUPT),
+           cpu->pc);
+  } else {
+    printf("Unhandled exception %d (tval %lx) at %lx\n", (int)cause, tval,
+           cpu->pc);
+  }
+  cpu_dump_state(cpu);
+  fflush(stdout);
+  assert(0);
+}
+
+// Interrupts go to base + 4 * cause in the vectored mode, exceptions always
+// go to the base
+static u64 trap_vector(u64 tvec, u64 cause) {
+  u64 base = tvec & ~(u64)3;
+  if ((tvec & 1) && (cause & CAUSE_INTERRUPT)) {
+    return base + 4 * (cause & ~CAUSE_INTERRUPT);
+  }
+  return base;
+}
+
+static void trap(struct CPU *cpu, u64 cause, u64 tval, bool delegate) {
+  struct Csrs *c = &cpu->csr;
+  u64 mstatus = c->mstatus;
+  if (delegate) {
+    if (0 == c->stvec) {
+      unhandled_trap(cpu, cause, tval);
+      return;
+    }
+    c->sepc = cpu->pc;
+    c->scause = cause;
+    c->stval = tval;
+    mstatus &= ~(MSTATUS_SPP | MSTATUS_SPIE | MSTATUS_SIE);
+    if (c->mstatus & MSTATUS_SIE) {
+      mstatus |= MSTATUS_SPIE;
+    }
+    if (PRIV_S == cpu->priv) {
+      mstatus |= MSTATUS_SPP;
+    }
+    cpu->priv = PRIV_S;
+    cpu->pc = trap_vector(c->stvec, cause);
+  } else {
+    if (0 == c->mtvec) {
+      unhandled_trap(cpu, cause, tval);
+      return;
+    }
+    c->mepc = cpu->pc;
+    c->mcause = cause;
+    c->mtval = tval;
+    mstatus &= ~(MSTATUS_MPP | MSTATUS_MPIE | MSTATUS_MIE);
+    if (c->mstatus & MSTATUS_MIE) {
+      mstatus |= MSTATUS_MPIE;
+    }
+    mstatus |= (u64)cpu->priv << MSTATUS_MPP_SHIFT;
+    cpu->priv = PRIV_M;
+    cpu->pc = trap_vector(c->mtvec, cause);
+  }
+  c->mstatus = mstatus;
+  cpu->did_branch = true;
+  cpu_update_mmu(cpu);
+}
+
+void cpu_trap(struct CPU *cpu, enum Exception cause, u64 tval) {
+  bool delegate =
+      cpu->priv <= PRIV_S && ((cpu->csr.medeleg >> cause) & 1);
+  trap(cpu, cause, tval, delegate);
+}
+
+void cpu_raise_interrupt(struct CPU *cpu, u64 bits) {
+  __atomic_fetch_or(&cpu->csr.mip, bits, __ATOMIC_SEQ_CST);
+  cpu_check_interrupts(cpu);
+}
+
+void cpu_lower_interrupt(struct CPU *cpu, u64 bits) {
+  __atomic_fetch_and(&cpu->csr.mip, ~bits, __ATOMIC_SEQ_CST);
+}
+
+bool cpu_take_interrupt(struct CPU *cpu) {
+  // Ordered by priority
+  static const u8 causes[] = {11, 3, 7, 9, 1, 5};
+  struct Csrs *c = &cpu->csr;
+  u64 pending = read_mip(c) & c->mie;
+  if (likely(0 == pending)) {
+    return false;
+  }
+  // Interrupts for a higher privilege level are always enabled and those for
+  // a lower one never are
+  u64 enabled = 0;
+  if (cpu->priv < PRIV_M || (c->mstatus & MSTATUS_MIE)) {
+    enabled |= ~c->mideleg;
+  }
+  if (cpu->priv < PRIV_S ||
+      (PRIV_S == cpu->priv && (c->mstatus & MSTATUS_SIE))) {
+    enabled |= c->mideleg;
+  }
+  pending &= enabled;
+  for (u32 i = 0; i < sizeof(causes); i++) {
+    u8 cause = causes[i];
+    if (pending & (1ULL << cause)) {
+      trap(cpu, CAUSE_INTERRUPT | cause, 0, (c->mideleg >> cause) & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Either the waiting hart sees what changed before it calls futex() or
+// wake_seq changes after it read it, so no wakeup is lost
+void cpu_check_interrupts(struct CPU *cpu) {
+  __atomic_store_n(&cpu->instret_stop, 0, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&cpu->waiting, __ATOMIC_SEQ_CST)) {
+    __atomic_fetch_add(&cpu->wake_seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &cpu->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+void cpu_wait_for_interrupt(struct CPU *cpu, struct Memory *mem) {
+  // Nothing could end the wait, wfi may then complete right away
+  if (0 == cpu->csr.mie) {
+    return;
+  }
+  __atomic_store_n(&cpu->waiting, true, __ATOMIC_SEQ_CST);
+  for (;;) {
+    u32 seq = __atomic_load_n(&cpu->wake_seq, __ATOMIC_SEQ_CST);
+    if ((read_mip(&cpu->csr) & cpu->csr.mie) || memory_halted(mem) ||
+        memory_pausing(mem) || (mem->gdb && gdb_stopping(mem->gdb))) {
+      break;
+    }
+    syscall(SYS_futex, &cpu->wake_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL,
+            0);
+  }
+  __atomic_store_n(&cpu->waiting, false, __ATOMIC_RELAXED);
+}
+
+void cpu_mmu_fault(struct CPU *cpu, struct Memory *mem, enum MmuResult result,
+                   enum Access access) {
+  static const enum Exception page_faults[] = {
+      EXC_LOAD_PAGE_FAULT, EXC_STORE_PAGE_FAULT, EXC_INSTRUCTION_PAGE_FAULT};
+  static const enum Exception access_faults[] = {
+      EXC_LOAD_ACCESS_FAULT, EXC_STORE_ACCESS_FAULT,
+      EXC_INSTRUCTION_ACCESS_FAULT};
+  if (MMU_WATCHPOINT == result) {
+    // Left like a trap that did not move the pc, the instruction runs again
+    // once the debugger continues
+    gdb_watchpoint_hit(mem->gdb, cpu, cpu->mmu.fault_address, access);
+    cpu->did_branch = true;
+  } else if (MMU_PAGE_FAULT == result) {
+    cpu_trap(cpu, page_faults[access], cpu->mmu.fault_address);
+  } else {
+    cpu_trap(cpu, access_faults[access], cpu->mmu.fault_address);
+  }
+}
+
+void cpu_mret(struct CPU *cpu) {
+  struct Csrs *c = &cpu->csr;
+  u64 mstatus = c->mstatus;
+  cpu->priv = (mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT;
+  mstatus &= ~(MSTATUS_MPP | MSTATUS_MIE);
+  if (c->mstatus & MSTATUS_MPIE) {
+    mstatus |= MSTATUS_MIE;
+  }
+  mstatus |= MSTATUS_MPIE;
+  if (PRIV_M != cpu->priv) {
+    mstatus &= ~MSTATUS_MPRV;
+  }
+  c->mstatus = mstatus;
+  cpu->pc = c->mepc;
+  cpu->did_branch = true;
+  cpu_update_mmu(cpu);
+  cpu_check_interrupts(cpu);
+}
+
+void cpu_sret(struct CPU *cpu) {
+  struct Csrs *c = &cpu->csr;
+  u64 mstatus = c->mstatus;
+  cpu->priv = (mstatus & MSTATUS_SPP) ? PRIV_S : PRIV_U;
+  mstatus &= ~(MSTATUS_SPP | MSTATUS_SIE | MSTATUS_MPRV);
+  if (c->mstatus & MSTATUS_SPIE) {
+    mstatus |= MSTATUS_SIE;
+  }
+  mstatus |= MSTATUS_SPIE;
+  c->mstatus = mstatus;
+  cpu->pc = c->sepc;
+  cpu->did_branch = true;
+  cpu_update_mmu(cpu);
+  cpu_check_interrupts(cpu);
+}
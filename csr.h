@@ -0,0 +1,123 @@
+#ifndef CSR_H
+#define CSR_H
+#include "cpu.h"
+#include "types.h"
+#include <stdbool.h>
+
+#define CSR_FFLAGS 0x001
+#define CSR_FRM 0x002
+#define CSR_FCSR 0x003
+#define CSR_SSTATUS 0x100
+#define CSR_SIE 0x104
+#define CSR_STVEC 0x105
+#define CSR_SCOUNTEREN 0x106
+#define CSR_SSCRATCH 0x140
+#define CSR_SEPC 0x141
+#define CSR_SCAUSE 0x142
+#define CSR_STVAL 0x143
+#define CSR_SIP 0x144
+#define CSR_SATP 0x180
+#define CSR_MSTATUS 0x300
+#define CSR_MISA 0x301
+#define CSR_MEDELEG 0x302
+#define CSR_MIDELEG 0x303
+#define CSR_MIE 0x304
+#define CSR_MTVEC 0x305
+#define CSR_MCOUNTEREN 0x306
+#define CSR_MSCRATCH 0x340
+#define CSR_MEPC 0x341
+#define CSR_MCAUSE 0x342
+#define CSR_MTVAL 0x343
+#define CSR_MIP 0x344
+#define CSR_TIME 0xC01
+#define CSR_MVENDORID 0xF11
+#define CSR_MARCHID 0xF12
+#define CSR_MIMPID 0xF13
+#define CSR_MHARTID 0xF14
+
+#define MSTATUS_SIE (1ULL << 1)
+#define MSTATUS_MIE (1ULL << 3)
+#define MSTATUS_SPIE (1ULL << 5)
+#define MSTATUS_MPIE (1ULL << 7)
+#define MSTATUS_SPP (1ULL << 8)
+#define MSTATUS_MPP_SHIFT 11
+#define MSTATUS_MPP (3ULL << MSTATUS_MPP_SHIFT)
+// State of the FPU, floating point instructions are illegal while it is off
+// and writing a floating point register makes it dirty
+#define MSTATUS_FS_SHIFT 13
+#define MSTATUS_FS (3ULL << MSTATUS_FS_SHIFT)
+#define MSTATUS_FS_INITIAL (1ULL << MSTATUS_FS_SHIFT)
+#define MSTATUS_MPRV (1ULL << 17)
+#define MSTATUS_SUM (1ULL << 18)
+#define MSTATUS_MXR (1ULL << 19)
+#define MSTATUS_TVM (1ULL << 20)
+#define MSTATUS_TW (1ULL << 21)
+#define MSTATUS_TSR (1ULL << 22)
+// UXLEN and SXLEN are fixed to 64 bits
+#define MSTATUS_UXL (2ULL << 32)
+#define MSTATUS_SXL (2ULL << 34)
+// Read-only, set while FS is dirty
+#define MSTATUS_SD (1ULL << 63)
+
+// Bits of mip and mie. The supervisor ones are the only ones software can set
+// in mip, the machine ones follow the CLINT.
+#define MIP_SSIP (1ULL << 1)
+#define MIP_MSIP (1ULL << 3)
+#define MIP_STIP (1ULL << 5)
+#define MIP_MTIP (1ULL << 7)
+#define MIP_SEIP (1ULL << 9)
+#define MIP_MEIP (1ULL << 11)
+#define MIP_SUPERVISOR (MIP_SSIP | MIP_STIP | MIP_SEIP)
+
+// Set in mcause and scause for interrupts, the rest is the bit in mip
+#define CAUSE_INTERRUPT (1ULL << 63)
+
+enum Exception {
+  EXC_INSTRUCTION_ACCESS_FAULT = 1,
+  EXC_ILLEGAL_INSTRUCTION = 2,
+  EXC_BREAKPOINT = 3,
+  EXC_LOAD_ADDRESS_MISALIGNED = 4,
+  EXC_LOAD_ACCESS_FAULT = 5,
+  EXC_STORE_ADDRESS_MISALIGNED = 6,
+  EXC_STORE_ACCESS_FAULT = 7,
+  EXC_ECALL_FROM_U = 8,
+  EXC_ECALL_FROM_S = 9,
+  EXC_ECALL_FROM_M = 11,
+  EXC_INSTRUCTION_PAGE_FAULT = 12,
+  EXC_LOAD_PAGE_FAULT = 13,
+  EXC_STORE_PAGE_FAULT = 15,
+};
+
+// Both return false if the CSR does not exist or may not be accessed from the
+// current privilege level, which is an illegal instruction.
+bool csr_read(struct CPU *cpu, u16 csr, u64 *value);
+bool csr_write(struct CPU *cpu, u16 csr, u64 value);
+
+// Takes the trap at cpu->pc and continues at the trap vector.
+void cpu_trap(struct CPU *cpu, enum Exception cause, u64 tval);
+// Raises the exception for a failed access through the MMU, or stops at the
+// watchpoint it touched
+void cpu_mmu_fault(struct CPU *cpu, struct Memory *mem, enum MmuResult result,
+                   enum Access access);
+// mip is the only CSR that other threads write, always atomically. Raising
+// an interrupt also makes the hart stop at the next block, see struct CPU.
+void cpu_raise_interrupt(struct CPU *cpu, u64 bits);
+void cpu_lower_interrupt(struct CPU *cpu, u64 bits);
+// Takes the highest priority interrupt that is pending and enabled, returns
+// false if there is none
+bool cpu_take_interrupt(struct CPU *cpu);
+// Makes the hart look for interrupts before the next block, which is needed
+// whenever an interrupt might have become enabled. Also wakes the hart if it
+// waits in wfi, so that it sees new interrupts and the end of the run.
+void cpu_check_interrupts(struct CPU *cpu);
+// Blocks the host thread of the hart until an interrupt is pending in mip and
+// enabled in mie, ignoring the global enable bits, the memory is halted, the
+// harts are paused or the debugger stops the machine.
+// Deadlines of the timer need no timeout here, the timer thread of the CLINT
+// raises the interrupt when it is due.
+void cpu_wait_for_interrupt(struct CPU *cpu, struct Memory *mem);
+void cpu_mret(struct CPU *cpu);
+void cpu_sret(struct CPU *cpu);
+// Applies the privilege level and mstatus to address translation
+void cpu_update_mmu(struct CPU *cpu);
+#endif // CSR_H
@@ -0,0 +1,44 @@
+// Test finisher device. A guest ends the run by writing FINISHER_PASS or
+// FINISHER_FAIL to it, which halts all harts and becomes the exit status of
+// the emulator.
+#include "finisher.h"
+#include "mmu.h"
+
+static u64 finisher_read(void *opaque, u64 offset, u8 length) {
+  (void)opaque;
+  (void)offset;
+  (void)length;
+  return 0;
+}
+
+static void finisher_write(void *opaque, u64 offset, u64 value, u8 length) {
+  struct Memory *mem = opaque;
+  if (0 != offset || sizeof(u32) != length) {
+    return;
+  }
+  u32 status = value >> 16;
+  switch (value & 0xFFFF) {
+  case FINISHER_PASS:
+    memory_halt(mem, 0);
+    break;
+  case FINISHER_FAIL: {
+    // Only the low byte survives as exit status, and failing with status 0
+    // would look like a pass
+    u8 code = status & 0xFF;
+    memory_halt(mem, 0 == code ? 1 : code);
+    break;
+  }
+  }
+}
+
+bool finisher_init(struct Memory *mem) {
+  struct Device device = {
+      .name = "finisher",
+      .base = FINISHER_BASE,
+      .size = FINISHER_SIZE,
+      .opaque = mem,
+      .read = finisher_read,
+      .write = finisher_write,
+  };
+  return memory_add_device(mem, &device);
+}
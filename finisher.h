@@ -0,0 +1,16 @@
+#ifndef FINISHER_H
+#define FINISHER_H
+#include "mmu.h"
+#include <stdbool.h>
+
+// SiFive test finisher, at the same address as on the QEMU virt machine
+#define FINISHER_BASE 0x100000
+#define FINISHER_SIZE 0x1000
+
+// Values written to the finisher, a failure has the exit status in the upper
+// 16 bits
+#define FINISHER_FAIL 0x3333
+#define FINISHER_PASS 0x5555
+
+bool finisher_init(struct Memory *mem);
+#endif // FINISHER_H
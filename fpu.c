@@ -0,0 +1,247 @@
+// Host side of the F and D extensions: the floating point environment of the
+// harts, conversions to integers and the instructions whose corner cases the
+// host does differently.
+#include "fpu.h"
+#include "cpu.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// Instructions using one of the invalid modes are illegal, which only leaves
+// frm to hold them. The host stays at the default then.
+static const int host_rounding[8] = {
+    [FRM_RNE] = FE_TONEAREST, [FRM_RTZ] = FE_TOWARDZERO,
+    [FRM_RDN] = FE_DOWNWARD,  [FRM_RUP] = FE_UPWARD,
+    // The host can not round ties away from zero, the closest is ties to even
+    [FRM_RMM] = FE_TONEAREST, [5] = FE_TONEAREST,
+    [6] = FE_TONEAREST,       [FRM_DYN] = FE_TONEAREST,
+};
+
+void fpu_set_rounding(u8 rm) {
+  fesetround(host_rounding[rm]);
+}
+
+static u8 host_fflags(void) {
+  int excepts = fetestexcept(FE_ALL_EXCEPT);
+  u8 fflags = 0;
+  if (excepts & FE_INEXACT) {
+    fflags |= FFLAGS_NX;
+  }
+  if (excepts & FE_UNDERFLOW) {
+    fflags |= FFLAGS_UF;
+  }
+  if (excepts & FE_OVERFLOW) {
+    fflags |= FFLAGS_OF;
+  }
+  if (excepts & FE_DIVBYZERO) {
+    fflags |= FFLAGS_DZ;
+  }
+  if (excepts & FE_INVALID) {
+    fflags |= FFLAGS_NV;
+  }
+  return fflags;
+}
+
+u8 fpu_read_fflags(struct CPU *cpu) {
+  // The host flags are sticky as well, so they are simply added again on
+  // every read until the guest clears them
+  cpu->csr.fflags |= host_fflags();
+  return cpu->csr.fflags;
+}
+
+void fpu_write_fflags(struct CPU *cpu, u8 fflags) {
+  cpu->csr.fflags = fflags & FFLAGS_MASK;
+  feclearexcept(FE_ALL_EXCEPT);
+}
+
+void fpu_write_frm(struct CPU *cpu, u8 frm) {
+  cpu->csr.frm = frm & 7;
+  fpu_set_rounding(cpu->csr.frm);
+}
+
+void fpu_enter(struct CPU *cpu, fenv_t *host) {
+  fegetenv(host);
+  feclearexcept(FE_ALL_EXCEPT);
+  fpu_set_rounding(cpu->csr.frm);
+}
+
+void fpu_leave(struct CPU *cpu, const fenv_t *host) {
+  fpu_read_fflags(cpu);
+  fesetenv(host);
+}
+
+// Rounds to an integer in the rounding mode without changing the one of the
+// host. None of these raise the inexact flag.
+static double round_integer(double value, u8 rm) {
+  switch (rm) {
+  case FRM_RTZ:
+    return trunc(value);
+  case FRM_RDN:
+    return floor(value);
+  case FRM_RUP:
+    return ceil(value);
+  case FRM_RMM:
+    return round(value);
+  default:
+    // The remainder is exact and rounds the quotient to even
+    return value - remainder(value, 1.0);
+  }
+}
+
+// Rounds value to an integer and checks that it is in [low, high). Returns 0
+// if it is, otherwise the invalid flag is raised and -1 or 1 tell which bound
+// to saturate to. NaN saturates to the upper bound.
+static int round_checked(double value, u8 rm, double low, double high,
+                         double *rounded) {
+  if (isnan(value)) {
+    feraiseexcept(FE_INVALID);
+    return 1;
+  }
+  if (isinf(value)) {
+    feraiseexcept(FE_INVALID);
+    return value < 0 ? -1 : 1;
+  }
+  double result = round_integer(value, rm);
+  if (result < low) {
+    feraiseexcept(FE_INVALID);
+    return -1;
+  }
+  if (result >= high) {
+    feraiseexcept(FE_INVALID);
+    return 1;
+  }
+  if (result != value) {
+    feraiseexcept(FE_INEXACT);
+  }
+  *rounded = result;
+  return 0;
+}
+
+// The 32 bit conversions sign extend their result
+i64 fpu_to_i32(double value, u8 rm) {
+  double rounded;
+  switch (round_checked(value, rm, -0x1p31, 0x1p31, &rounded)) {
+  case -1:
+    return INT32_MIN;
+  case 1:
+    return INT32_MAX;
+  }
+  return (i32)rounded;
+}
+
+i64 fpu_to_u32(double value, u8 rm) {
+  double rounded;
+  switch (round_checked(value, rm, 0, 0x1p32, &rounded)) {
+  case -1:
+    return 0;
+  case 1:
+    return (i32)UINT32_MAX;
+  }
+  return (i32)(u32)rounded;
+}
+
+i64 fpu_to_i64(double value, u8 rm) {
+  double rounded;
+  switch (round_checked(value, rm, -0x1p63, 0x1p63, &rounded)) {
+  case -1:
+    return INT64_MIN;
+  case 1:
+    return INT64_MAX;
+  }
+  return (i64)rounded;
+}
+
+u64 fpu_to_u64(double value, u8 rm) {
+  double rounded;
+  switch (round_checked(value, rm, 0, 0x1p64, &rounded)) {
+  case -1:
+    return 0;
+  case 1:
+    return UINT64_MAX;
+  }
+  return (u64)rounded;
+}
+
+// Lays out the fields of a single or double precision number
+#define SIGN_S(_bits) ((_bits) >> 31)
+#define EXPONENT_S(_bits) (((_bits) >> 23) & 0xFF)
+#define MANTISSA_S(_bits) ((_bits) & 0x7FFFFF)
+#define QUIET_S(_bits) (((_bits) >> 22) & 1)
+#define MAX_EXPONENT_S 0xFF
+#define SIGN_D(_bits) ((_bits) >> 63)
+#define EXPONENT_D(_bits) (((_bits) >> 52) & 0x7FF)
+#define MANTISSA_D(_bits) ((_bits) & 0xFFFFFFFFFFFFFULL)
+#define QUIET_D(_bits) (((_bits) >> 51) & 1)
+#define MAX_EXPONENT_D 0x7FF
+
+// Bits set by fclass
+#define CLASS_NEGATIVE_INFINITY (1 << 0)
+#define CLASS_NEGATIVE_NORMAL (1 << 1)
+#define CLASS_NEGATIVE_SUBNORMAL (1 << 2)
+#define CLASS_NEGATIVE_ZERO (1 << 3)
+#define CLASS_POSITIVE_ZERO (1 << 4)
+#define CLASS_POSITIVE_SUBNORMAL (1 << 5)
+#define CLASS_POSITIVE_NORMAL (1 << 6)
+#define CLASS_POSITIVE_INFINITY (1 << 7)
+#define CLASS_SIGNALING_NAN (1 << 8)
+#define CLASS_QUIET_NAN (1 << 9)
+
+static u64 classify(bool negative, bool max_exponent, bool zero_exponent,
+                    bool zero_mantissa, bool quiet) {
+  if (max_exponent) {
+    if (!zero_mantissa) {
+      return quiet ? CLASS_QUIET_NAN : CLASS_SIGNALING_NAN;
+    }
+    return negative ? CLASS_NEGATIVE_INFINITY : CLASS_POSITIVE_INFINITY;
+  }
+  if (zero_exponent) {
+    if (zero_mantissa) {
+      return negative ? CLASS_NEGATIVE_ZERO : CLASS_POSITIVE_ZERO;
+    }
+    return negative ? CLASS_NEGATIVE_SUBNORMAL : CLASS_POSITIVE_SUBNORMAL;
+  }
+  return negative ? CLASS_NEGATIVE_NORMAL : CLASS_POSITIVE_NORMAL;
+}
+
+// fmin and fmax return the other operand if one is NaN and order -0 before 0.
+// Signaling NaNs raise the invalid flag.
+#define FP_HELPERS(_suffix, _SUFFIX, _type, _float)                            \
+  static bool is_nan_##_suffix(_type bits) {                                   \
+    return MAX_EXPONENT_##_SUFFIX == EXPONENT_##_SUFFIX(bits) &&               \
+           0 != MANTISSA_##_SUFFIX(bits);                                      \
+  }                                                                            \
+                                                                               \
+  static bool is_signaling_##_suffix(_type bits) {                             \
+    return is_nan_##_suffix(bits) && !QUIET_##_SUFFIX(bits);                   \
+  }                                                                            \
+                                                                               \
+  _type fpu_min_max_##_suffix(_type a, _type b, bool max) {                    \
+    if (is_signaling_##_suffix(a) || is_signaling_##_suffix(b)) {              \
+      feraiseexcept(FE_INVALID);                                               \
+    }                                                                          \
+    if (is_nan_##_suffix(a)) {                                                 \
+      return is_nan_##_suffix(b) ? CANONICAL_NAN_##_SUFFIX : b;              \
+    }                                                                          \
+    if (is_nan_##_suffix(b)) {                                                 \
+      return a;                                                                \
+    }                                                                          \
+    _float x, y;                                                               \
+    memcpy(&x, &a, sizeof(x));                                                 \
+    memcpy(&y, &b, sizeof(y));                                                 \
+    if (x == y) {                                                              \
+      /* Also true for zeros of different signs */                             \
+      return (SIGN_##_SUFFIX(a) != max) ? a : b;                               \
+    }                                                                          \
+    return ((x < y) != max) ? a : b;                                           \
+  }                                                                            \
+                                                                               \
+  u64 fpu_class_##_suffix(_type bits) {                                        \
+    return classify(SIGN_##_SUFFIX(bits),                                      \
+                    MAX_EXPONENT_##_SUFFIX == EXPONENT_##_SUFFIX(bits),        \
+                    0 == EXPONENT_##_SUFFIX(bits),                             \
+                    0 == MANTISSA_##_SUFFIX(bits), QUIET_##_SUFFIX(bits));     \
+  }
+
+FP_HELPERS(s, S, u32, float)
+FP_HELPERS(d, D, u64, double)
+#undef FP_HELPERS
@@ -0,0 +1,58 @@
+#ifndef FPU_H
+#define FPU_H
+#include "cpu.h"
+#include "types.h"
+#include <fenv.h>
+#include <stdbool.h>
+
+// Rounding modes of frm and of the rm field of the instructions
+#define FRM_RNE 0
+#define FRM_RTZ 1
+#define FRM_RDN 2
+#define FRM_RUP 3
+#define FRM_RMM 4
+// Only valid in the rm field, selects frm
+#define FRM_DYN 7
+
+#define FFLAGS_NX 0x01
+#define FFLAGS_UF 0x02
+#define FFLAGS_OF 0x04
+#define FFLAGS_DZ 0x08
+#define FFLAGS_NV 0x10
+#define FFLAGS_MASK 0x1F
+
+#define CANONICAL_NAN_S 0x7FC00000U
+#define CANONICAL_NAN_D 0x7FF8000000000000ULL
+
+// The F and D instructions run on the host FPU of the thread running the hart,
+// which accumulates the exception flags in its own status register. They are
+// only collected into fflags when the guest reads them and when cpu_loop()
+// returns, so that no instruction has to compute them.
+//
+// fpu_enter() saves the floating point environment of the host and loads
+// the one of the hart, fpu_leave() does the opposite.
+void fpu_enter(struct CPU *cpu, fenv_t *host);
+void fpu_leave(struct CPU *cpu, const fenv_t *host);
+
+u8 fpu_read_fflags(struct CPU *cpu);
+void fpu_write_fflags(struct CPU *cpu, u8 fflags);
+void fpu_write_frm(struct CPU *cpu, u8 frm);
+// Switches the host to the rounding mode
+void fpu_set_rounding(u8 rm);
+
+// Conversions to integers, which saturate and raise the invalid flag when
+// the value is out of range like RISC-V defines them instead of like the
+// host does. rm is the effective rounding mode, which is applied without
+// switching the host to it.
+i64 fpu_to_i32(double value, u8 rm);
+i64 fpu_to_u32(double value, u8 rm);
+i64 fpu_to_i64(double value, u8 rm);
+u64 fpu_to_u64(double value, u8 rm);
+
+// fmin and fmax on the bit patterns, which tell -0 from 0 and signaling from
+// quiet NaNs
+u32 fpu_min_max_s(u32 a, u32 b, bool max);
+u64 fpu_min_max_d(u64 a, u64 b, bool max);
+u64 fpu_class_s(u32 bits);
+u64 fpu_class_d(u64 bits);
+#endif // FPU_H
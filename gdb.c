@@ -0,0 +1,1066 @@
+// GDB remote serial protocol server, see struct Gdb.
+#include "gdb.h"
+#include "csr.h"
+#include "fpu.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Signal numbers of the stop replies, which GDB defines independently of the
+// host
+#define GDB_SIGINT 2
+#define GDB_SIGTRAP 5
+
+// Exit status when the debugger kills the machine, the same as for a job of
+// the fork server killed by SIGKILL
+#define GDB_EXIT_KILLED (128 + 9)
+
+// Registers as numbered in the target description. The g packet has the
+// ones up to the floating point registers, the CSRs are only accessed one
+// at a time.
+#define GDB_REG_PC 32
+#define GDB_REG_F0 33
+#define GDB_REG_FFLAGS 65
+#define GDB_REG_FRM 66
+#define GDB_REG_FCSR 67
+#define GDB_NUM_G_REGS GDB_REG_FFLAGS
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char *const x_names[32] = {
+    "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "fp", "s1", "a0",
+    "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
+    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+
+static const char *const f_names[32] = {
+    "ft0", "ft1", "ft2",  "ft3",  "ft4", "ft5", "ft6",  "ft7",
+    "fs0", "fs1", "fa0",  "fa1",  "fa2", "fa3", "fa4",  "fa5",
+    "fa6", "fa7", "fs2",  "fs3",  "fs4", "fs5", "fs6",  "fs7",
+    "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11"};
+
+// Must be called with the lock held
+static void notify_server(struct Gdb *gdb) {
+  u8 c = 0;
+  write(gdb->notify_pipe[1], &c, 1);
+}
+
+// Must be called with the lock held. The harts see the request at their
+// next block, or right away if they wait in wfi.
+static void request_stop(struct Gdb *gdb) {
+  __atomic_store_n(&gdb->stop, true, __ATOMIC_SEQ_CST);
+  for (u64 i = 0; i < gdb->num_harts; i++) {
+    cpu_check_interrupts(&gdb->cpus[i]);
+  }
+}
+
+enum GdbResume gdb_park(struct Gdb *gdb, struct CPU *cpu) {
+  u64 hart = cpu - gdb->cpus;
+  pthread_mutex_lock(&gdb->lock);
+  gdb->parked++;
+  notify_server(gdb);
+  while (gdb->stop && hart + 1 != gdb->step_hart) {
+    pthread_cond_wait(&gdb->resume, &gdb->lock);
+  }
+  enum GdbResume resume = GDB_CONTINUE;
+  if (hart + 1 == gdb->step_hart) {
+    gdb->step_hart = 0;
+    resume = GDB_STEP;
+  }
+  gdb->parked--;
+  pthread_mutex_unlock(&gdb->lock);
+  return resume;
+}
+
+void gdb_hart_done(struct Gdb *gdb, struct CPU *cpu) {
+  pthread_mutex_lock(&gdb->lock);
+  gdb->harts[cpu - gdb->cpus].done = true;
+  gdb->done++;
+  notify_server(gdb);
+  pthread_mutex_unlock(&gdb->lock);
+}
+
+bool gdb_breakpoint_at(const struct Gdb *gdb, u64 pc) {
+  for (u32 i = 0; i < gdb->num_breakpoints; i++) {
+    if (gdb->breakpoints[i] == pc) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool watch_matches(enum GdbWatch kind, enum Access access) {
+  switch (kind) {
+  case GDB_WATCH_WRITE:
+    return ACCESS_WRITE == access;
+  case GDB_WATCH_READ:
+    return ACCESS_READ == access;
+  case GDB_WATCH_ACCESS:
+    return true;
+  }
+  return false;
+}
+
+bool gdb_watchpoint_at(const struct Gdb *gdb, u64 address, u64 length,
+                       enum Access access, u64 *hit) {
+  if (gdb->ignore_hits) {
+    return false;
+  }
+  for (u32 i = 0; i < gdb->num_watchpoints; i++) {
+    const struct GdbWatchpoint *watch = &gdb->watchpoints[i];
+    if (watch_matches(watch->kind, access) &&
+        address < watch->address + watch->length &&
+        watch->address < address + length) {
+      // GDB looks for the address inside of the watched range
+      *hit = address < watch->address ? watch->address : address;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool gdb_page_watched(const struct Gdb *gdb, u64 page) {
+  for (u32 i = 0; i < gdb->num_watchpoints; i++) {
+    const struct GdbWatchpoint *watch = &gdb->watchpoints[i];
+    if (page < watch->address + watch->length &&
+        watch->address < page + PAGE_SIZE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void gdb_breakpoint_hit(struct Gdb *gdb, struct CPU *cpu) {
+  pthread_mutex_lock(&gdb->lock);
+  struct GdbHart *hart = &gdb->harts[cpu - gdb->cpus];
+  hart->signal = GDB_SIGTRAP;
+  hart->watchpoint = false;
+  request_stop(gdb);
+  pthread_mutex_unlock(&gdb->lock);
+}
+
+void gdb_watchpoint_hit(struct Gdb *gdb, struct CPU *cpu, u64 address,
+                        enum Access access) {
+  pthread_mutex_lock(&gdb->lock);
+  struct GdbHart *hart = &gdb->harts[cpu - gdb->cpus];
+  hart->signal = GDB_SIGTRAP;
+  hart->watchpoint = true;
+  hart->address = address;
+  hart->access = access;
+  request_stop(gdb);
+  pthread_mutex_unlock(&gdb->lock);
+}
+
+// Returns -1 once the debugger is gone
+static int read_byte(struct Gdb *gdb) {
+  if (gdb->input_head == gdb->input_length) {
+    ssize_t rc;
+    do {
+      rc = read(gdb->fd, gdb->input, sizeof(gdb->input));
+    } while (-1 == rc && EINTR == errno);
+    if (rc <= 0) {
+      return -1;
+    }
+    gdb->input_head = 0;
+    gdb->input_length = rc;
+  }
+  return gdb->input[gdb->input_head++];
+}
+
+static bool write_all(struct Gdb *gdb, const char *data, u64 length) {
+  while (length > 0) {
+    ssize_t rc = send(gdb->fd, data, length, MSG_NOSIGNAL);
+    if (-1 == rc && EINTR == errno) {
+      continue;
+    }
+    if (rc <= 0) {
+      return false;
+    }
+    data += rc;
+    length -= rc;
+  }
+  return true;
+}
+
+static int hex_value(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// Reads the next packet into gdb->packet and acknowledges it. Anything
+// outside of a packet, like the acknowledgements of the debugger, is
+// skipped. Returns false once the debugger is gone.
+static bool read_packet(struct Gdb *gdb) {
+  for (;;) {
+    int c;
+    do {
+      c = read_byte(gdb);
+      if (-1 == c) {
+        return false;
+      }
+    } while ('$' != c);
+    u64 length = 0;
+    u8 sum = 0;
+    while ('#' != (c = read_byte(gdb))) {
+      if (-1 == c) {
+        return false;
+      }
+      sum += c;
+      if (length < sizeof(gdb->packet) - 1) {
+        gdb->packet[length++] = c;
+      }
+    }
+    gdb->packet[length] = '\0';
+    int high = read_byte(gdb);
+    int low = read_byte(gdb);
+    if (-1 == high || -1 == low) {
+      return false;
+    }
+    if (gdb->no_ack) {
+      return true;
+    }
+    bool valid = hex_value(high) * 16 + hex_value(low) == sum &&
+                 length < sizeof(gdb->packet) - 1;
+    // A debugger that sends k and hangs up is gone before the
+    // acknowledgement, the packet is still handled
+    write_all(gdb, valid ? "+" : "-", 1);
+    if (valid) {
+      return true;
+    }
+  }
+}
+
+static bool send_packet(struct Gdb *gdb, const char *data) {
+  char frame[GDB_PACKET_SIZE + 4];
+  u64 length = strlen(data);
+  u8 sum = 0;
+  frame[0] = '$';
+  for (u64 i = 0; i < length; i++) {
+    frame[1 + i] = data[i];
+    sum += data[i];
+  }
+  frame[1 + length] = '#';
+  frame[2 + length] = hex_digits[sum >> 4];
+  frame[3 + length] = hex_digits[sum & 0xF];
+  return write_all(gdb, frame, length + 4);
+}
+
+// Appends the bytes in memory order
+static char *put_hex(char *out, const void *data, u64 length) {
+  const u8 *bytes = data;
+  for (u64 i = 0; i < length; i++) {
+    *out++ = hex_digits[bytes[i] >> 4];
+    *out++ = hex_digits[bytes[i] & 0xF];
+  }
+  *out = '\0';
+  return out;
+}
+
+static bool get_hex(const char **in, void *data, u64 length) {
+  u8 *bytes = data;
+  for (u64 i = 0; i < length; i++) {
+    int high = hex_value((*in)[0]);
+    int low = -1 == high ? -1 : hex_value((*in)[1]);
+    if (-1 == low) {
+      return false;
+    }
+    bytes[i] = high * 16 + low;
+    *in += 2;
+  }
+  return true;
+}
+
+// A number in hex followed by one of the separators, or by the end of the
+// packet if separators is NULL
+static bool parse_hex(const char **in, u64 *value, const char *separators) {
+  char *end;
+  errno = 0;
+  *value = strtoull(*in, &end, 16);
+  if (end == *in || 0 != errno) {
+    return false;
+  }
+  *in = end;
+  if (!separators) {
+    return '\0' == **in;
+  }
+  if ('\0' == **in || !strchr(separators, **in)) {
+    return false;
+  }
+  (*in)++;
+  return true;
+}
+
+// Returns the size of the register, 0 if there is none with that number
+static u32 read_register(const struct CPU *cpu, u64 number, u64 *value) {
+  if (number < GDB_REG_PC) {
+    *value = cpu->registers[number];
+  } else if (GDB_REG_PC == number) {
+    *value = cpu->pc;
+  } else if (number < GDB_REG_FFLAGS) {
+    *value = cpu->fregisters[number - GDB_REG_F0];
+  } else if (GDB_REG_FFLAGS == number) {
+    *value = cpu->csr.fflags;
+  } else if (GDB_REG_FRM == number) {
+    *value = cpu->csr.frm;
+  } else if (GDB_REG_FCSR == number) {
+    *value = (u64)cpu->csr.frm << 5 | cpu->csr.fflags;
+  } else {
+    return 0;
+  }
+  return number < GDB_REG_FFLAGS ? sizeof(u64) : sizeof(u32);
+}
+
+// The hart applies fflags and frm to the host FPU once it runs again
+static void write_register(struct CPU *cpu, u64 number, u64 value) {
+  if (number < GDB_REG_PC) {
+    if (0 != number) {
+      cpu->registers[number] = value;
+    }
+  } else if (GDB_REG_PC == number) {
+    cpu->pc = value;
+  } else if (number < GDB_REG_FFLAGS) {
+    cpu->fregisters[number - GDB_REG_F0] = value;
+  } else if (GDB_REG_FFLAGS == number) {
+    cpu->csr.fflags = value & FFLAGS_MASK;
+  } else if (GDB_REG_FRM == number) {
+    cpu->csr.frm = value & 7;
+  } else if (GDB_REG_FCSR == number) {
+    cpu->csr.fflags = value & FFLAGS_MASK;
+    cpu->csr.frm = (value >> 5) & 7;
+  }
+}
+
+// Accesses the memory seen by the selected hart one page at a time. Only RAM
+// is accessible, reading the registers of a device could change its state.
+// Returns the number of bytes accessed before the first that is not.
+static u64 access_memory(struct Gdb *gdb, u64 address, u8 *data, u64 length,
+                         bool write) {
+  struct CPU *cpu = &gdb->cpus[gdb->hart];
+  u64 done = 0;
+  while (done < length) {
+    u64 left = PAGE_SIZE - ((address + done) & (PAGE_SIZE - 1));
+    u64 chunk = length - done < left ? length - done : left;
+    u64 physical;
+    // The debugger may also write to pages that the guest can only read,
+    // which is how it would insert breakpoints without Z0
+    if (MMU_OK != mmu_translate(&cpu->mmu, gdb->mem, address + done,
+                                ACCESS_READ, &physical) ||
+        !ram_contains(gdb->mem, physical, chunk)) {
+      break;
+    }
+    if (write) {
+      memory_write(gdb->mem, physical, data + done, chunk);
+    } else {
+      memory_read(gdb->mem, physical, data + done, chunk);
+    }
+    done += chunk;
+  }
+  return done;
+}
+
+// Invalidates the code at pc in RAM as every hart translates it, which
+// makes the translation caches decode it again
+static void invalidate_breakpoint(struct Gdb *gdb, u64 pc) {
+  for (u64 i = 0; i < gdb->num_harts; i++) {
+    u64 physical;
+    if (MMU_OK == mmu_translate(&gdb->cpus[i].mmu, gdb->mem, pc,
+                                ACCESS_EXECUTE, &physical) &&
+        ram_contains(gdb->mem, physical, 1)) {
+      memory_invalidate_code(gdb->mem, physical, 1);
+    }
+  }
+}
+
+static bool insert_breakpoint(struct Gdb *gdb, u64 pc) {
+  if (gdb_breakpoint_at(gdb, pc)) {
+    return true;
+  }
+  if (GDB_MAX_BREAKPOINTS == gdb->num_breakpoints) {
+    return false;
+  }
+  gdb->breakpoints[gdb->num_breakpoints++] = pc;
+  invalidate_breakpoint(gdb, pc);
+  return true;
+}
+
+static bool remove_breakpoint(struct Gdb *gdb, u64 pc) {
+  for (u32 i = 0; i < gdb->num_breakpoints; i++) {
+    if (gdb->breakpoints[i] == pc) {
+      gdb->breakpoints[i] = gdb->breakpoints[--gdb->num_breakpoints];
+      invalidate_breakpoint(gdb, pc);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Takes the pages of the watchpoint out of the TLBs, they are not cached
+// again as long as it is there, see mmu_translate()
+static bool insert_watchpoint(struct Gdb *gdb, u64 address, u64 length,
+                              enum GdbWatch kind) {
+  if (GDB_MAX_WATCHPOINTS == gdb->num_watchpoints || 0 == length ||
+      address + length < address) {
+    return false;
+  }
+  gdb->watchpoints[gdb->num_watchpoints++] =
+      (struct GdbWatchpoint){address, length, kind};
+  u64 page = address & ~(u64)(PAGE_SIZE - 1);
+  for (; page < address + length; page += PAGE_SIZE) {
+    for (u64 i = 0; i < gdb->num_harts; i++) {
+      mmu_flush_page(&gdb->cpus[i].mmu, page);
+    }
+  }
+  return true;
+}
+
+static bool remove_watchpoint(struct Gdb *gdb, u64 address, u64 length,
+                              enum GdbWatch kind) {
+  for (u32 i = 0; i < gdb->num_watchpoints; i++) {
+    struct GdbWatchpoint *watch = &gdb->watchpoints[i];
+    if (watch->address == address && watch->length == length &&
+        watch->kind == kind) {
+      *watch = gdb->watchpoints[--gdb->num_watchpoints];
+      return true;
+    }
+  }
+  return false;
+}
+
+// Fills in the part of the target description at offset, starting with 'l'
+// if it is the last one and 'm' otherwise
+static void target_description(char *reply, u64 offset, u64 length) {
+  char xml[8192];
+  u64 used = snprintf(xml, sizeof(xml),
+                      "<?xml version=\"1.0\"?>"
+                      "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                      "<target version=\"1.0\">"
+                      "<architecture>riscv:rv64</architecture>"
+                      "<feature name=\"org.gnu.gdb.riscv.cpu\">");
+  for (u32 i = 0; i < 32; i++) {
+    const char *type = 1 == i ? "code_ptr" : 2 == i ? "data_ptr" : "int";
+    used += snprintf(xml + used, sizeof(xml) - used,
+                     "<reg name=\"%s\" bitsize=\"64\" type=\"%s\" "
+                     "regnum=\"%u\"/>",
+                     x_names[i], type, i);
+  }
+  used += snprintf(xml + used, sizeof(xml) - used,
+                   "<reg name=\"pc\" bitsize=\"64\" type=\"code_ptr\" "
+                   "regnum=\"%u\"/></feature>"
+                   "<feature name=\"org.gnu.gdb.riscv.fpu\">",
+                   GDB_REG_PC);
+  for (u32 i = 0; i < 32; i++) {
+    used += snprintf(xml + used, sizeof(xml) - used,
+                     "<reg name=\"%s\" bitsize=\"64\" type=\"ieee_double\" "
+                     "regnum=\"%u\"/>",
+                     f_names[i], GDB_REG_F0 + i);
+  }
+  used += snprintf(xml + used, sizeof(xml) - used,
+                   "<reg name=\"fflags\" bitsize=\"32\" type=\"int\" "
+                   "regnum=\"%u\" group=\"float\"/>"
+                   "<reg name=\"frm\" bitsize=\"32\" type=\"int\" "
+                   "regnum=\"%u\" group=\"float\"/>"
+                   "<reg name=\"fcsr\" bitsize=\"32\" type=\"int\" "
+                   "regnum=\"%u\" group=\"float\"/>"
+                   "</feature></target>",
+                   GDB_REG_FFLAGS, GDB_REG_FRM, GDB_REG_FCSR);
+  if (offset > used) {
+    offset = used;
+  }
+  if (length > used - offset) {
+    length = used - offset;
+  }
+  reply[0] = offset + length == used ? 'l' : 'm';
+  memcpy(reply + 1, xml + offset, length);
+  reply[1 + length] = '\0';
+}
+
+// Waits until every hart is parked or done. A ^C from the debugger stops the
+// machine, which is also stopped if the debugger goes away, false is
+// returned then. Harts that were let go still count as parked until they
+// wake up, so they are only counted while a stop is requested.
+static bool wait_for_stop(struct Gdb *gdb, bool *interrupted) {
+  bool connected = true;
+  for (;;) {
+    pthread_mutex_lock(&gdb->lock);
+    bool stopped = gdb->num_harts == gdb->done ||
+                   (gdb->stop && gdb->num_harts == gdb->parked + gdb->done &&
+                    0 == gdb->step_hart);
+    pthread_mutex_unlock(&gdb->lock);
+    if (stopped) {
+      return connected;
+    }
+    // Bytes that came with the last packet are not seen by poll(). A packet
+    // is left for read_packet(), GDB waits for the stop reply before it
+    // sends the next one anyway.
+    while (connected && gdb->input_head < gdb->input_length &&
+           0x03 == gdb->input[gdb->input_head]) {
+      gdb->input_head++;
+      *interrupted = true;
+      pthread_mutex_lock(&gdb->lock);
+      request_stop(gdb);
+      pthread_mutex_unlock(&gdb->lock);
+    }
+    bool pending = gdb->input_head < gdb->input_length;
+    struct pollfd fds[2] = {
+        {.fd = gdb->notify_pipe[0], .events = POLLIN},
+        {.fd = gdb->fd, .events = POLLIN},
+    };
+    if (-1 == poll(fds, connected && !pending ? 2 : 1, -1)) {
+      if (EINTR != errno) {
+        perror("poll");
+        return false;
+      }
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      u8 drain[64];
+      read(gdb->notify_pipe[0], drain, sizeof(drain));
+    }
+    if (connected && !pending && fds[1].revents) {
+      int c = read_byte(gdb);
+      // Rewound so that the loop above handles it
+      if (-1 != c) {
+        gdb->input_head--;
+      } else {
+        connected = false;
+        pthread_mutex_lock(&gdb->lock);
+        request_stop(gdb);
+        pthread_mutex_unlock(&gdb->lock);
+      }
+    }
+  }
+}
+
+// Lets the parked hart execute a single instruction, hits of breakpoints and
+// watchpoints are ignored if it steps over one
+static bool step_hart(struct Gdb *gdb, u64 hart, bool ignore_hits) {
+  pthread_mutex_lock(&gdb->lock);
+  gdb->ignore_hits = ignore_hits;
+  gdb->step_hart = hart + 1;
+  pthread_cond_broadcast(&gdb->resume);
+  pthread_mutex_unlock(&gdb->lock);
+  bool interrupted = false;
+  bool connected = wait_for_stop(gdb, &interrupted);
+  gdb->ignore_hits = false;
+  return connected;
+}
+
+static void clear_stops(struct Gdb *gdb) {
+  pthread_mutex_lock(&gdb->lock);
+  for (u64 i = 0; i < gdb->num_harts; i++) {
+    gdb->harts[i].signal = 0;
+    gdb->harts[i].watchpoint = false;
+  }
+  pthread_mutex_unlock(&gdb->lock);
+}
+
+// Reports the first hart that stopped for a reason of its own, or hart with
+// signal if there is none
+static bool report_stop(struct Gdb *gdb, u64 hart, u8 signal) {
+  for (u64 i = 0; i < gdb->num_harts; i++) {
+    if (0 != gdb->harts[i].signal) {
+      hart = i;
+      signal = gdb->harts[i].signal;
+      break;
+    }
+  }
+  gdb->hart = hart;
+  char reply[128];
+  int used = snprintf(reply, sizeof(reply), "T%02xthread:%lx;", signal,
+                      hart + 1);
+  const struct GdbHart *stop = &gdb->harts[hart];
+  if (stop->watchpoint) {
+    // Only a watchpoint of the same kind as the access tells GDB to compare
+    // the value
+    const char *name = "awatch";
+    for (u32 i = 0; i < gdb->num_watchpoints; i++) {
+      const struct GdbWatchpoint *watch = &gdb->watchpoints[i];
+      if (stop->address >= watch->address &&
+          stop->address - watch->address < watch->length &&
+          GDB_WATCH_ACCESS != watch->kind &&
+          watch_matches(watch->kind, stop->access)) {
+        name = GDB_WATCH_WRITE == watch->kind ? "watch" : "rwatch";
+        break;
+      }
+    }
+    snprintf(reply + used, sizeof(reply) - used, "%s:%lx;", name,
+             stop->address);
+  }
+  return send_packet(gdb, reply);
+}
+
+// Runs the machine until it stops again, or only lets hart step if step is
+// set, and reports why it stopped. Returns false once the session is over.
+static bool run(struct Gdb *gdb, u64 hart, bool step) {
+  if (step) {
+    bool ignore_hits = gdb->harts[hart].watchpoint;
+    clear_stops(gdb);
+    if (!step_hart(gdb, hart, ignore_hits)) {
+      return false;
+    }
+  } else {
+    // The harts that stopped at a breakpoint or watchpoint would stop there
+    // again right away
+    for (u64 i = 0; i < gdb->num_harts; i++) {
+      if (!gdb->harts[i].done &&
+          (gdb->harts[i].watchpoint ||
+           gdb_breakpoint_at(gdb, gdb->cpus[i].pc)) &&
+          !step_hart(gdb, i, true)) {
+        return false;
+      }
+    }
+    clear_stops(gdb);
+  }
+  bool interrupted = false;
+  if (!step && !memory_halted(gdb->mem)) {
+    pthread_mutex_lock(&gdb->lock);
+    __atomic_store_n(&gdb->stop, false, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&gdb->resume);
+    pthread_mutex_unlock(&gdb->lock);
+    if (!wait_for_stop(gdb, &interrupted)) {
+      return false;
+    }
+  }
+  if (memory_halted(gdb->mem)) {
+    char reply[8];
+    snprintf(reply, sizeof(reply), "W%02x", gdb->mem->exit_status & 0xFF);
+    send_packet(gdb, reply);
+    return false;
+  }
+  return report_stop(gdb, hart, interrupted ? GDB_SIGINT : GDB_SIGTRAP);
+}
+
+// Thread ids are the hart index + 1, -1 and 0 leave the selection alone
+static bool parse_thread(struct Gdb *gdb, const char *text, u64 *hart) {
+  if (0 == strcmp(text, "-1") || 0 == strcmp(text, "0")) {
+    return true;
+  }
+  u64 id;
+  if (!parse_hex(&text, &id, NULL) || 0 == id || id > gdb->num_harts) {
+    return false;
+  }
+  *hart = id - 1;
+  return true;
+}
+
+// vCont;action[:thread]... Since the machine stops as a whole a step only
+// runs the hart that steps.
+static bool handle_vcont(struct Gdb *gdb, const char *actions) {
+  u64 hart = gdb->hart;
+  bool step = false;
+  while (';' == *actions) {
+    char action = actions[1];
+    const char *end = strchr(actions + 1, ';');
+    char thread[32] = "-1";
+    const char *colon = strchr(actions + 1, ':');
+    if (colon && (!end || colon < end)) {
+      u64 length = (end ? (u64)(end - colon) : strlen(colon)) - 1;
+      if (length < sizeof(thread)) {
+        memcpy(thread, colon + 1, length);
+        thread[length] = '\0';
+      }
+    }
+    if ('s' == action || 'S' == action) {
+      step = true;
+      if (!parse_thread(gdb, thread, &hart)) {
+        return send_packet(gdb, "E01");
+      }
+    }
+    actions = end ? end : "";
+  }
+  return run(gdb, hart, step);
+}
+
+static bool handle_query(struct Gdb *gdb, const char *query) {
+  char reply[GDB_PACKET_SIZE];
+  if (0 == strncmp(query, "qSupported", 10)) {
+    snprintf(reply, sizeof(reply),
+             "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+",
+             GDB_PACKET_SIZE - 1);
+    return send_packet(gdb, reply);
+  }
+  if (0 == strncmp(query, "qXfer:features:read:target.xml:", 31)) {
+    const char *in = query + 31;
+    u64 offset, length;
+    if (!parse_hex(&in, &offset, ",") || !parse_hex(&in, &length, NULL)) {
+      return send_packet(gdb, "E01");
+    }
+    if (length > sizeof(reply) - 2) {
+      length = sizeof(reply) - 2;
+    }
+    target_description(reply, offset, length);
+    return send_packet(gdb, reply);
+  }
+  if (0 == strcmp(query, "qfThreadInfo")) {
+    char *out = reply;
+    *out++ = 'm';
+    for (u64 i = 0; i < gdb->num_harts && out < reply + sizeof(reply) - 20;
+         i++) {
+      out += sprintf(out, "%s%lx", 0 == i ? "" : ",", i + 1);
+    }
+    return send_packet(gdb, reply);
+  }
+  if (0 == strcmp(query, "qsThreadInfo")) {
+    return send_packet(gdb, "l");
+  }
+  if (0 == strcmp(query, "qC")) {
+    snprintf(reply, sizeof(reply), "QC%lx", gdb->hart + 1);
+    return send_packet(gdb, reply);
+  }
+  if (0 == strcmp(query, "qAttached")) {
+    return send_packet(gdb, "1");
+  }
+  if (0 == strcmp(query, "QStartNoAckMode")) {
+    bool ok = send_packet(gdb, "OK");
+    gdb->no_ack = true;
+    return ok;
+  }
+  return send_packet(gdb, "");
+}
+
+static bool handle_breakpoint(struct Gdb *gdb, const char *packet) {
+  bool insert = 'Z' == packet[0];
+  const char *in = packet + 1;
+  u64 type, address, kind;
+  if (!parse_hex(&in, &type, ",") || !parse_hex(&in, &address, ",") ||
+      !parse_hex(&in, &kind, ";")) {
+    // The conditions after the kind are ignored
+    in = packet + 1;
+    if (!parse_hex(&in, &type, ",") || !parse_hex(&in, &address, ",") ||
+        !parse_hex(&in, &kind, NULL)) {
+      return send_packet(gdb, "E01");
+    }
+  }
+  bool ok;
+  switch (type) {
+  // Hardware breakpoints are the same as software ones here
+  case 0:
+  case 1:
+    ok = insert ? insert_breakpoint(gdb, address)
+                : remove_breakpoint(gdb, address);
+    break;
+  case GDB_WATCH_WRITE:
+  case GDB_WATCH_READ:
+  case GDB_WATCH_ACCESS:
+    ok = insert ? insert_watchpoint(gdb, address, kind, type)
+                : remove_watchpoint(gdb, address, kind, type);
+    break;
+  default:
+    return send_packet(gdb, "");
+  }
+  return send_packet(gdb, ok ? "OK" : "E01");
+}
+
+// The optional address to continue at of c, s, C and S
+static bool handle_resume(struct Gdb *gdb, const char *packet) {
+  bool step = 's' == packet[0] || 'S' == packet[0];
+  const char *in = packet + 1;
+  if ('C' == packet[0] || 'S' == packet[0]) {
+    // The signal is not delivered to the guest
+    in = strchr(in, ';');
+    in = in ? in + 1 : "";
+  }
+  u64 address;
+  if ('\0' != *in) {
+    if (!parse_hex(&in, &address, NULL)) {
+      return send_packet(gdb, "E01");
+    }
+    gdb->cpus[gdb->hart].pc = address;
+  }
+  return run(gdb, gdb->hart, step);
+}
+
+// Handles the packet, returns false once the session is over
+static bool handle_packet(struct Gdb *gdb) {
+  const char *packet = gdb->packet;
+  struct CPU *cpu = &gdb->cpus[gdb->hart];
+  char reply[GDB_PACKET_SIZE];
+  const char *in = packet + 1;
+  u64 number, value, address, length;
+  switch (packet[0]) {
+  case '?':
+    return report_stop(gdb, gdb->hart, GDB_SIGTRAP);
+  case 'g': {
+    char *out = reply;
+    for (u32 i = 0; i < GDB_NUM_G_REGS; i++) {
+      read_register(cpu, i, &value);
+      out = put_hex(out, &value, sizeof(value));
+    }
+    return send_packet(gdb, reply);
+  }
+  case 'G':
+    for (u32 i = 0; i < GDB_NUM_G_REGS && '\0' != *in; i++) {
+      if (!get_hex(&in, &value, sizeof(value))) {
+        return send_packet(gdb, "E01");
+      }
+      write_register(cpu, i, value);
+    }
+    return send_packet(gdb, "OK");
+  case 'p': {
+    u32 size;
+    if (!parse_hex(&in, &number, NULL) ||
+        0 == (size = read_register(cpu, number, &value))) {
+      return send_packet(gdb, "E01");
+    }
+    put_hex(reply, &value, size);
+    return send_packet(gdb, reply);
+  }
+  case 'P': {
+    value = 0;
+    u32 size;
+    if (!parse_hex(&in, &number, "=") ||
+        0 == (size = read_register(cpu, number, &value)) ||
+        !get_hex(&in, &value, size)) {
+      return send_packet(gdb, "E01");
+    }
+    write_register(cpu, number, value);
+    return send_packet(gdb, "OK");
+  }
+  case 'm': {
+    u8 data[(GDB_PACKET_SIZE - 1) / 2];
+    if (!parse_hex(&in, &address, ",") || !parse_hex(&in, &length, NULL)) {
+      return send_packet(gdb, "E01");
+    }
+    if (length > sizeof(data)) {
+      length = sizeof(data);
+    }
+    length = access_memory(gdb, address, data, length, false);
+    if (0 == length) {
+      return send_packet(gdb, "E01");
+    }
+    put_hex(reply, data, length);
+    return send_packet(gdb, reply);
+  }
+  case 'M': {
+    u8 data[GDB_PACKET_SIZE / 2];
+    if (!parse_hex(&in, &address, ",") || !parse_hex(&in, &length, ":") ||
+        length > sizeof(data) || !get_hex(&in, data, length)) {
+      return send_packet(gdb, "E01");
+    }
+    bool ok = length == access_memory(gdb, address, data, length, true);
+    return send_packet(gdb, ok ? "OK" : "E01");
+  }
+  case 'c':
+  case 'C':
+  case 's':
+  case 'S':
+    return handle_resume(gdb, packet);
+  case 'H':
+    if (('g' == packet[1] || 'c' == packet[1]) &&
+        parse_thread(gdb, packet + 2, &gdb->hart)) {
+      return send_packet(gdb, "OK");
+    }
+    return send_packet(gdb, "E01");
+  case 'T':
+    return send_packet(gdb, parse_thread(gdb, in, &number) ? "OK" : "E01");
+  case 'Z':
+  case 'z':
+    return handle_breakpoint(gdb, packet);
+  case 'q':
+  case 'Q':
+    return handle_query(gdb, packet);
+  case 'v':
+    if (0 == strcmp(packet, "vCont?")) {
+      return send_packet(gdb, "vCont;c;C;s;S");
+    }
+    if (0 == strncmp(packet, "vCont;", 6)) {
+      return handle_vcont(gdb, packet + 5);
+    }
+    if (0 == strncmp(packet, "vKill", 5)) {
+      send_packet(gdb, "OK");
+      memory_halt(gdb->mem, GDB_EXIT_KILLED);
+      return false;
+    }
+    return send_packet(gdb, "");
+  case 'k':
+    memory_halt(gdb->mem, GDB_EXIT_KILLED);
+    return false;
+  case 'D':
+    send_packet(gdb, "OK");
+    return false;
+  default:
+    return send_packet(gdb, "");
+  }
+}
+
+// Everything the debugger inserted goes away with it and the harts run on
+// their own
+static void end_session(struct Gdb *gdb) {
+  while (gdb->num_breakpoints > 0) {
+    remove_breakpoint(gdb, gdb->breakpoints[0]);
+  }
+  gdb->num_watchpoints = 0;
+  clear_stops(gdb);
+  pthread_mutex_lock(&gdb->lock);
+  __atomic_store_n(&gdb->stop, false, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&gdb->resume);
+  pthread_mutex_unlock(&gdb->lock);
+  if (-1 != gdb->fd) {
+    close(gdb->fd);
+    gdb->fd = -1;
+  }
+}
+
+static void *gdb_thread(void *opaque) {
+  struct Gdb *gdb = opaque;
+  do {
+    gdb->fd = accept(gdb->listen_fd, NULL, NULL);
+  } while (-1 == gdb->fd && EINTR == errno);
+  if (-1 == gdb->fd) {
+    perror("accept");
+    end_session(gdb);
+    return NULL;
+  }
+  // Replies are single writes that should not wait for the next one
+  int one = 1;
+  setsockopt(gdb->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  bool interrupted = false;
+  // The harts park at their first block
+  if (wait_for_stop(gdb, &interrupted)) {
+    while (read_packet(gdb) && handle_packet(gdb)) {
+    }
+  }
+  end_session(gdb);
+  return NULL;
+}
+
+static int listen_unix(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s is too long for a socket\n", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (-1 == fd) {
+    perror("socket");
+    return -1;
+  }
+  // Left behind by an earlier run
+  unlink(path);
+  if (-1 == bind(fd, (const struct sockaddr *)&address, sizeof(address))) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Only the local host can connect, the debugger has full control over the
+// machine
+static int listen_tcp(const char *port) {
+  char *end;
+  unsigned long number = strtoul(port, &end, 10);
+  if ('\0' == *port || '\0' != *end || 0 == number || number > 65535) {
+    fprintf(stderr, "Bad debugger address %s\n", port);
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (-1 == fd) {
+    perror("socket");
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(number);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (-1 == bind(fd, (const struct sockaddr *)&address, sizeof(address))) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool gdb_init(struct Gdb *gdb, struct Memory *mem, struct CPU *cpus,
+              u64 num_harts, const char *address) {
+  gdb->listen_fd = 0 == strncmp(address, "unix:", 5)
+                       ? listen_unix(address + 5)
+                       : listen_tcp(address);
+  if (-1 == gdb->listen_fd) {
+    return false;
+  }
+  if (-1 == listen(gdb->listen_fd, 1)) {
+    perror("listen");
+    close(gdb->listen_fd);
+    return false;
+  }
+  gdb->harts = calloc(num_harts, sizeof(struct GdbHart));
+  if (!gdb->harts) {
+    perror("calloc");
+    close(gdb->listen_fd);
+    return false;
+  }
+  if (-1 == pipe(gdb->notify_pipe)) {
+    perror("pipe");
+    free(gdb->harts);
+    close(gdb->listen_fd);
+    return false;
+  }
+  fcntl(gdb->notify_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(gdb->notify_pipe[1], F_SETFL, O_NONBLOCK);
+  gdb->mem = mem;
+  gdb->cpus = cpus;
+  gdb->num_harts = num_harts;
+  gdb->started = false;
+  gdb->fd = -1;
+  pthread_mutex_init(&gdb->lock, NULL);
+  pthread_cond_init(&gdb->resume, NULL);
+  gdb->stop = true;
+  gdb->parked = 0;
+  gdb->done = 0;
+  gdb->step_hart = 0;
+  gdb->ignore_hits = false;
+  gdb->num_breakpoints = 0;
+  gdb->num_watchpoints = 0;
+  gdb->hart = 0;
+  gdb->no_ack = false;
+  gdb->input_head = 0;
+  gdb->input_length = 0;
+  mem->gdb = gdb;
+  fprintf(stderr, "Waiting for GDB on %s\n", address);
+  return true;
+}
+
+bool gdb_start(struct Gdb *gdb) {
+  int rc = pthread_create(&gdb->thread, NULL, gdb_thread, gdb);
+  if (0 != rc) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+    return false;
+  }
+  gdb->started = true;
+  return true;
+}
+
+void gdb_destroy(struct Gdb *gdb) {
+  if (gdb->started) {
+    pthread_join(gdb->thread, NULL);
+  }
+  gdb->mem->gdb = NULL;
+  pthread_mutex_destroy(&gdb->lock);
+  pthread_cond_destroy(&gdb->resume);
+  close(gdb->notify_pipe[0]);
+  close(gdb->notify_pipe[1]);
+  close(gdb->listen_fd);
+  free(gdb->harts);
+}
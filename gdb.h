@@ -0,0 +1,127 @@
+#ifndef GDB_H
+#define GDB_H
+#include "cpu.h"
+#include "mmu.h"
+#include "types.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+#define GDB_MAX_BREAKPOINTS 64
+#define GDB_MAX_WATCHPOINTS 16
+#define GDB_PACKET_SIZE 4096
+
+// Kinds of watchpoints, numbered like the Z packets that insert them
+enum GdbWatch {
+  GDB_WATCH_WRITE = 2,
+  GDB_WATCH_READ = 3,
+  GDB_WATCH_ACCESS = 4,
+};
+
+struct GdbWatchpoint {
+  u64 address;
+  u64 length;
+  enum GdbWatch kind;
+};
+
+// Why a hart stopped, reported to the debugger
+struct GdbHart {
+  // Signal of the stop reply, 0 while the hart has nothing to report
+  u8 signal;
+  bool watchpoint;
+  // Address of the access that hit the watchpoint
+  u64 address;
+  enum Access access;
+  // Set once the hart has returned from cpu_loop()
+  bool done;
+};
+
+// GDB remote serial protocol server. Every hart is a thread of the debugger
+// with the hart index + 1 as its id. The machine stops as a whole: once a
+// stop is requested every hart parks at its next block until the debugger
+// lets them run again, and single steps are executed by the parked hart
+// itself. The harts start stopped and wait for the debugger to connect.
+//
+// Nothing is checked in the hot loop. Breakpoints are decoded as
+// OP_breakpoint into the blocks of the translation cache, so inserting or
+// removing one only invalidates the code of its page. Pages with a
+// watchpoint are kept out of the data TLBs, so only the slow path of the MMU
+// has to look at the watchpoints. The lists only change while all harts are
+// parked, which is why the harts read them without the lock.
+struct Gdb {
+  struct Memory *mem;
+  struct CPU *cpus;
+  u64 num_harts;
+  pthread_t thread;
+  bool started;
+  int listen_fd;
+  int fd;
+  // Written by the harts when they park or finish, so that the server can
+  // wait for them and for the debugger at the same time
+  int notify_pipe[2];
+
+  pthread_mutex_t lock;
+  // Signalled when the parked harts may run or step
+  pthread_cond_t resume;
+  // Set while the machine is stopped or stopping. Only accessed atomically.
+  bool stop;
+  u64 parked;
+  // Harts that returned from cpu_loop()
+  u64 done;
+  // Index + 1 of the hart that executes a single step, 0 if there is none
+  u64 step_hart;
+  // Set while a hart steps over the breakpoint or watchpoint it stopped at
+  bool ignore_hits;
+  struct GdbHart *harts;
+
+  u64 breakpoints[GDB_MAX_BREAKPOINTS];
+  u32 num_breakpoints;
+  struct GdbWatchpoint watchpoints[GDB_MAX_WATCHPOINTS];
+  u32 num_watchpoints;
+
+  // Hart index selected with Hg for register and memory accesses
+  u64 hart;
+  bool no_ack;
+  u8 input[GDB_PACKET_SIZE];
+  u64 input_head;
+  u64 input_length;
+  char packet[GDB_PACKET_SIZE];
+};
+
+// Listens on address, which is unix:PATH for a UNIX socket or a TCP port on
+// the loopback interface, and makes the harts stop at their first block.
+// Sets mem->gdb.
+bool gdb_init(struct Gdb *gdb, struct Memory *mem, struct CPU *cpus,
+              u64 num_harts, const char *address);
+// Starts the server thread, which accepts a single debugger. The harts run
+// on their own once it detaches or disconnects.
+bool gdb_start(struct Gdb *gdb);
+// Waits for the server to report the end of the run, the harts have to be
+// done
+void gdb_destroy(struct Gdb *gdb);
+
+// Used by the harts
+static inline bool gdb_stopping(const struct Gdb *gdb) {
+  return __atomic_load_n(&gdb->stop, __ATOMIC_SEQ_CST);
+}
+
+enum GdbResume {
+  GDB_CONTINUE,
+  GDB_STEP,
+};
+
+// Blocks the hart while the machine is stopped. Returns GDB_STEP if the hart
+// has to execute a single instruction, after which it parks again.
+enum GdbResume gdb_park(struct Gdb *gdb, struct CPU *cpu);
+// Called once the hart has returned from cpu_loop() for good
+void gdb_hart_done(struct Gdb *gdb, struct CPU *cpu);
+bool gdb_breakpoint_at(const struct Gdb *gdb, u64 pc);
+// Returns false if the access does not touch a watchpoint of its kind and
+// the address to report in hit otherwise
+bool gdb_watchpoint_at(const struct Gdb *gdb, u64 address, u64 length,
+                       enum Access access, u64 *hit);
+bool gdb_page_watched(const struct Gdb *gdb, u64 page);
+// Stops the machine before the instruction of the hart at cpu->pc
+void gdb_breakpoint_hit(struct Gdb *gdb, struct CPU *cpu);
+void gdb_watchpoint_hit(struct Gdb *gdb, struct CPU *cpu, u64 address,
+                        enum Access access);
+#endif // GDB_H
@@ -0,0 +1,1102 @@
+// x86-64 backend for hot blocks in the translation cache.
+//
+// Native code runs with rbx pointing to the struct CPU and rbp pointing to the
+// struct Memory. Guest registers are kept at their offsets in the struct CPU
+// and rax/rcx are used as scratch. The integer instructions are emitted
+// directly, everything else is a call to the same handler the interpreter
+// uses so that the semantics stay the same.
+//
+// Every exit that leaves the block for a known pc in the same page starts
+// with a jmp that initially falls through to code returning to the
+// dispatcher. Once the target block has been compiled the dispatcher patches
+// that jmp to go directly to it. Since chained blocks never pass through
+// tcache_lookup() every block starts by checking that the code generation of
+// its page is still the one it was compiled from. Jumps to other pages always
+// return to the dispatcher because the translation of the target page may
+// have changed since the exit was patched. For the same reason every block
+// counts its own instructions and returns to the dispatcher once the hart
+// has reached its instruction limit or the memory has been halted.
+//
+// While tracing, every exit that leaves a block after running it first
+// appends the record of the block to the trace, see struct Trace. Which
+// registers it covers is known when the block is compiled, so the record is a
+// handful of instructions using rdx and rsi as scratch as well. Blocks return
+// to the dispatcher before they start once the buffer of the trace is full,
+// which flushes it.
+#include "jit.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "tcache.h"
+#include "trace.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+// Upper bound of the native code of a single instruction. A store with its
+// inline TLB lookup, code page check and handler call is the largest at 175
+// bytes.
+#define JIT_MAX_INST_SIZE 192
+// Upper bound of the checks at the start of a block and the exits at its
+// end, which are 160 bytes while tracing and 136 otherwise
+#define JIT_MAX_BLOCK_OVERHEAD 192
+// Upper bound of the code appending a trace record at an exit, which is 586
+// bytes if the block writes all 31 registers
+#define JIT_MAX_TRACE_SIZE 608
+// Upper bound of the code and data generated for a single block, the copy of
+// its records included. Every instruction has at most one exit for a trap
+// and the last one up to two more, which all append a trace record.
+#define JIT_MAX_BLOCK_SIZE                                                     \
+  (BLOCK_MAX_LENGTH * (sizeof(struct Inst) + JIT_MAX_INST_SIZE) +              \
+   JIT_MAX_BLOCK_OVERHEAD + (BLOCK_MAX_LENGTH + 2) * JIT_MAX_TRACE_SIZE)
+
+#define REG_OFFSET(_r) ((u32)(offsetof(struct CPU, registers) + 8 * (_r)))
+#define PC_OFFSET ((u32)offsetof(struct CPU, pc))
+#define DID_BRANCH_OFFSET ((u32)offsetof(struct CPU, did_branch))
+#define INSTRET_OFFSET ((u32)offsetof(struct CPU, instret))
+#define INSTRET_STOP_OFFSET ((u32)offsetof(struct CPU, instret_stop))
+#define RAM_OFFSET ((u32)offsetof(struct Memory, ram))
+#define CODE_GEN_OFFSET ((u32)offsetof(struct Memory, code_gen))
+#define HALTED_OFFSET ((u32)offsetof(struct Memory, halted))
+#define DATA_TLB_OFFSET ((u32)offsetof(struct CPU, mmu.data))
+#define TLB_TAG_OFFSET(_access)                                                \
+  ((u8)(offsetof(struct TlbEntry, tag) + 8 * (_access)))
+#define TLB_ADDEND_OFFSET ((u8)offsetof(struct TlbEntry, addend))
+#define TLB_ENTRY_SHIFT 5
+#define TRACE_NEXT_OFFSET ((u8)offsetof(struct Trace, next))
+#define TRACE_END_OFFSET ((u8)offsetof(struct Trace, end))
+#define TRACE_HASH_OFFSET ((u8)offsetof(struct Trace, hash))
+#define TRACE_LAST_WORD_OFFSET ((u8)offsetof(struct Trace, last_word))
+#define TRACE_REPEAT_OFFSET ((u8)offsetof(struct Trace, repeat))
+
+_Static_assert(sizeof(struct TlbEntry) == 1 << TLB_ENTRY_SHIFT,
+               "TLB entries are indexed with a shift");
+_Static_assert((u64)(i64)(i32)(u32)TRACE_HASH_MULTIPLIER ==
+                   TRACE_HASH_MULTIPLIER,
+               "The trace hash multiplies by a sign extended imm32");
+
+// Opcodes used with a [rbx + disp32] operand
+#define X86_ADD 0x03
+#define X86_OR 0x0B
+#define X86_AND 0x23
+#define X86_SUB 0x2B
+#define X86_XOR 0x33
+#define X86_CMP 0x3B
+#define X86_MOV_LOAD 0x8B
+#define X86_MOV_STORE 0x89
+
+// Opcodes of the rax/eax, imm32 forms
+#define X86_ADD_IMM 0x05
+#define X86_OR_IMM 0x0D
+#define X86_AND_IMM 0x25
+#define X86_XOR_IMM 0x35
+#define X86_CMP_IMM 0x3D
+
+// ModRM /digit of the unary group 3, which takes rax as the other operand of
+// the multiplies and leaves the high half of the product in rdx
+#define X86_GROUP3 0xF7
+#define X86_MUL 4
+#define X86_IMUL 5
+
+// ModRM /digit of the shift group
+#define X86_SHL 4
+#define X86_SHR 5
+#define X86_SAR 7
+
+// Condition codes for jcc/setcc
+#define X86_CC_B 0x2
+#define X86_CC_AE 0x3
+#define X86_CC_E 0x4
+#define X86_CC_NE 0x5
+#define X86_CC_A 0x7
+#define X86_CC_L 0xC
+#define X86_CC_GE 0xD
+
+#define X86_RAX 0
+#define X86_RCX 1
+#define X86_RDX 2
+#define X86_RSI 6
+
+#define REX_W 0x48
+
+#define KIND_IS_BRANCH_NEXT false
+#define KIND_IS_BRANCH_TRAP false
+#define KIND_IS_BRANCH_BRANCH true
+#define KIND_IS_BRANCH_FLOAT false
+#define KIND_ENTRY(_name, _kind) KIND_IS_BRANCH_##_kind,
+static const bool op_is_branch[OP_COUNT] = {INSTRUCTION_LIST(KIND_ENTRY)};
+#undef KIND_ENTRY
+
+static void emit8(u8 **p, u8 value) {
+  *(*p)++ = value;
+}
+
+static void emit32(u8 **p, u32 value) {
+  memcpy(*p, &value, sizeof(value));
+  *p += sizeof(value);
+}
+
+static void emit64(u8 **p, u64 value) {
+  memcpy(*p, &value, sizeof(value));
+  *p += sizeof(value);
+}
+
+static void patch_rel32(u8 *rel, const u8 *target) {
+  i32 offset = (i32)(target - (rel + 4));
+  memcpy(rel, &offset, sizeof(offset));
+}
+
+// op reg, [rbx + disp32]
+static void emit_mem_op(u8 **p, bool wide, u8 opcode, u8 reg, u32 disp) {
+  if (wide) {
+    emit8(p, REX_W);
+  }
+  emit8(p, opcode);
+  emit8(p, 0x80 | (reg << 3) | 3);
+  emit32(p, disp);
+}
+
+static void emit_load(u8 **p, bool wide, u8 reg, u8 guest_reg) {
+  emit_mem_op(p, wide, X86_MOV_LOAD, reg, REG_OFFSET(guest_reg));
+}
+
+static void emit_store_rax(u8 **p, u8 guest_reg) {
+  emit_mem_op(p, true, X86_MOV_STORE, X86_RAX, REG_OFFSET(guest_reg));
+}
+
+static void emit_mov_rax_imm64(u8 **p, u64 value) {
+  emit8(p, REX_W);
+  emit8(p, 0xB8);
+  emit64(p, value);
+}
+
+static void emit_store_pc(u8 **p, u64 pc) {
+  emit_mov_rax_imm64(p, pc);
+  emit_mem_op(p, true, X86_MOV_STORE, X86_RAX, PC_OFFSET);
+}
+
+// op rax/eax, imm32
+static void emit_imm_op(u8 **p, bool wide, u8 opcode, i32 imm) {
+  if (wide) {
+    emit8(p, REX_W);
+  }
+  emit8(p, opcode);
+  emit32(p, imm);
+}
+
+// shift rax/eax, imm8
+static void emit_shift_imm(u8 **p, bool wide, u8 digit, u8 amount) {
+  if (wide) {
+    emit8(p, REX_W);
+  }
+  emit8(p, 0xC1);
+  emit8(p, 0xC0 | (digit << 3));
+  emit8(p, amount);
+}
+
+// shift eax, cl
+static void emit_shift_cl(u8 **p, u8 digit) {
+  emit8(p, 0xD3);
+  emit8(p, 0xC0 | (digit << 3));
+}
+
+// movsxd rax, eax
+static void emit_sext32(u8 **p) {
+  emit8(p, REX_W);
+  emit8(p, 0x63);
+  emit8(p, 0xC0);
+}
+
+// setcc al; movzx eax, al
+static void emit_setcc(u8 **p, u8 cc) {
+  emit8(p, 0x0F);
+  emit8(p, 0x90 | cc);
+  emit8(p, 0xC0);
+  emit8(p, 0x0F);
+  emit8(p, 0xB6);
+  emit8(p, 0xC0);
+}
+
+// Returns the location of the rel32 to patch
+static u8 *emit_jcc(u8 **p, u8 cc) {
+  emit8(p, 0x0F);
+  emit8(p, 0x80 | cc);
+  u8 *rel = *p;
+  emit32(p, 0);
+  return rel;
+}
+
+// Returns the location of the rel32 to patch
+static u8 *emit_jmp_fixup(u8 **p) {
+  emit8(p, 0xE9);
+  u8 *rel = *p;
+  emit32(p, 0);
+  return rel;
+}
+
+static void emit_jmp(u8 **p, const u8 *target) {
+  patch_rel32(emit_jmp_fixup(p), target);
+}
+
+// mov rdx, trace
+static void emit_trace_address(struct Jit *jit, u8 **p) {
+  emit8(p, REX_W);
+  emit8(p, 0xBA);
+  emit64(p, (u64)(uintptr_t)jit->trace);
+}
+
+// op reg, [base + disp8], reg being the /digit of the immediate forms
+static void emit_disp8_op(u8 **p, bool wide, u8 opcode, u8 reg, u8 base,
+                          u8 disp) {
+  if (wide) {
+    emit8(p, REX_W);
+  }
+  emit8(p, opcode);
+  emit8(p, 0x40 | (reg << 3) | base);
+  emit8(p, disp);
+}
+
+// Appends the execution of the first count instructions of the block to the
+// trace, the same steps as trace_execute(). rcx points to the record.
+static void emit_trace_record(struct Jit *jit, u8 **p, u32 count) {
+  if (!jit->trace) {
+    return;
+  }
+  const struct Block *block = jit->block;
+  bool partial = count < block->length;
+  u32 mask =
+      partial ? tcache_written(block, count) : block->trace_mask;
+  u32 word = block->trace_id << TRACE_KIND_BITS;
+  emit_trace_address(jit, p);
+  if (jit->trace->flags & TRACE_VALUES) {
+    // mov rcx, [rdx + next]; mov dword [rcx], word
+    emit_disp8_op(p, true, X86_MOV_LOAD, X86_RCX, X86_RDX, TRACE_NEXT_OFFSET);
+    emit8(p, 0xC7);
+    emit8(p, 0x01);
+    emit32(p, word | (partial ? TRACE_PARTIAL : TRACE_EXECUTED));
+    u8 size = sizeof(u32);
+    if (partial) {
+      // mov byte [rcx + size], count
+      emit_disp8_op(p, false, 0xC6, 0, X86_RCX, size);
+      emit8(p, count);
+      size++;
+    }
+    // mov dword [rcx + size], mask
+    emit_disp8_op(p, false, 0xC7, 0, X86_RCX, size);
+    emit32(p, mask);
+    size += sizeof(u32);
+    for (; mask; mask &= mask - 1) {
+      // mov rax, [rbx + reg]; mov [rcx + size], rax
+      emit_load(p, true, X86_RAX, __builtin_ctz(mask));
+      emit8(p, REX_W);
+      emit8(p, X86_MOV_STORE);
+      emit8(p, 0x81);
+      emit32(p, size);
+      size += sizeof(u64);
+    }
+    // add qword [rdx + next], size
+    emit_disp8_op(p, true, 0x81, 0, X86_RDX, TRACE_NEXT_OFFSET);
+    emit32(p, size);
+    return;
+  }
+
+  // Chains the registers into the hash and leaves the check in eax
+  emit_disp8_op(p, true, X86_MOV_LOAD, X86_RAX, X86_RDX, TRACE_HASH_OFFSET);
+  if (mask) {
+    for (; mask; mask &= mask - 1) {
+      // xor rax, [rbx + reg]; imul rax, rax, multiplier
+      emit_mem_op(p, true, X86_XOR, X86_RAX, REG_OFFSET(__builtin_ctz(mask)));
+      emit8(p, REX_W);
+      emit8(p, 0x69);
+      emit8(p, 0xC0);
+      emit32(p, (u32)TRACE_HASH_MULTIPLIER);
+    }
+    emit_disp8_op(p, true, X86_MOV_STORE, X86_RAX, X86_RDX, TRACE_HASH_OFFSET);
+  }
+  // mov esi, eax; shr rax, 32; xor eax, esi
+  emit8(p, 0x89);
+  emit8(p, 0xC6);
+  emit_shift_imm(p, true, X86_SHR, 32);
+  emit8(p, 0x31);
+  emit8(p, 0xF0);
+
+  if (partial) {
+    // mov rcx, [rdx + next]; mov dword [rcx], word;
+    // mov byte [rcx + 4], count; mov [rcx + 5], eax
+    emit_disp8_op(p, true, X86_MOV_LOAD, X86_RCX, X86_RDX, TRACE_NEXT_OFFSET);
+    emit8(p, 0xC7);
+    emit8(p, 0x01);
+    emit32(p, word | TRACE_PARTIAL);
+    emit_disp8_op(p, false, 0xC6, 0, X86_RCX, sizeof(u32));
+    emit8(p, count);
+    emit_disp8_op(p, false, X86_MOV_STORE, X86_RAX, X86_RCX, sizeof(u32) + 1);
+    // add qword [rdx + next], 9; mov dword [rdx + last_word], 0
+    emit_disp8_op(p, true, 0x83, 0, X86_RDX, TRACE_NEXT_OFFSET);
+    emit8(p, 2 * sizeof(u32) + 1);
+    emit_disp8_op(p, false, 0xC7, 0, X86_RDX, TRACE_LAST_WORD_OFFSET);
+    emit32(p, 0);
+    return;
+  }
+
+  // Another execution of a block that is already repeating, which is by far
+  // the most common case since every loop iterates that way.
+  // cmp dword [rdx + last_word], repeated; jne other
+  emit_disp8_op(p, false, 0x81, 7, X86_RDX, TRACE_LAST_WORD_OFFSET);
+  emit32(p, word | TRACE_REPEATED);
+  u8 *other = emit_jcc(p, X86_CC_NE);
+  // mov rsi, [rdx + repeat]; add dword [rsi + 4], 1; jc overflow;
+  // mov [rsi + 8], eax
+  emit_disp8_op(p, true, X86_MOV_LOAD, X86_RSI, X86_RDX, TRACE_REPEAT_OFFSET);
+  emit_disp8_op(p, false, 0x83, 0, X86_RSI, sizeof(u32));
+  emit8(p, 1);
+  u8 *overflow = emit_jcc(p, X86_CC_B);
+  emit_disp8_op(p, false, X86_MOV_STORE, X86_RAX, X86_RSI, 2 * sizeof(u32));
+  u8 *done[2];
+  done[0] = emit_jmp_fixup(p);
+
+  // Undoes the increment and starts over with a new record
+  patch_rel32(overflow, *p);
+  // mov dword [rsi + 4], -1; jmp new
+  emit_disp8_op(p, false, 0xC7, 0, X86_RSI, sizeof(u32));
+  emit32(p, UINT32_MAX);
+  u8 *overflow_new = emit_jmp_fixup(p);
+
+  // The second execution in a row adds a TRACE_REPEATED record.
+  // cmp dword [rdx + last_word], word; jne new
+  patch_rel32(other, *p);
+  emit_disp8_op(p, false, 0x81, 7, X86_RDX, TRACE_LAST_WORD_OFFSET);
+  emit32(p, word);
+  u8 *new_record = emit_jcc(p, X86_CC_NE);
+  // mov rcx, [rdx + next]; mov dword [rcx], repeated;
+  // mov dword [rcx + 4], 1; mov [rcx + 8], eax
+  emit_disp8_op(p, true, X86_MOV_LOAD, X86_RCX, X86_RDX, TRACE_NEXT_OFFSET);
+  emit8(p, 0xC7);
+  emit8(p, 0x01);
+  emit32(p, word | TRACE_REPEATED);
+  emit_disp8_op(p, false, 0xC7, 0, X86_RCX, sizeof(u32));
+  emit32(p, 1);
+  emit_disp8_op(p, false, X86_MOV_STORE, X86_RAX, X86_RCX, 2 * sizeof(u32));
+  // mov [rdx + repeat], rcx; mov dword [rdx + last_word], repeated;
+  // add qword [rdx + next], 12
+  emit_disp8_op(p, true, X86_MOV_STORE, X86_RCX, X86_RDX, TRACE_REPEAT_OFFSET);
+  emit_disp8_op(p, false, 0xC7, 0, X86_RDX, TRACE_LAST_WORD_OFFSET);
+  emit32(p, word | TRACE_REPEATED);
+  emit_disp8_op(p, true, 0x83, 0, X86_RDX, TRACE_NEXT_OFFSET);
+  emit8(p, 3 * sizeof(u32));
+  done[1] = emit_jmp_fixup(p);
+
+  patch_rel32(new_record, *p);
+  patch_rel32(overflow_new, *p);
+  // mov rcx, [rdx + next]; mov dword [rcx], word; mov [rcx + 4], eax
+  emit_disp8_op(p, true, X86_MOV_LOAD, X86_RCX, X86_RDX, TRACE_NEXT_OFFSET);
+  emit8(p, 0xC7);
+  emit8(p, 0x01);
+  emit32(p, word);
+  emit_disp8_op(p, false, X86_MOV_STORE, X86_RAX, X86_RCX, sizeof(u32));
+  // add qword [rdx + next], 8; mov dword [rdx + last_word], word
+  emit_disp8_op(p, true, 0x83, 0, X86_RDX, TRACE_NEXT_OFFSET);
+  emit8(p, 2 * sizeof(u32));
+  emit_disp8_op(p, false, 0xC7, 0, X86_RDX, TRACE_LAST_WORD_OFFSET);
+  emit32(p, word);
+  patch_rel32(done[0], *p);
+  patch_rel32(done[1], *p);
+}
+
+// Returns to the dispatcher without touching cpu->pc
+static void emit_exit(struct Jit *jit, u8 **p) {
+  // xor eax, eax
+  emit8(p, 0x31);
+  emit8(p, 0xC0);
+  emit_jmp(p, jit->epilogue);
+}
+
+// Leaves the block at pc for a target that is known at compile time
+static void emit_chainable_exit(struct Jit *jit, u8 **p, u64 pc, u64 target) {
+  emit_trace_record(jit, p, jit->block->length);
+  if ((pc ^ target) >> PAGE_SHIFT) {
+    emit_store_pc(p, target);
+    emit_exit(jit, p);
+    return;
+  }
+  u8 *site = *p;
+  emit_jmp(p, site + 5);
+  emit_store_pc(p, target);
+  emit_mov_rax_imm64(p, (u64)(uintptr_t)site);
+  emit_jmp(p, jit->epilogue);
+}
+
+static void emit_handler_call(u8 **p, const struct Inst *inst, u64 pc,
+                              u8 **exit_fixups, u32 *num_fixups) {
+  u64 handler;
+  memcpy(&handler, &inst->dispatch.handler, sizeof(handler));
+  emit_store_pc(p, pc);
+  // mov rdi, rbx; mov rsi, rbp; mov rdx, inst
+  emit8(p, REX_W);
+  emit8(p, 0x89);
+  emit8(p, 0xDF);
+  emit8(p, REX_W);
+  emit8(p, 0x89);
+  emit8(p, 0xEE);
+  emit8(p, REX_W);
+  emit8(p, 0xBA);
+  emit64(p, (u64)(uintptr_t)inst);
+  emit_mov_rax_imm64(p, handler);
+  // call rax
+  emit8(p, 0xFF);
+  emit8(p, 0xD0);
+  if (0 == inst->rd) {
+    // mov qword [rbx + x0], 0
+    emit8(p, REX_W);
+    emit8(p, 0xC7);
+    emit8(p, 0x83);
+    emit32(p, REG_OFFSET(0));
+    emit32(p, 0);
+  }
+  // cmp byte [rbx + did_branch], 0; jne exit
+  emit8(p, 0x80);
+  emit8(p, 0xBB);
+  emit32(p, DID_BRANCH_OFFSET);
+  emit8(p, 0);
+  exit_fixups[(*num_fixups)++] = emit_jcc(p, X86_CC_NE);
+}
+
+static void emit_alu_reg(u8 **p, bool wide, u8 opcode, const struct Inst *inst) {
+  emit_load(p, wide, X86_RAX, inst->rs1);
+  emit_mem_op(p, wide, opcode, X86_RAX, REG_OFFSET(inst->rs2));
+  if (!wide) {
+    emit_sext32(p);
+  }
+  emit_store_rax(p, inst->rd);
+}
+
+static void emit_alu_imm(u8 **p, bool wide, u8 opcode, const struct Inst *inst) {
+  emit_load(p, wide, X86_RAX, inst->rs1);
+  emit_imm_op(p, wide, opcode, inst->imm);
+  if (!wide) {
+    emit_sext32(p);
+  }
+  emit_store_rax(p, inst->rd);
+}
+
+static void emit_shift_by_imm(u8 **p, bool wide, u8 digit,
+                              const struct Inst *inst) {
+  emit_load(p, wide, X86_RAX, inst->rs1);
+  emit_shift_imm(p, wide, digit, inst->imm);
+  if (!wide) {
+    emit_sext32(p);
+  }
+  emit_store_rax(p, inst->rd);
+}
+
+static void emit_shift_by_reg32(u8 **p, u8 digit, const struct Inst *inst) {
+  emit_load(p, false, X86_RAX, inst->rs1);
+  emit_load(p, false, X86_RCX, inst->rs2);
+  emit_shift_cl(p, digit);
+  emit_sext32(p);
+  emit_store_rax(p, inst->rd);
+}
+
+static void emit_mul(u8 **p, bool wide, const struct Inst *inst) {
+  emit_load(p, wide, X86_RAX, inst->rs1);
+  // imul rax, [rbx + rs2]
+  if (wide) {
+    emit8(p, REX_W);
+  }
+  emit8(p, 0x0F);
+  emit8(p, 0xAF);
+  emit8(p, 0x80 | (X86_RAX << 3) | 3);
+  emit32(p, REG_OFFSET(inst->rs2));
+  if (!wide) {
+    emit_sext32(p);
+  }
+  emit_store_rax(p, inst->rd);
+}
+
+// High half of the full product of rs1 and rs2
+static void emit_mul_high(u8 **p, u8 digit, const struct Inst *inst) {
+  emit_load(p, true, X86_RAX, inst->rs1);
+  emit_mem_op(p, true, X86_GROUP3, digit, REG_OFFSET(inst->rs2));
+  emit_mem_op(p, true, X86_MOV_STORE, X86_RDX, REG_OFFSET(inst->rd));
+}
+
+static void emit_set_reg(u8 **p, u8 cc, bool use_imm, const struct Inst *inst) {
+  emit_load(p, true, X86_RAX, inst->rs1);
+  if (use_imm) {
+    emit_imm_op(p, true, X86_CMP_IMM, inst->imm);
+  } else {
+    emit_mem_op(p, true, X86_CMP, X86_RAX, REG_OFFSET(inst->rs2));
+  }
+  emit_setcc(p, cc);
+  emit_store_rax(p, inst->rd);
+}
+
+static void emit_branch(struct Jit *jit, u8 **p, u8 cc, const struct Inst *inst,
+                        u64 pc) {
+  emit_load(p, true, X86_RAX, inst->rs1);
+  emit_mem_op(p, true, X86_CMP, X86_RAX, REG_OFFSET(inst->rs2));
+  u8 *taken = emit_jcc(p, cc);
+  emit_chainable_exit(jit, p, pc, pc + inst->length);
+  patch_rel32(taken, *p);
+  emit_chainable_exit(jit, p, pc, pc + (i64)inst->imm);
+}
+
+static bool op_is_alu(u8 op) {
+  switch (op) {
+  case OP_lui:
+  case OP_addi:
+  case OP_slti:
+  case OP_sltiu:
+  case OP_xori:
+  case OP_ori:
+  case OP_andi:
+  case OP_slli:
+  case OP_srli:
+  case OP_srai:
+  case OP_add:
+  case OP_sub:
+  case OP_sltu:
+  case OP_xor:
+  case OP_or:
+  case OP_and:
+  case OP_addiw:
+  case OP_slliw:
+  case OP_srliw:
+  case OP_sraiw:
+  case OP_addw:
+  case OP_subw:
+  case OP_sllw:
+  case OP_srlw:
+  case OP_sraw:
+  case OP_mul:
+  case OP_mulh:
+  case OP_mulhu:
+  case OP_mulw:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// mov reg, [rbp + disp32]
+static void emit_load_mem_field(u8 **p, u8 reg, u32 disp) {
+  emit8(p, REX_W);
+  emit8(p, X86_MOV_LOAD);
+  emit8(p, 0x80 | (reg << 3) | 5);
+  emit32(p, disp);
+}
+
+// shr rdx, PAGE_SHIFT; test byte [rcx + rdx * 4], 1; jnz slow
+static u8 *emit_code_page_check(u8 **p) {
+  emit8(p, REX_W);
+  emit8(p, 0xC1);
+  emit8(p, 0xEA);
+  emit8(p, PAGE_SHIFT);
+  emit8(p, 0xF6);
+  emit8(p, 0x04);
+  emit8(p, 0x91);
+  emit8(p, 0x01);
+  return emit_jcc(p, X86_CC_NE);
+}
+
+// Same fast path as the accessors in mmu.h. Accesses that hit in the data TLB
+// are done inline and everything else, including stores to pages containing
+// code, goes through the handler.
+static bool emit_memory_access(u8 **p, const struct Inst *inst, u64 pc,
+                               u8 **exit_fixups, u32 *num_fixups) {
+  u8 length;
+  switch (inst->op) {
+  case OP_lbu:
+  case OP_sb:
+    length = 1;
+    break;
+  case OP_sh:
+    length = 2;
+    break;
+  case OP_lw:
+  case OP_sw:
+    length = 4;
+    break;
+  case OP_ld:
+  case OP_sd:
+    length = 8;
+    break;
+  default:
+    return false;
+  }
+  const bool is_store = (OP_sb == inst->op || OP_sh == inst->op ||
+                         OP_sw == inst->op || OP_sd == inst->op);
+  if (!is_store && 0 == inst->rd) {
+    // Loads into x0 are left to the handler
+    return false;
+  }
+
+  u8 *slow[2];
+  u32 num_slow = 0;
+
+  emit_load(p, true, X86_RAX, inst->rs1);
+  emit_imm_op(p, true, X86_ADD_IMM, inst->imm);
+  // rdx = &cpu->mmu.data[(rax >> PAGE_SHIFT) & (TLB_SIZE - 1)]
+  // mov rdx, rax; shr rdx, PAGE_SHIFT; and edx, TLB_SIZE - 1;
+  // shl edx, TLB_ENTRY_SHIFT; add rdx, [rbx + data]
+  emit8(p, REX_W);
+  emit8(p, 0x89);
+  emit8(p, 0xC2);
+  emit8(p, REX_W);
+  emit8(p, 0xC1);
+  emit8(p, 0xEA);
+  emit8(p, PAGE_SHIFT);
+  emit8(p, 0x81);
+  emit8(p, 0xE2);
+  emit32(p, TLB_SIZE - 1);
+  emit8(p, 0xC1);
+  emit8(p, 0xE2);
+  emit8(p, TLB_ENTRY_SHIFT);
+  emit_mem_op(p, true, X86_ADD, X86_RDX, DATA_TLB_OFFSET);
+  // mov rcx, rax; and rcx, TLB_MASK; cmp rcx, [rdx + tag]; jne slow
+  emit8(p, REX_W);
+  emit8(p, 0x89);
+  emit8(p, 0xC1);
+  emit8(p, REX_W);
+  emit8(p, 0x81);
+  emit8(p, 0xE1);
+  emit32(p, (u32)TLB_MASK(length));
+  emit8(p, REX_W);
+  emit8(p, X86_CMP);
+  emit8(p, 0x4A);
+  emit8(p, TLB_TAG_OFFSET(is_store ? ACCESS_WRITE : ACCESS_READ));
+  slow[num_slow++] = emit_jcc(p, X86_CC_NE);
+  // add rax, [rdx + addend]
+  emit8(p, REX_W);
+  emit8(p, X86_ADD);
+  emit8(p, 0x42);
+  emit8(p, TLB_ADDEND_OFFSET);
+
+  if (is_store) {
+    // An aligned access never crosses into the next page, so only the page
+    // of rax - mem->ram has to be checked.
+    // mov rdx, rax; sub rdx, [rbp + ram]
+    emit8(p, REX_W);
+    emit8(p, 0x89);
+    emit8(p, 0xC2);
+    emit8(p, REX_W);
+    emit8(p, X86_SUB);
+    emit8(p, 0x95);
+    emit32(p, RAM_OFFSET);
+    emit_load_mem_field(p, X86_RCX, CODE_GEN_OFFSET);
+    slow[num_slow++] = emit_code_page_check(p);
+  }
+
+  switch (inst->op) {
+  case OP_lbu:
+    // movzx eax, byte [rax]
+    emit8(p, 0x0F);
+    emit8(p, 0xB6);
+    emit8(p, 0x00);
+    break;
+  case OP_lw:
+    // movsxd rax, dword [rax]
+    emit8(p, REX_W);
+    emit8(p, 0x63);
+    emit8(p, 0x00);
+    break;
+  case OP_ld:
+    // mov rax, [rax]
+    emit8(p, REX_W);
+    emit8(p, 0x8B);
+    emit8(p, 0x00);
+    break;
+  default:
+    // mov rdx, [rbx + rs2]; mov [rax], dl/dx/edx/rdx
+    emit_load(p, true, X86_RDX, inst->rs2);
+    if (2 == length) {
+      emit8(p, 0x66);
+    } else if (8 == length) {
+      emit8(p, REX_W);
+    }
+    emit8(p, (1 == length) ? 0x88 : 0x89);
+    emit8(p, 0x10);
+    break;
+  }
+  if (!is_store) {
+    emit_store_rax(p, inst->rd);
+  }
+  // jmp done
+  emit8(p, 0xE9);
+  u8 *done = *p;
+  emit32(p, 0);
+
+  for (u32 i = 0; i < num_slow; i++) {
+    patch_rel32(slow[i], *p);
+  }
+  emit_handler_call(p, inst, pc, exit_fixups, num_fixups);
+  patch_rel32(done, *p);
+  return true;
+}
+
+// Returns false if the instruction has to be executed through its handler
+static bool emit_native(struct Jit *jit, u8 **p, const struct Inst *inst,
+                        u64 pc) {
+  // Without side effects a write to x0 is a no-op
+  if (0 == inst->rd && op_is_alu(inst->op)) {
+    return true;
+  }
+
+  switch (inst->op) {
+  case OP_lui:
+    // mov rax, simm32
+    emit8(p, REX_W);
+    emit8(p, 0xC7);
+    emit8(p, 0xC0);
+    emit32(p, inst->imm);
+    emit_store_rax(p, inst->rd);
+    return true;
+  case OP_addi:
+    emit_alu_imm(p, true, X86_ADD_IMM, inst);
+    return true;
+  case OP_xori:
+    emit_alu_imm(p, true, X86_XOR_IMM, inst);
+    return true;
+  case OP_ori:
+    emit_alu_imm(p, true, X86_OR_IMM, inst);
+    return true;
+  case OP_andi:
+    emit_alu_imm(p, true, X86_AND_IMM, inst);
+    return true;
+  case OP_slti:
+    emit_set_reg(p, X86_CC_L, true, inst);
+    return true;
+  case OP_sltiu:
+    emit_set_reg(p, X86_CC_B, true, inst);
+    return true;
+  case OP_slli:
+    emit_shift_by_imm(p, true, X86_SHL, inst);
+    return true;
+  case OP_srli:
+    emit_shift_by_imm(p, true, X86_SHR, inst);
+    return true;
+  case OP_srai:
+    emit_shift_by_imm(p, true, X86_SAR, inst);
+    return true;
+  case OP_add:
+    emit_alu_reg(p, true, X86_ADD, inst);
+    return true;
+  case OP_sub:
+    emit_alu_reg(p, true, X86_SUB, inst);
+    return true;
+  case OP_xor:
+    emit_alu_reg(p, true, X86_XOR, inst);
+    return true;
+  case OP_or:
+    emit_alu_reg(p, true, X86_OR, inst);
+    return true;
+  case OP_and:
+    emit_alu_reg(p, true, X86_AND, inst);
+    return true;
+  case OP_sltu:
+    emit_set_reg(p, X86_CC_B, false, inst);
+    return true;
+  case OP_addiw:
+    emit_alu_imm(p, false, X86_ADD_IMM, inst);
+    return true;
+  case OP_slliw:
+    emit_shift_by_imm(p, false, X86_SHL, inst);
+    return true;
+  case OP_srliw:
+    emit_shift_by_imm(p, false, X86_SHR, inst);
+    return true;
+  case OP_sraiw:
+    emit_shift_by_imm(p, false, X86_SAR, inst);
+    return true;
+  case OP_addw:
+    emit_alu_reg(p, false, X86_ADD, inst);
+    return true;
+  case OP_subw:
+    emit_alu_reg(p, false, X86_SUB, inst);
+    return true;
+  case OP_sllw:
+    emit_shift_by_reg32(p, X86_SHL, inst);
+    return true;
+  case OP_srlw:
+    emit_shift_by_reg32(p, X86_SHR, inst);
+    return true;
+  case OP_sraw:
+    emit_shift_by_reg32(p, X86_SAR, inst);
+    return true;
+  case OP_mul:
+    emit_mul(p, true, inst);
+    return true;
+  case OP_mulw:
+    emit_mul(p, false, inst);
+    return true;
+  case OP_mulh:
+    emit_mul_high(p, X86_IMUL, inst);
+    return true;
+  case OP_mulhu:
+    emit_mul_high(p, X86_MUL, inst);
+    return true;
+  case OP_jal:
+    if (0 != inst->rd) {
+      emit_mov_rax_imm64(p, pc + inst->length);
+      emit_store_rax(p, inst->rd);
+    }
+    emit_chainable_exit(jit, p, pc, pc + (i64)inst->imm);
+    return true;
+  case OP_jalr:
+    emit_load(p, true, X86_RAX, inst->rs1);
+    emit_imm_op(p, true, X86_ADD_IMM, inst->imm);
+    // and rax, ~1
+    emit8(p, REX_W);
+    emit8(p, 0x83);
+    emit8(p, 0xE0);
+    emit8(p, 0xFE);
+    emit_mem_op(p, true, X86_MOV_STORE, X86_RAX, PC_OFFSET);
+    if (0 != inst->rd) {
+      emit_mov_rax_imm64(p, pc + inst->length);
+      emit_store_rax(p, inst->rd);
+    }
+    emit_trace_record(jit, p, jit->block->length);
+    emit_exit(jit, p);
+    return true;
+  case OP_beq:
+    emit_branch(jit, p, X86_CC_E, inst, pc);
+    return true;
+  case OP_bne:
+    emit_branch(jit, p, X86_CC_NE, inst, pc);
+    return true;
+  case OP_bge:
+    emit_branch(jit, p, X86_CC_GE, inst, pc);
+    return true;
+  case OP_bltu:
+    emit_branch(jit, p, X86_CC_B, inst, pc);
+    return true;
+  case OP_bgeu:
+    emit_branch(jit, p, X86_CC_AE, inst, pc);
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void jit_flush(struct Jit *jit, struct TCache *cache) {
+  jit->used = (jit->trampoline_size + 15) & ~(u64)15;
+  for (int i = 0; i < TCACHE_SIZE; i++) {
+    cache->blocks[i].native = NULL;
+  }
+}
+
+bool jit_init(struct Jit *jit) {
+  jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == jit->buffer) {
+    perror("mmap");
+    return false;
+  }
+  u8 *p = jit->buffer;
+  jit->enter = p;
+  emit8(&p, 0x53); // push rbx
+  emit8(&p, 0x55); // push rbp
+  // sub rsp, 8 to keep the stack aligned for calls to handlers
+  emit8(&p, REX_W);
+  emit8(&p, 0x83);
+  emit8(&p, 0xEC);
+  emit8(&p, 0x08);
+  // mov rbx, rdi; mov rbp, rsi; jmp rdx
+  emit8(&p, REX_W);
+  emit8(&p, 0x89);
+  emit8(&p, 0xFB);
+  emit8(&p, REX_W);
+  emit8(&p, 0x89);
+  emit8(&p, 0xF5);
+  emit8(&p, 0xFF);
+  emit8(&p, 0xE2);
+
+  jit->epilogue = p;
+  // add rsp, 8
+  emit8(&p, REX_W);
+  emit8(&p, 0x83);
+  emit8(&p, 0xC4);
+  emit8(&p, 0x08);
+  emit8(&p, 0x5D); // pop rbp
+  emit8(&p, 0x5B); // pop rbx
+  emit8(&p, 0xC3); // ret
+
+  jit->trampoline_size = p - jit->buffer;
+  jit->used = jit->trampoline_size;
+  return true;
+}
+
+void jit_destroy(struct Jit *jit) {
+  munmap(jit->buffer, JIT_BUFFER_SIZE);
+}
+
+bool jit_compile(struct Jit *jit, struct TCache *cache, struct Memory *mem,
+                 struct Block *block) {
+  for (u32 i = 0; i < block->length; i++) {
+    const struct Inst *inst = &block->insts[i];
+    if (OP_illegal == inst->op) {
+      return false;
+    }
+  }
+
+  // Keep the records aligned
+  jit->used = (jit->used + 15) & ~(u64)15;
+  if (JIT_BUFFER_SIZE - jit->used < JIT_MAX_BLOCK_SIZE) {
+    jit_flush(jit, cache);
+  }
+
+  // The instructions executed through their handlers need a copy of their
+  // record that lives as long as the code.
+  struct Inst *records = (struct Inst *)(jit->buffer + jit->used);
+  memcpy(records, block->insts, block->length * sizeof(struct Inst));
+  u8 *const native = (u8 *)(records + block->length);
+  u8 *p = native;
+
+  u8 *exit_fixups[BLOCK_MAX_LENGTH];
+  // Number of instructions executed when leaving through the fixup
+  u32 fixup_counts[BLOCK_MAX_LENGTH];
+  u32 num_fixups = 0;
+  jit->trace = cache->trace;
+  jit->block = block;
+
+  // mov rax, &code_gen; cmp dword [rax], gen; jne stale
+  emit_mov_rax_imm64(&p,
+                     (u64)(uintptr_t)memory_code_gen_ptr(mem, block->physical));
+  emit8(&p, 0x81);
+  emit8(&p, 0x38);
+  emit32(&p, block->code_gen);
+  u8 *stale = emit_jcc(&p, X86_CC_NE);
+
+  // cmp byte [rbp + halted], 0; jne stale
+  emit8(&p, 0x80);
+  emit8(&p, 0xBD);
+  emit32(&p, HALTED_OFFSET);
+  emit8(&p, 0);
+  u8 *halted = emit_jcc(&p, X86_CC_NE);
+  u8 *full = NULL;
+  if (jit->trace) {
+    // mov rdx, trace; mov rax, [rdx + next]; cmp rax, [rdx + end]; jae stale
+    emit_trace_address(jit, &p);
+    emit_disp8_op(&p, true, X86_MOV_LOAD, X86_RAX, X86_RDX, TRACE_NEXT_OFFSET);
+    emit_disp8_op(&p, true, X86_CMP, X86_RAX, X86_RDX, TRACE_END_OFFSET);
+    full = emit_jcc(&p, X86_CC_AE);
+  }
+  // mov rax, [instret]; cmp rax, [instret_stop]; jae stale
+  // add rax, length; mov [instret], rax
+  emit_mem_op(&p, true, X86_MOV_LOAD, X86_RAX, INSTRET_OFFSET);
+  emit_mem_op(&p, true, X86_CMP, X86_RAX, INSTRET_STOP_OFFSET);
+  u8 *limit = emit_jcc(&p, X86_CC_AE);
+  emit_imm_op(&p, true, X86_ADD_IMM, block->length);
+  emit_mem_op(&p, true, X86_MOV_STORE, X86_RAX, INSTRET_OFFSET);
+
+  u64 pc = block->pc;
+  bool ended = false;
+  for (u32 i = 0; i < block->length; i++) {
+    const struct Inst *inst = &records[i];
+    const u8 *start = p;
+    u32 first_fixup = num_fixups;
+    bool native = emit_native(jit, &p, inst, pc);
+    if (!native &&
+        !emit_memory_access(&p, inst, pc, exit_fixups, &num_fixups)) {
+      emit_handler_call(&p, inst, pc, exit_fixups, &num_fixups);
+    }
+    // A branch that did not trap has been executed
+    for (u32 j = first_fixup; j < num_fixups; j++) {
+      fixup_counts[j] = i + op_is_branch[inst->op];
+    }
+    // Anything larger would run past the end of the buffer. Branches append
+    // up to two trace records.
+    assert(p - start <=
+           JIT_MAX_INST_SIZE + (jit->trace ? 2 * JIT_MAX_TRACE_SIZE : 0));
+    pc += inst->length;
+    if (op_is_branch[inst->op]) {
+      // Branches emitted natively leave the block themselves, the ones
+      // implemented by a handler fall through if they did not branch.
+      ended = native;
+      break;
+    }
+  }
+  if (!ended) {
+    emit_chainable_exit(jit, &p, block->pc, pc);
+  }
+
+  // Leaves without running the block, the dispatcher takes it from here
+  patch_rel32(stale, p);
+  patch_rel32(limit, p);
+  patch_rel32(halted, p);
+  if (full) {
+    patch_rel32(full, p);
+  }
+  emit_store_pc(&p, block->pc);
+  emit_exit(jit, &p);
+
+  if (jit->trace) {
+    // Every exit has its own record
+    for (u32 i = 0; i < num_fixups; i++) {
+      patch_rel32(exit_fixups[i], p);
+      emit_trace_record(jit, &p, fixup_counts[i]);
+      emit_exit(jit, &p);
+    }
+  } else if (num_fixups > 0) {
+    u8 *exit = p;
+    emit_exit(jit, &p);
+    for (u32 i = 0; i < num_fixups; i++) {
+      patch_rel32(exit_fixups[i], exit);
+    }
+  }
+
+  assert((u64)(p - jit->buffer) - jit->used <= JIT_MAX_BLOCK_SIZE);
+  jit->used = p - jit->buffer;
+  block->native = native;
+  return true;
+}
+
+u8 *jit_run(struct Jit *jit, struct CPU *cpu, struct Memory *mem,
+            const u8 *native) {
+  u8 *(*enter)(struct CPU *, struct Memory *, const u8 *);
+  memcpy(&enter, &jit->enter, sizeof(enter));
+  return enter(cpu, mem, native);
+}
+
+void jit_chain(u8 *exit, const u8 *native) {
+  patch_rel32(exit + 1, native);
+}
+
+#else
+
+bool jit_init(struct Jit *jit) {
+  (void)jit;
+  fprintf(stderr, "The JIT is only supported on x86-64\n");
+  return false;
+}
+
+void jit_destroy(struct Jit *jit) {
+  (void)jit;
+}
+
+bool jit_compile(struct Jit *jit, struct TCache *cache, struct Memory *mem,
+                 struct Block *block) {
+  (void)jit;
+  (void)cache;
+  (void)mem;
+  (void)block;
+  return false;
+}
+
+u8 *jit_run(struct Jit *jit, struct CPU *cpu, struct Memory *mem,
+            const u8 *native) {
+  (void)jit;
+  (void)cpu;
+  (void)mem;
+  (void)native;
+  return NULL;
+}
+
+void jit_chain(u8 *exit, const u8 *native) {
+  (void)exit;
+  (void)native;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef JIT_H
+#define JIT_H
+#include "cpu.h"
+#include "mmu.h"
+#include "tcache.h"
+#include "types.h"
+#include <stdbool.h>
+
+// Number of times a block is interpreted before it gets compiled
+#define JIT_THRESHOLD 64
+#define JIT_BUFFER_SIZE (16 << 20)
+
+struct Jit {
+  u8 *buffer;
+  u64 used;
+  // Common entry and exit code at the start of the buffer
+  u8 *enter;
+  u8 *epilogue;
+  u64 trampoline_size;
+  // Set by jit_compile() for the emitters, the trace of the cache if there is
+  // one and the block being compiled
+  struct Trace *trace;
+  const struct Block *block;
+};
+
+bool jit_init(struct Jit *jit);
+void jit_destroy(struct Jit *jit);
+
+// Compiles the block and sets block->native on success. Blocks containing
+// instructions the JIT can not handle are left to the interpreter.
+bool jit_compile(struct Jit *jit, struct TCache *cache, struct Memory *mem,
+                 struct Block *block);
+
+// Runs native code until it exits back to the dispatcher. Returns the exit
+// that was taken if it can be chained to the block at the new cpu->pc, NULL
+// otherwise.
+u8 *jit_run(struct Jit *jit, struct CPU *cpu, struct Memory *mem,
+            const u8 *native);
+
+// Patches the exit to jump directly to the native code of the next block.
+void jit_chain(u8 *exit, const u8 *native);
+#endif // JIT_H
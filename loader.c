@@ -0,0 +1,294 @@
+// Loads guest images into RAM. Instead of copying the image, every whole page
+// of a segment is mapped privately from the file on top of the RAM mapping,
+// so pages are only read in when the guest touches them and writes by the
+// guest never reach the file. Only the partial pages at the edges of a
+// segment are copied, and the BSS is left to memory_zero().
+#include "loader.h"
+#include "mmu.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uintptr_t align_down(uintptr_t value, uintptr_t alignment) {
+  return value & ~(alignment - 1);
+}
+
+static uintptr_t align_up(uintptr_t value, uintptr_t alignment) {
+  return align_down(value + alignment - 1, alignment);
+}
+
+static bool read_exact(int fd, void *buffer, u64 length, u64 offset) {
+  u8 *out = buffer;
+  while (length > 0) {
+    ssize_t rc = pread(fd, out, length, offset);
+    if (-1 == rc) {
+      perror("pread");
+      return false;
+    }
+    if (0 == rc) {
+      fprintf(stderr, "Unexpected end of file\n");
+      return false;
+    }
+    out += rc;
+    offset += rc;
+    length -= rc;
+  }
+  return true;
+}
+
+// Places file_size bytes of the file at guest physical address followed by
+// memory_size - file_size zero bytes.
+static bool map_segment(int fd, struct Memory *mem, u64 address, u64 offset,
+                        u64 file_size, u64 memory_size) {
+  if (file_size > memory_size || !ram_contains(mem, address, memory_size)) {
+    fprintf(stderr, "Segment at %lx of %lu bytes does not fit in RAM\n",
+            address, memory_size);
+    return false;
+  }
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)(mem->ram + (address - mem->ram_base));
+  uintptr_t file_end = start + file_size;
+  // The file can only be mapped if the segment has the same offset into a
+  // page in the file as in RAM. Huge pages from hugetlbfs can not be partially
+  // replaced by file pages.
+  uintptr_t map_start = file_end;
+  uintptr_t map_end = file_end;
+  if (RAM_PAGES_HUGETLB != mem->pages && start % page == offset % page) {
+    map_start = align_up(start, page);
+    map_end = align_down(file_end, page);
+    if (map_start >= map_end) {
+      map_start = map_end = file_end;
+    }
+  }
+  if (map_start != map_end &&
+      MAP_FAILED == mmap((void *)map_start, map_end - map_start,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                         offset + (map_start - start))) {
+    perror("mmap");
+    return false;
+  }
+  if (map_start != map_end) {
+    mem->file_backed = true;
+  }
+  if (!read_exact(fd, (void *)start, map_start - start, offset) ||
+      !read_exact(fd, (void *)map_end, file_end - map_end,
+                  offset + (map_end - start))) {
+    return false;
+  }
+  memory_mark_dirty(mem, address, file_size);
+  memory_zero(mem, address + file_size, memory_size - file_size);
+  return true;
+}
+
+static bool load_elf(int fd, struct Memory *mem, u64 *entry) {
+  Elf64_Ehdr header;
+  if (!read_exact(fd, &header, sizeof(header), 0)) {
+    return false;
+  }
+  if (ELFCLASS64 != header.e_ident[EI_CLASS] ||
+      ELFDATA2LSB != header.e_ident[EI_DATA] ||
+      EM_RISCV != header.e_machine) {
+    fprintf(stderr, "Not a little endian RV64 ELF file\n");
+    return false;
+  }
+  if (ET_EXEC != header.e_type ||
+      sizeof(Elf64_Phdr) != header.e_phentsize) {
+    fprintf(stderr, "Unsupported ELF file\n");
+    return false;
+  }
+  Elf64_Phdr *headers = calloc(header.e_phnum, sizeof(Elf64_Phdr));
+  if (!headers) {
+    perror("calloc");
+    return false;
+  }
+  bool ok = read_exact(fd, headers, header.e_phnum * sizeof(Elf64_Phdr),
+                       header.e_phoff);
+  for (u32 i = 0; ok && i < header.e_phnum; i++) {
+    const Elf64_Phdr *segment = &headers[i];
+    if (PT_LOAD != segment->p_type || 0 == segment->p_memsz) {
+      continue;
+    }
+    // There is no address translation yet, so segments are placed at their
+    // physical address.
+    ok = map_segment(fd, mem, segment->p_paddr, segment->p_offset,
+                     segment->p_filesz, segment->p_memsz);
+  }
+  free(headers);
+  *entry = header.e_entry;
+  return ok;
+}
+
+static bool load_flat(int fd, struct Memory *mem, u64 *entry) {
+  struct stat st;
+  if (-1 == fstat(fd, &st)) {
+    perror("fstat");
+    return false;
+  }
+  *entry = mem->ram_base + FLAT_LOAD_OFFSET;
+  return map_segment(fd, mem, *entry, 0, st.st_size, st.st_size);
+}
+
+bool load_image(const char *path, struct Memory *mem, u64 *entry) {
+  int fd = open(path, O_RDONLY);
+  if (-1 == fd) {
+    perror("open");
+    return false;
+  }
+  u8 magic[SELFMAG];
+  ssize_t rc = pread(fd, magic, sizeof(magic), 0);
+  bool ok;
+  if (-1 == rc) {
+    perror("pread");
+    ok = false;
+  } else if (SELFMAG == rc && 0 == memcmp(magic, ELFMAG, SELFMAG)) {
+    ok = load_elf(fd, mem, entry);
+  } else {
+    ok = load_flat(fd, mem, entry);
+  }
+  // The mappings keep their own reference to the file
+  if (-1 == close(fd)) {
+    perror("close");
+    return false;
+  }
+  return ok;
+}
+
+static int compare_symbols(const void *a, const void *b) {
+  const struct Symbol *left = a;
+  const struct Symbol *right = b;
+  return left->address < right->address ? -1 : left->address > right->address;
+}
+
+// Only named symbols of code and labels are kept. Mapping symbols like $x and
+// local labels of the assembler would hide the function they are in.
+static bool keep_symbol(const Elf64_Sym *symbol, u64 strings_size,
+                        const char *strings) {
+  u8 type = ELF64_ST_TYPE(symbol->st_info);
+  if ((STT_FUNC != type && STT_NOTYPE != type) ||
+      SHN_UNDEF == symbol->st_shndx || symbol->st_shndx >= SHN_LORESERVE ||
+      0 == symbol->st_name || symbol->st_name >= strings_size) {
+    return false;
+  }
+  const char *name = strings + symbol->st_name;
+  return '$' != name[0] && 0 != strncmp(name, ".L", 2);
+}
+
+static bool read_symbols(int fd, struct SymbolTable *table) {
+  Elf64_Ehdr header;
+  if (!read_exact(fd, &header, sizeof(header), 0)) {
+    return false;
+  }
+  if (0 == header.e_shnum || sizeof(Elf64_Shdr) != header.e_shentsize) {
+    return true;
+  }
+  Elf64_Shdr *sections = calloc(header.e_shnum, sizeof(Elf64_Shdr));
+  if (!sections) {
+    perror("calloc");
+    return false;
+  }
+  bool ok = read_exact(fd, sections, header.e_shnum * sizeof(Elf64_Shdr),
+                       header.e_shoff);
+  const Elf64_Shdr *symtab = NULL;
+  for (u32 i = 0; ok && i < header.e_shnum; i++) {
+    if (SHT_SYMTAB == sections[i].sh_type &&
+        sections[i].sh_link < header.e_shnum) {
+      symtab = &sections[i];
+      break;
+    }
+  }
+  Elf64_Sym *symbols = NULL;
+  if (ok && symtab) {
+    const Elf64_Shdr *strtab = &sections[symtab->sh_link];
+    u64 count = symtab->sh_size / sizeof(Elf64_Sym);
+    symbols = calloc(count, sizeof(Elf64_Sym));
+    // Terminate the last string even if the file does not
+    table->strings = calloc(strtab->sh_size + 1, 1);
+    table->symbols = calloc(count, sizeof(struct Symbol));
+    if (!symbols || !table->strings || !table->symbols) {
+      perror("calloc");
+      ok = false;
+    }
+    ok = ok &&
+         read_exact(fd, symbols, count * sizeof(Elf64_Sym),
+                    symtab->sh_offset) &&
+         read_exact(fd, table->strings, strtab->sh_size, strtab->sh_offset);
+    for (u64 i = 0; ok && i < count; i++) {
+      if (keep_symbol(&symbols[i], strtab->sh_size, table->strings)) {
+        struct Symbol *symbol = &table->symbols[table->count++];
+        symbol->address = symbols[i].st_value;
+        symbol->size = symbols[i].st_size;
+        symbol->name = table->strings + symbols[i].st_name;
+      }
+    }
+    qsort(table->symbols, table->count, sizeof(struct Symbol),
+          compare_symbols);
+  }
+  free(symbols);
+  free(sections);
+  return ok;
+}
+
+bool load_symbols(const char *path, struct SymbolTable *table) {
+  table->symbols = NULL;
+  table->count = 0;
+  table->strings = NULL;
+  int fd = open(path, O_RDONLY);
+  if (-1 == fd) {
+    perror("open");
+    return false;
+  }
+  u8 magic[SELFMAG];
+  ssize_t rc = pread(fd, magic, sizeof(magic), 0);
+  bool ok = true;
+  if (-1 == rc) {
+    perror("pread");
+    ok = false;
+  } else if (SELFMAG == rc && 0 == memcmp(magic, ELFMAG, SELFMAG)) {
+    ok = read_symbols(fd, table);
+  }
+  if (-1 == close(fd)) {
+    perror("close");
+    ok = false;
+  }
+  if (!ok) {
+    symbols_destroy(table);
+  }
+  return ok;
+}
+
+void symbols_destroy(struct SymbolTable *table) {
+  free(table->symbols);
+  free(table->strings);
+  table->symbols = NULL;
+  table->count = 0;
+  table->strings = NULL;
+}
+
+const struct Symbol *symbol_lookup(const struct SymbolTable *table,
+                                   u64 address) {
+  // Find the last symbol at or below the address
+  u64 low = 0;
+  u64 high = table->count;
+  while (low < high) {
+    u64 middle = low + (high - low) / 2;
+    if (table->symbols[middle].address <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (0 == low) {
+    return NULL;
+  }
+  const struct Symbol *symbol = &table->symbols[low - 1];
+  if (0 != symbol->size && address - symbol->address >= symbol->size) {
+    return NULL;
+  }
+  return symbol;
+}
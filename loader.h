@@ -0,0 +1,36 @@
+#ifndef LOADER_H
+#define LOADER_H
+#include "mmu.h"
+#include "types.h"
+#include <stdbool.h>
+
+// Images that are not ELF files are loaded this far into RAM and started at
+// their first byte.
+#define FLAT_LOAD_OFFSET 0x1000
+
+// Loads an ELF64 or flat image into RAM and sets the entry point. Page
+// aligned parts of the image are mapped from the file instead of copied.
+bool load_image(const char *path, struct Memory *mem, u64 *entry);
+
+struct Symbol {
+  u64 address;
+  // Zero if unknown, the symbol then extends to the next one
+  u64 size;
+  const char *name;
+};
+
+// Code symbols of an image sorted by address
+struct SymbolTable {
+  struct Symbol *symbols;
+  u64 count;
+  char *strings;
+};
+
+// Reads the symbol table of an ELF image. Images without one, including flat
+// images, give an empty table.
+bool load_symbols(const char *path, struct SymbolTable *table);
+void symbols_destroy(struct SymbolTable *table);
+// Returns the symbol containing the address or NULL
+const struct Symbol *symbol_lookup(const struct SymbolTable *table,
+                                   u64 address);
+#endif // LOADER_H
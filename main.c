@@ -1,876 +1,877 @@
+#include "clint.h"
+#include "cpu.h"
+#include "csr.h"
+#include "finisher.h"
+#include "gdb.h"
+#include "loader.h"
 #include "mmu.h"
+#include "plic.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "tcache.h"
+#include "trace.h"
 #include "types.h"
+#include "uart.h"
+#include "virtio.h"
+#include "virtio_blk.h"
+#include "virtio_net.h"
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-#define RD_REGISTER                                                            \
-  const u8 num_rd = (inst >> 7) & 0x1F;                                        \
-  u64 zero_tmp;                                                                \
-  u64 *_rd;                                                                    \
-  if (0 == num_rd) {                                                           \
-    _rd = &zero_tmp;                                                           \
-  } else {                                                                     \
-    _rd = &cpu->registers[num_rd];                                             \
-  }                                                                            \
-  u64 *const rd = _rd;                                                         \
-  (void)zero_tmp;                                                              \
-  (void)rd;
-
-#define RS1_REGISTER                                                           \
-  const u8 num_rs1 = (inst >> 15) & 0x1F;                                      \
-  const u64 *const rs1 = &cpu->registers[num_rs1];                             \
-  (void)rs1;
-
-#define RS2_REGISTER                                                           \
-  const u8 num_rs2 = (inst >> 20) & 0x1F;                                      \
-  const u64 *const rs2 = &cpu->registers[num_rs2];                             \
-  (void)rs2;
-
-#define R_TYPE_DEF                                                             \
-  const u8 funct3 = (inst >> 12) & 0x7;                                        \
-  const u8 funct7 = (inst >> 25);                                              \
-  RD_REGISTER;                                                                 \
-  RS1_REGISTER;                                                                \
-  RS2_REGISTER;                                                                \
-  (void)funct3;                                                                \
-  (void)funct7;
-
-#define I_TYPE_DEF                                                             \
-  const u32 imm = (inst >> 20);                                                \
-  const u8 funct3 = (inst >> 12) & 0x7;                                        \
-  RD_REGISTER;                                                                 \
-  RS1_REGISTER;                                                                \
-  (void)imm;                                                                   \
-  (void)funct3;
-
-#define U_TYPE_DEF                                                             \
-  const u32 imm = inst & ~(0x1000 - 1);                                        \
-  RD_REGISTER;                                                                 \
-  (void)imm;
-
-#define B_TYPE_DEF                                                             \
-  const u32 imm = ((inst & 0xf00) >> 7) | ((inst & 0x7e000000) >> 20) |        \
-                  ((inst & 0x80) << 4) | ((inst >> 31) << 12);                 \
-  const u8 funct3 = (inst >> 12) & 0x7;                                        \
-  RS1_REGISTER;                                                                \
-  RS2_REGISTER;                                                                \
-  (void)funct3;                                                                \
-  (void)imm;
-
-#define J_TYPE_DEF                                                             \
-  u32 _dont_use = 0;                                                           \
-  _dont_use |= (inst & (0x1 << 31));                                           \
-  _dont_use |= (inst & (0xFF << 12)) << 11;                                    \
-  _dont_use |= (inst & (0x1 << 20)) << 2;                                      \
-  _dont_use |= (inst & (0x3FF << 21)) >> 9;                                    \
-  _dont_use = ((i32)_dont_use) >> 11;                                          \
-  const u32 imm = _dont_use;                                                   \
-  RD_REGISTER;                                                                 \
-  (void)imm;
-
-#define S_TYPE_DEF                                                             \
-  const u32 imm = ((inst >> 7) & 0x1F) | ((inst >> 25) << 5);                  \
-  const u8 funct3 = (inst >> 12) & 0x7;                                        \
-  RS1_REGISTER;                                                                \
-  RS2_REGISTER;                                                                \
-  (void)imm;                                                                   \
-  (void)funct3;
-
-i32 sign_extend(u32 n, u8 len) {
-  n &= ~(0xFFFFFFFF << (len + 1));
-  if (n & (1 << len)) {
-    n |= 0xFFFFFFFF << len;
-  }
-  return (i32)n;
+static struct Uart uart;
+static struct Clint clint;
+static struct Plic plic;
+static struct VirtioBlk blk;
+static bool has_disk;
+static struct VirtioNet net;
+static bool has_net;
+static struct Gdb gdb;
+// One profile per hart if profiling is enabled
+static struct Profile *profiles;
+static u64 num_profiles;
+static struct SymbolTable symbols;
+// One trace per hart if tracing is enabled
+static struct Trace *traces;
+static u64 num_traces;
+
+static void report_profile(void) {
+  if (profiles) {
+    profile_report(profiles, num_profiles, &symbols, stderr);
+  }
 }
 
-struct CPU {
-  u64 registers[32];
-  u64 pc;
-  bool did_branch;
+// Guest errors end in an assert, make sure that the output of the guest up
+// to that point and the traces are not lost. Other harts may still be running
+// or hold the UART locks, so only raw writes of what is already buffered are
+// safe here, and the profile is not reported.
+static void flush_on_abort(int signal_number) {
+  uart_flush_on_signal(&uart);
+  for (u64 i = 0; i < num_traces; i++) {
+    trace_flush(&traces[i]);
+  }
+  signal(signal_number, SIG_DFL);
+  raise(signal_number);
+}
+
+// Exit status when the guest did not exit by itself, the same as timeout(1)
+#define EXIT_INSTRUCTION_LIMIT 124
+
+// Everything a hart thread needs to run
+struct Hart {
+  struct CPU *cpu;
+  // All harts of the machine
+  struct CPU *cpus;
+  u64 num_harts;
+  struct Memory *mem;
+  enum Engine engine;
+  struct Profile *profile;
+  struct Trace *trace;
+  // Kept across the jobs of a fork server, NULL otherwise
+  struct CpuCache *cache;
+  pthread_t thread;
 };
 
-static void inst_slli(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  u64 to_shift = *rs1;
-  u8 shift_amount = imm & 0x3F;
-  u64 result = to_shift << shift_amount;
-  *rd = result;
-#ifdef DEBUG
-  printf("%lx: slli x%d,x%d,%d\n", cpu->pc, rd, rs1, shift_amount);
-#endif
-}
-
-static void inst_addi(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  i32 b = sign_extend(imm, 11);
-  *rd = (i64)*rs1 + b;
-#ifdef DEBUG
-  printf("%lx: addi x%d,x%d,%d\n", cpu->pc, rd, rs1, b);
-#endif
-}
-
-static void inst_slti(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  if ((i64)*rs1 < (i64)sign_extend(imm, 11)) {
-    *rd = 1;
-  } else {
-    *rd = 0;
+static void *run_hart(void *opaque) {
+  struct Hart *hart = opaque;
+  cpu_loop(hart->cpu, hart->mem, hart->engine, hart->profile, hart->trace,
+           hart->cache);
+  // The first hart to run out of instructions ends the run for all of them
+  if (!memory_halted(hart->mem)) {
+    fprintf(stderr, "Hart %lu reached the instruction limit\n",
+            hart->cpu->hart_id);
+    memory_halt(hart->mem, EXIT_INSTRUCTION_LIMIT);
   }
-}
-
-static void inst_sltiu(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  if ((u64)*rs1 < (u64)imm) {
-    *rd = 1;
-  } else {
-    *rd = 0;
+  // The others may be waiting in wfi for an interrupt that never comes
+  for (u64 i = 0; i < hart->num_harts; i++) {
+    cpu_check_interrupts(&hart->cpus[i]);
   }
+  if (hart->mem->gdb) {
+    gdb_hart_done(hart->mem->gdb, hart->cpu);
+  }
+  return NULL;
 }
 
-static void inst_andi(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  i32 b = sign_extend(imm, 11);
-  u64 result = (i64)*rs1 & (i64)b;
-  *rd = result;
-}
-
-static void inst_ori(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  i32 b = sign_extend(imm, 11);
-  i64 result = (i64)*rs1 | b;
-  *rd = result;
-}
-
-static void inst_xori(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  i32 b = sign_extend(imm, 11);
-  i64 result = (i64)*rs1 ^ (i64)b;
-  *rd = result;
-}
-
-static void inst_srli(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  u64 to_be_shifted = *rs1;
-  u8 shift_amount = imm & 0x3F;
-  u64 result = to_be_shifted >> shift_amount;
-  *rd = result;
+// Runs the harts until the guest exits or they reach their limit, hart 0 on
+// the calling thread
+static bool run_harts(struct Hart *harts, u64 num_harts) {
+  for (u64 i = 1; i < num_harts; i++) {
+    int rc = pthread_create(&harts[i].thread, NULL, run_hart, &harts[i]);
+    if (0 != rc) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      return false;
+    }
+  }
+  run_hart(&harts[0]);
+  for (u64 i = 1; i < num_harts; i++) {
+    pthread_join(harts[i].thread, NULL);
+  }
+  return true;
 }
 
-static void inst_srai(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  i64 to_be_shifted = *rs1;
-  u8 shift_amount = imm & 0x3F;
-  i64 result = to_be_shifted >> shift_amount;
-  *rd = result;
-}
+// SIGUSR1 and SIGINT while profiling. The handler only passes the signal on
+// to the signal thread, which may take locks and waits for the harts.
+static int signal_pipe[2];
+static pthread_t signal_thread;
 
-static void inst_add(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  *rd = *rs1 + *rs2;
+static void forward_signal(int signal_number) {
+  int saved_errno = errno;
+  u8 c = signal_number;
+  write(signal_pipe[1], &c, 1);
+  errno = saved_errno;
 }
 
-static void inst_sltu(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  if (*rs1 < *rs2) {
-    *rd = 1;
-  } else {
-    *rd = 0;
+// SIGUSR1 prints the profile so far with the harts paused, SIGINT ends the
+// run like the guest would, after which the profile is printed and the
+// output flushed as usual. A zero byte stops the thread.
+static void *handle_signals(void *opaque) {
+  const struct Hart *hart = opaque;
+  for (;;) {
+    u8 c;
+    ssize_t rc = read(signal_pipe[0], &c, 1);
+    if (-1 == rc && EINTR == errno) {
+      continue;
+    }
+    if (rc <= 0 || 0 == c) {
+      break;
+    }
+    if (SIGUSR1 == c) {
+      cpu_pause(hart->mem, hart->cpus, hart->num_harts);
+      report_profile();
+      cpu_resume(hart->mem);
+    } else {
+      memory_halt(hart->mem, 128 + SIGINT);
+      for (u64 i = 0; i < hart->num_harts; i++) {
+        cpu_check_interrupts(&hart->cpus[i]);
+      }
+      // A second one does not wait for the harts
+      signal(SIGINT, SIG_DFL);
+    }
   }
+  return NULL;
 }
 
-static void inst_and(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  *rd = *rs1 & *rs2;
-}
-
-static void inst_or(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  *rd = *rs1 | *rs2;
+static bool start_signal_thread(struct Hart *hart) {
+  if (-1 == pipe(signal_pipe)) {
+    perror("pipe");
+    return false;
+  }
+  int rc = pthread_create(&signal_thread, NULL, handle_signals, hart);
+  if (0 != rc) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+    return false;
+  }
+  signal(SIGUSR1, forward_signal);
+  signal(SIGINT, forward_signal);
+  return true;
 }
 
-static void inst_xor(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  *rd = *rs1 ^ *rs2;
-}
+static void stop_signal_thread(void) {
+  signal(SIGUSR1, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  u8 c = 0;
+  write(signal_pipe[1], &c, 1);
+  pthread_join(signal_thread, NULL);
+  close(signal_pipe[0]);
+  close(signal_pipe[1]);
+}
+
+// State the devices start from, either on boot or from a snapshot
+struct DeviceStates {
+  // NULL on boot
+  const struct UartState *uart;
+  struct ClintState clint;
+  struct PlicState plic;
+  struct VirtioState blk;
+  struct VirtioState net;
+};
 
-void cpu_dump_state(struct CPU *cpu) {
-  printf("CPU dump:\n");
-  for (int i = 0; i < 32; i++) {
-    printf("reg %d: %ld\n", i, cpu->registers[i]);
+// The UART, the CLINT and the virtio devices have threads, which do not
+// survive a fork, so they are started by the process running the harts.
+static bool start_devices(struct Memory *mem,
+                          const struct DeviceStates *states) {
+  if (!uart_init(&uart, mem, &plic, PLIC_IRQ_UART)) {
+    return false;
   }
-}
-
-#define FUNCT3_SB 0x0
-#define FUNCT3_SH 0x1
-#define FUNCT3_SW 0x2
-#define FUNCT3_SD 0x3
-
-#define FUNCT3_LW 0x2
-#define FUNCT3_LD 0x3
-#define FUNCT3_LBU 0x4
-
-#define FUNCT3_BEQ 0x0
-#define FUNCT3_BNE 0x1
-#define FUNCT3_BGE 0x5
-#define FUNCT3_BLTU 0x6
-#define FUNCT3_BGEU 0x7
-
-#define FUNCT3_JALR 0x0
-#define FUNCT3_ADDI 0x0
-#define FUNCT3_SLLI 0x1
-#define FUNCT3_SLTI 0x2
-#define FUNCT3_SLTIU 0x3
-#define FUNCT3_XORI 0x4
-#define FUNCT3_SR 0x5
-#define FUNCT3_ORI 0x6
-#define FUNCT3_ANDI 0x7
-
-#define FUNCT3_SLLIW 0x1
-#define FUNCT3_SRW 0x5
-
-#define FUNCT3_ADD 0x0
-#define FUNCT3_SLTU 0x3
-#define FUNCT3_AND 0x7
-#define FUNCT3_OR 0x6
-#define FUNCT3_XOR 0x4
-
-static void opcode_h13(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  u8 funct3 = (inst >> 12) & 0x7;
-  u8 funct7 = (inst >> 26 /* shamt is sligthly bigger for 64 bit */) &
-              0x3F; // Only used for certain funct3
-  switch (funct3) {
-  case FUNCT3_ADDI:
-    inst_addi(cpu, mem, inst);
-    break;
-  case FUNCT3_SLTI:
-    inst_slti(cpu, mem, inst);
-    break;
-  case FUNCT3_SLTIU:
-    inst_sltiu(cpu, mem, inst);
-    break;
-  case FUNCT3_XORI:
-    inst_xori(cpu, mem, inst);
-    break;
-  case FUNCT3_ORI:
-    inst_ori(cpu, mem, inst);
-    break;
-  case FUNCT3_ANDI:
-    inst_andi(cpu, mem, inst);
-    break;
-  case FUNCT3_SLLI: {
-    assert(0 == funct7);
-    inst_slli(cpu, mem, inst);
-    break;
-  }
-  case FUNCT3_SR: {
-    if (0 == funct7) {
-      inst_srli(cpu, mem, inst);
-    } else {
-      inst_srai(cpu, mem, inst);
+  signal(SIGABRT, flush_on_abort);
+  clint_restore_state(&clint, &states->clint);
+  // Before the UART and the virtio devices, which raise their interrupts
+  // again
+  plic_restore_state(&plic, &states->plic);
+  if (states->uart) {
+    uart_restore_state(&uart, states->uart);
+  }
+  if (has_disk) {
+    virtio_restore_state(&blk.virtio, &states->blk);
+    if (!virtio_blk_start(&blk)) {
+      return false;
     }
-    break;
   }
-  default:
-    printf("Unknown funct3: %x in opcode: %x\n", funct3, inst & 0x7F);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+  if (has_net) {
+    virtio_restore_state(&net.virtio, &states->net);
+    if (!virtio_net_start(&net)) {
+      return false;
+    }
   }
+  return clint_start(&clint);
 }
 
-static void inst_lui(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  U_TYPE_DEF
-  *rd = imm;
-#ifdef DEBUG
-  printf("%lx: lui x%d,%d\n", cpu->pc, rd, imm >> 12);
-#endif
-}
-
-static void inst_jalr(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  u64 target_address = *rs1 + sign_extend(imm, 12);
-  target_address &= ~(1); // Setting the least significant bit to zero
-
-  *rd = cpu->pc + 4;
-
-#ifdef DEBUG
-  printf("%lx: jalr x%d,%d(x%d)\n", cpu->pc, rd, imm, rs1);
-#endif
-  cpu->pc = target_address;
-  cpu->did_branch = true;
-}
-
-static void opcode_h67(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  I_TYPE_DEF
-  switch (funct3) {
-  case FUNCT3_JALR:
-    inst_jalr(cpu, mem, inst);
-    break;
-  default:
-    printf("Unknown funct3: %x in opcode: %x\n", funct3, inst & 0x7F);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+// The virtio devices write to RAM on their own threads, so they are paused
+// before RAM is saved or reset
+static void pause_virtio(void) {
+  if (has_disk) {
+    virtio_pause(&blk.virtio);
+  }
+  if (has_net) {
+    virtio_pause(&net.virtio);
   }
 }
 
-static void inst_sb(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  S_TYPE_DEF
-
-  i32 b = sign_extend(imm, 11);
-  u64 destination = *rs1 + b;
-  u8 tmp_value = *rs2;
-  memory_write(mem, destination, &tmp_value, sizeof(tmp_value));
-}
-
-static void inst_sh(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  S_TYPE_DEF
-
-  i32 b = sign_extend(imm, 11);
-  u64 destination = *rs1 + b;
-  u16 tmp_value = *rs2;
-  memory_write(mem, destination, &tmp_value, sizeof(tmp_value));
-}
-
-static void inst_sw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  S_TYPE_DEF
-
-  i32 b = sign_extend(imm, 11);
-  u64 destination = *rs1 + (i64)b;
-  u32 value = *rs2;
-  memory_write(mem, destination, &value, sizeof(value));
-#ifdef DEBUG
-  printf("%lx: sw x%d,%d(x%d)\n", cpu->pc, rs2, b, rs1);
-#endif
-}
-
-static void inst_sd(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  S_TYPE_DEF
-
-  i32 b = sign_extend(imm, 11);
-  u64 destination = *rs1 + b;
-  u64 value = *rs2;
-  memory_write(mem, destination, &value, sizeof(value));
-#ifdef DEBUG
-  printf("%lx: sd x%d,%d(x%d)\n", cpu->pc, rs2, b, rs1);
-#endif
-}
-
-static void opcode_h23(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  S_TYPE_DEF
-  switch (funct3) {
-  case FUNCT3_SB:
-    inst_sb(cpu, mem, inst);
-    break;
-  case FUNCT3_SH:
-    inst_sh(cpu, mem, inst);
-    break;
-  case FUNCT3_SW:
-    inst_sw(cpu, mem, inst);
-    break;
-  case FUNCT3_SD:
-    inst_sd(cpu, mem, inst);
-    break;
-  default:
-    printf("Unknown funct3: %x in opcode: %x\n", funct3, inst & 0x7F);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+static void resume_virtio(void) {
+  if (has_disk) {
+    virtio_resume(&blk.virtio);
+  }
+  if (has_net) {
+    virtio_resume(&net.virtio);
   }
 }
 
-static void inst_jal(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  J_TYPE_DEF
-
-  i64 offset = sign_extend(imm, 20);
-
-  u64 jump_target_address = cpu->pc + offset;
-  *rd = cpu->pc + 4;
-#ifdef DEBUG
-  printf("%lx: jal x%d, %lx\n", cpu->pc, rd, jump_target_address);
-#endif
-  cpu->pc = jump_target_address;
-  cpu->did_branch = true;
+static void destroy_virtio(void) {
+  if (has_disk) {
+    virtio_blk_destroy(&blk);
+  }
+  if (has_net) {
+    virtio_net_destroy(&net);
+  }
 }
 
-static void inst_beq(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  B_TYPE_DEF
-  if (*rs1 != *rs2)
-    return;
-
-  i64 offset = sign_extend(imm, 12);
+// File descriptors of the fork server, the same ones AFL uses
+#define FORK_SERVER_CONTROL_FD 198
+#define FORK_SERVER_STATUS_FD 199
+#define FORK_SERVER_HELLO 0x52354653
 
-  u64 jump_target_address = cpu->pc + offset;
-  cpu->pc = jump_target_address;
-  cpu->did_branch = true;
-}
-
-static void inst_bge(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  B_TYPE_DEF
+// Written to FORK_SERVER_STATUS_FD for every job
+struct ForkServerResult {
+  // Exit status of the job or 128 + the signal that killed it
+  i32 status;
+  u32 reserved;
+  // Instructions executed by all harts, 0 if the job was killed
+  u64 instret;
+};
 
-  i64 offset = sign_extend(imm, 12);
-  u64 jump_target_address = cpu->pc + offset;
-#ifdef DEBUG
-  printf("%lx: bge x%d,x%d,%lx\n", cpu->pc, rs1, rs2, jump_target_address);
-#endif
-  if ((i64)*rs1 >= (i64)*rs2) {
-    cpu->pc = jump_target_address;
-    cpu->did_branch = true;
+static bool read_full(int fd, void *data, u64 length) {
+  u8 *out = data;
+  while (length > 0) {
+    ssize_t rc = read(fd, out, length);
+    if (-1 == rc && EINTR == errno) {
+      continue;
+    }
+    if (rc <= 0) {
+      return false;
+    }
+    out += rc;
+    length -= rc;
   }
+  return true;
 }
 
-static void inst_bgeu(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  B_TYPE_DEF
-
-  i64 offset = sign_extend(imm, 12);
-  u64 jump_target_address = cpu->pc + offset;
-#ifdef DEBUG
-  printf("%lx: bge x%d,x%d,%lx\n", cpu->pc, rs1, rs2, jump_target_address);
-#endif
-  if (*rs1 >= *rs2) {
-    cpu->pc = jump_target_address;
-    cpu->did_branch = true;
+static bool write_full(int fd, const void *data, u64 length) {
+  const u8 *in = data;
+  while (length > 0) {
+    ssize_t rc = write(fd, in, length);
+    if (-1 == rc && EINTR == errno) {
+      continue;
+    }
+    if (rc <= 0) {
+      perror("write");
+      return false;
+    }
+    in += rc;
+    length -= rc;
   }
+  return true;
 }
 
-static void inst_bne(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  B_TYPE_DEF
-
-  i64 offset = sign_extend(imm, 12);
-  u64 jump_target_address = cpu->pc + offset;
-#ifdef DEBUG
-  printf("%lx: bne x%d,x%d,%lx\n", cpu->pc, rs1, rs2, jump_target_address);
-#endif
-  if ((i64)*rs1 != (i64)*rs2) {
-    cpu->pc = jump_target_address;
-    cpu->did_branch = true;
+static u64 total_instret(const struct Hart *harts, u64 num_harts) {
+  u64 instret = 0;
+  for (u64 i = 0; i < num_harts; i++) {
+    instret += harts[i].cpu->instret;
   }
-}
-
-static void inst_bltu(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  B_TYPE_DEF
-
-  i64 offset = sign_extend(imm, 12);
-  u64 jump_target_address = cpu->pc + offset;
-#ifdef DEBUG
-  printf("%lx: bltu x%d,x%d,%lx\n", cpu->pc, rs1, rs2, jump_target_address);
-#endif
-  if (*rs1 < *rs2) {
-    cpu->pc = jump_target_address;
-    cpu->did_branch = true;
+  return instret;
+}
+
+// Runs a job in a fork of the server, which shares RAM copy-on-write and
+// takes everything it changed with it when it exits. The blocks it decoded
+// and compiled come back through logs, one per hart, so that the server has
+// them in its caches for the next fork.
+static bool run_forked(struct Memory *mem, struct Hart *harts, u64 num_harts,
+                       const struct DeviceStates *states, u64 *job_instret,
+                       struct TCacheLog *logs,
+                       struct ForkServerResult *result) {
+  u64 start_instret = total_instret(harts, num_harts);
+  *job_instret = 0;
+  pid_t pid = fork();
+  if (-1 == pid) {
+    perror("fork");
+    return false;
   }
-}
-
-static void opcode_h63(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  B_TYPE_DEF
-  switch (funct3) {
-  case FUNCT3_BNE:
-    inst_bne(cpu, mem, inst);
-    break;
-  case FUNCT3_BEQ:
-    inst_beq(cpu, mem, inst);
-    break;
-  case FUNCT3_BGE:
-    inst_bge(cpu, mem, inst);
-    break;
-  case FUNCT3_BLTU:
-    inst_bltu(cpu, mem, inst);
-    break;
-  case FUNCT3_BGEU:
-    inst_bgeu(cpu, mem, inst);
-    break;
-  default:
-    printf("Unknown funct3: %x in opcode: %x\n", funct3, inst & 0x7F);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+  if (0 == pid) {
+    close(FORK_SERVER_CONTROL_FD);
+    close(FORK_SERVER_STATUS_FD);
+    for (u64 i = 0; i < num_harts; i++) {
+      cpu_cache_record(harts[i].cache, &logs[i]);
+    }
+    bool ok = start_devices(mem, states) && run_harts(harts, num_harts);
+    *job_instret = total_instret(harts, num_harts) - start_instret;
+    uart_destroy(&uart);
+    clint_destroy(&clint);
+    destroy_virtio();
+    _exit(ok ? mem->exit_status : 1);
   }
-}
-
-static void inst_lw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  I_TYPE_DEF
-  i32 b = sign_extend(imm, 11);
-  u64 location = *rs1 + (i64)b;
-  i32 value;
-  memory_read(mem, location, &value, sizeof(value));
-  *rd = (i64)value;
-#ifdef DEBUG
-  printf("%lx: lw x%d, %d(x%d)\n", cpu->pc, rd, b, rs1);
-#endif
-}
-
-static void inst_ld(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  I_TYPE_DEF
-  i32 b = sign_extend(imm, 11);
-  u64 location = *rs1 + b;
-  i64 value;
-  memory_read(mem, location, &value, sizeof(i64));
-  *rd = value;
-#ifdef DEBUG
-  printf("%lx: ld x%d, %d(x%d)\n", cpu->pc, rd, b, rs1);
-#endif
-}
-
-static void inst_lbu(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  I_TYPE_DEF
-  i32 b = sign_extend(imm, 11);
-  u64 location = *rs1 + b;
-  u8 value;
-  memory_read(mem, location, &value, sizeof(u8));
-  *rd = value;
-#ifdef DEBUG
-  printf("%lx: lbu x%d, %d(x%d)\n", cpu->pc, rd, b, rs1);
-#endif
-}
-
-static void opcode_h03(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  I_TYPE_DEF
-  switch (funct3) {
-  case FUNCT3_LW:
-    inst_lw(cpu, mem, inst);
-    break;
-  case FUNCT3_LD:
-    inst_ld(cpu, mem, inst);
-    break;
-  case FUNCT3_LBU:
-    inst_lbu(cpu, mem, inst);
-    break;
-  default:
-    printf("Unknown funct3: %x in opcode: %x\n", funct3, inst & 0x7F);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+  int wait_status;
+  while (-1 == waitpid(pid, &wait_status, 0)) {
+    if (EINTR != errno) {
+      perror("waitpid");
+      return false;
+    }
   }
+  for (u64 i = 0; i < num_harts; i++) {
+    cpu_cache_replay(harts[i].cache, mem, &logs[i]);
+  }
+  result->instret = *job_instret;
+  if (WIFEXITED(wait_status)) {
+    result->status = WEXITSTATUS(wait_status);
+  } else {
+    result->status = 128 + WTERMSIG(wait_status);
+  }
+  return true;
 }
 
-#define FUNCT3_ADDW 0x0
-#define FUNCT3_SLLW 0x1
-
-#define FUNCT3_SRLW_SRAW 0x5
-
-#define FUNCT7_ADDW 0x0
-#define FUNCT7_SUBW (0x1 << 5)
-
-static void inst_addw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  *rd = *rs1 + *rs2;
-}
-
-static void inst_subw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  *rd = *rs1 - *rs2;
-}
-
-static void inst_sllw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-
-  u64 to_shift = *rs1;
-  u8 shift_amount = *rs2 & 0x1F;
-  i32 result = (to_shift << shift_amount);
-  *rd = (i64)result;
-}
-
-static void inst_srlw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  u32 to_be_shifted = *rs1;
-  u8 shift_amount = *rs2 & 0x1F;
-  i32 result = to_be_shifted >> shift_amount;
-  *rd = (i64)result;
-}
-
-static void inst_sraw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  R_TYPE_DEF
-  i32 to_be_shifted = *rs1;
-  u8 shift_amount = *rs2 & 0x1F;
-  i32 result = to_be_shifted >> shift_amount;
-  *rd = (i64)result;
-}
-
-static void opcode_h3B(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  R_TYPE_DEF
-  switch (funct3) {
-  case FUNCT3_SLLW:
-    if (0 == funct7) {
-      inst_sllw(cpu, mem, inst);
-    }
-    break;
-  case FUNCT3_ADDW:
-    if (FUNCT7_ADDW == funct7) {
-      inst_addw(cpu, mem, inst);
-    } else if (FUNCT7_SUBW == funct7) {
-      inst_subw(cpu, mem, inst);
-    } else {
-      assert(0);
+// Runs a job in the server process itself and puts the machine back the way
+// it was. Only the pages of RAM that the job wrote are copied back from
+// baseline, so a job costs as much as it writes instead of a fork and a copy
+// fault for every page it touches. A guest error takes the server down.
+static bool run_in_place(struct Memory *mem, struct Hart *harts,
+                         u64 num_harts, const struct CPU *initial,
+                         const struct DeviceStates *states,
+                         const u8 *baseline, struct ForkServerResult *result) {
+  u64 start_instret = total_instret(harts, num_harts);
+  bool ok = run_harts(harts, num_harts);
+  result->status = ok ? mem->exit_status : 1;
+  result->instret = total_instret(harts, num_harts) - start_instret;
+  uart_flush(&uart);
+  uart_restore_state(&uart, states->uart);
+  pause_virtio();
+  memory_reset_dirty(mem, baseline);
+  // The restored TLBs are empty, so the next write to every page marks it
+  // dirty again
+  for (u64 i = 0; i < num_harts; i++) {
+    *harts[i].cpu = initial[i];
+    mmu_flush(&harts[i].cpu->mmu);
+  }
+  // Also sets the timer interrupts again, which the timer thread may have
+  // raised while the harts were reset
+  clint_restore_state(&clint, &states->clint);
+  plic_restore_state(&plic, &states->plic);
+  if (has_disk) {
+    virtio_blk_reset_disk(&blk);
+    virtio_restore_state(&blk.virtio, &states->blk);
+  }
+  if (has_net) {
+    virtio_restore_state(&net.virtio, &states->net);
+  }
+  mem->halted = false;
+  mem->exit_status = 0;
+  resume_virtio();
+  return ok;
+}
+
+// Runs one job for every 4 byte request read from FORK_SERVER_CONTROL_FD.
+// Every job starts from the fully initialized emulator without loading
+// anything, either in a fork or in place if a baseline of RAM is given, see
+// run_forked() and run_in_place(). The server announces itself with
+// FORK_SERVER_HELLO and answers every request with a struct ForkServerResult
+// once the job is done. It stops when the control pipe is closed.
+// The harts keep their caches from one job to the next, see run_forked().
+static int serve_forks(struct Memory *mem, struct Hart *harts, u64 num_harts,
+                       const struct DeviceStates *states, const u8 *baseline) {
+  // A forked job reports its instruction count and its blocks through shared
+  // memory
+  u64 *job_instret = mmap(NULL, sizeof(u64), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  struct TCacheLog *logs =
+      mmap(NULL, num_harts * sizeof(struct TCacheLog), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == job_instret || MAP_FAILED == logs) {
+    perror("mmap");
+    return 1;
+  }
+  for (u64 i = 0; i < num_harts; i++) {
+    harts[i].cache = cpu_cache_create(harts[i].engine, NULL, NULL);
+    if (!harts[i].cache) {
+      return 1;
     }
-    break;
-  case FUNCT3_SRLW_SRAW:
-    if (0 == funct7) {
-      inst_srlw(cpu, mem, inst);
+  }
+  struct CPU *initial = NULL;
+  struct UartState initial_uart;
+  struct DeviceStates initial_states = *states;
+  initial_states.uart = &initial_uart;
+  if (baseline) {
+    initial = malloc(num_harts * sizeof(struct CPU));
+    if (!initial) {
+      perror("malloc");
+      return 1;
+    }
+    for (u64 i = 0; i < num_harts; i++) {
+      initial[i] = *harts[i].cpu;
     }
-    break;
-    if ((1 << 5) == funct7) {
-      inst_sraw(cpu, mem, inst);
+    if (!start_devices(mem, states)) {
+      free(initial);
+      return 1;
     }
-    break;
-  default:
-    printf("Unknown funct3: %x in opcode: %x\n", funct3, inst & 0x7F);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+    uart_save_state(&uart, &initial_uart);
+  }
+  int status = 0;
+  u32 hello = FORK_SERVER_HELLO;
+  if (!write_full(FORK_SERVER_STATUS_FD, &hello, sizeof(hello))) {
+    status = 1;
+  }
+  u32 request;
+  while (0 == status &&
+         read_full(FORK_SERVER_CONTROL_FD, &request, sizeof(request))) {
+    struct ForkServerResult result = {0, 0, 0};
+    bool ok = baseline ? run_in_place(mem, harts, num_harts, initial,
+                                      &initial_states, baseline, &result)
+                       : run_forked(mem, harts, num_harts, states, job_instret,
+                                    logs, &result);
+    if (!ok || !write_full(FORK_SERVER_STATUS_FD, &result, sizeof(result))) {
+      status = 1;
+    }
+  }
+  if (baseline) {
+    uart_destroy(&uart);
+    free(initial);
+  }
+  for (u64 i = 0; i < num_harts; i++) {
+    cpu_cache_destroy(harts[i].cache);
+    harts[i].cache = NULL;
   }
+  return status;
+}
+
+static bool parse_engine(const char *name, enum Engine *engine) {
+  if (0 == strcmp(name, "switch")) {
+    *engine = ENGINE_SWITCH;
+  } else if (0 == strcmp(name, "cached")) {
+    *engine = ENGINE_CACHED;
+  } else if (0 == strcmp(name, "threaded")) {
+    *engine = ENGINE_THREADED;
+  } else if (0 == strcmp(name, "jit")) {
+    *engine = ENGINE_JIT;
+  } else {
+    return false;
+  }
+  return true;
 }
 
-#define FUNCT3_ADDIW 0x0
-
-static void inst_addiw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-
-  i64 a = *rs1;
-  i64 b = sign_extend(imm, 11);
-  *rd = a + b;
+static bool parse_number(const char *text, u64 *value) {
+  char *end;
+  *value = strtoull(text, &end, 0);
+  return '\0' != *text && '\0' == *end;
 }
 
-uint64_t kUpper32bitMask = 0xFFFFFFFF00000000;
-u64 Sext32bit(u64 data32bit) {
-  if ((data32bit >> 31) & 1) {
-    return data32bit | kUpper32bitMask;
+static bool parse_pages(const char *name, enum RamPages *pages) {
+  if (0 == strcmp(name, "thp")) {
+    *pages = RAM_PAGES_THP;
+  } else if (0 == strcmp(name, "hugetlb")) {
+    *pages = RAM_PAGES_HUGETLB;
   } else {
-    return data32bit & (~kUpper32bitMask);
+    return false;
   }
+  return true;
 }
 
-static void inst_srliw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  u64 to_be_shifted = *rs1 & 0xFFFFFFFF;
-  u8 shift_amount = imm & 0x3F;
-  u64 result = to_be_shifted >> shift_amount;
-  result = Sext32bit(result);
-  *rd = result;
-}
-
-static void inst_sraiw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  i64 to_be_shifted = (i64)*rs1;
-  u8 shift_amount = imm & 0x1F;
-  i64 result = to_be_shifted >> shift_amount;
-  *rd = (i64)result;
+// Hart 0 writes to the given path and every other hart to path.<hart id>
+static bool open_traces(const char *path, u64 num_harts, u32 flags) {
+  traces = calloc(num_harts, sizeof(struct Trace));
+  if (!traces) {
+    perror("calloc");
+    return false;
+  }
+  for (u64 i = 0; i < num_harts; i++) {
+    char name[4096];
+    if (0 == i) {
+      snprintf(name, sizeof(name), "%s", path);
+    } else {
+      snprintf(name, sizeof(name), "%s.%lu", path, i);
+    }
+    if (!trace_open(&traces[i], name, i, flags)) {
+      return false;
+    }
+    num_traces++;
+  }
+  return true;
 }
 
-static void inst_slliw(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  (void)mem;
-  I_TYPE_DEF
-  u32 to_shift = *rs1;
-  u8 shift_amount = imm & 0x1F;
-  u32 result = to_shift << shift_amount;
-  *rd = result;
-#ifdef DEBUG
-  printf("%lx: slli x%d,x%d,%d\n", cpu->pc, rd, rs1, shift_amount);
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-e switch|cached|threaded|jit] [-b ram-base] "
+          "[-m ram-MiB] [-H thp|hugetlb] [-n harts] [-d disk] [-N net] "
+          "[-p] [-t trace [-z] [--trace-values] | -g gdb] "
+          "[--max-insns n [-s snapshot]] image\n"
+          "       %s [-e engine] [-d disk] [-N net] [-p] "
+          "[-t trace [-z] [--trace-values] | -g gdb] "
+          "[--max-insns n [-s snapshot]] -r snapshot\n"
+          "       %s --fork-server [--persistent] [-e engine] "
+          "[machine options] [-d disk] [-N net] [--max-insns n] "
+          "image|-r snapshot\n"
+          "net is unix:local-socket,peer-socket or pipe:in-fifo,out-fifo\n"
+          "gdb is a TCP port on 127.0.0.1 or unix:socket\n",
+          argv0, argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+  struct Memory mem;
+#if defined(__x86_64__)
+  enum Engine engine = ENGINE_JIT;
+#else
+  enum Engine engine = ENGINE_THREADED;
 #endif
-}
-
-static void opcode_h1B(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  u8 funct3 = (inst >> 12) & 0x7;
-  u8 funct7 = (inst >> 25) & 0x3F; // Only used for certain funct3
-  switch (funct3) {
-  case FUNCT3_ADDIW:
-    inst_addiw(cpu, mem, inst);
-    break;
-  case FUNCT3_SLLIW:
-    inst_slliw(cpu, mem, inst);
-    break;
-  case FUNCT3_SRW: {
-    if (0 == funct7) {
-      inst_srliw(cpu, mem, inst);
-    } else {
-      inst_sraiw(cpu, mem, inst);
+  u64 ram_base = 0;
+  u64 ram_mib = 1;
+  enum RamPages pages = RAM_PAGES_DEFAULT;
+  u64 num_harts = 1;
+  bool profiling = false;
+  const char *trace_path = NULL;
+  u32 trace_flags = 0;
+  u64 max_insns = ~0ULL;
+  const char *save_path = NULL;
+  const char *restore_path = NULL;
+  const char *disk_path = NULL;
+  const char *net_backend = NULL;
+  const char *gdb_address = NULL;
+  // RAM and the harts come from the snapshot when restoring
+  bool machine_options = false;
+  bool fork_server = false;
+  bool persistent = false;
+  static const struct option long_options[] = {
+      {"max-insns", required_argument, NULL, 'i'},
+      {"fork-server", no_argument, NULL, 'f'},
+      {"persistent", no_argument, NULL, 'P'},
+      {"trace-values", no_argument, NULL, 'V'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while (-1 != (c = getopt_long(argc, argv, "e:b:m:H:n:d:N:g:pt:zs:r:",
+                                long_options, NULL))) {
+    switch (c) {
+    case 'e':
+      if (!parse_engine(optarg, &engine)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'b':
+      if (!parse_number(optarg, &ram_base) || ram_base % PAGE_SIZE) {
+        usage(argv[0]);
+        return 1;
+      }
+      machine_options = true;
+      break;
+    case 'm':
+      if (!parse_number(optarg, &ram_mib) || 0 == ram_mib) {
+        usage(argv[0]);
+        return 1;
+      }
+      machine_options = true;
+      break;
+    case 'H':
+      if (!parse_pages(optarg, &pages)) {
+        usage(argv[0]);
+        return 1;
+      }
+      machine_options = true;
+      break;
+    case 'n':
+      if (!parse_number(optarg, &num_harts) || 0 == num_harts) {
+        usage(argv[0]);
+        return 1;
+      }
+      machine_options = true;
+      break;
+    case 'd':
+      disk_path = optarg;
+      break;
+    case 'N':
+      net_backend = optarg;
+      break;
+    case 'g':
+      gdb_address = optarg;
+      break;
+    case 'p':
+      profiling = true;
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    case 'z':
+      trace_flags |= TRACE_COMPRESSED;
+      break;
+    case 'V':
+      trace_flags |= TRACE_VALUES;
+      break;
+    case 'i':
+      if (!parse_number(optarg, &max_insns) || 0 == max_insns) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      save_path = optarg;
+      break;
+    case 'r':
+      restore_path = optarg;
+      break;
+    case 'f':
+      fork_server = true;
+      break;
+    case 'P':
+      persistent = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
     }
-    break;
   }
-  default:
-    printf("Unknown funct3: %x in opcode: %x\n", funct3, inst & 0x7F);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+  // A snapshot is taken when the run stops at the instruction limit
+  if ((restore_path ? optind != argc || machine_options
+                    : optind + 1 != argc) ||
+      (save_path && ~0ULL == max_insns)) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Jobs only report their exit status and instruction count. The trace
+  // would show the breakpoints of the debugger as instructions.
+  if ((fork_server && (profiling || trace_path || save_path || gdb_address)) ||
+      (persistent && !fork_server) || (trace_path && gdb_address)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (fork_server && (-1 == fcntl(FORK_SERVER_CONTROL_FD, F_GETFD) ||
+                      -1 == fcntl(FORK_SERVER_STATUS_FD, F_GETFD))) {
+    fprintf(stderr, "The fork server needs file descriptors %d and %d\n",
+            FORK_SERVER_CONTROL_FD, FORK_SERVER_STATUS_FD);
+    return 1;
   }
-}
 
-static void opcode_h33(struct CPU *cpu, struct Memory *mem, const u32 inst) {
-  u8 funct3 = (inst >> 12) & 0x7;
-  u8 funct7 = (inst >> 25) & 0x3F; // Only used for certain funct3
-  switch (funct3) {
-  case FUNCT3_ADD:
-    if (0 == funct7) {
-      inst_add(cpu, mem, inst);
-    } else {
-      assert(0);
+  struct Snapshot snapshot;
+  u64 ram_size = ram_mib << 20;
+  if (restore_path) {
+    if (!snapshot_open(&snapshot, restore_path)) {
+      return 1;
     }
-    break;
-  case FUNCT3_SLTU:
-    if (0 == funct7) {
-      inst_sltu(cpu, mem, inst);
-    } else {
-      assert(0);
-    }
-    break;
-  case FUNCT3_XOR:
-    if (0 == funct7) {
-      inst_xor(cpu, mem, inst);
-    } else {
-      assert(0);
+    ram_base = snapshot.ram_base;
+    ram_size = snapshot.ram_size;
+    num_harts = snapshot.num_harts;
+  }
+  if (!ram_init(&mem, ram_base, ram_size, pages)) {
+    return 1;
+  }
+  if (restore_path && !snapshot_map_ram(&snapshot, &mem)) {
+    return 1;
+  }
+  // Left out if RAM is in the way, the exit system call still works then
+  if (!ram_contains(&mem, FINISHER_BASE, 1) &&
+      !ram_contains(&mem, FINISHER_BASE + FINISHER_SIZE - 1, 1) &&
+      !finisher_init(&mem)) {
+    return 1;
+  }
+  u64 entry = 0;
+  if (!restore_path && !load_image(argv[optind], &mem, &entry)) {
+    return 1;
+  }
+  if (profiling) {
+    // There are no symbols for a restored snapshot
+    if (!restore_path && !load_symbols(argv[optind], &symbols)) {
+      return 1;
     }
-    break;
-  case FUNCT3_AND:
-    if (0 == funct7) {
-      inst_and(cpu, mem, inst);
-    } else {
-      assert(0);
+    profiles = calloc(num_harts, sizeof(struct Profile));
+    if (!profiles) {
+      perror("calloc");
+      return 1;
     }
-    break;
-  case FUNCT3_OR:
-    if (0 == funct7) {
-      inst_or(cpu, mem, inst);
-    } else {
-      assert(0);
+    for (u64 i = 0; i < num_harts; i++) {
+      if (!profile_init(&profiles[i])) {
+        return 1;
+      }
     }
-    break;
-  default:
-    printf("Unknown funct3: %x in opcode: %x\n", funct3, inst & 0x7F);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+    num_profiles = num_harts;
   }
-}
-
-static void perform_instruction(struct CPU *cpu, struct Memory *mem,
-                                const u32 inst) {
-  cpu->did_branch = false;
-  u8 opcode = inst & 0x7F;
-  switch (opcode) {
-  case 0x3:
-    opcode_h03(cpu, mem, inst);
-    break;
-  case 0x13:
-    opcode_h13(cpu, mem, inst);
-    break;
-  case 0x1B:
-    opcode_h1B(cpu, mem, inst);
-    break;
-  case 0x23:
-    opcode_h23(cpu, mem, inst);
-    break;
-  case 0x33:
-    opcode_h33(cpu, mem, inst);
-    break;
-  case 0x37:
-    inst_lui(cpu, mem, inst);
-    break;
-  case 0x3B:
-    opcode_h3B(cpu, mem, inst);
-    break;
-  case 0x63:
-    opcode_h63(cpu, mem, inst);
-    break;
-  case 0x67:
-    opcode_h67(cpu, mem, inst);
-    break;
-  case 0x6F:
-    inst_jal(cpu, mem, inst);
-    break;
-  default:
-    printf("Unknown opcode: %x\n", opcode);
-    cpu_dump_state(cpu);
-    assert(0);
-    break;
+  if (trace_path && !open_traces(trace_path, num_harts, trace_flags)) {
+    return 1;
   }
-}
-
-static void cpu_loop(struct CPU *cpu, struct Memory *mem) {
-  for (;;) {
-    u32 inst;
-    memory_read(mem, cpu->pc, &inst, sizeof(u32));
-    perform_instruction(cpu, mem, inst);
-    if (cpu->did_branch)
-      continue;
-    cpu->pc += sizeof(u32);
+  // Every hart starts at the entry point, the guest tells them apart by the
+  // hart id in a0.
+  struct CPU *cpus = calloc(num_harts, sizeof(struct CPU));
+  struct Hart *harts = calloc(num_harts, sizeof(struct Hart));
+  if (!cpus || !harts) {
+    perror("calloc");
+    return 1;
   }
-}
-
-bool load_file(const char *file, struct Memory *mem, u64 offset) {
-  int fd = open(file, O_RDONLY);
-  if (-1 == fd) {
-    perror("open");
-    return false;
+  for (u64 i = 0; i < num_harts; i++) {
+    cpu_init(&cpus[i], i, entry);
+    if (restore_path) {
+      snapshot_restore_hart(&snapshot, i, &cpus[i]);
+    }
+    // The limit counts from the start of this run
+    if (~0ULL != max_insns) {
+      cpus[i].instret_limit = cpus[i].instret + max_insns;
+    }
+    harts[i].cpu = &cpus[i];
+    harts[i].cpus = cpus;
+    harts[i].num_harts = num_harts;
+    harts[i].mem = &mem;
+    harts[i].engine = engine;
+    harts[i].profile = profiles ? &profiles[i] : NULL;
+    harts[i].trace = traces ? &traces[i] : NULL;
   }
-  int rc = read(fd, mem->ram + offset, 8192);
-  if (-1 == rc) {
-    perror("read");
-    return false;
+  // Same as for the finisher, the time CSR still works without the registers
+  bool clint_mapped = !ram_contains(&mem, CLINT_BASE, 1) &&
+                      !ram_contains(&mem, CLINT_BASE + CLINT_SIZE - 1, 1);
+  if (!clint_init(&clint, clint_mapped ? &mem : NULL, cpus, num_harts)) {
+    return 1;
   }
-  if (-1 == close(fd)) {
-    perror("close");
-    return false;
+  bool plic_mapped = !ram_contains(&mem, PLIC_BASE, 1) &&
+                     !ram_contains(&mem, PLIC_BASE + PLIC_SIZE - 1, 1);
+  if (!plic_init(&plic, plic_mapped ? &mem : NULL, cpus, num_harts)) {
+    return 1;
   }
-  return true;
-}
-
-void cpu_init(struct CPU *cpu, u64 pc) {
-  for (int i = 0; i < 32; i++) {
-    cpu->registers[i] = 0;
+  // The disk cannot do without its registers. Jobs of the fork server keep
+  // their writes to themselves.
+  if (disk_path) {
+    if (ram_contains(&mem, VIRTIO_BASE, 1) ||
+        ram_contains(&mem, VIRTIO_BASE + VIRTIO_SIZE - 1, 1)) {
+      fprintf(stderr, "RAM overlaps the registers of the disk\n");
+      return 1;
+    }
+    if (!virtio_blk_init(&blk, &mem, VIRTIO_BASE, &plic, PLIC_IRQ_VIRTIO_BLK,
+                         disk_path, fork_server)) {
+      return 1;
+    }
+    has_disk = true;
   }
-  cpu->did_branch = false;
-  cpu->pc = pc;
-}
-
-int main(void) {
-  struct CPU cpu;
-  struct Memory mem;
-  if (!ram_init(&mem, 1048576)) {
+  if (net_backend) {
+    if (ram_contains(&mem, VIRTIO_NET_BASE, 1) ||
+        ram_contains(&mem, VIRTIO_NET_BASE + VIRTIO_SIZE - 1, 1)) {
+      fprintf(stderr, "RAM overlaps the registers of the network\n");
+      return 1;
+    }
+    if (!virtio_net_init(&net, &mem, VIRTIO_NET_BASE, &plic,
+                         PLIC_IRQ_VIRTIO_NET, net_backend)) {
+      return 1;
+    }
+    has_net = true;
+  }
+  if (gdb_address &&
+      !gdb_init(&gdb, &mem, cpus, num_harts, gdb_address)) {
     return 1;
   }
-  cpu_init(&cpu, 0x1000);
-
-  if (!load_file("./fib-example/flat", &mem, 0x1000)) {
+  // The snapshot stays open for the baseline and as the parent of the
+  // snapshot taken at the end. Everything starts at 0 on boot.
+  struct DeviceStates states = {0};
+  if (restore_path) {
+    if (!disk_path && 0 != snapshot.blk.status) {
+      fprintf(stderr, "The snapshot was taken with a disk, -d is missing\n");
+      return 1;
+    }
+    if (!net_backend && 0 != snapshot.net.status) {
+      fprintf(stderr,
+              "The snapshot was taken with a network, -N is missing\n");
+      return 1;
+    }
+    states.uart = &snapshot.uart;
+    states.clint = snapshot.clint;
+    states.plic = snapshot.plic;
+    states.blk = snapshot.blk;
+    states.net = snapshot.net;
+  }
+  if (fork_server) {
+    // Jobs run in place start from RAM as it is now
+    u8 *baseline = NULL;
+    if (persistent) {
+      baseline = restore_path ? snapshot_map_baseline(&snapshot, &mem)
+                              : memory_save_baseline(&mem);
+      if (!baseline) {
+        return 1;
+      }
+      memory_clear_dirty(&mem);
+    }
+    int status = serve_forks(&mem, harts, num_harts, &states, baseline);
+    if (baseline) {
+      memory_free_baseline(&mem, baseline);
+    }
+    if (restore_path) {
+      snapshot_close(&snapshot);
+    }
+    clint_destroy(&clint);
+    plic_destroy(&plic);
+    destroy_virtio();
+    free(harts);
+    free(cpus);
+    return status;
+  }
+  if (!start_devices(&mem, &states) ||
+      (gdb_address && !gdb_start(&gdb)) ||
+      (profiling && !start_signal_thread(&harts[0])) ||
+      !run_harts(harts, num_harts)) {
     return 1;
   }
-
-  cpu_loop(&cpu, &mem);
-  return 0;
+  if (profiling) {
+    stop_signal_thread();
+  }
+  if (gdb_address) {
+    gdb_destroy(&gdb);
+  }
+  report_profile();
+  for (u64 i = 0; i < num_traces; i++) {
+    trace_close(&traces[i]);
+  }
+  int status = mem.exit_status;
+  // Only the hart that reached the limit is done with its instructions
+  bool limit_reached = false;
+  for (u64 i = 0; i < num_harts; i++) {
+    limit_reached |= cpus[i].instret >= cpus[i].instret_limit;
+  }
+  if (save_path && limit_reached) {
+    uart_flush(&uart);
+    pause_virtio();
+    status = snapshot_save(save_path, &mem, &uart, &clint, &plic,
+                           has_disk ? &blk.virtio : NULL,
+                           has_net ? &net.virtio : NULL, cpus, num_harts,
+                           restore_path ? &snapshot : NULL)
+                 ? 0
+                 : 1;
+  }
+  if (restore_path) {
+    snapshot_close(&snapshot);
+  }
+  clint_destroy(&clint);
+  plic_destroy(&plic);
+  destroy_virtio();
+  free(harts);
+  free(cpus);
+  uart_destroy(&uart);
+  return status;
 }
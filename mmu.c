@@ -2,79 +2,705 @@
 // often stuff will be written to RAM but sometimes attached devices may occupy
 // certain memory regions which are handeled differently from RAM.
 //
-// Paging will also be handeled in this file when/if that gets implemented
+// Virtual memory is handled here as well. Sv39 and Sv48 page tables are
+// walked on a miss in the software TLB of the hart, see struct Mmu.
 #include "mmu.h"
+#include "gdb.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
-#define U64_OVERFLOW_CHECK(_a, _b, _exp)                                       \
-  {                                                                            \
-    if ((_a) > UINT64_MAX - (_b)) {                                            \
-      _exp;                                                                    \
-    }                                                                          \
-  }
+static u64 align_up(u64 value, u64 alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
 
-// UART
-#define Ns16650a_BASE 0x10000000
+// Reserves address space for RAM. Nothing is committed until the guest
+// touches a page, so the size of RAM costs nothing up front.
+static u8 *map_ram(u64 size, enum RamPages pages) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  if (RAM_PAGES_HUGETLB == pages) {
+    // Reserve the pages from the pool so that running out of huge pages is
+    // reported here instead of as a fault when the guest touches RAM.
+    u8 *ram = mmap(NULL, align_up(size, HUGE_PAGE_SIZE),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (MAP_FAILED == ram) {
+      perror("mmap(MAP_HUGETLB)");
+      return NULL;
+    }
+    return ram;
+  }
+  if (RAM_PAGES_DEFAULT == pages) {
+    u8 *ram = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (MAP_FAILED == ram) {
+      perror("mmap");
+      return NULL;
+    }
+    return ram;
+  }
+  // Transparent huge pages can only back ranges that are aligned to a huge
+  // page, so overallocate and trim the reservation.
+  u64 length = align_up(size, HUGE_PAGE_SIZE);
+  u8 *reservation = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         flags, -1, 0);
+  if (MAP_FAILED == reservation) {
+    perror("mmap");
+    return NULL;
+  }
+  u8 *ram = (u8 *)align_up((u64)reservation, HUGE_PAGE_SIZE);
+  if (ram != reservation) {
+    munmap(reservation, ram - reservation);
+  }
+  munmap(ram + length, reservation + HUGE_PAGE_SIZE - ram);
+  if (-1 == madvise(ram, length, MADV_HUGEPAGE)) {
+    // Not fatal, RAM just ends up with normal pages
+    perror("madvise(MADV_HUGEPAGE)");
+  }
+  return ram;
+}
 
-bool ram_init(struct Memory *mem, u64 size) {
-  mem->ram = malloc(size);
+bool ram_init(struct Memory *mem, u64 base, u64 size, enum RamPages pages) {
+  mem->ram = map_ram(size, pages);
   if (!mem->ram) {
-    perror("malloc");
     return false;
   }
+  mem->code_gen = calloc((size >> PAGE_SHIFT) + 1, sizeof(u32));
+  mem->dirty = calloc(size >> PAGE_SHIFT, sizeof(u8));
+  if (!mem->code_gen || !mem->dirty) {
+    perror("calloc");
+    return false;
+  }
+  mem->ram_base = base;
   mem->size = size;
+  mem->pages = pages;
+  mem->file_backed = false;
+  mem->num_devices = 0;
+  mem->halted = false;
+  mem->exit_status = 0;
+  mem->gdb = NULL;
+  mem->pause = false;
+  mem->running_harts = 0;
+  mem->parked_harts = 0;
+  pthread_mutex_init(&mem->pause_lock, NULL);
+  pthread_cond_init(&mem->pause_changed, NULL);
   return true;
 }
 
-// Bounds checked memory write for instructions to use.
+// Hands whole host pages of RAM back to the host, they read as zero again
+// the next time they are touched. MADV_DONTNEED would bring back the
+// contents of a file mapping instead, so with one the range is replaced by
+// fresh anonymous memory.
+static bool zero_pages(struct Memory *mem, u64 start, u64 length) {
+  if (!mem->file_backed) {
+    return 0 == madvise((void *)start, length, MADV_DONTNEED);
+  }
+  if (MAP_FAILED == mmap((void *)start, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                             MAP_FIXED,
+                         -1, 0)) {
+    return false;
+  }
+  if (RAM_PAGES_THP == mem->pages) {
+    madvise((void *)start, length, MADV_HUGEPAGE);
+  }
+  return true;
+}
+
+// Zeroes a range of RAM, see zero_pages() for the whole host pages
+void memory_zero(struct Memory *mem, u64 address, u64 length) {
+  assert(ram_contains(mem, address, length));
+  if (0 == length) {
+    return;
+  }
+  // The file pages are not huge even if the rest of RAM is
+  u64 granule = RAM_PAGES_HUGETLB == mem->pages && !mem->file_backed
+                    ? HUGE_PAGE_SIZE
+                    : (u64)sysconf(_SC_PAGESIZE);
+  u64 start = (u64)(mem->ram + (address - mem->ram_base));
+  u64 end = start + length;
+  u64 first = align_up(start, granule);
+  u64 last = end & ~(granule - 1);
+  if (first < last && zero_pages(mem, first, last - first)) {
+    memset((void *)start, 0, first - start);
+    memset((void *)last, 0, end - last);
+  } else {
+    memset((void *)start, 0, length);
+  }
+  memory_mark_dirty(mem, address, length);
+  memory_invalidate_code(mem, address, length);
+}
+
+static bool ranges_overlap(u64 base_a, u64 size_a, u64 base_b, u64 size_b) {
+  return base_a < base_b + size_b && base_b < base_a + size_a;
+}
+
+// Maps a device into the physical address space. Devices may not overlap with
+// RAM or with each other.
+bool memory_add_device(struct Memory *mem, const struct Device *device) {
+  if (MAX_DEVICES == mem->num_devices) {
+    fprintf(stderr, "Too many devices, can not add %s\n", device->name);
+    return false;
+  }
+  if (ranges_overlap(device->base, device->size, mem->ram_base, mem->size)) {
+    fprintf(stderr, "Device %s overlaps with RAM\n", device->name);
+    return false;
+  }
+  u32 i = 0;
+  for (; i < mem->num_devices; i++) {
+    const struct Device *other = &mem->devices[i];
+    if (ranges_overlap(device->base, device->size, other->base, other->size)) {
+      fprintf(stderr, "Device %s overlaps with %s\n", device->name,
+              other->name);
+      return false;
+    }
+    if (device->base < other->base) {
+      break;
+    }
+  }
+  memmove(&mem->devices[i + 1], &mem->devices[i],
+          (mem->num_devices - i) * sizeof(struct Device));
+  mem->devices[i] = *device;
+  mem->num_devices++;
+  return true;
+}
+
+void memory_halt(struct Memory *mem, int exit_status) {
+  // Everyone reads the status after joining the harts
+  if (!__atomic_exchange_n(&mem->halted, true, __ATOMIC_RELAXED)) {
+    mem->exit_status = exit_status;
+  }
+}
+
+// Binary search of the device table, returns NULL if no device covers the
+// whole access.
+static struct Device *find_device(struct Memory *mem, u64 address,
+                                  u8 length) {
+  u32 low = 0;
+  u32 high = mem->num_devices;
+  while (low < high) {
+    u32 middle = low + (high - low) / 2;
+    struct Device *device = &mem->devices[middle];
+    if (address < device->base) {
+      high = middle;
+    } else if (address - device->base >= device->size) {
+      low = middle + 1;
+    } else {
+      if (length > device->size - (address - device->base)) {
+        return NULL;
+      }
+      return device;
+    }
+  }
+  return NULL;
+}
+
+// Marks the page as containing decoded code and returns its generation.
+u32 memory_mark_code(struct Memory *mem, u64 address) {
+  u32 *gen = memory_code_gen_ptr(mem, address);
+  if (!gen) {
+    return 0;
+  }
+  // Harts decoding and writing the same page race here, the generation may
+  // only move from even to odd once.
+  u32 value = __atomic_load_n(gen, __ATOMIC_ACQUIRE);
+  while (!(value & 1) &&
+         !__atomic_compare_exchange_n(gen, &value, value + 1, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+  }
+  return value | 1;
+}
+
+// Invalidates the decoded code in the pages covered by the write.
+void memory_invalidate_code(struct Memory *mem, u64 destination, u64 length) {
+  u64 first = (destination - mem->ram_base) >> PAGE_SHIFT;
+  u64 last = (destination - mem->ram_base + length - 1) >> PAGE_SHIFT;
+  for (u64 page = first; page <= last; page++) {
+    u32 *gen = &mem->code_gen[page];
+    u32 value = __atomic_load_n(gen, __ATOMIC_ACQUIRE);
+    while ((value & 1) &&
+           !__atomic_compare_exchange_n(gen, &value, value + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+  }
+}
+
+void memory_mark_dirty(struct Memory *mem, u64 destination, u64 length) {
+  if (0 == length) {
+    return;
+  }
+  u64 first = (destination - mem->ram_base) >> PAGE_SHIFT;
+  u64 last = (destination - mem->ram_base + length - 1) >> PAGE_SHIFT;
+  for (u64 page = first; page <= last; page++) {
+    // Keeps the cache line shared between harts once the page is dirty
+    if (!memory_page_dirty(mem, page)) {
+      __atomic_store_n(&mem->dirty[page], 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Skips eight clean pages at a time
+u64 memory_next_dirty(const struct Memory *mem, u64 page) {
+  u64 pages = mem->size >> PAGE_SHIFT;
+  while (page < pages) {
+    u64 word;
+    if (0 == page % sizeof(word) && page + sizeof(word) <= pages) {
+      memcpy(&word, &mem->dirty[page], sizeof(word));
+      if (0 == word) {
+        page += sizeof(word);
+        continue;
+      }
+    }
+    if (mem->dirty[page]) {
+      return page;
+    }
+    page++;
+  }
+  return pages;
+}
+
+void memory_clear_dirty(struct Memory *mem) {
+  memset(mem->dirty, 0, mem->size >> PAGE_SHIFT);
+}
+
+// Finds the next run of dirty pages at or after *first, returns false if
+// there is none
+static bool next_dirty_run(const struct Memory *mem, u64 *first, u64 *end) {
+  u64 pages = mem->size >> PAGE_SHIFT;
+  *first = memory_next_dirty(mem, *first);
+  if (*first == pages) {
+    return false;
+  }
+  for (*end = *first + 1; *end < pages && mem->dirty[*end]; (*end)++) {
+  }
+  return true;
+}
+
+void memory_reset_dirty(struct Memory *mem, const u8 *baseline) {
+  u64 first = 0;
+  u64 end;
+  for (; next_dirty_run(mem, &first, &end); first = end) {
+    u64 offset = first << PAGE_SHIFT;
+    u64 length = (end - first) << PAGE_SHIFT;
+    memcpy(mem->ram + offset, baseline + offset, length);
+    memory_invalidate_code(mem, mem->ram_base + offset, length);
+  }
+  memory_clear_dirty(mem);
+}
+
+u8 *memory_save_baseline(struct Memory *mem) {
+  // Only the dirty pages take up memory in the copy
+  u8 *baseline = mmap(NULL, mem->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == baseline) {
+    perror("mmap");
+    return NULL;
+  }
+  u64 first = 0;
+  u64 end;
+  for (; next_dirty_run(mem, &first, &end); first = end) {
+    u64 offset = first << PAGE_SHIFT;
+    memcpy(baseline + offset, mem->ram + offset, (end - first) << PAGE_SHIFT);
+  }
+  memory_clear_dirty(mem);
+  return baseline;
+}
+
+void memory_free_baseline(struct Memory *mem, u8 *baseline) {
+  if (-1 == munmap(baseline, mem->size)) {
+    perror("munmap");
+  }
+}
+
+// Accesses that are not entirely inside of RAM end up here from the typed
+// accessors in mmu.h.
+void memory_write_slow(struct Memory *mem, u64 destination, u64 value,
+                       u8 length) {
+  struct Device *device = find_device(mem, destination, length);
+  if (!device || !device->write) {
+    printf("Invalid write of %d bytes to %lx\n", length, destination);
+    assert(0);
+    return;
+  }
+  device->write(device->opaque, destination - device->base, value, length);
+}
+
+u64 memory_read_slow(struct Memory *mem, u64 source, u8 length) {
+  struct Device *device = find_device(mem, source, length);
+  if (!device || !device->read) {
+    printf("Invalid read of %d bytes from %lx\n", length, source);
+    assert(0);
+    return 0;
+  }
+  return device->read(device->opaque, source - device->base, length);
+}
+
+// Bounds checked memory write for copies of arbitrary length.
 void memory_write(struct Memory *mem, u64 destination, void *buffer,
                   u64 length) {
-  U64_OVERFLOW_CHECK(destination, length, goto write_fail);
+  if (ram_contains(mem, destination, length)) {
+    memcpy(mem->ram + (destination - mem->ram_base), buffer, length);
+    memory_mark_dirty(mem, destination, length);
+    memory_invalidate_code(mem, destination, length);
+    return;
+  }
+  assert(length <= sizeof(u64));
+  u64 value = 0;
+  memcpy(&value, buffer, length);
+  memory_write_slow(mem, destination, value, length);
+}
 
-  // TODO: Make this more general and not hardcoded
-  if (Ns16650a_BASE == destination) {
-    write(STDOUT_FILENO, buffer, 1);
+// Bounds checked memory read for copies of arbitrary length.
+void memory_read(struct Memory *mem, u64 source, void *buffer, u64 length) {
+  if (ram_contains(mem, source, length)) {
+    memcpy(buffer, mem->ram + (source - mem->ram_base), length);
     return;
   }
+  assert(length <= sizeof(u64));
+  u64 value = memory_read_slow(mem, source, length);
+  memcpy(buffer, &value, length);
+}
+
+#define PTE_V (1 << 0)
+#define PTE_R (1 << 1)
+#define PTE_W (1 << 2)
+#define PTE_X (1 << 3)
+#define PTE_U (1 << 4)
+#define PTE_A (1 << 6)
+#define PTE_D (1 << 7)
+#define PTE_PPN_SHIFT 10
+#define PTE_PPN_MASK ((1ULL << 44) - 1)
+// Bits used by Svpbmt and Svnapot, which are not supported
+#define PTE_RESERVED (~0ULL << 54)
 
-  U64_OVERFLOW_CHECK(destination, (u64)mem->ram, goto write_fail);
-  U64_OVERFLOW_CHECK(length, (u64)mem->ram, goto write_fail);
+static u32 tlb_index(u8 priv) {
+  return PRIV_M == priv ? 2 : priv;
+}
+
+void mmu_init(struct Mmu *mmu) {
+  mmu->satp = 0;
+  mmu->sum = false;
+  mmu->mxr = false;
+  mmu->fault_address = 0;
+  mmu_flush(mmu);
+  mmu_set_mode(mmu, PRIV_M, PRIV_M, false, false);
+}
 
-  if (destination + length >= mem->size) {
-    goto write_fail;
+void mmu_flush(struct Mmu *mmu) {
+  memset(mmu->tlb, 0xFF, sizeof(mmu->tlb));
+  mmu->superpages = false;
+}
+
+// Drops every entry that came from a superpage containing the address
+static void flush_superpages(struct Mmu *mmu, u64 address) {
+  bool remaining = false;
+  for (u32 i = 0; i < 3; i++) {
+    for (u32 j = 0; j < TLB_SIZE; j++) {
+      struct TlbEntry *entry = &mmu->tlb[i][j];
+      u8 level = mmu->tlb_level[i][j];
+      u64 page = TLB_INVALID;
+      for (u32 access = 0; access < 3; access++) {
+        if (TLB_INVALID != entry->tag[access]) {
+          page = entry->tag[access];
+        }
+      }
+      if (0 == level || TLB_INVALID == page) {
+        continue;
+      }
+      u64 mask = ~((PAGE_SIZE << (9 * level)) - 1);
+      if ((page & mask) != (address & mask)) {
+        remaining = true;
+        continue;
+      }
+      for (u32 access = 0; access < 3; access++) {
+        entry->tag[access] = TLB_INVALID;
+      }
+    }
   }
-  memcpy(mem->ram + destination, buffer, length);
-  return;
-write_fail:
-#ifdef DEBUG
-  assert(0);
-#else
-  assert(0);
-  return;
-#endif
+  mmu->superpages = remaining;
 }
 
-// Bounds checked memory read for instructions to use.
-void memory_read(struct Memory *mem, u64 source, void *buffer, u64 length) {
-  U64_OVERFLOW_CHECK(source, (u64)mem->ram, goto read_fail);
-  U64_OVERFLOW_CHECK(length, (u64)mem->ram, goto read_fail);
-  U64_OVERFLOW_CHECK(source, length, goto read_fail);
-
-  if (source + length >= mem->size) {
-    goto read_fail;
-  }
-  memcpy(buffer, mem->ram + source, length);
-  return;
-read_fail:
-  memset(buffer, 0, length);
-#ifdef DEBUG
-  assert(0);
-#else
-  assert(0);
-  return;
-#endif
+// Drops the translations of the page containing the address, and of the whole
+// superpage if it is part of one
+void mmu_flush_page(struct Mmu *mmu, u64 address) {
+  if (mmu->superpages) {
+    flush_superpages(mmu, address);
+  }
+  u64 page = address & ~(u64)(PAGE_SIZE - 1);
+  for (u32 i = 0; i < 3; i++) {
+    struct TlbEntry *entry = tlb_entry(mmu->tlb[i], address);
+    for (u32 access = 0; access < 3; access++) {
+      if (entry->tag[access] == page) {
+        entry->tag[access] = TLB_INVALID;
+      }
+    }
+  }
+}
+
+void mmu_set_satp(struct Mmu *mmu, u64 satp) {
+  mmu->satp = satp;
+  mmu_flush(mmu);
+}
+
+void mmu_set_mode(struct Mmu *mmu, u8 fetch_priv, u8 data_priv, bool sum,
+                  bool mxr) {
+  // The cached permissions depend on SUM and MXR
+  if (sum != mmu->sum || mxr != mmu->mxr) {
+    mmu_flush(mmu);
+  }
+  mmu->fetch_priv = fetch_priv;
+  mmu->data_priv = data_priv;
+  mmu->sum = sum;
+  mmu->mxr = mxr;
+  mmu->fetch = mmu->tlb[tlb_index(fetch_priv)];
+  mmu->data = mmu->tlb[tlb_index(data_priv)];
+}
+
+static bool leaf_allows(const struct Mmu *mmu, u64 pte, enum Access access,
+                        u8 priv) {
+  if (PRIV_U == priv) {
+    if (!(pte & PTE_U)) {
+      return false;
+    }
+  } else if (pte & PTE_U) {
+    // Supervisor mode may only read and write user pages if SUM is set
+    if (ACCESS_EXECUTE == access || !mmu->sum) {
+      return false;
+    }
+  }
+  switch (access) {
+  case ACCESS_READ:
+    return (pte & PTE_R) || (mmu->mxr && (pte & PTE_X));
+  case ACCESS_WRITE:
+    return pte & PTE_W;
+  case ACCESS_EXECUTE:
+    return pte & PTE_X;
+  }
+  return false;
+}
+
+// Returns the level of the leaf PTE in level_out, 0 for a 4 KiB page
+static enum MmuResult walk(struct Mmu *mmu, struct Memory *mem, u64 address,
+                           enum Access access, u8 priv, u64 *physical,
+                           u8 *level_out) {
+  u64 mode = mmu->satp >> SATP_MODE_SHIFT;
+  *level_out = 0;
+  if (PRIV_M == priv || SATP_MODE_BARE == mode) {
+    *physical = address;
+    return MMU_OK;
+  }
+  i32 levels = SATP_MODE_SV39 == mode ? 3 : 4;
+  u32 unused_bits = 64 - (PAGE_SHIFT + 9 * levels);
+  // Virtual addresses have to be sign extended from their top bit
+  if ((u64)((i64)(address << unused_bits) >> unused_bits) != address) {
+    return MMU_PAGE_FAULT;
+  }
+  u64 table = (mmu->satp & SATP_PPN_MASK) << PAGE_SHIFT;
+  for (i32 level = levels - 1; level >= 0; level--) {
+    u32 shift = PAGE_SHIFT + 9 * level;
+    u64 pte_address = table + ((address >> shift) & 0x1FF) * sizeof(u64);
+    if (!ram_contains(mem, pte_address, sizeof(u64))) {
+      return MMU_ACCESS_FAULT;
+    }
+    u64 *host = (u64 *)(mem->ram + (pte_address - mem->ram_base));
+    // Other harts may update the page tables concurrently
+    u64 pte = __atomic_load_n(host, __ATOMIC_ACQUIRE);
+    if (!(pte & PTE_V) || ((pte & PTE_W) && !(pte & PTE_R)) ||
+        (pte & PTE_RESERVED)) {
+      return MMU_PAGE_FAULT;
+    }
+    u64 ppn = (pte >> PTE_PPN_SHIFT) & PTE_PPN_MASK;
+    if (!(pte & (PTE_R | PTE_X))) {
+      table = ppn << PAGE_SHIFT;
+      continue;
+    }
+    u64 superpage_mask = (1ULL << (9 * level)) - 1;
+    if (!leaf_allows(mmu, pte, access, priv) || (ppn & superpage_mask)) {
+      return MMU_PAGE_FAULT;
+    }
+    u64 flags = PTE_A | (ACCESS_WRITE == access ? PTE_D : 0);
+    if ((pte & flags) != flags) {
+      // Hardware update of the accessed and dirty bits. If the entry changed
+      // under us the walk starts over.
+      if (!__atomic_compare_exchange_n(host, &pte, pte | flags, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return walk(mmu, mem, address, access, priv, physical, level_out);
+      }
+      memory_invalidate_code(mem, pte_address, sizeof(u64));
+      memory_mark_dirty(mem, pte_address, sizeof(u64));
+    }
+    ppn |= (address >> PAGE_SHIFT) & superpage_mask;
+    *level_out = level;
+    *physical = (ppn << PAGE_SHIFT) | (address & (PAGE_SIZE - 1));
+    return MMU_OK;
+  }
+  return MMU_PAGE_FAULT;
+}
+
+static void tlb_fill(struct TlbEntry *entry, u64 page, u64 addend,
+                     enum Access access) {
+  if (entry->addend != addend) {
+    for (u32 i = 0; i < 3; i++) {
+      entry->tag[i] = TLB_INVALID;
+    }
+    entry->addend = addend;
+  }
+  entry->tag[access] = page;
+  // Writable pages are always readable
+  if (ACCESS_WRITE == access) {
+    entry->tag[ACCESS_READ] = page;
+  }
+}
+
+enum MmuResult mmu_translate(struct Mmu *mmu, struct Memory *mem, u64 address,
+                             enum Access access, u64 *physical) {
+  bool fetch = ACCESS_EXECUTE == access;
+  u8 priv = fetch ? mmu->fetch_priv : mmu->data_priv;
+  u8 level;
+  enum MmuResult result =
+      walk(mmu, mem, address, access, priv, physical, &level);
+  if (MMU_OK != result) {
+    mmu->fault_address = address;
+    return result;
+  }
+  u64 physical_page = *physical & ~(u64)(PAGE_SIZE - 1);
+  u64 page = address & ~(u64)(PAGE_SIZE - 1);
+  if (ram_contains(mem, physical_page, PAGE_SIZE) &&
+      (fetch || !mem->gdb || !gdb_page_watched(mem->gdb, page))) {
+    u8 *host = mem->ram + (physical_page - mem->ram_base);
+    // The write that filled the entry is about to dirty the page, so the
+    // hits that follow do not have to mark it
+    if (ACCESS_WRITE == access) {
+      memory_mark_dirty(mem, physical_page, PAGE_SIZE);
+    }
+    tlb_fill(tlb_entry(fetch ? mmu->fetch : mmu->data, address), page,
+             (u64)(uintptr_t)host - page, access);
+    mmu->tlb_level[tlb_index(priv)][(address >> PAGE_SHIFT) & (TLB_SIZE - 1)] =
+        level;
+    if (0 != level) {
+      mmu->superpages = true;
+    }
+  }
+  return MMU_OK;
+}
+
+// Translates both halves of an access that may cross a page. Returns the
+// number of bytes in the first page in split.
+static enum MmuResult translate_access(struct Mmu *mmu, struct Memory *mem,
+                                       u64 address, u8 length,
+                                       enum Access access, u64 physical[2],
+                                       u8 *split) {
+  u64 left = PAGE_SIZE - (address & (PAGE_SIZE - 1));
+  *split = left < length ? left : length;
+  enum MmuResult result =
+      mmu_translate(mmu, mem, address, access, &physical[0]);
+  if (MMU_OK != result || *split == length) {
+    return result;
+  }
+  return mmu_translate(mmu, mem, address + *split, access, &physical[1]);
+}
+
+static bool physical_read(struct Memory *mem, u64 address, u8 length,
+                          u64 *value) {
+  *value = 0;
+  if (ram_contains(mem, address, length)) {
+    memcpy(value, mem->ram + (address - mem->ram_base), length);
+    return true;
+  }
+  struct Device *device = find_device(mem, address, length);
+  if (!device || !device->read) {
+    return false;
+  }
+  *value = device->read(device->opaque, address - device->base, length);
+  return true;
+}
+
+static bool physical_write(struct Memory *mem, u64 address, u64 value,
+                           u8 length) {
+  if (ram_contains(mem, address, length)) {
+    memcpy(mem->ram + (address - mem->ram_base), &value, length);
+    memory_mark_dirty(mem, address, length);
+    memory_invalidate_code(mem, address, length);
+    return true;
+  }
+  struct Device *device = find_device(mem, address, length);
+  if (!device || !device->write) {
+    return false;
+  }
+  device->write(device->opaque, address - device->base, value, length);
+  return true;
+}
+
+enum MmuResult mmu_read_slow(struct Mmu *mmu, struct Memory *mem, u64 address,
+                             u8 length, u64 *value) {
+  u64 physical[2];
+  u8 split;
+  enum MmuResult result = translate_access(mmu, mem, address, length,
+                                           ACCESS_READ, physical, &split);
+  if (MMU_OK != result) {
+    return result;
+  }
+  if (unlikely(mem->gdb) &&
+      gdb_watchpoint_at(mem->gdb, address, length, ACCESS_READ,
+                        &mmu->fault_address)) {
+    return MMU_WATCHPOINT;
+  }
+  u64 high = 0;
+  if (!physical_read(mem, physical[0], split, value) ||
+      (split < length &&
+       !physical_read(mem, physical[1], length - split, &high))) {
+    mmu->fault_address = address;
+    return MMU_ACCESS_FAULT;
+  }
+  if (split < length) {
+    *value |= high << (8 * split);
+  }
+  return MMU_OK;
+}
+
+enum MmuResult mmu_write_slow(struct Mmu *mmu, struct Memory *mem,
+                              u64 address, u64 value, u8 length) {
+  u64 physical[2];
+  u8 split;
+  enum MmuResult result = translate_access(mmu, mem, address, length,
+                                           ACCESS_WRITE, physical, &split);
+  if (MMU_OK != result) {
+    return result;
+  }
+  if (unlikely(mem->gdb) &&
+      gdb_watchpoint_at(mem->gdb, address, length, ACCESS_WRITE,
+                        &mmu->fault_address)) {
+    return MMU_WATCHPOINT;
+  }
+  if (!physical_write(mem, physical[0], value, split) ||
+      (split < length &&
+       !physical_write(mem, physical[1], value >> (8 * split),
+                       length - split))) {
+    mmu->fault_address = address;
+    return MMU_ACCESS_FAULT;
+  }
+  return MMU_OK;
+}
+
+enum MmuResult mmu_host_address_slow(struct Mmu *mmu, struct Memory *mem,
+                                     u64 address, u8 length,
+                                     enum Access access, void **host) {
+  u64 physical;
+  enum MmuResult result = mmu_translate(mmu, mem, address, access, &physical);
+  if (MMU_OK != result) {
+    return result;
+  }
+  if (!ram_contains(mem, physical, length)) {
+    mmu->fault_address = address;
+    return MMU_ACCESS_FAULT;
+  }
+  if (unlikely(mem->gdb) &&
+      gdb_watchpoint_at(mem->gdb, address, length, access,
+                        &mmu->fault_address)) {
+    return MMU_WATCHPOINT;
+  }
+  *host = mem->ram + (physical - mem->ram_base);
+  return MMU_OK;
 }
@@ -1,12 +1,328 @@
+#ifndef MMU_H
+#define MMU_H
 #include "types.h"
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// Privilege levels, encoded the same way as in mstatus.MPP
+#define PRIV_U 0
+#define PRIV_S 1
+#define PRIV_M 3
+
+#define SATP_MODE_SHIFT 60
+#define SATP_MODE_BARE 0
+#define SATP_MODE_SV39 8
+#define SATP_MODE_SV48 9
+#define SATP_PPN_MASK ((1ULL << 44) - 1)
+
+#define TLB_BITS 8
+#define TLB_SIZE (1 << TLB_BITS)
+// Tag of an empty TLB entry, never equal to a masked address
+#define TLB_INVALID (~0ULL)
+// Keeps the page and the bits that make an access of the given size
+// misaligned, so that only aligned accesses can hit in the TLB.
+#define TLB_MASK(_size) (~(u64)(PAGE_SIZE - 1) | ((_size) - 1))
+
+#define MAX_DEVICES 16
+
+struct Gdb;
+
+// Host pages backing RAM
+enum RamPages {
+  RAM_PAGES_DEFAULT,
+  // Transparent huge pages
+  RAM_PAGES_THP,
+  // Preallocated pages from hugetlbfs
+  RAM_PAGES_HUGETLB,
+};
+
+// A memory mapped device. The offsets passed to the callbacks are relative to
+// the base of the device.
+struct Device {
+  const char *name;
+  u64 base;
+  u64 size;
+  void *opaque;
+  u64 (*read)(void *opaque, u64 offset, u8 length);
+  void (*write)(void *opaque, u64 offset, u64 value, u8 length);
+};
 
 struct Memory {
   u8 *ram;
+  // Guest physical address of the first byte of RAM
+  u64 ram_base;
   u64 size;
+  enum RamPages pages;
+  // Set once parts of RAM are private mappings of a file, an ELF segment or
+  // a snapshot, see memory_zero()
+  bool file_backed;
+  // Per page generation used to invalidate decoded code. An odd value means
+  // that the page has been decoded by the translation cache since it was last
+  // written to. Shared by all harts, so it is only accessed atomically.
+  u32 *code_gen;
+  // One byte per page, set once the page has been written to since the last
+  // memory_clear_dirty(). The TLBs only allow writes to pages that are
+  // already dirty, so the first write to a clean page always takes the slow
+  // path which marks it. Only accessed atomically.
+  u8 *dirty;
+  // Everything outside of RAM, sorted by base
+  struct Device devices[MAX_DEVICES];
+  u32 num_devices;
+  // Set once the run is over, every hart returns from cpu_loop() at its next
+  // block. Only accessed atomically.
+  bool halted;
+  // Exit status of the emulator, set by the first memory_halt()
+  int exit_status;
+  // Set while another thread needs every hart to park, see cpu_pause(). Only
+  // accessed atomically.
+  bool pause;
+  // Harts inside of cpu_loop() and how many of them are parked, protected by
+  // pause_lock
+  u64 running_harts;
+  u64 parked_harts;
+  pthread_mutex_t pause_lock;
+  pthread_cond_t pause_changed;
+  // The debugger, NULL without one
+  struct Gdb *gdb;
+};
+
+enum Access {
+  ACCESS_READ,
+  ACCESS_WRITE,
+  ACCESS_EXECUTE,
+};
+
+enum MmuResult {
+  MMU_OK,
+  MMU_PAGE_FAULT,
+  MMU_ACCESS_FAULT,
+  // The access touches a watchpoint of the debugger and has to stop before
+  // it is done, see struct Gdb
+  MMU_WATCHPOINT,
 };
 
-bool ram_init(struct Memory *mem, u64 size);
+// A virtual page that translates to a page of RAM. The tags hold the address
+// of the virtual page for every kind of access that is allowed and
+// TLB_INVALID otherwise. Writes are only cached for dirty pages, see
+// struct Memory.
+struct TlbEntry {
+  u64 tag[3];
+  // Added to a virtual address to get the host address
+  u64 addend;
+};
+
+// Address translation state of a hart. Every access first goes through a
+// direct mapped software TLB and only misses walk the page tables. Pages
+// outside of RAM are never cached, so device accesses always take the slow
+// path, and neither are the pages with a watchpoint for loads and stores.
+struct Mmu {
+  u64 satp;
+  // Privilege used for instruction fetches and for loads and stores, which
+  // differ when mstatus.MPRV is set
+  u8 fetch_priv;
+  u8 data_priv;
+  // mstatus.SUM and mstatus.MXR
+  bool sum;
+  bool mxr;
+  // Virtual address of the last access that failed
+  u64 fault_address;
+  struct TlbEntry *fetch;
+  struct TlbEntry *data;
+  // One TLB per privilege level so that traps do not need a flush
+  struct TlbEntry tlb[3][TLB_SIZE];
+  // Level of the leaf PTE that each TLB entry came from, 0 for a 4 KiB page.
+  // Superpages are cached one 4 KiB page at a time, see mmu_flush_page().
+  u8 tlb_level[3][TLB_SIZE];
+  // Whether any of the entries may have come from a superpage
+  bool superpages;
+};
+
+bool ram_init(struct Memory *mem, u64 base, u64 size, enum RamPages pages);
+void memory_zero(struct Memory *mem, u64 address, u64 length);
+bool memory_add_device(struct Memory *mem, const struct Device *device);
+// Ends the run of all harts, safe to call from any of them
+void memory_halt(struct Memory *mem, int exit_status);
 void memory_write(struct Memory *mem, u64 destination, void *buffer,
                   u64 length);
 void memory_read(struct Memory *mem, u64 source, void *buffer, u64 length);
+void memory_write_slow(struct Memory *mem, u64 destination, u64 value,
+                       u8 length);
+u64 memory_read_slow(struct Memory *mem, u64 source, u8 length);
+u32 memory_mark_code(struct Memory *mem, u64 address);
+void memory_invalidate_code(struct Memory *mem, u64 destination, u64 length);
+void memory_mark_dirty(struct Memory *mem, u64 destination, u64 length);
+// The harts have to be stopped and their TLBs flushed before they run again,
+// which makes their next write to every page mark it again.
+void memory_clear_dirty(struct Memory *mem);
+// Copies the dirty pages back from baseline, a host copy of RAM that matches
+// RAM everywhere else, and clears the dirty set like memory_clear_dirty().
+void memory_reset_dirty(struct Memory *mem, const u8 *baseline);
+// Returns a copy of RAM for memory_reset_dirty() and clears the dirty set.
+// Pages that are not dirty are taken to be zero, as they are after
+// ram_init().
+u8 *memory_save_baseline(struct Memory *mem);
+// Unmaps a baseline of the size of RAM
+void memory_free_baseline(struct Memory *mem, u8 *baseline);
+// Index of the first dirty page at or after page, the number of pages of RAM
+// if there is none
+u64 memory_next_dirty(const struct Memory *mem, u64 page);
+
+static inline bool ram_contains(const struct Memory *mem, u64 address,
+                                u64 length) {
+  u64 offset = address - mem->ram_base;
+  return length <= mem->size && offset <= mem->size - length;
+}
+
+static inline bool memory_halted(const struct Memory *mem) {
+  return __atomic_load_n(&mem->halted, __ATOMIC_RELAXED);
+}
+
+static inline bool memory_pausing(const struct Memory *mem) {
+  return __atomic_load_n(&mem->pause, __ATOMIC_SEQ_CST);
+}
+
+static inline bool memory_page_dirty(const struct Memory *mem, u64 page) {
+  return __atomic_load_n(&mem->dirty[page], __ATOMIC_RELAXED);
+}
+
+// Generation of the page at the given offset into RAM
+static inline u32 memory_page_gen(const struct Memory *mem, u64 offset) {
+  return __atomic_load_n(&mem->code_gen[offset >> PAGE_SHIFT],
+                         __ATOMIC_RELAXED);
+}
+
+// Typed accessors for the instructions. Accesses inside of RAM are a single
+// range check and a fixed size copy, everything else goes to the slow path.
+#define MEMORY_ACCESSORS(_bits)                                                \
+  static inline u##_bits memory_read##_bits(struct Memory *mem, u64 source) {  \
+    u64 offset = source - mem->ram_base;                                       \
+    if (likely(offset <= mem->size - sizeof(u##_bits))) {                      \
+      u##_bits value;                                                          \
+      memcpy(&value, mem->ram + offset, sizeof(value));                        \
+      return value;                                                            \
+    }                                                                          \
+    return memory_read_slow(mem, source, sizeof(u##_bits));                    \
+  }                                                                            \
+                                                                               \
+  static inline void memory_write##_bits(struct Memory *mem, u64 destination,  \
+                                         u##_bits value) {                     \
+    u64 offset = destination - mem->ram_base;                                  \
+    if (likely(offset <= mem->size - sizeof(u##_bits))) {                      \
+      memcpy(mem->ram + offset, &value, sizeof(value));                        \
+      if (unlikely(!memory_page_dirty(mem, offset >> PAGE_SHIFT) ||            \
+                   !memory_page_dirty(                                         \
+                       mem, (offset + sizeof(value) - 1) >> PAGE_SHIFT))) {    \
+        memory_mark_dirty(mem, destination, sizeof(value));                    \
+      }                                                                        \
+      if (unlikely((memory_page_gen(mem, offset) |                             \
+                    memory_page_gen(mem, offset + sizeof(value) - 1)) &        \
+                   1)) {                                                       \
+        memory_invalidate_code(mem, destination, sizeof(value));               \
+      }                                                                        \
+      return;                                                                  \
+    }                                                                          \
+    memory_write_slow(mem, destination, value, sizeof(u##_bits));              \
+  }
+
+MEMORY_ACCESSORS(8)
+MEMORY_ACCESSORS(16)
+MEMORY_ACCESSORS(32)
+MEMORY_ACCESSORS(64)
+#undef MEMORY_ACCESSORS
+
+// Returns NULL if the address is not in RAM
+static inline u32 *memory_code_gen_ptr(const struct Memory *mem, u64 address) {
+  if (!ram_contains(mem, address, 1)) {
+    return NULL;
+  }
+  return &mem->code_gen[(address - mem->ram_base) >> PAGE_SHIFT];
+}
+
+static inline u32 memory_code_gen(const struct Memory *mem, u64 address) {
+  u32 *gen = memory_code_gen_ptr(mem, address);
+  return gen ? __atomic_load_n(gen, __ATOMIC_ACQUIRE) : 0;
+}
+void mmu_init(struct Mmu *mmu);
+void mmu_flush(struct Mmu *mmu);
+void mmu_flush_page(struct Mmu *mmu, u64 address);
+void mmu_set_satp(struct Mmu *mmu, u64 satp);
+void mmu_set_mode(struct Mmu *mmu, u8 fetch_priv, u8 data_priv, bool sum,
+                  bool mxr);
+enum MmuResult mmu_translate(struct Mmu *mmu, struct Memory *mem, u64 address,
+                             enum Access access, u64 *physical);
+enum MmuResult mmu_read_slow(struct Mmu *mmu, struct Memory *mem, u64 address,
+                             u8 length, u64 *value);
+enum MmuResult mmu_write_slow(struct Mmu *mmu, struct Memory *mem,
+                              u64 address, u64 value, u8 length);
+enum MmuResult mmu_host_address_slow(struct Mmu *mmu, struct Memory *mem,
+                                     u64 address, u8 length,
+                                     enum Access access, void **host);
+
+static inline struct TlbEntry *tlb_entry(struct TlbEntry *tlb, u64 address) {
+  return &tlb[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+}
+
+// Virtual memory accessors used by the instructions. A TLB hit is a compare
+// and an add, everything else goes to the slow path which walks the page
+// tables and handles devices and misaligned accesses.
+#define MMU_ACCESSORS(_bits)                                                   \
+  static inline enum MmuResult mmu_read##_bits(                                \
+      struct Mmu *mmu, struct Memory *mem, u64 address, u##_bits *value) {     \
+    const struct TlbEntry *entry = tlb_entry(mmu->data, address);              \
+    if (likely((address & TLB_MASK(sizeof(u##_bits))) ==                       \
+               entry->tag[ACCESS_READ])) {                                     \
+      memcpy(value, (void *)(uintptr_t)(address + entry->addend),              \
+             sizeof(*value));                                                  \
+      return MMU_OK;                                                           \
+    }                                                                          \
+    u64 wide;                                                                  \
+    enum MmuResult result =                                                    \
+        mmu_read_slow(mmu, mem, address, sizeof(*value), &wide);               \
+    *value = wide;                                                             \
+    return result;                                                             \
+  }                                                                            \
+                                                                               \
+  static inline enum MmuResult mmu_write##_bits(                               \
+      struct Mmu *mmu, struct Memory *mem, u64 address, u##_bits value) {      \
+    const struct TlbEntry *entry = tlb_entry(mmu->data, address);              \
+    if (likely((address & TLB_MASK(sizeof(u##_bits))) ==                       \
+               entry->tag[ACCESS_WRITE])) {                                    \
+      u8 *host = (u8 *)(uintptr_t)(address + entry->addend);                   \
+      memcpy(host, &value, sizeof(value));                                     \
+      u64 offset = host - mem->ram;                                            \
+      if (unlikely(memory_page_gen(mem, offset) & 1)) {                        \
+        memory_invalidate_code(mem, mem->ram_base + offset, sizeof(value));    \
+      }                                                                        \
+      return MMU_OK;                                                           \
+    }                                                                          \
+    return mmu_write_slow(mmu, mem, address, value, sizeof(value));            \
+  }
+
+MMU_ACCESSORS(8)
+MMU_ACCESSORS(16)
+MMU_ACCESSORS(32)
+MMU_ACCESSORS(64)
+#undef MMU_ACCESSORS
+
+// Translates an aligned access to the host address it maps to, for the atomic
+// instructions which operate on host memory directly. Anything outside of
+// RAM is an access fault.
+static inline enum MmuResult mmu_host_address(struct Mmu *mmu,
+                                              struct Memory *mem, u64 address,
+                                              u8 length, enum Access access,
+                                              void **host) {
+  const struct TlbEntry *entry = tlb_entry(mmu->data, address);
+  if (likely((address & TLB_MASK(length)) == entry->tag[access])) {
+    *host = (void *)(uintptr_t)(address + entry->addend);
+    return MMU_OK;
+  }
+  return mmu_host_address_slow(mmu, mem, address, length, access, host);
+}
+#endif // MMU_H
@@ -0,0 +1,210 @@
+// Platform-level interrupt controller, routes the interrupts of the devices
+// to the external interrupts of the harts, see struct Plic.
+#include "plic.h"
+#include "cpu.h"
+#include "csr.h"
+#include "mmu.h"
+#include <stdio.h>
+#include <string.h>
+
+#define PLIC_PRIORITY 0x0
+#define PLIC_PENDING 0x1000
+#define PLIC_ENABLE 0x2000
+#define PLIC_ENABLE_STRIDE 0x80
+#define PLIC_CONTEXT 0x200000
+#define PLIC_CONTEXT_STRIDE 0x1000
+#define PLIC_THRESHOLD 0x0
+#define PLIC_CLAIM 0x4
+
+// Priorities and thresholds go from 0 to 7
+#define PLIC_PRIORITY_MASK 7
+// Source 0 can never be pending or enabled
+#define PLIC_SOURCE_MASK (~1U)
+
+// The interrupt of every context in mip, in the order of the contexts
+static const u64 context_interrupts[] = {MIP_MEIP, MIP_SEIP};
+
+// Source with the highest priority above the threshold that is pending and
+// enabled in the context, 0 if there is none. Ties go to the lowest source.
+static u32 best_source(const struct Plic *plic, u64 context) {
+  const struct CPU *cpu = &plic->cpus[context / 2];
+  u32 candidates =
+      plic->pending & ~plic->claimed & cpu->plic_enable[context % 2];
+  u32 best = 0;
+  u32 best_priority = cpu->plic_threshold[context % 2];
+  for (u32 source = 1; source < PLIC_SOURCES; source++) {
+    if ((candidates >> source & 1) && plic->priority[source] > best_priority) {
+      best = source;
+      best_priority = plic->priority[source];
+    }
+  }
+  return best;
+}
+
+// Must be called with the lock held whenever anything changed that could
+// change which contexts have an interrupt
+static void update(struct Plic *plic) {
+  for (u64 context = 0; context < 2 * plic->num_harts; context++) {
+    struct CPU *cpu = &plic->cpus[context / 2];
+    if (best_source(plic, context)) {
+      cpu_raise_interrupt(cpu, context_interrupts[context % 2]);
+    } else {
+      cpu_lower_interrupt(cpu, context_interrupts[context % 2]);
+    }
+  }
+}
+
+static u32 claim(struct Plic *plic, u64 context) {
+  u32 source = best_source(plic, context);
+  if (source) {
+    plic->pending &= ~(1U << source);
+    plic->claimed |= 1U << source;
+    update(plic);
+  }
+  return source;
+}
+
+static void complete(struct Plic *plic, u32 source) {
+  if (source >= PLIC_SOURCES || !(plic->claimed >> source & 1)) {
+    return;
+  }
+  plic->claimed &= ~(1U << source);
+  plic->pending |= plic->level & (1U << source);
+  update(plic);
+}
+
+static u64 plic_read(void *opaque, u64 offset, u8 length) {
+  struct Plic *plic = opaque;
+  if (sizeof(u32) != length) {
+    return 0;
+  }
+  u32 value = 0;
+  pthread_mutex_lock(&plic->lock);
+  if (offset < PLIC_PENDING) {
+    u64 source = (offset - PLIC_PRIORITY) / sizeof(u32);
+    if (source < PLIC_SOURCES) {
+      value = plic->priority[source];
+    }
+  } else if (PLIC_PENDING == offset) {
+    value = plic->pending;
+  } else if (offset >= PLIC_ENABLE && offset < PLIC_CONTEXT) {
+    u64 context = (offset - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+    if (context < 2 * plic->num_harts &&
+        0 == (offset - PLIC_ENABLE) % PLIC_ENABLE_STRIDE) {
+      value = plic->cpus[context / 2].plic_enable[context % 2];
+    }
+  } else if (offset >= PLIC_CONTEXT) {
+    u64 context = (offset - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+    u64 reg = (offset - PLIC_CONTEXT) % PLIC_CONTEXT_STRIDE;
+    if (context < 2 * plic->num_harts) {
+      if (PLIC_THRESHOLD == reg) {
+        value = plic->cpus[context / 2].plic_threshold[context % 2];
+      } else if (PLIC_CLAIM == reg) {
+        value = claim(plic, context);
+      }
+    }
+  }
+  pthread_mutex_unlock(&plic->lock);
+  return value;
+}
+
+static void plic_write(void *opaque, u64 offset, u64 value, u8 length) {
+  struct Plic *plic = opaque;
+  if (sizeof(u32) != length) {
+    return;
+  }
+  pthread_mutex_lock(&plic->lock);
+  if (offset < PLIC_PENDING) {
+    u64 source = (offset - PLIC_PRIORITY) / sizeof(u32);
+    if (source > 0 && source < PLIC_SOURCES) {
+      plic->priority[source] = value & PLIC_PRIORITY_MASK;
+      update(plic);
+    }
+  } else if (offset >= PLIC_ENABLE && offset < PLIC_CONTEXT) {
+    u64 context = (offset - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+    if (context < 2 * plic->num_harts &&
+        0 == (offset - PLIC_ENABLE) % PLIC_ENABLE_STRIDE) {
+      plic->cpus[context / 2].plic_enable[context % 2] =
+          value & PLIC_SOURCE_MASK;
+      update(plic);
+    }
+  } else if (offset >= PLIC_CONTEXT) {
+    u64 context = (offset - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+    u64 reg = (offset - PLIC_CONTEXT) % PLIC_CONTEXT_STRIDE;
+    if (context < 2 * plic->num_harts) {
+      if (PLIC_THRESHOLD == reg) {
+        plic->cpus[context / 2].plic_threshold[context % 2] =
+            value & PLIC_PRIORITY_MASK;
+        update(plic);
+      } else if (PLIC_CLAIM == reg) {
+        complete(plic, value);
+      }
+    }
+  }
+  pthread_mutex_unlock(&plic->lock);
+}
+
+bool plic_init(struct Plic *plic, struct Memory *mem, struct CPU *cpus,
+               u64 num_harts) {
+  if (num_harts > PLIC_MAX_HARTS) {
+    fprintf(stderr, "The PLIC supports at most %d harts\n", PLIC_MAX_HARTS);
+    return false;
+  }
+  pthread_mutex_init(&plic->lock, NULL);
+  plic->cpus = cpus;
+  plic->num_harts = num_harts;
+  plic->level = 0;
+  memset(plic->priority, 0, sizeof(plic->priority));
+  plic->pending = 0;
+  plic->claimed = 0;
+  if (!mem) {
+    return true;
+  }
+  struct Device device = {
+      .name = "plic",
+      .base = PLIC_BASE,
+      .size = PLIC_SIZE,
+      .opaque = plic,
+      .read = plic_read,
+      .write = plic_write,
+  };
+  return memory_add_device(mem, &device);
+}
+
+void plic_set_level(struct Plic *plic, u32 irq, bool high) {
+  u32 bit = 1U << irq;
+  pthread_mutex_lock(&plic->lock);
+  if (high) {
+    plic->level |= bit;
+    if (!(plic->claimed & bit)) {
+      plic->pending |= bit;
+    }
+  } else {
+    plic->level &= ~bit;
+    plic->pending &= ~bit;
+  }
+  update(plic);
+  pthread_mutex_unlock(&plic->lock);
+}
+
+void plic_save_state(struct Plic *plic, struct PlicState *state) {
+  pthread_mutex_lock(&plic->lock);
+  memcpy(state->priority, plic->priority, sizeof(state->priority));
+  state->pending = plic->pending;
+  state->claimed = plic->claimed;
+  pthread_mutex_unlock(&plic->lock);
+}
+
+void plic_restore_state(struct Plic *plic, const struct PlicState *state) {
+  pthread_mutex_lock(&plic->lock);
+  memcpy(plic->priority, state->priority, sizeof(plic->priority));
+  plic->pending = state->pending;
+  plic->claimed = state->claimed;
+  plic->level = 0;
+  update(plic);
+  pthread_mutex_unlock(&plic->lock);
+}
+
+void plic_destroy(struct Plic *plic) {
+  pthread_mutex_destroy(&plic->lock);
+}
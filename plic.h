@@ -0,0 +1,54 @@
+#ifndef PLIC_H
+#define PLIC_H
+#include "cpu.h"
+#include "mmu.h"
+#include "types.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+// Platform-level interrupt controller, at the same address and with the same
+// interrupt sources as on the QEMU virt machine
+#define PLIC_BASE 0xC000000
+#define PLIC_SIZE 0x4000000
+// Source 0 does not exist
+#define PLIC_SOURCES 32
+#define PLIC_IRQ_VIRTIO_BLK 1
+#define PLIC_IRQ_VIRTIO_NET 2
+#define PLIC_IRQ_UART 10
+// Every hart has a context for machine mode and one for supervisor mode,
+// which keeps the registers of all of them apart
+#define PLIC_MAX_HARTS 4095
+
+// All sources are level triggered. A source is pending while its line is
+// high and it has not been claimed, and it becomes pending again on
+// completion if the line is still high. The enable bits and the threshold of
+// every context are kept by the harts like mtimecmp, see struct CPU.
+struct Plic {
+  pthread_mutex_t lock;
+  struct CPU *cpus;
+  u64 num_harts;
+  // Lines of the devices, which set them again after a restore
+  u32 level;
+  u32 priority[PLIC_SOURCES];
+  u32 pending;
+  u32 claimed;
+};
+
+// Registers of the PLIC as seen by the guest, for snapshots
+struct PlicState {
+  u32 priority[PLIC_SOURCES];
+  u32 pending;
+  u32 claimed;
+};
+
+// mem is NULL if the registers are left out of the address space
+bool plic_init(struct Plic *plic, struct Memory *mem, struct CPU *cpus,
+               u64 num_harts);
+// Sets the line of a device, safe to call from any thread
+void plic_set_level(struct Plic *plic, u32 irq, bool high);
+void plic_save_state(struct Plic *plic, struct PlicState *state);
+// Clears the lines of the devices and updates the external interrupts of
+// the harts, which have to be stopped
+void plic_restore_state(struct Plic *plic, const struct PlicState *state);
+void plic_destroy(struct Plic *plic);
+#endif // PLIC_H
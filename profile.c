@@ -0,0 +1,231 @@
+// Guest execution profile, see struct Profile. Reports are sorted by the
+// number of executed instructions and name the function containing the code
+// when the image came with a symbol table.
+#include "profile.h"
+#include "cpu.h"
+#include "loader.h"
+#include "tcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_INITIAL_CAPACITY 4096
+// Number of lines in the sections listing code and functions
+#define PROFILE_TOP 20
+
+#define NAME_ENTRY(_name, _kind) #_name,
+static const char *const op_names[OP_COUNT] = {
+    INSTRUCTION_LIST(NAME_ENTRY) "block_end"};
+#undef NAME_ENTRY
+
+bool profile_init(struct Profile *profile) {
+  memset(profile->ops, 0, sizeof(profile->ops));
+  profile->entries =
+      calloc(PROFILE_INITIAL_CAPACITY, sizeof(struct ProfileEntry));
+  if (!profile->entries) {
+    perror("calloc");
+    return false;
+  }
+  profile->capacity = PROFILE_INITIAL_CAPACITY;
+  profile->used = 0;
+  profile->cache = NULL;
+  return true;
+}
+
+void profile_destroy(struct Profile *profile) {
+  free(profile->entries);
+}
+
+static struct ProfileEntry *find_slot(struct ProfileEntry *entries,
+                                      u64 capacity, u64 pc) {
+  u64 hash = ((pc >> 1) * 0x9E3779B97F4A7C15ULL) >> 32;
+  for (u64 i = hash;; i++) {
+    struct ProfileEntry *entry = &entries[i & (capacity - 1)];
+    if (0 == entry->count || entry->pc == pc) {
+      return entry;
+    }
+  }
+}
+
+static bool grow(struct Profile *profile) {
+  u64 capacity = 2 * profile->capacity;
+  struct ProfileEntry *entries = calloc(capacity, sizeof(struct ProfileEntry));
+  if (!entries) {
+    perror("calloc");
+    return false;
+  }
+  for (u64 i = 0; i < profile->capacity; i++) {
+    const struct ProfileEntry *entry = &profile->entries[i];
+    if (0 != entry->count) {
+      *find_slot(entries, capacity, entry->pc) = *entry;
+    }
+  }
+  free(profile->entries);
+  profile->entries = entries;
+  profile->capacity = capacity;
+  return true;
+}
+
+static void add_count(struct Profile *profile, u64 pc, u64 count) {
+  if (0 == count) {
+    return;
+  }
+  // Keep the table at most three quarters full. If it can not grow the new
+  // pcs are dropped once it is full.
+  if (4 * (profile->used + 1) > 3 * profile->capacity && !grow(profile) &&
+      profile->used + 1 == profile->capacity) {
+    return;
+  }
+  struct ProfileEntry *entry =
+      find_slot(profile->entries, profile->capacity, pc);
+  if (0 == entry->count) {
+    entry->pc = pc;
+    profile->used++;
+  }
+  entry->count += count;
+}
+
+static void add_block(struct Profile *profile, const struct Block *block) {
+  if (0 == block->length || 0 == block->executions) {
+    return;
+  }
+  for (u32 i = 0; i < block->length; i++) {
+    profile->ops[block->insts[i].op] += block->executions;
+  }
+  add_count(profile, block->pc, block->length * block->executions);
+}
+
+void profile_instruction(struct Profile *profile, u64 pc, u8 op) {
+  profile->ops[op]++;
+  add_count(profile, pc, 1);
+}
+
+void profile_retire(struct Profile *profile, struct Block *block) {
+  add_block(profile, block);
+  block->executions = 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const struct ProfileEntry *left = a;
+  const struct ProfileEntry *right = b;
+  if (left->count != right->count) {
+    return left->count < right->count ? 1 : -1;
+  }
+  return left->pc < right->pc ? -1 : left->pc > right->pc;
+}
+
+static double percent(u64 count, u64 total) {
+  return 100.0 * count / total;
+}
+
+static void report_handlers(const struct Profile *total, u64 instructions,
+                            FILE *out) {
+  struct ProfileEntry ops[OP_COUNT];
+  for (u32 op = 0; op < OP_COUNT; op++) {
+    ops[op].pc = op;
+    ops[op].count = total->ops[op];
+  }
+  qsort(ops, OP_COUNT, sizeof(ops[0]), compare_entries);
+  fprintf(out, "\nInstructions by handler:\n");
+  for (u32 i = 0; i < OP_COUNT && 0 != ops[i].count; i++) {
+    fprintf(out, "  %-12s %16lu %6.2f%%\n", op_names[ops[i].pc], ops[i].count,
+            percent(ops[i].count, instructions));
+  }
+}
+
+static void report_code(const struct ProfileEntry *entries, u64 count,
+                        u64 instructions, const struct SymbolTable *symbols,
+                        FILE *out) {
+  fprintf(out, "\nHottest code:\n");
+  for (u64 i = 0; i < count && i < PROFILE_TOP; i++) {
+    const struct Symbol *symbol = symbol_lookup(symbols, entries[i].pc);
+    char location[64] = "";
+    if (symbol) {
+      snprintf(location, sizeof(location), "%s+0x%lx", symbol->name,
+               entries[i].pc - symbol->address);
+    }
+    fprintf(out, "  %016lx %-32s %16lu %6.2f%%\n", entries[i].pc, location,
+            entries[i].count, percent(entries[i].count, instructions));
+  }
+}
+
+// The code is attributed to the function containing its first instruction,
+// everything outside of a known function is summed up as [unknown].
+static void report_functions(const struct ProfileEntry *entries, u64 count,
+                             u64 instructions,
+                             const struct SymbolTable *symbols, FILE *out) {
+  if (0 == symbols->count) {
+    return;
+  }
+  u64 unknown = symbols->count;
+  struct ProfileEntry *functions =
+      calloc(symbols->count + 1, sizeof(struct ProfileEntry));
+  if (!functions) {
+    perror("calloc");
+    return;
+  }
+  for (u64 i = 0; i <= symbols->count; i++) {
+    functions[i].pc = i;
+  }
+  for (u64 i = 0; i < count; i++) {
+    const struct Symbol *symbol = symbol_lookup(symbols, entries[i].pc);
+    functions[symbol ? (u64)(symbol - symbols->symbols) : unknown].count +=
+        entries[i].count;
+  }
+  qsort(functions, symbols->count + 1, sizeof(functions[0]), compare_entries);
+  fprintf(out, "\nHottest functions:\n");
+  for (u64 i = 0; i <= symbols->count && i < PROFILE_TOP; i++) {
+    if (0 == functions[i].count) {
+      break;
+    }
+    const char *name = unknown == functions[i].pc
+                           ? "[unknown]"
+                           : symbols->symbols[functions[i].pc].name;
+    fprintf(out, "  %-49s %16lu %6.2f%%\n", name, functions[i].count,
+            percent(functions[i].count, instructions));
+  }
+  free(functions);
+}
+
+void profile_report(const struct Profile *profiles, u64 num_profiles,
+                    const struct SymbolTable *symbols, FILE *out) {
+  // Merge the harts without touching their profiles, which are still in use
+  struct Profile total;
+  if (!profile_init(&total)) {
+    return;
+  }
+  for (u64 i = 0; i < num_profiles; i++) {
+    const struct Profile *profile = &profiles[i];
+    for (u32 op = 0; op < OP_COUNT; op++) {
+      total.ops[op] += profile->ops[op];
+    }
+    for (u64 j = 0; j < profile->capacity; j++) {
+      add_count(&total, profile->entries[j].pc, profile->entries[j].count);
+    }
+    if (profile->cache) {
+      for (u32 j = 0; j < TCACHE_SIZE; j++) {
+        add_block(&total, &profile->cache->blocks[j]);
+      }
+    }
+  }
+  u64 instructions = 0;
+  for (u32 op = 0; op < OP_COUNT; op++) {
+    instructions += total.ops[op];
+  }
+  fprintf(out, "Profile of %lu instructions\n", instructions);
+  if (0 != instructions) {
+    report_handlers(&total, instructions, out);
+    // Compact the table into the sorted list of code
+    u64 count = 0;
+    for (u64 i = 0; i < total.capacity; i++) {
+      if (0 != total.entries[i].count) {
+        total.entries[count++] = total.entries[i];
+      }
+    }
+    qsort(total.entries, count, sizeof(struct ProfileEntry), compare_entries);
+    report_code(total.entries, count, instructions, symbols, out);
+    report_functions(total.entries, count, instructions, symbols, out);
+  }
+  fflush(out);
+  profile_destroy(&total);
+}
@@ -0,0 +1,43 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include "cpu.h"
+#include "loader.h"
+#include "types.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+struct Block;
+struct TCache;
+
+// Number of guest instructions executed from the code starting at pc
+struct ProfileEntry {
+  u64 pc;
+  u64 count;
+};
+
+// Execution counts of a single hart. The engines only count how often every
+// block is entered and the counts are folded in here when a block leaves the
+// translation cache or a report is made, so profiling costs one increment
+// per block. A block that is left early because of a trap is counted as if
+// it ran to the end.
+struct Profile {
+  u64 ops[OP_COUNT];
+  // Open addressing hash table keyed by pc, empty slots have a zero count
+  struct ProfileEntry *entries;
+  u64 capacity;
+  u64 used;
+  // Translation cache of the hart, its blocks are part of every report
+  struct TCache *cache;
+};
+
+bool profile_init(struct Profile *profile);
+void profile_destroy(struct Profile *profile);
+// Counts a single instruction, for the engine without a translation cache
+void profile_instruction(struct Profile *profile, u64 pc, u8 op);
+// Folds the executions of the block into the profile and resets them
+void profile_retire(struct Profile *profile, struct Block *block);
+// Prints the instructions per handler, the hottest code and the hottest
+// functions of all harts combined.
+void profile_report(const struct Profile *profiles, u64 num_profiles,
+                    const struct SymbolTable *symbols, FILE *out);
+#endif // PROFILE_H
@@ -0,0 +1,277 @@
+// Expansion of the RV64C compressed instructions. Every compressed
+// instruction is a short form of a 32 bit one, so they are expanded once
+// when they are decoded and from then on execute like any other instruction.
+#include "rvc.h"
+
+// Bits _high to _low of the instruction, shifted down to bit 0
+#define BITS(_raw, _high, _low)                                                \
+  (((u32)(_raw) >> (_low)) & ((1U << ((_high) - (_low) + 1)) - 1))
+// Bit _bit of the instruction moved to bit _to of an immediate
+#define BIT_TO(_raw, _bit, _to) (BITS(_raw, _bit, _bit) << (_to))
+
+// The three bit register fields only address x8 to x15
+#define RD_PRIME(_raw) (8 + BITS(_raw, 4, 2))
+#define RS1_PRIME(_raw) (8 + BITS(_raw, 9, 7))
+#define RS2_PRIME(_raw) (8 + BITS(_raw, 4, 2))
+#define RD_FULL(_raw) BITS(_raw, 11, 7)
+#define RS2_FULL(_raw) BITS(_raw, 6, 2)
+
+#define X0 0
+#define RA 1
+#define SP 2
+
+#define OPCODE_LOAD 0x03
+#define OPCODE_LOAD_FP 0x07
+#define OPCODE_OP_IMM 0x13
+#define OPCODE_OP_IMM_32 0x1B
+#define OPCODE_STORE 0x23
+#define OPCODE_STORE_FP 0x27
+#define OPCODE_OP 0x33
+#define OPCODE_LUI 0x37
+#define OPCODE_OP_32 0x3B
+#define OPCODE_BRANCH 0x63
+#define OPCODE_JALR 0x67
+#define OPCODE_JAL 0x6F
+
+#define RAW_EBREAK 0x00100073
+
+static i32 sign_extend_bits(u32 value, u32 bits) {
+  return (i32)(value << (32 - bits)) >> (32 - bits);
+}
+
+static u32 r_type(u32 funct7, u32 rs2, u32 rs1, u32 funct3, u32 rd,
+                  u32 opcode) {
+  return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 |
+         opcode;
+}
+
+static u32 i_type(i32 imm, u32 rs1, u32 funct3, u32 rd, u32 opcode) {
+  return ((u32)imm & 0xFFF) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 |
+         opcode;
+}
+
+static u32 s_type(i32 imm, u32 rs2, u32 rs1, u32 funct3, u32 opcode) {
+  return (((u32)imm >> 5) & 0x7F) << 25 | rs2 << 20 | rs1 << 15 |
+         funct3 << 12 | ((u32)imm & 0x1F) << 7 | opcode;
+}
+
+static u32 b_type(i32 offset, u32 rs2, u32 rs1, u32 funct3) {
+  u32 imm = offset;
+  return ((imm >> 12) & 1) << 31 | ((imm >> 5) & 0x3F) << 25 | rs2 << 20 |
+         rs1 << 15 | funct3 << 12 | ((imm >> 1) & 0xF) << 8 |
+         ((imm >> 11) & 1) << 7 | OPCODE_BRANCH;
+}
+
+static u32 j_type(i32 offset, u32 rd) {
+  u32 imm = offset;
+  return ((imm >> 20) & 1) << 31 | ((imm >> 1) & 0x3FF) << 21 |
+         ((imm >> 11) & 1) << 20 | ((imm >> 12) & 0xFF) << 12 | rd << 7 |
+         OPCODE_JAL;
+}
+
+// Offsets of the loads and stores, scaled by the access size
+static u32 offset_word(u16 raw) {
+  return BITS(raw, 12, 10) << 3 | BIT_TO(raw, 6, 2) | BIT_TO(raw, 5, 6);
+}
+
+static u32 offset_double(u16 raw) {
+  return BITS(raw, 12, 10) << 3 | BITS(raw, 6, 5) << 6;
+}
+
+static u32 offset_word_sp_load(u16 raw) {
+  return BIT_TO(raw, 12, 5) | BITS(raw, 6, 4) << 2 | BITS(raw, 3, 2) << 6;
+}
+
+static u32 offset_double_sp_load(u16 raw) {
+  return BIT_TO(raw, 12, 5) | BITS(raw, 6, 5) << 3 | BITS(raw, 4, 2) << 6;
+}
+
+static u32 offset_word_sp_store(u16 raw) {
+  return BITS(raw, 12, 9) << 2 | BITS(raw, 8, 7) << 6;
+}
+
+static u32 offset_double_sp_store(u16 raw) {
+  return BITS(raw, 12, 10) << 3 | BITS(raw, 9, 7) << 6;
+}
+
+// The six bit immediate of the ALU instructions
+static i32 imm6(u16 raw) {
+  return sign_extend_bits(BIT_TO(raw, 12, 5) | BITS(raw, 6, 2), 6);
+}
+
+static u32 shamt6(u16 raw) {
+  return BIT_TO(raw, 12, 5) | BITS(raw, 6, 2);
+}
+
+static i32 jump_offset(u16 raw) {
+  return sign_extend_bits(BIT_TO(raw, 12, 11) | BIT_TO(raw, 11, 4) |
+                              BITS(raw, 10, 9) << 8 | BIT_TO(raw, 8, 10) |
+                              BIT_TO(raw, 7, 6) | BIT_TO(raw, 6, 7) |
+                              BITS(raw, 5, 3) << 1 | BIT_TO(raw, 2, 5),
+                          12);
+}
+
+static i32 branch_offset(u16 raw) {
+  return sign_extend_bits(BIT_TO(raw, 12, 8) | BITS(raw, 11, 10) << 3 |
+                              BITS(raw, 6, 5) << 6 | BITS(raw, 4, 3) << 1 |
+                              BIT_TO(raw, 2, 5),
+                          9);
+}
+
+static u32 quadrant0(u16 raw) {
+  switch (BITS(raw, 15, 13)) {
+  case 0: {
+    // c.addi4spn, which also makes the all zero instruction illegal
+    u32 imm = BITS(raw, 12, 11) << 4 | BITS(raw, 10, 7) << 6 |
+              BIT_TO(raw, 6, 2) | BIT_TO(raw, 5, 3);
+    if (0 == imm) {
+      return 0;
+    }
+    return i_type(imm, SP, 0, RD_PRIME(raw), OPCODE_OP_IMM);
+  }
+  case 1: // c.fld
+    return i_type(offset_double(raw), RS1_PRIME(raw), 3, RD_PRIME(raw),
+                  OPCODE_LOAD_FP);
+  case 2: // c.lw
+    return i_type(offset_word(raw), RS1_PRIME(raw), 2, RD_PRIME(raw),
+                  OPCODE_LOAD);
+  case 3: // c.ld
+    return i_type(offset_double(raw), RS1_PRIME(raw), 3, RD_PRIME(raw),
+                  OPCODE_LOAD);
+  case 5: // c.fsd
+    return s_type(offset_double(raw), RS2_PRIME(raw), RS1_PRIME(raw), 3,
+                  OPCODE_STORE_FP);
+  case 6: // c.sw
+    return s_type(offset_word(raw), RS2_PRIME(raw), RS1_PRIME(raw), 2,
+                  OPCODE_STORE);
+  case 7: // c.sd
+    return s_type(offset_double(raw), RS2_PRIME(raw), RS1_PRIME(raw), 3,
+                  OPCODE_STORE);
+  default:
+    return 0;
+  }
+}
+
+static u32 misc_alu(u16 raw) {
+  u32 rd = RS1_PRIME(raw);
+  u32 rs2 = RS2_PRIME(raw);
+  switch (BITS(raw, 11, 10)) {
+  case 0: // c.srli
+    return i_type(shamt6(raw), rd, 5, rd, OPCODE_OP_IMM);
+  case 1: // c.srai
+    return i_type(0x400 | shamt6(raw), rd, 5, rd, OPCODE_OP_IMM);
+  case 2: // c.andi
+    return i_type(imm6(raw), rd, 7, rd, OPCODE_OP_IMM);
+  }
+  // c.sub, c.xor, c.or and c.and, then c.subw and c.addw
+  static const u32 funct3s[4] = {0, 4, 6, 7};
+  u32 op = BITS(raw, 6, 5);
+  if (0 == BITS(raw, 12, 12)) {
+    return r_type(0 == op ? 0x20 : 0, rs2, rd, funct3s[op], rd, OPCODE_OP);
+  }
+  if (op > 1) {
+    return 0;
+  }
+  return r_type(0 == op ? 0x20 : 0, rs2, rd, 0, rd, OPCODE_OP_32);
+}
+
+static u32 quadrant1(u16 raw) {
+  u32 rd = RD_FULL(raw);
+  switch (BITS(raw, 15, 13)) {
+  case 0: // c.addi
+    return i_type(imm6(raw), rd, 0, rd, OPCODE_OP_IMM);
+  case 1: // c.addiw
+    if (X0 == rd) {
+      return 0;
+    }
+    return i_type(imm6(raw), rd, 0, rd, OPCODE_OP_IMM_32);
+  case 2: // c.li
+    return i_type(imm6(raw), X0, 0, rd, OPCODE_OP_IMM);
+  case 3: {
+    if (SP == rd) {
+      // c.addi16sp
+      i32 imm = sign_extend_bits(BIT_TO(raw, 12, 9) | BIT_TO(raw, 6, 4) |
+                                     BIT_TO(raw, 5, 6) |
+                                     BITS(raw, 4, 3) << 7 | BIT_TO(raw, 2, 5),
+                                 10);
+      if (0 == imm) {
+        return 0;
+      }
+      return i_type(imm, SP, 0, SP, OPCODE_OP_IMM);
+    }
+    // c.lui
+    i32 imm = imm6(raw);
+    if (0 == imm) {
+      return 0;
+    }
+    return ((u32)imm << 12) | rd << 7 | OPCODE_LUI;
+  }
+  case 4:
+    return misc_alu(raw);
+  case 5: // c.j
+    return j_type(jump_offset(raw), X0);
+  case 6: // c.beqz
+    return b_type(branch_offset(raw), X0, RS1_PRIME(raw), 0);
+  default: // c.bnez
+    return b_type(branch_offset(raw), X0, RS1_PRIME(raw), 1);
+  }
+}
+
+static u32 quadrant2(u16 raw) {
+  u32 rd = RD_FULL(raw);
+  u32 rs2 = RS2_FULL(raw);
+  switch (BITS(raw, 15, 13)) {
+  case 0: // c.slli
+    return i_type(shamt6(raw), rd, 1, rd, OPCODE_OP_IMM);
+  case 1: // c.fldsp
+    return i_type(offset_double_sp_load(raw), SP, 3, rd, OPCODE_LOAD_FP);
+  case 2: // c.lwsp
+    if (X0 == rd) {
+      return 0;
+    }
+    return i_type(offset_word_sp_load(raw), SP, 2, rd, OPCODE_LOAD);
+  case 3: // c.ldsp
+    if (X0 == rd) {
+      return 0;
+    }
+    return i_type(offset_double_sp_load(raw), SP, 3, rd, OPCODE_LOAD);
+  case 4:
+    if (0 == BITS(raw, 12, 12)) {
+      if (0 != rs2) {
+        // c.mv
+        return r_type(0, rs2, X0, 0, rd, OPCODE_OP);
+      }
+      // c.jr
+      if (X0 == rd) {
+        return 0;
+      }
+      return i_type(0, rd, 0, X0, OPCODE_JALR);
+    }
+    if (0 != rs2) {
+      // c.add
+      return r_type(0, rs2, rd, 0, rd, OPCODE_OP);
+    }
+    if (X0 == rd) {
+      return RAW_EBREAK;
+    }
+    // c.jalr
+    return i_type(0, rd, 0, RA, OPCODE_JALR);
+  case 5: // c.fsdsp
+    return s_type(offset_double_sp_store(raw), rs2, SP, 3, OPCODE_STORE_FP);
+  case 6: // c.swsp
+    return s_type(offset_word_sp_store(raw), rs2, SP, 2, OPCODE_STORE);
+  default: // c.sdsp
+    return s_type(offset_double_sp_store(raw), rs2, SP, 3, OPCODE_STORE);
+  }
+}
+
+u32 rvc_expand(u16 raw) {
+  switch (raw & 3) {
+  case 0:
+    return quadrant0(raw);
+  case 1:
+    return quadrant1(raw);
+  default:
+    return quadrant2(raw);
+  }
+}
@@ -0,0 +1,15 @@
+#ifndef RVC_H
+#define RVC_H
+#include "types.h"
+#include <stdbool.h>
+
+// Instructions of the C extension have anything but 0b11 in their lowest two
+// bits
+static inline bool rvc_is_compressed(u32 raw) {
+  return 3 != (raw & 3);
+}
+
+// Returns the 32 bit instruction that the compressed instruction is a short
+// form of, or 0, which is illegal, if it is reserved.
+u32 rvc_expand(u16 raw);
+#endif // RVC_H
@@ -0,0 +1,384 @@
+// Snapshots of the whole machine, see struct Snapshot.
+// copy_file_range() and SEEK_DATA are Linux extensions
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include "csr.h"
+#include "mmu.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Upper bound of the number of harts in a valid snapshot
+#define SNAPSHOT_MAX_HARTS 4096
+
+struct SnapshotHeader {
+  char magic[8];
+  u32 version;
+  // Catches snapshots from builds with a different struct CPU
+  u32 hart_size;
+  u64 num_harts;
+  u64 ram_base;
+  u64 ram_size;
+  u64 ram_offset;
+};
+
+static u64 align_up(u64 value, u64 alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static bool write_at(int fd, const void *data, u64 length, u64 offset) {
+  const u8 *in = data;
+  while (length > 0) {
+    ssize_t rc = pwrite(fd, in, length, offset);
+    if (-1 == rc) {
+      if (EINTR == errno) {
+        continue;
+      }
+      perror("pwrite");
+      return false;
+    }
+    in += rc;
+    offset += rc;
+    length -= rc;
+  }
+  return true;
+}
+
+static bool read_at(int fd, void *data, u64 length, u64 offset) {
+  u8 *out = data;
+  while (length > 0) {
+    ssize_t rc = pread(fd, out, length, offset);
+    if (-1 == rc) {
+      if (EINTR == errno) {
+        continue;
+      }
+      perror("pread");
+      return false;
+    }
+    if (0 == rc) {
+      fprintf(stderr, "Snapshot is truncated\n");
+      return false;
+    }
+    out += rc;
+    offset += rc;
+    length -= rc;
+  }
+  return true;
+}
+
+static bool page_is_zero(const u8 *page) {
+  static const u8 zero[PAGE_SIZE];
+  return 0 == memcmp(page, zero, PAGE_SIZE);
+}
+
+// Copies a range of the parent snapshot, in the kernel if it can be done
+// there, which may share the blocks with the parent instead of copying them.
+static bool copy_range(int fd, int parent_fd, u64 offset, u64 parent_offset,
+                       u64 length) {
+  while (length > 0) {
+    off_t in = parent_offset;
+    off_t out = offset;
+    ssize_t rc = copy_file_range(parent_fd, &in, fd, &out, length, 0);
+    if (-1 == rc && EINTR == errno) {
+      continue;
+    }
+    if (rc <= 0) {
+      break;
+    }
+    parent_offset += rc;
+    offset += rc;
+    length -= rc;
+  }
+  // The files may be on different file systems or one that does not support
+  // it, the rest goes through a buffer
+  static u8 buffer[1 << 20];
+  while (length > 0) {
+    u64 chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+    if (!read_at(parent_fd, buffer, chunk, parent_offset) ||
+        !write_at(fd, buffer, chunk, offset)) {
+      return false;
+    }
+    parent_offset += chunk;
+    offset += chunk;
+    length -= chunk;
+  }
+  return true;
+}
+
+// Copies the RAM of the parent snapshot, skipping its holes
+static bool copy_parent_ram(int fd, const struct Snapshot *parent, u64 offset) {
+  u64 start = parent->ram_offset;
+  u64 end = start + parent->ram_size;
+  u64 data = start;
+  while (data < end) {
+    off_t found = lseek(parent->fd, data, SEEK_DATA);
+    if (-1 == found) {
+      // ENXIO means that only holes are left
+      if (ENXIO == errno) {
+        return true;
+      }
+      perror("lseek");
+      return false;
+    }
+    data = found;
+    if (data >= end) {
+      return true;
+    }
+    off_t hole = lseek(parent->fd, data, SEEK_HOLE);
+    if (-1 == hole) {
+      perror("lseek");
+      return false;
+    }
+    u64 length = ((u64)hole < end ? (u64)hole : end) - data;
+    if (!copy_range(fd, parent->fd, offset + (data - start), data, length)) {
+      return false;
+    }
+    data += length;
+  }
+  return true;
+}
+
+// Pages that are not dirty are the same as in the parent, or zero without
+// one, so only the dirty pages are written after copying the parent. Runs of
+// them are written at once and without a parent zero pages stay holes.
+static bool write_ram(int fd, const struct Memory *mem, u64 offset,
+                      const struct Snapshot *parent) {
+  if (parent && !copy_parent_ram(fd, parent, offset)) {
+    return false;
+  }
+  u64 pages = mem->size >> PAGE_SHIFT;
+  u64 run = 0;
+  u64 end = 0;
+  for (u64 page = memory_next_dirty(mem, 0);;
+       page = memory_next_dirty(mem, page + 1)) {
+    bool write = page < pages &&
+                 (parent || !page_is_zero(mem->ram + (page << PAGE_SHIFT)));
+    if (write && page == end) {
+      end++;
+      continue;
+    }
+    if (run != end &&
+        !write_at(fd, mem->ram + (run << PAGE_SHIFT), (end - run) << PAGE_SHIFT,
+                  offset + (run << PAGE_SHIFT))) {
+      return false;
+    }
+    if (page == pages) {
+      break;
+    }
+    run = page;
+    end = write ? page + 1 : page;
+  }
+  if (-1 == ftruncate(fd, offset + mem->size)) {
+    perror("ftruncate");
+    return false;
+  }
+  return true;
+}
+
+bool snapshot_save(const char *path, struct Memory *mem, struct Uart *uart,
+                   struct Clint *clint, struct Plic *plic, struct Virtio *blk,
+                   struct Virtio *net, const struct CPU *cpus, u64 num_harts,
+                   const struct Snapshot *parent) {
+  struct SnapshotHart *harts = calloc(num_harts, sizeof(struct SnapshotHart));
+  if (!harts) {
+    perror("calloc");
+    return false;
+  }
+  for (u64 i = 0; i < num_harts; i++) {
+    const struct CPU *cpu = &cpus[i];
+    memcpy(harts[i].registers, cpu->registers, sizeof(cpu->registers));
+    memcpy(harts[i].fregisters, cpu->fregisters, sizeof(cpu->fregisters));
+    harts[i].pc = cpu->pc;
+    harts[i].hart_id = cpu->hart_id;
+    harts[i].instret = cpu->instret;
+    harts[i].satp = cpu->mmu.satp;
+    harts[i].mtimecmp = cpu->mtimecmp;
+    memcpy(harts[i].plic_enable, cpu->plic_enable, sizeof(cpu->plic_enable));
+    memcpy(harts[i].plic_threshold, cpu->plic_threshold,
+           sizeof(cpu->plic_threshold));
+    harts[i].csr = cpu->csr;
+    harts[i].priv = cpu->priv;
+  }
+  struct UartState uart_state;
+  uart_save_state(uart, &uart_state);
+  struct ClintState clint_state;
+  clint_save_state(clint, &clint_state);
+  struct PlicState plic_state;
+  plic_save_state(plic, &plic_state);
+  struct VirtioState blk_state = {0};
+  if (blk) {
+    virtio_save_state(blk, &blk_state);
+  }
+  struct VirtioState net_state = {0};
+  if (net) {
+    virtio_save_state(net, &net_state);
+  }
+
+  u64 harts_size = num_harts * sizeof(struct SnapshotHart);
+  u64 uart_offset = sizeof(struct SnapshotHeader) + harts_size;
+  u64 clint_offset = uart_offset + sizeof(uart_state);
+  u64 plic_offset = clint_offset + sizeof(clint_state);
+  u64 blk_offset = plic_offset + sizeof(plic_state);
+  u64 net_offset = blk_offset + sizeof(blk_state);
+  struct SnapshotHeader header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION,
+                                  sizeof(struct SnapshotHart), num_harts,
+                                  mem->ram_base, mem->size, 0};
+  // Aligned for mmap() with any host page size
+  header.ram_offset = align_up(net_offset + sizeof(net_state), HUGE_PAGE_SIZE);
+
+  // Written next to path and renamed over it once complete. path may be the
+  // snapshot RAM was restored from, which stays mapped and is read by
+  // write_ram() for the clean pages, so it must not be truncated.
+  char temporary[4096];
+  if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >=
+      (int)sizeof(temporary)) {
+    fprintf(stderr, "%s is too long\n", path);
+    free(harts);
+    return false;
+  }
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (-1 == fd) {
+    perror("open");
+    free(harts);
+    return false;
+  }
+  bool ok = write_at(fd, &header, sizeof(header), 0) &&
+            write_at(fd, harts, harts_size, sizeof(header)) &&
+            write_at(fd, &uart_state, sizeof(uart_state), uart_offset) &&
+            write_at(fd, &clint_state, sizeof(clint_state), clint_offset) &&
+            write_at(fd, &plic_state, sizeof(plic_state), plic_offset) &&
+            write_at(fd, &blk_state, sizeof(blk_state), blk_offset) &&
+            write_at(fd, &net_state, sizeof(net_state), net_offset) &&
+            write_ram(fd, mem, header.ram_offset, parent);
+  free(harts);
+  if (-1 == close(fd)) {
+    perror("close");
+    ok = false;
+  }
+  if (ok && -1 == rename(temporary, path)) {
+    perror("rename");
+    ok = false;
+  }
+  if (!ok) {
+    unlink(temporary);
+  }
+  return ok;
+}
+
+bool snapshot_open(struct Snapshot *snapshot, const char *path) {
+  snapshot->harts = NULL;
+  snapshot->fd = open(path, O_RDONLY);
+  if (-1 == snapshot->fd) {
+    perror("open");
+    return false;
+  }
+  struct SnapshotHeader header;
+  if (!read_at(snapshot->fd, &header, sizeof(header), 0)) {
+    snapshot_close(snapshot);
+    return false;
+  }
+  if (0 != memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) ||
+      SNAPSHOT_VERSION != header.version ||
+      sizeof(struct SnapshotHart) != header.hart_size ||
+      0 == header.num_harts || header.num_harts > SNAPSHOT_MAX_HARTS ||
+      0 != header.ram_size % PAGE_SIZE ||
+      0 != header.ram_offset % sysconf(_SC_PAGESIZE)) {
+    fprintf(stderr, "%s is not a snapshot of this build\n", path);
+    snapshot_close(snapshot);
+    return false;
+  }
+  snapshot->ram_base = header.ram_base;
+  snapshot->ram_size = header.ram_size;
+  snapshot->ram_offset = header.ram_offset;
+  snapshot->num_harts = header.num_harts;
+  u64 harts_size = header.num_harts * sizeof(struct SnapshotHart);
+  snapshot->harts = malloc(harts_size);
+  if (!snapshot->harts) {
+    perror("malloc");
+    snapshot_close(snapshot);
+    return false;
+  }
+  u64 uart_offset = sizeof(header) + harts_size;
+  u64 clint_offset = uart_offset + sizeof(snapshot->uart);
+  u64 plic_offset = clint_offset + sizeof(snapshot->clint);
+  u64 blk_offset = plic_offset + sizeof(snapshot->plic);
+  u64 net_offset = blk_offset + sizeof(snapshot->blk);
+  if (!read_at(snapshot->fd, snapshot->harts, harts_size, sizeof(header)) ||
+      !read_at(snapshot->fd, &snapshot->uart, sizeof(snapshot->uart),
+               uart_offset) ||
+      !read_at(snapshot->fd, &snapshot->clint, sizeof(snapshot->clint),
+               clint_offset) ||
+      !read_at(snapshot->fd, &snapshot->plic, sizeof(snapshot->plic),
+               plic_offset) ||
+      !read_at(snapshot->fd, &snapshot->blk, sizeof(snapshot->blk),
+               blk_offset) ||
+      !read_at(snapshot->fd, &snapshot->net, sizeof(snapshot->net),
+               net_offset)) {
+    snapshot_close(snapshot);
+    return false;
+  }
+  return true;
+}
+
+bool snapshot_map_ram(const struct Snapshot *snapshot, struct Memory *mem) {
+  // Mapping past the end of the file would fault on access
+  struct stat st;
+  if (-1 == fstat(snapshot->fd, &st)) {
+    perror("fstat");
+    return false;
+  }
+  if ((u64)st.st_size < snapshot->ram_offset + snapshot->ram_size) {
+    fprintf(stderr, "Snapshot is truncated\n");
+    return false;
+  }
+  if (MAP_FAILED == mmap(mem->ram, mem->size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_FIXED, snapshot->fd,
+                         snapshot->ram_offset)) {
+    perror("mmap");
+    return false;
+  }
+  mem->file_backed = true;
+  return true;
+}
+
+u8 *snapshot_map_baseline(const struct Snapshot *snapshot,
+                          const struct Memory *mem) {
+  u8 *baseline = mmap(NULL, mem->size, PROT_READ, MAP_PRIVATE, snapshot->fd,
+                      snapshot->ram_offset);
+  if (MAP_FAILED == baseline) {
+    perror("mmap");
+    return NULL;
+  }
+  return baseline;
+}
+
+void snapshot_restore_hart(const struct Snapshot *snapshot, u64 index,
+                           struct CPU *cpu) {
+  const struct SnapshotHart *hart = &snapshot->harts[index];
+  memcpy(cpu->registers, hart->registers, sizeof(cpu->registers));
+  memcpy(cpu->fregisters, hart->fregisters, sizeof(cpu->fregisters));
+  cpu->pc = hart->pc;
+  cpu->hart_id = hart->hart_id;
+  cpu->instret = hart->instret;
+  cpu->mtimecmp = hart->mtimecmp;
+  memcpy(cpu->plic_enable, hart->plic_enable, sizeof(cpu->plic_enable));
+  memcpy(cpu->plic_threshold, hart->plic_threshold,
+         sizeof(cpu->plic_threshold));
+  cpu->csr = hart->csr;
+  cpu->priv = hart->priv;
+  mmu_set_satp(&cpu->mmu, hart->satp);
+  cpu_update_mmu(cpu);
+}
+
+void snapshot_close(struct Snapshot *snapshot) {
+  free(snapshot->harts);
+  // The mapping of RAM keeps its own reference to the file
+  if (-1 == close(snapshot->fd)) {
+    perror("close");
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include "clint.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "plic.h"
+#include "types.h"
+#include "uart.h"
+#include "virtio.h"
+#include <stdbool.h>
+
+#define SNAPSHOT_MAGIC "R5SNAP"
+#define SNAPSHOT_VERSION 5
+
+// Architectural state of a hart. The TLB and the decoded code are rebuilt
+// after a restore and an LR reservation is dropped.
+struct SnapshotHart {
+  u64 registers[32];
+  u64 fregisters[32];
+  u64 pc;
+  u64 hart_id;
+  u64 instret;
+  u64 satp;
+  u64 mtimecmp;
+  u32 plic_enable[2];
+  u32 plic_threshold[2];
+  struct Csrs csr;
+  u8 priv;
+};
+
+// A snapshot file starts with a header, the harts and the device state,
+// followed by RAM at ram_offset. The contents of the disk and frames in the
+// network backend are not part of it.
+// Everything is in host byte order, snapshots are meant to be restored by the
+// same build. Pages of RAM that are zero are left as holes in the file, unless
+// they overwrite a page of the parent.
+//
+// A restore maps RAM privately from the file, which takes the same time for
+// any size of RAM and lets every emulator restoring the same snapshot share
+// the pages that it does not write to.
+struct Snapshot {
+  int fd;
+  u64 ram_base;
+  u64 ram_size;
+  u64 ram_offset;
+  u64 num_harts;
+  struct SnapshotHart *harts;
+  struct UartState uart;
+  struct ClintState clint;
+  struct PlicState plic;
+  // All zero if there was no disk or network
+  struct VirtioState blk;
+  struct VirtioState net;
+};
+
+// The harts, the disk and the network, which are NULL if there are none,
+// have to be stopped. Only the pages that are dirty are read from
+// RAM, the others are copied from parent, the snapshot RAM was restored from,
+// or are zero if parent is NULL.
+bool snapshot_save(const char *path, struct Memory *mem, struct Uart *uart,
+                   struct Clint *clint, struct Plic *plic, struct Virtio *blk,
+                   struct Virtio *net, const struct CPU *cpus, u64 num_harts,
+                   const struct Snapshot *parent);
+
+// Reads everything but RAM, which is left to snapshot_map_ram()
+bool snapshot_open(struct Snapshot *snapshot, const char *path);
+// Maps RAM from the snapshot into memory set up by ram_init() with the base
+// and size of the snapshot
+bool snapshot_map_ram(const struct Snapshot *snapshot, struct Memory *mem);
+// Maps RAM from the snapshot once more as a baseline for
+// memory_reset_dirty(), freed with memory_free_baseline()
+u8 *snapshot_map_baseline(const struct Snapshot *snapshot,
+                          const struct Memory *mem);
+// Restores a hart initialized by cpu_init()
+void snapshot_restore_hart(const struct Snapshot *snapshot, u64 index,
+                           struct CPU *cpu);
+void snapshot_close(struct Snapshot *snapshot);
+#endif // SNAPSHOT_H
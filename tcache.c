@@ -0,0 +1,190 @@
+// Translation cache. Guest code is decoded one block at a time into
+// struct Inst records which are then replayed by cpu_loop() without having to
+// fetch or decode the instructions again.
+//
+// Invalidation is done with the per page code generation kept by the MMU.
+// When a block is decoded the generation of its page is marked as containing
+// code and remembered in the block. Stores into such a page bump the
+// generation which makes every block in that page stale. The debugger does the
+// same to the page of a breakpoint, which then ends the block it is decoded
+// into.
+#include "tcache.h"
+#include "cpu.h"
+#include "gdb.h"
+#include "mmu.h"
+#include "profile.h"
+#include "rvc.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+_Static_assert(BLOCK_MAX_LENGTH <= TRACE_MAX_LENGTH,
+               "Every block has to fit into a trace definition");
+
+struct TCache *tcache_create(const void *const *labels,
+                             struct Profile *profile, struct Trace *trace) {
+  struct TCache *cache = calloc(1, sizeof(struct TCache));
+  if (!cache) {
+    perror("calloc");
+    return NULL;
+  }
+  cache->labels = labels;
+  cache->profile = profile;
+  cache->trace = trace;
+  if (profile) {
+    profile->cache = cache;
+  }
+  return cache;
+}
+
+void tcache_destroy(struct TCache *cache) {
+  // Only the profile needs to see the blocks, flushing without one would
+  // touch every page of the cache for nothing
+  if (cache->profile) {
+    tcache_flush(cache);
+    cache->profile->cache = NULL;
+  }
+  free(cache);
+}
+
+void tcache_flush(struct TCache *cache) {
+  for (int i = 0; i < TCACHE_SIZE; i++) {
+    if (cache->profile) {
+      profile_retire(cache->profile, &cache->blocks[i]);
+    }
+    cache->blocks[i].length = 0;
+  }
+}
+
+// The physical address has been checked to be in RAM by the caller and since a
+// block stays inside of a page the rest of the block is in RAM as well. The
+// first instruction has already been fetched into raw since it is the only one
+// that may continue on the next page.
+static void decode_block(struct TCache *cache, struct Block *block,
+                         struct Memory *mem, u64 pc, u64 physical, u32 raw) {
+  if (cache->profile) {
+    profile_retire(cache->profile, block);
+  }
+  block->pc = pc;
+  block->physical = physical;
+  block->length = 0;
+  block->hits = 0;
+  block->executions = 0;
+  block->native = NULL;
+  block->code_gen = memory_mark_code(mem, physical);
+  u32 raws[BLOCK_MAX_LENGTH];
+  for (;;) {
+    raws[block->length] = raw;
+    struct Inst *inst = &block->insts[block->length++];
+    if (unlikely(mem->gdb) && gdb_breakpoint_at(mem->gdb, pc)) {
+      decode_breakpoint(inst);
+      break;
+    }
+    if (decode_instruction(raw, inst)) {
+      break;
+    }
+    pc += inst->length;
+    physical += inst->length;
+    u64 offset = pc & (PAGE_SIZE - 1);
+    if (BLOCK_MAX_LENGTH == block->length || offset < inst->length) {
+      break;
+    }
+    raw = memory_read16(mem, physical);
+    if (!rvc_is_compressed(raw)) {
+      if (PAGE_SIZE - sizeof(u16) == offset) {
+        // Continues on the next page, left for a block of its own
+        break;
+      }
+      raw = memory_read32(mem, physical);
+    }
+  }
+  if (block->pc >> PAGE_SHIFT != (pc - 1) >> PAGE_SHIFT) {
+    // Crossed into the next page, whose generation is not checked. Making the
+    // block stale right away decodes it again every time it is entered.
+    block->code_gen = 0;
+  }
+  struct Inst *end = &block->insts[block->length];
+  end->op = OP_BLOCK_END;
+  if (cache->labels) {
+    for (struct Inst *inst = block->insts; inst <= end; inst++) {
+      inst->dispatch.label = cache->labels[inst->op];
+    }
+  }
+  if (cache->log) {
+    tcache_record(cache, block);
+  }
+  if (cache->trace) {
+    u8 rds[BLOCK_MAX_LENGTH];
+    for (u32 i = 0; i < block->length; i++) {
+      rds[i] = written_register(&block->insts[i]);
+    }
+    block->trace_id =
+        trace_define(cache->trace, block->pc, block->length, raws, rds);
+    block->trace_mask = tcache_written(block, block->length);
+  }
+}
+
+static bool block_valid(const struct Block *block, struct Memory *mem, u64 pc,
+                        u64 physical) {
+  return block->pc == pc && block->physical == physical &&
+         0 != block->length &&
+         block->code_gen == memory_code_gen(mem, physical);
+}
+
+struct Block *tcache_lookup(struct TCache *cache, struct CPU *cpu,
+                            struct Memory *mem) {
+  u64 physical;
+  if (!cpu_fetch_address(cpu, mem, &physical)) {
+    return NULL;
+  }
+  u64 pc = cpu->pc;
+  struct Block *block = &cache->blocks[(pc >> 1) & (TCACHE_SIZE - 1)];
+  if (block_valid(block, mem, pc, physical)) {
+    return block;
+  }
+  u32 raw;
+  if (!cpu_fetch_instruction(cpu, mem, physical, &raw)) {
+    return NULL;
+  }
+  decode_block(cache, block, mem, pc, physical, raw);
+  return block;
+}
+
+struct Block *tcache_decode(struct TCache *cache, struct Memory *mem, u64 pc,
+                            u64 physical) {
+  if (!ram_contains(mem, physical, sizeof(u16))) {
+    return NULL;
+  }
+  struct Block *block = &cache->blocks[(pc >> 1) & (TCACHE_SIZE - 1)];
+  if (block_valid(block, mem, pc, physical)) {
+    return block;
+  }
+  u32 raw = memory_read16(mem, physical);
+  if (!rvc_is_compressed(raw)) {
+    if (PAGE_SIZE - sizeof(u16) == (physical & (PAGE_SIZE - 1))) {
+      return NULL;
+    }
+    raw = memory_read32(mem, physical);
+  }
+  decode_block(cache, block, mem, pc, physical, raw);
+  return block;
+}
+
+void tcache_record(struct TCache *cache, const struct Block *block) {
+  struct TCacheLog *log = cache->log;
+  if (TCACHE_LOG_SIZE == log->length) {
+    return;
+  }
+  struct TCacheLogEntry *entry = &log->entries[log->length++];
+  entry->pc = block->pc;
+  entry->physical = block->physical;
+  entry->native = NULL != block->native;
+}
+
+u32 tcache_written(const struct Block *block, u32 count) {
+  u32 mask = 0;
+  for (u32 i = 0; i < count; i++) {
+    mask |= 1u << written_register(&block->insts[i]);
+  }
+  return mask & ~1u;
+}
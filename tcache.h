@@ -0,0 +1,87 @@
+#ifndef TCACHE_H
+#define TCACHE_H
+#include "cpu.h"
+#include "mmu.h"
+#include "types.h"
+
+struct Profile;
+struct Trace;
+
+#define TCACHE_BITS 12
+#define TCACHE_SIZE (1 << TCACHE_BITS)
+#define BLOCK_MAX_LENGTH 32
+
+// A straight-line run of pre-decoded instructions starting at pc. Only the
+// last instruction may change the control flow and a block never crosses a
+// page boundary, so invalidating a page invalidates every block inside it.
+// The one exception is a 32 bit instruction starting in the last two bytes of
+// a page, which gets a block of its own that is decoded again every time.
+// The instructions are followed by an OP_BLOCK_END record.
+//
+// Blocks are looked up by their virtual pc and only used if the pc still
+// translates to the physical address they were decoded from.
+struct Block {
+  u64 pc;
+  u64 physical;
+  u32 code_gen;
+  u32 length;
+  // Number of times the block has been interpreted and its native code once
+  // the JIT has compiled it
+  u32 hits;
+  // Number of times the block has been entered, see struct Profile
+  u64 executions;
+  // Only set while tracing, the id of the definition of the block and the
+  // integer registers it writes, see struct Trace
+  u32 trace_id;
+  u32 trace_mask;
+  u8 *native;
+  struct Inst insts[BLOCK_MAX_LENGTH + 1];
+};
+
+// Blocks decoded and compiled by a job of the fork server, which the server
+// decodes and compiles as well so that the jobs after it start with them, see
+// cpu_cache_replay(). Blocks past TCACHE_LOG_SIZE are not recorded.
+#define TCACHE_LOG_SIZE 4096
+struct TCacheLogEntry {
+  u64 pc;
+  u64 physical;
+  // Whether the JIT compiled the block
+  bool native;
+};
+struct TCacheLog {
+  u64 length;
+  struct TCacheLogEntry entries[TCACHE_LOG_SIZE];
+};
+
+// Direct mapped translation cache keyed by the guest pc.
+struct TCache {
+  // If set, decoded instructions dispatch to labels[op] instead of to their
+  // handler.
+  const void *const *labels;
+  // If set, the executions of blocks are added to it before they are replaced
+  struct Profile *profile;
+  // If set, every block is recorded in it once decoded and once compiled
+  struct TCacheLog *log;
+  // If set, every block is defined in it once decoded
+  struct Trace *trace;
+  struct Block blocks[TCACHE_SIZE];
+};
+
+struct TCache *tcache_create(const void *const *labels,
+                             struct Profile *profile, struct Trace *trace);
+void tcache_destroy(struct TCache *cache);
+void tcache_flush(struct TCache *cache);
+// Returns the block at cpu->pc or NULL if fetching from it faulted, in which
+// case the trap has already been taken.
+struct Block *tcache_lookup(struct TCache *cache, struct CPU *cpu,
+                            struct Memory *mem);
+// Decodes the block at pc, which translates to physical, without a hart.
+// Returns NULL for blocks that need one, which are those outside of RAM and
+// those starting with an instruction that continues on the next page.
+struct Block *tcache_decode(struct TCache *cache, struct Memory *mem, u64 pc,
+                            u64 physical);
+void tcache_record(struct TCache *cache, const struct Block *block);
+// Returns the integer registers written by the first count instructions of
+// the block as a mask, see written_register()
+u32 tcache_written(const struct Block *block, u32 count);
+#endif // TCACHE_H
@@ -0,0 +1,381 @@
+// Binary execution traces, see struct Trace for the format. The file starts
+// with TRACE_MAGIC, the version, the format flags and the hart id, all in
+// little endian like the rest of the trace.
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_BUFFER_SIZE (1 << 20)
+// Encoded records are at most a quarter larger than the plain ones, a value
+// takes up to 10 bytes instead of 8 and loses the 4 bytes of the mask
+#define TRACE_PACKED_SIZE (TRACE_BUFFER_SIZE + TRACE_BUFFER_SIZE / 4)
+
+struct TraceHeader {
+  char magic[8];
+  u32 version;
+  u32 flags;
+  u64 hart_id;
+};
+
+static u64 zigzag(u64 value) {
+  return (value << 1) ^ (u64)((i64)value >> 63);
+}
+
+static u64 unzigzag(u64 value) {
+  return (value >> 1) ^ -(value & 1);
+}
+
+static u8 *put_varint(u8 *p, u64 value) {
+  while (value >= 0x80) {
+    *p++ = value | 0x80;
+    value >>= 7;
+  }
+  *p++ = value;
+  return p;
+}
+
+static u8 *put_fixed(u8 *p, u64 value, u8 length) {
+  memcpy(p, &value, length);
+  return p + length;
+}
+
+static u64 definition_size(u32 length) {
+  return sizeof(u64) + sizeof(u8) + length * (sizeof(u32) + sizeof(u8));
+}
+
+static bool write_all(int fd, const u8 *data, u64 length) {
+  while (length > 0) {
+    ssize_t rc = write(fd, data, length);
+    if (-1 == rc) {
+      if (EINTR == errno) {
+        continue;
+      }
+      perror("write");
+      return false;
+    }
+    data += rc;
+    length -= rc;
+  }
+  return true;
+}
+
+bool trace_open(struct Trace *trace, const char *path, u64 hart_id,
+                u32 flags) {
+  memset(trace, 0, sizeof(*trace));
+  trace->flags = flags;
+  trace->buffer = malloc(TRACE_BUFFER_SIZE);
+  if ((flags & TRACE_COMPRESSED) && trace->buffer) {
+    trace->packed = malloc(TRACE_PACKED_SIZE);
+  }
+  if (!trace->buffer || ((flags & TRACE_COMPRESSED) && !trace->packed)) {
+    perror("malloc");
+    free(trace->buffer);
+    return false;
+  }
+  trace->next = trace->buffer;
+  trace->end = trace->buffer + TRACE_BUFFER_SIZE - TRACE_MAX_RECORD;
+  trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (-1 == trace->fd) {
+    perror("open");
+    free(trace->packed);
+    free(trace->buffer);
+    return false;
+  }
+  struct TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, flags, hart_id};
+  if (!write_all(trace->fd, (const u8 *)&header, sizeof(header))) {
+    trace_close(trace);
+    return false;
+  }
+  return true;
+}
+
+u32 trace_define(struct Trace *trace, u64 pc, u32 length, const u32 *raws,
+                 const u8 *rds) {
+  struct TraceDefined *defined =
+      &trace->defined[(pc >> 1) & (TRACE_DEFINED_SIZE - 1)];
+  if (0 != defined->id && defined->pc == pc && defined->length == length &&
+      0 == memcmp(defined->raws, raws, length * sizeof(u32))) {
+    return defined->id;
+  }
+  if (trace->next >= trace->end) {
+    trace_flush(trace);
+  }
+  u32 id = ++trace->num_ids;
+  u8 *p = trace->next;
+  p = put_fixed(p, id << TRACE_KIND_BITS | TRACE_DEFINED, sizeof(u32));
+  p = put_fixed(p, pc, sizeof(pc));
+  *p++ = length;
+  memcpy(p, raws, length * sizeof(u32));
+  p += length * sizeof(u32);
+  memcpy(p, rds, length);
+  trace->next = p + length;
+  defined->pc = pc;
+  defined->id = id;
+  defined->length = length;
+  memcpy(defined->raws, raws, length * sizeof(u32));
+  return id;
+}
+
+// Encodes the plain records in the buffer into the packed buffer and returns
+// the length of the result
+static u64 pack(struct Trace *trace) {
+  const u8 *p = trace->buffer;
+  u8 *out = trace->packed;
+  while (p < trace->next) {
+    u32 word;
+    memcpy(&word, p, sizeof(word));
+    p += sizeof(word);
+    u32 id = word >> TRACE_KIND_BITS;
+    u32 kind = word & ((1 << TRACE_KIND_BITS) - 1);
+    out = put_varint(out, zigzag((u64)id - trace->last_id) << TRACE_KIND_BITS |
+                              kind);
+    trace->last_id = id;
+    if (TRACE_DEFINED == kind) {
+      u64 size = definition_size(p[sizeof(u64)]);
+      memcpy(out, p, size);
+      out += size;
+      p += size;
+      continue;
+    }
+    if (TRACE_PARTIAL == kind) {
+      *out++ = *p++;
+    }
+    if (TRACE_REPEATED == kind) {
+      u32 times;
+      memcpy(&times, p, sizeof(times));
+      p += sizeof(times);
+      out = put_varint(out, times);
+    }
+    if (!(trace->flags & TRACE_VALUES)) {
+      memcpy(out, p, sizeof(u32));
+      out += sizeof(u32);
+      p += sizeof(u32);
+      continue;
+    }
+    u32 mask;
+    memcpy(&mask, p, sizeof(mask));
+    p += sizeof(mask);
+    for (; mask; mask &= mask - 1) {
+      u32 r = __builtin_ctz(mask);
+      u64 value;
+      memcpy(&value, p, sizeof(value));
+      p += sizeof(value);
+      out = put_varint(out, zigzag(value - trace->registers[r]));
+      trace->registers[r] = value;
+    }
+  }
+  return out - trace->packed;
+}
+
+bool trace_flush(struct Trace *trace) {
+  const u8 *data = trace->buffer;
+  u64 length = trace->next - trace->buffer;
+  if (trace->flags & TRACE_COMPRESSED) {
+    data = trace->packed;
+    length = pack(trace);
+  }
+  bool ok = write_all(trace->fd, data, length);
+  trace->next = trace->buffer;
+  trace->last_word = 0;
+  return ok;
+}
+
+void trace_close(struct Trace *trace) {
+  trace_flush(trace);
+  if (-1 == close(trace->fd)) {
+    perror("close");
+  }
+  free(trace->packed);
+  free(trace->buffer);
+}
+
+bool trace_reader_open(struct TraceReader *reader, const char *path) {
+  memset(reader, 0, sizeof(*reader));
+  reader->file = fopen(path, "rb");
+  if (!reader->file) {
+    perror("fopen");
+    return false;
+  }
+  struct TraceHeader header;
+  if (1 != fread(&header, sizeof(header), 1, reader->file) ||
+      0 != memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) ||
+      TRACE_VERSION != header.version) {
+    fprintf(stderr, "%s is not a trace\n", path);
+    fclose(reader->file);
+    return false;
+  }
+  reader->flags = header.flags;
+  reader->hart_id = header.hart_id;
+  return true;
+}
+
+static bool get_fixed(struct TraceReader *reader, void *value, u64 length) {
+  return 1 == fread(value, length, 1, reader->file);
+}
+
+static bool get_varint(struct TraceReader *reader, u64 *value) {
+  *value = 0;
+  for (u32 shift = 0; shift < 64; shift += 7) {
+    int c = getc(reader->file);
+    if (EOF == c) {
+      return false;
+    }
+    *value |= (u64)(c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns 1 for a word, 0 at the end of the trace and -1 on errors
+static int get_word(struct TraceReader *reader, u32 *id, u32 *kind) {
+  int c = getc(reader->file);
+  if (EOF == c) {
+    return 0;
+  }
+  ungetc(c, reader->file);
+  u64 word;
+  if (reader->flags & TRACE_COMPRESSED) {
+    if (!get_varint(reader, &word)) {
+      return -1;
+    }
+    *id = reader->last_id + unzigzag(word >> TRACE_KIND_BITS);
+  } else {
+    u32 plain;
+    if (!get_fixed(reader, &plain, sizeof(plain))) {
+      return -1;
+    }
+    word = plain;
+    *id = plain >> TRACE_KIND_BITS;
+  }
+  *kind = word & ((1 << TRACE_KIND_BITS) - 1);
+  reader->last_id = *id;
+  return 1;
+}
+
+static bool get_definition(struct TraceReader *reader, u32 id) {
+  // Ids are handed out in order
+  if (id != reader->num_blocks + 1) {
+    return false;
+  }
+  // Grows by doubling, so the size is a power of two whenever it is full
+  if (0 == (reader->num_blocks & (reader->num_blocks - 1))) {
+    u64 size = reader->num_blocks ? 2 * reader->num_blocks : 1;
+    struct TraceBlock *blocks =
+        realloc(reader->blocks, size * sizeof(struct TraceBlock));
+    if (!blocks) {
+      perror("realloc");
+      return false;
+    }
+    reader->blocks = blocks;
+  }
+  struct TraceBlock *block = &reader->blocks[reader->num_blocks];
+  u8 length;
+  if (!get_fixed(reader, &block->pc, sizeof(block->pc)) ||
+      !get_fixed(reader, &length, sizeof(length)) || 0 == length ||
+      length > TRACE_MAX_LENGTH ||
+      !get_fixed(reader, block->raws, length * sizeof(u32)) ||
+      !get_fixed(reader, block->rds, length)) {
+    return false;
+  }
+  for (u32 i = 0; i < length; i++) {
+    if (block->rds[i] >= 32) {
+      return false;
+    }
+  }
+  block->length = length;
+  reader->num_blocks++;
+  return true;
+}
+
+static bool get_values(struct TraceReader *reader,
+                       struct TraceRecord *record) {
+  if (!(reader->flags & TRACE_COMPRESSED)) {
+    u32 mask;
+    if (!get_fixed(reader, &mask, sizeof(mask)) || mask != record->mask) {
+      return false;
+    }
+  }
+  for (u32 mask = record->mask; mask; mask &= mask - 1) {
+    u32 r = __builtin_ctz(mask);
+    u64 value;
+    if (reader->flags & TRACE_COMPRESSED) {
+      if (!get_varint(reader, &value)) {
+        return false;
+      }
+      value = reader->registers[r] + unzigzag(value);
+    } else if (!get_fixed(reader, &value, sizeof(value))) {
+      return false;
+    }
+    record->values[r] = value;
+    reader->registers[r] = value;
+  }
+  return true;
+}
+
+int trace_read(struct TraceReader *reader, struct TraceRecord *record) {
+  u32 id;
+  u32 kind;
+  int rc;
+  while (1 == (rc = get_word(reader, &id, &kind)) &&
+         TRACE_DEFINED == kind) {
+    if (!get_definition(reader, id)) {
+      return -1;
+    }
+  }
+  if (1 != rc) {
+    return rc;
+  }
+  if (0 == id || id > reader->num_blocks) {
+    return -1;
+  }
+  const struct TraceBlock *block = trace_reader_block(reader, id);
+  u32 last_id = reader->last_executed;
+  reader->last_executed = TRACE_EXECUTED == kind ? id : 0;
+  memset(record, 0, sizeof(*record));
+  record->id = id;
+  record->count = block->length;
+  record->times = 1;
+  if (TRACE_REPEATED == kind) {
+    u64 times = 0;
+    // Only ever follows the execution of the same block
+    if ((reader->flags & TRACE_VALUES) || id != last_id ||
+        !((reader->flags & TRACE_COMPRESSED)
+              ? get_varint(reader, &times) && times <= UINT32_MAX
+              : get_fixed(reader, &times, sizeof(u32))) ||
+        0 == (u32)times) {
+      return -1;
+    }
+    record->times = times;
+  }
+  if (TRACE_PARTIAL == kind) {
+    u8 count;
+    if (!get_fixed(reader, &count, sizeof(count)) || count >= block->length) {
+      return -1;
+    }
+    record->count = count;
+    record->trapped = true;
+  }
+  record->mask = trace_block_mask(block, record->count);
+  if (reader->flags & TRACE_VALUES) {
+    return get_values(reader, record) ? 1 : -1;
+  }
+  return get_fixed(reader, &record->check, sizeof(record->check)) ? 1 : -1;
+}
+
+void trace_reader_close(struct TraceReader *reader) {
+  free(reader->blocks);
+  fclose(reader->file);
+}
+
+u32 trace_block_mask(const struct TraceBlock *block, u32 count) {
+  u32 mask = 0;
+  for (u32 i = 0; i < count; i++) {
+    mask |= 1u << block->rds[i];
+  }
+  return mask & ~1u;
+}
@@ -0,0 +1,231 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include "types.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TRACE_MAGIC "R5TRACE"
+#define TRACE_VERSION 2
+
+// Header flags. TRACE_COMPRESSED traces use the delta encoding, TRACE_VALUES
+// traces hold the values written by every block instead of their hash.
+#define TRACE_COMPRESSED 1
+#define TRACE_VALUES 2
+
+// Record kinds, in the low bits of the word every record starts with
+#define TRACE_KIND_BITS 2
+#define TRACE_EXECUTED 0
+#define TRACE_PARTIAL 1
+#define TRACE_DEFINED 2
+#define TRACE_REPEATED 3
+
+// Longest block a definition can describe
+#define TRACE_MAX_LENGTH 32
+// Upper bound of a record: a partial execution with 31 values is 257 bytes,
+// a definition of TRACE_MAX_LENGTH instructions 173
+#define TRACE_MAX_RECORD 264
+
+// Sign extension of a 32 bit immediate, which lets the JIT multiply by it
+// without loading it into a register first
+#define TRACE_HASH_MULTIPLIER 0xFFFFFFFF9E3779B1ULL
+
+#define TRACE_DEFINED_SIZE 4096
+
+// Last block defined at a pc, which gets the same id if the translation
+// cache decodes it again
+struct TraceDefined {
+  u64 pc;
+  u32 id;
+  u32 length;
+  u32 raws[TRACE_MAX_LENGTH];
+};
+
+// Writer for the trace of a single hart. The engines record every block
+// they execute rather than every instruction, which keeps tracing cheap
+// enough for the JIT to do inline.
+//
+// A block is described once by a TRACE_DEFINED record when the translation
+// cache decodes it: its id, pc, length, raw instructions and the integer
+// register each of them writes. Each execution of it is then a single
+// record with its id, which is TRACE_PARTIAL together with the number of
+// instructions executed if one of them trapped. Stores are not recorded,
+// their effect shows up once the value is loaded again.
+//
+// By default the record ends with a check of the values written, see
+// trace_chain(). Since the hash is chained through every block, a value
+// that differs between two runs changes the check of every record after
+// it. Executing the block of the last TRACE_EXECUTED record again adds a
+// TRACE_REPEATED record holding the number of further executions and
+// updates it from then on, so loops take up no space. With TRACE_VALUES
+// every execution instead has its own record with the mask of the registers
+// written and their values in register order, which pins down the block
+// that went wrong rather than the loop it is part of.
+//
+// Records start with a 32 bit word holding the id above the kind and are
+// written out in one go once the buffer fills up. With TRACE_COMPRESSED that
+// word becomes a zigzag varint of the difference to the previous id, the
+// number of executions a varint, the mask is left out since the definition
+// has it and the values become zigzag varints of the difference to the last
+// value of the same register. The engines write the plain records,
+// trace_flush() encodes them.
+struct Trace {
+  // Where the next record goes. Records start below end, which leaves room
+  // for the largest one at the end of the buffer.
+  u8 *next;
+  u8 *end;
+  // Chained hash of the values written so far
+  u64 hash;
+  // Word of the last record if it is a TRACE_EXECUTED or TRACE_REPEATED one
+  // still in the buffer and 0 otherwise, repeat points to the latter
+  u32 last_word;
+  u8 *repeat;
+  int fd;
+  u32 flags;
+  u8 *buffer;
+  u32 num_ids;
+  struct TraceDefined defined[TRACE_DEFINED_SIZE];
+  // Compressed traces only, the encoded records and the delta state shared
+  // with struct TraceReader
+  u8 *packed;
+  u32 last_id;
+  u64 registers[32];
+};
+
+// Adds the registers in the mask to the hash in register order. For a given
+// value the step is a bijection, so two hashes that differ once keep
+// differing.
+static inline u64 trace_chain(u64 hash, u32 mask, const u64 *registers) {
+  for (; mask; mask &= mask - 1) {
+    hash = (hash ^ registers[__builtin_ctz(mask)]) * TRACE_HASH_MULTIPLIER;
+  }
+  return hash;
+}
+
+// Check stored in the records, both halves are folded in so that it changes
+// with any bit of the values
+static inline u32 trace_check(u64 hash) {
+  return hash ^ hash >> 32;
+}
+
+bool trace_open(struct Trace *trace, const char *path, u64 hart_id,
+                u32 flags);
+// Returns the id of the block, writing its definition if this is the first
+// time it is seen
+u32 trace_define(struct Trace *trace, u64 pc, u32 length, const u32 *raws,
+                 const u8 *rds);
+// Writes out the buffered records, safe to call from a signal handler
+bool trace_flush(struct Trace *trace);
+void trace_close(struct Trace *trace);
+
+// Appends the execution of the first count instructions of a block of the
+// given length, which wrote the registers in the mask. The JIT emits the same
+// steps, see emit_trace_record().
+static inline void trace_execute(struct Trace *trace, u32 id, u32 count,
+                                 u32 length, u32 mask, const u64 *registers) {
+  if (trace->next >= trace->end) {
+    trace_flush(trace);
+  }
+  u8 *p = trace->next;
+  u32 word = id << TRACE_KIND_BITS;
+  if (trace->flags & TRACE_VALUES) {
+    if (count < length) {
+      word |= TRACE_PARTIAL;
+    }
+    memcpy(p, &word, sizeof(word));
+    p += sizeof(word);
+    if (count < length) {
+      *p++ = count;
+    }
+    memcpy(p, &mask, sizeof(mask));
+    p += sizeof(mask);
+    for (; mask; mask &= mask - 1) {
+      memcpy(p, &registers[__builtin_ctz(mask)], sizeof(u64));
+      p += sizeof(u64);
+    }
+    trace->next = p;
+    return;
+  }
+  trace->hash = trace_chain(trace->hash, mask, registers);
+  u32 check = trace_check(trace->hash);
+  if (count < length) {
+    word |= TRACE_PARTIAL;
+    memcpy(p, &word, sizeof(word));
+    p[sizeof(word)] = count;
+    memcpy(p + sizeof(word) + 1, &check, sizeof(check));
+    trace->next = p + 2 * sizeof(u32) + 1;
+    trace->last_word = 0;
+    return;
+  }
+  if ((word | TRACE_REPEATED) == trace->last_word) {
+    u32 times;
+    memcpy(&times, trace->repeat + sizeof(u32), sizeof(times));
+    // Starts over with a new record once the count would overflow
+    if (UINT32_MAX != times) {
+      times++;
+      memcpy(trace->repeat + sizeof(u32), &times, sizeof(times));
+      memcpy(trace->repeat + 2 * sizeof(u32), &check, sizeof(check));
+      return;
+    }
+  } else if (word == trace->last_word) {
+    u32 repeated[3] = {word | TRACE_REPEATED, 1, check};
+    memcpy(p, repeated, sizeof(repeated));
+    trace->next = p + sizeof(repeated);
+    trace->last_word = repeated[0];
+    trace->repeat = p;
+    return;
+  }
+  memcpy(p, &word, sizeof(word));
+  memcpy(p + sizeof(word), &check, sizeof(check));
+  trace->next = p + 2 * sizeof(u32);
+  trace->last_word = word;
+}
+
+// A block as described by its definition
+struct TraceBlock {
+  u64 pc;
+  u32 length;
+  u32 raws[TRACE_MAX_LENGTH];
+  u8 rds[TRACE_MAX_LENGTH];
+};
+
+// Executions of a block. If trapped is set the instruction at count
+// trapped, otherwise the whole block was executed the given number of times
+// in a row. Only TRACE_REPEATED records are executed more than once, which
+// continue the record before them. values only holds the registers in the
+// mask and only with TRACE_VALUES, otherwise check is set.
+struct TraceRecord {
+  u32 id;
+  u32 count;
+  bool trapped;
+  u32 times;
+  u32 mask;
+  u32 check;
+  u64 values[32];
+};
+
+struct TraceReader {
+  FILE *file;
+  u32 flags;
+  u64 hart_id;
+  struct TraceBlock *blocks;
+  u32 num_blocks;
+  u32 last_id;
+  // Block of the last TRACE_EXECUTED record, 0 if another record followed it
+  u32 last_executed;
+  // Last value seen for every register, only with TRACE_VALUES
+  u64 registers[32];
+};
+
+bool trace_reader_open(struct TraceReader *reader, const char *path);
+// Returns 1 for a record, 0 at the end of the trace and -1 on errors
+int trace_read(struct TraceReader *reader, struct TraceRecord *record);
+// Definition of the block of a record that has been read
+static inline const struct TraceBlock *
+trace_reader_block(const struct TraceReader *reader, u32 id) {
+  return &reader->blocks[id - 1];
+}
+void trace_reader_close(struct TraceReader *reader);
+// Integer registers written by the first count instructions of the block
+u32 trace_block_mask(const struct TraceBlock *block, u32 count);
+#endif // TRACE_H
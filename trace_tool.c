@@ -0,0 +1,222 @@
+// Offline companion of the trace writer. replay prints the instructions of a
+// trace together with the values their blocks wrote, diff runs two traces
+// side by side and stops at the first block where they disagree.
+#include "rvc.h"
+#include "trace.h"
+#include "types.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of instructions shown before a divergence
+#define DIFF_CONTEXT 8
+
+static u64 instruction_length(u32 raw) {
+  return rvc_is_compressed(raw) ? sizeof(u16) : sizeof(u32);
+}
+
+// Prints the instructions of the record, the first one of which has the
+// given index, leaving out those outside of [first, end). A trapping
+// instruction is shown without an index. Each register value is shown on the
+// last instruction writing it, or the check on the last one if the trace has
+// no values. A block executed several times in a row is shown once.
+static void print_record(const char *prefix, const struct TraceReader *reader,
+                         const struct TraceRecord *record, u64 index,
+                         u64 first, u64 end) {
+  const struct TraceBlock *block = trace_reader_block(reader, record->id);
+  if (record->times > 1) {
+    first = 0;
+    end = ~0ULL;
+  }
+  u32 last_write[32];
+  for (u32 i = 0; i < record->count; i++) {
+    last_write[block->rds[i]] = i;
+  }
+  u64 pc = block->pc;
+  for (u32 i = 0; i < record->count + record->trapped;
+       pc += instruction_length(block->raws[i]), i++) {
+    if (index + i < first || index + i >= end) {
+      continue;
+    }
+    if (i == record->count) {
+      printf("%s%10s %016lx %08x trap\n", prefix, "", pc, block->raws[i]);
+      continue;
+    }
+    printf("%s%10lu %016lx %08x", prefix, index + i, pc, block->raws[i]);
+    u8 rd = block->rds[i];
+    if ((reader->flags & TRACE_VALUES) && 0 != rd && i == last_write[rd]) {
+      printf(" x%u=%lx", rd, record->values[rd]);
+    }
+    if (!(reader->flags & TRACE_VALUES) && 0 != record->mask &&
+        i + 1 == record->count) {
+      printf(" check=%08x", record->check);
+    }
+    printf("\n");
+  }
+  if (record->times > 1) {
+    printf("%s%10s %u times\n", prefix, "", record->times);
+  }
+}
+
+static bool records_equal(const struct TraceReader *a,
+                          const struct TraceRecord *record_a,
+                          const struct TraceReader *b,
+                          const struct TraceRecord *record_b) {
+  const struct TraceBlock *block_a = trace_reader_block(a, record_a->id);
+  const struct TraceBlock *block_b = trace_reader_block(b, record_b->id);
+  u32 length = record_a->count + record_a->trapped;
+  if (block_a->pc != block_b->pc || record_a->count != record_b->count ||
+      record_a->trapped != record_b->trapped ||
+      record_a->times != record_b->times ||
+      0 != memcmp(block_a->raws, block_b->raws, length * sizeof(u32))) {
+    return false;
+  }
+  if (!(a->flags & TRACE_VALUES)) {
+    return record_a->check == record_b->check;
+  }
+  for (u32 mask = record_a->mask; mask; mask &= mask - 1) {
+    u32 r = __builtin_ctz(mask);
+    if (record_a->values[r] != record_b->values[r]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool parse_number(const char *text, u64 *value) {
+  char *end;
+  *value = strtoull(text, &end, 0);
+  return '\0' != *text && '\0' == *end;
+}
+
+static int replay(const char *path, u64 first, u64 count) {
+  struct TraceReader reader;
+  if (!trace_reader_open(&reader, path)) {
+    return 2;
+  }
+  struct TraceRecord record;
+  u64 index = 0;
+  u64 blocks = 0;
+  int rc;
+  u64 end = count > ~0ULL - first ? ~0ULL : first + count;
+  while (1 == (rc = trace_read(&reader, &record))) {
+    u64 length = (u64)record.count * record.times + record.trapped;
+    if (index + length > first && index < end) {
+      print_record("", &reader, &record, index, first, end);
+    }
+    index += (u64)record.count * record.times;
+    blocks += record.times;
+  }
+  printf("%lu instructions in %lu blocks on hart %lu\n", index, blocks,
+         reader.hart_id);
+  if (reader.flags & TRACE_VALUES) {
+    printf("Last values written:\n");
+    for (u32 i = 1; i < 32; i++) {
+      printf("x%u: %lx\n", i, reader.registers[i]);
+    }
+  }
+  trace_reader_close(&reader);
+  if (rc < 0) {
+    fprintf(stderr, "%s: corrupt record after instruction %lu\n", path,
+            index);
+    return 2;
+  }
+  return 0;
+}
+
+static int diff(const char *path_a, const char *path_b) {
+  struct TraceReader a;
+  struct TraceReader b;
+  if (!trace_reader_open(&a, path_a)) {
+    return 2;
+  }
+  if (!trace_reader_open(&b, path_b)) {
+    trace_reader_close(&a);
+    return 2;
+  }
+  if ((a.flags ^ b.flags) & TRACE_VALUES) {
+    // Only traces with values have a record for every execution
+    fprintf(stderr, "%s and %s differ in --trace-values\n", path_a, path_b);
+    trace_reader_close(&a);
+    trace_reader_close(&b);
+    return 2;
+  }
+  // The last blocks of the first trace and the index of their first
+  // instruction, which hold the context shown before a divergence
+  struct TraceRecord context[DIFF_CONTEXT];
+  u64 context_indices[DIFF_CONTEXT];
+  u64 num_context = 0;
+  struct TraceRecord record_a;
+  struct TraceRecord record_b;
+  u64 index = 0;
+  int status = 0;
+  for (;;) {
+    int rc_a = trace_read(&a, &record_a);
+    int rc_b = trace_read(&b, &record_b);
+    if (rc_a < 0 || rc_b < 0) {
+      fprintf(stderr, "%s: corrupt record after instruction %lu\n",
+              rc_a < 0 ? path_a : path_b, index);
+      status = 2;
+      break;
+    }
+    if (0 == rc_a || 0 == rc_b ||
+        !records_equal(&a, &record_a, &b, &record_b)) {
+      if (0 == rc_a && 0 == rc_b) {
+        printf("Traces are identical, %lu instructions\n", index);
+        break;
+      }
+      u64 first = index > DIFF_CONTEXT ? index - DIFF_CONTEXT : 0;
+      u64 start = num_context > DIFF_CONTEXT ? num_context - DIFF_CONTEXT : 0;
+      for (u64 i = start; i < num_context; i++) {
+        u64 slot = i % DIFF_CONTEXT;
+        print_record(" ", &a, &context[slot], context_indices[slot], first,
+                     index);
+      }
+      if (0 == rc_a) {
+        printf("-%10lu end of %s\n", index, path_a);
+      } else {
+        print_record("-", &a, &record_a, index, index, ~0ULL);
+      }
+      if (0 == rc_b) {
+        printf("+%10lu end of %s\n", index, path_b);
+      } else {
+        print_record("+", &b, &record_b, index, index, ~0ULL);
+      }
+      status = 1;
+      break;
+    }
+    u64 slot = num_context++ % DIFF_CONTEXT;
+    context[slot] = record_a;
+    context_indices[slot] = index;
+    index += (u64)record_a.count * record_a.times;
+  }
+  trace_reader_close(&a);
+  trace_reader_close(&b);
+  return status;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s replay trace [first [count]]\n"
+          "       %s diff trace-a trace-b\n",
+          argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 3 && argc <= 5 && 0 == strcmp(argv[1], "replay")) {
+    u64 first = 0;
+    u64 count = ~0ULL;
+    if ((argc >= 4 && !parse_number(argv[3], &first)) ||
+        (5 == argc && !parse_number(argv[4], &count))) {
+      usage(argv[0]);
+      return 2;
+    }
+    return replay(argv[2], first, count);
+  }
+  if (4 == argc && 0 == strcmp(argv[1], "diff")) {
+    return diff(argv[2], argv[3]);
+  }
+  usage(argv[0]);
+  return 2;
+}
@@ -0,0 +1,392 @@
+// NS16550A compatible UART
+//
+// Guest output is queued in a ring buffer and written to stdout in batches by
+// a separate I/O thread, either once enough has been queued or when the flush
+// interval has passed. The same thread reads stdin into the receive ring so
+// that the hart never has to make a syscall or block on the host terminal.
+#include "uart.h"
+#include "mmu.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define UART_RBR 0 // Read, DLAB = 0
+#define UART_THR 0 // Write, DLAB = 0
+#define UART_DLL 0 // DLAB = 1
+#define UART_IER 1 // DLAB = 0
+#define UART_DLM 1 // DLAB = 1
+#define UART_IIR 2 // Read
+#define UART_FCR 2 // Write
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+#define UART_SCR 7
+
+#define IER_RDI 0x01  // Received data available
+#define IER_THRI 0x02 // Transmitter holding register empty
+
+#define IIR_NO_INT 0x01
+#define IIR_THRI 0x02
+#define IIR_RDI 0x04
+#define IIR_FIFO_ENABLED 0xC0
+
+#define FCR_ENABLE_FIFO 0x01
+
+#define LCR_DLAB 0x80
+
+#define LSR_DR 0x01   // Data ready
+#define LSR_THRE 0x20 // Transmitter holding register empty
+#define LSR_TEMT 0x40 // Transmitter empty
+
+#define MSR_DCD 0x80
+#define MSR_DSR 0x20
+#define MSR_CTS 0x10
+
+static bool tx_full(const struct Uart *uart) {
+  return uart->tx_head - uart->tx_tail == UART_TX_SIZE;
+}
+
+static u64 rx_count(const struct Uart *uart) {
+  return uart->rx_head - uart->rx_tail;
+}
+
+// Must be called with the lock held
+static void wake_io_thread(struct Uart *uart) {
+  if (uart->wake_pending) {
+    return;
+  }
+  uart->wake_pending = true;
+  u8 c = 0;
+  write(uart->wake_pipe[1], &c, 1);
+}
+
+// The transmitter interrupt stays pending while there is room in the tx
+// ring instead of being cleared by reading IIR, drivers turn it off in IER
+// once they have nothing left to send.
+static u8 uart_iir(const struct Uart *uart) {
+  u8 iir = IIR_NO_INT;
+  if ((uart->ier & IER_RDI) && rx_count(uart) > 0) {
+    iir = IIR_RDI;
+  } else if ((uart->ier & IER_THRI) && !tx_full(uart)) {
+    iir = IIR_THRI;
+  }
+  if (uart->fcr & FCR_ENABLE_FIFO) {
+    iir |= IIR_FIFO_ENABLED;
+  }
+  return iir;
+}
+
+// Must be called with the lock held whenever IER or one of the rings changes
+static void update_interrupt(struct Uart *uart) {
+  bool level = !(uart_iir(uart) & IIR_NO_INT);
+  if (level != uart->irq_level) {
+    uart->irq_level = level;
+    plic_set_level(uart->plic, uart->irq, level);
+  }
+}
+
+static void uart_transmit(struct Uart *uart, u8 c) {
+  pthread_mutex_lock(&uart->lock);
+  while (tx_full(uart) && uart->running) {
+    wake_io_thread(uart);
+    pthread_cond_wait(&uart->tx_space, &uart->lock);
+  }
+  if (tx_full(uart)) {
+    // The I/O thread is gone, nothing will drain the ring anymore
+    pthread_mutex_unlock(&uart->lock);
+    return;
+  }
+  uart->tx[uart->tx_head++ % UART_TX_SIZE] = c;
+  if (uart->tx_head - uart->tx_tail >= UART_FLUSH_THRESHOLD) {
+    wake_io_thread(uart);
+  }
+  update_interrupt(uart);
+  pthread_mutex_unlock(&uart->lock);
+}
+
+static u64 uart_read(void *opaque, u64 offset, u8 length) {
+  struct Uart *uart = opaque;
+  (void)length;
+  u8 value = 0;
+  pthread_mutex_lock(&uart->lock);
+  const bool dlab = uart->lcr & LCR_DLAB;
+  switch (offset) {
+  case UART_RBR:
+    if (dlab) {
+      value = uart->dll;
+    } else if (rx_count(uart) > 0) {
+      value = uart->rx[uart->rx_tail++ % UART_RX_SIZE];
+      update_interrupt(uart);
+    }
+    break;
+  case UART_IER:
+    value = dlab ? uart->dlm : uart->ier;
+    break;
+  case UART_IIR:
+    value = uart_iir(uart);
+    break;
+  case UART_LCR:
+    value = uart->lcr;
+    break;
+  case UART_MCR:
+    value = uart->mcr;
+    break;
+  case UART_LSR:
+    if (rx_count(uart) > 0) {
+      value |= LSR_DR;
+    }
+    if (!tx_full(uart)) {
+      value |= LSR_THRE | LSR_TEMT;
+    }
+    break;
+  case UART_MSR:
+    value = MSR_DCD | MSR_DSR | MSR_CTS;
+    break;
+  case UART_SCR:
+    value = uart->scr;
+    break;
+  default:
+    break;
+  }
+  pthread_mutex_unlock(&uart->lock);
+  return value;
+}
+
+static void uart_write(void *opaque, u64 offset, u64 value, u8 length) {
+  struct Uart *uart = opaque;
+  (void)length;
+  if (UART_THR == offset && !(uart->lcr & LCR_DLAB)) {
+    uart_transmit(uart, value);
+    return;
+  }
+  pthread_mutex_lock(&uart->lock);
+  const bool dlab = uart->lcr & LCR_DLAB;
+  switch (offset) {
+  case UART_DLL:
+    uart->dll = value;
+    break;
+  case UART_IER:
+    if (dlab) {
+      uart->dlm = value;
+    } else {
+      uart->ier = value & 0x0F;
+      update_interrupt(uart);
+    }
+    break;
+  case UART_FCR:
+    uart->fcr = value;
+    break;
+  case UART_LCR:
+    uart->lcr = value;
+    break;
+  case UART_MCR:
+    uart->mcr = value;
+    break;
+  case UART_SCR:
+    uart->scr = value;
+    break;
+  default:
+    break;
+  }
+  pthread_mutex_unlock(&uart->lock);
+}
+
+// Writes out the tx ring. The data is copied out so that the hart can keep
+// queueing output while the write blocks.
+static void flush_tx(struct Uart *uart) {
+  u8 *const buffer = uart->flush_buffer;
+  pthread_mutex_lock(&uart->flush_lock);
+  pthread_mutex_lock(&uart->lock);
+  u64 length = uart->tx_head - uart->tx_tail;
+  for (u64 i = 0; i < length; i++) {
+    buffer[i] = uart->tx[(uart->tx_tail + i) % UART_TX_SIZE];
+  }
+  uart->tx_tail += length;
+  pthread_cond_broadcast(&uart->tx_space);
+  update_interrupt(uart);
+  pthread_mutex_unlock(&uart->lock);
+
+  u64 written = 0;
+  while (written < length) {
+    ssize_t rc = write(STDOUT_FILENO, buffer + written, length - written);
+    if (-1 == rc) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if (EAGAIN == errno) {
+        struct pollfd pfd = {.fd = STDOUT_FILENO, .events = POLLOUT};
+        poll(&pfd, 1, -1);
+        continue;
+      }
+      // Nowhere to write the output, drop it
+      break;
+    }
+    written += rc;
+  }
+  pthread_mutex_unlock(&uart->flush_lock);
+}
+
+static void receive(struct Uart *uart) {
+  u8 buffer[UART_RX_SIZE];
+  pthread_mutex_lock(&uart->lock);
+  u64 space = UART_RX_SIZE - rx_count(uart);
+  pthread_mutex_unlock(&uart->lock);
+  if (0 == space) {
+    return;
+  }
+  ssize_t rc = read(STDIN_FILENO, buffer, space);
+  if (rc <= 0) {
+    if (0 == rc || (EINTR != errno && EAGAIN != errno)) {
+      uart->rx_eof = true;
+    }
+    return;
+  }
+  pthread_mutex_lock(&uart->lock);
+  for (ssize_t i = 0; i < rc; i++) {
+    uart->rx[uart->rx_head++ % UART_RX_SIZE] = buffer[i];
+  }
+  update_interrupt(uart);
+  pthread_mutex_unlock(&uart->lock);
+}
+
+static void *uart_io_thread(void *arg) {
+  struct Uart *uart = arg;
+  for (;;) {
+    pthread_mutex_lock(&uart->lock);
+    bool running = uart->running;
+    bool rx_full = (UART_RX_SIZE == rx_count(uart));
+    pthread_mutex_unlock(&uart->lock);
+    if (!running) {
+      break;
+    }
+
+    struct pollfd fds[2] = {
+        {.fd = uart->wake_pipe[0], .events = POLLIN},
+        {.fd = STDIN_FILENO, .events = POLLIN},
+    };
+    // Stop polling stdin while there is no room for the data
+    nfds_t nfds = (uart->rx_eof || rx_full) ? 1 : 2;
+    int rc = poll(fds, nfds, UART_FLUSH_INTERVAL_MS);
+    if (rc > 0 && (fds[0].revents & POLLIN)) {
+      u8 drain[64];
+      read(uart->wake_pipe[0], drain, sizeof(drain));
+      pthread_mutex_lock(&uart->lock);
+      uart->wake_pending = false;
+      pthread_mutex_unlock(&uart->lock);
+    }
+    if (rc > 0 && nfds > 1 && (fds[1].revents & (POLLIN | POLLHUP))) {
+      receive(uart);
+    }
+    flush_tx(uart);
+  }
+  return NULL;
+}
+
+bool uart_init(struct Uart *uart, struct Memory *mem, struct Plic *plic,
+               u32 irq) {
+  uart->tx_head = uart->tx_tail = 0;
+  uart->rx_head = uart->rx_tail = 0;
+  uart->ier = uart->fcr = uart->lcr = uart->mcr = uart->scr = 0;
+  uart->dll = uart->dlm = 0;
+  uart->plic = plic;
+  uart->irq = irq;
+  uart->irq_level = false;
+  uart->wake_pending = false;
+  uart->rx_eof = false;
+  if (-1 == pipe(uart->wake_pipe)) {
+    perror("pipe");
+    return false;
+  }
+  fcntl(uart->wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(uart->wake_pipe[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&uart->lock, NULL);
+  pthread_mutex_init(&uart->flush_lock, NULL);
+  pthread_cond_init(&uart->tx_space, NULL);
+
+  struct Device device = {
+      .name = "uart",
+      .base = Ns16650a_BASE,
+      .size = Ns16650a_SIZE,
+      .opaque = uart,
+      .read = uart_read,
+      .write = uart_write,
+  };
+  if (!memory_add_device(mem, &device)) {
+    return false;
+  }
+
+  uart->running = true;
+  if (0 != pthread_create(&uart->io_thread, NULL, uart_io_thread, uart)) {
+    perror("pthread_create");
+    uart->running = false;
+    return false;
+  }
+  return true;
+}
+
+void uart_save_state(struct Uart *uart, struct UartState *state) {
+  pthread_mutex_lock(&uart->lock);
+  state->ier = uart->ier;
+  state->fcr = uart->fcr;
+  state->lcr = uart->lcr;
+  state->mcr = uart->mcr;
+  state->scr = uart->scr;
+  state->dll = uart->dll;
+  state->dlm = uart->dlm;
+  pthread_mutex_unlock(&uart->lock);
+}
+
+void uart_restore_state(struct Uart *uart, const struct UartState *state) {
+  pthread_mutex_lock(&uart->lock);
+  uart->ier = state->ier;
+  uart->fcr = state->fcr;
+  uart->lcr = state->lcr;
+  uart->mcr = state->mcr;
+  uart->scr = state->scr;
+  uart->dll = state->dll;
+  uart->dlm = state->dlm;
+  // The PLIC has forgotten the line
+  uart->irq_level = false;
+  update_interrupt(uart);
+  pthread_mutex_unlock(&uart->lock);
+}
+
+void uart_flush(struct Uart *uart) {
+  flush_tx(uart);
+}
+
+void uart_flush_on_signal(struct Uart *uart) {
+  u64 tail = __atomic_load_n(&uart->tx_tail, __ATOMIC_ACQUIRE);
+  u64 head = __atomic_load_n(&uart->tx_head, __ATOMIC_ACQUIRE);
+  while (tail < head) {
+    // Up to the end of the ring at most
+    u64 offset = tail % UART_TX_SIZE;
+    u64 length = head - tail;
+    if (length > UART_TX_SIZE - offset) {
+      length = UART_TX_SIZE - offset;
+    }
+    ssize_t rc = write(STDOUT_FILENO, uart->tx + offset, length);
+    if (-1 == rc && EINTR == errno) {
+      continue;
+    }
+    if (rc <= 0) {
+      break;
+    }
+    tail += rc;
+  }
+}
+
+void uart_destroy(struct Uart *uart) {
+  pthread_mutex_lock(&uart->lock);
+  uart->running = false;
+  wake_io_thread(uart);
+  pthread_cond_broadcast(&uart->tx_space);
+  pthread_mutex_unlock(&uart->lock);
+  pthread_join(uart->io_thread, NULL);
+  flush_tx(uart);
+  close(uart->wake_pipe[0]);
+  close(uart->wake_pipe[1]);
+}
@@ -0,0 +1,78 @@
+#ifndef UART_H
+#define UART_H
+#include "mmu.h"
+#include "plic.h"
+#include "types.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+#define Ns16650a_BASE 0x10000000
+#define Ns16650a_SIZE 0x100
+
+#define UART_TX_SIZE (64 * 1024)
+#define UART_RX_SIZE 4096
+// Buffered output is written out once this much is queued, or after
+// UART_FLUSH_INTERVAL_MS otherwise.
+#define UART_FLUSH_THRESHOLD 4096
+#define UART_FLUSH_INTERVAL_MS 10
+
+struct Uart {
+  pthread_mutex_t lock;
+  // Signalled when the I/O thread has made room in the tx ring
+  pthread_cond_t tx_space;
+  pthread_t io_thread;
+  bool running;
+  // Written to wake the I/O thread up before the flush interval has passed
+  int wake_pipe[2];
+  bool wake_pending;
+  bool rx_eof;
+  // Serializes writers to stdout so that output stays in order
+  pthread_mutex_t flush_lock;
+  u8 flush_buffer[UART_TX_SIZE];
+
+  // The rings are indexed by free running counters
+  u8 tx[UART_TX_SIZE];
+  u64 tx_head;
+  u64 tx_tail;
+  u8 rx[UART_RX_SIZE];
+  u64 rx_head;
+  u64 rx_tail;
+
+  struct Plic *plic;
+  u32 irq;
+  // Last level given to the PLIC, so that it is only told about changes
+  bool irq_level;
+
+  u8 ier;
+  u8 fcr;
+  u8 lcr;
+  u8 mcr;
+  u8 scr;
+  u8 dll;
+  u8 dlm;
+};
+
+// Registers of the UART as seen by the guest, for snapshots
+struct UartState {
+  u8 ier;
+  u8 fcr;
+  u8 lcr;
+  u8 mcr;
+  u8 scr;
+  u8 dll;
+  u8 dlm;
+};
+
+// The interrupt line is high while the condition of IIR is, see uart_iir()
+bool uart_init(struct Uart *uart, struct Memory *mem, struct Plic *plic,
+               u32 irq);
+void uart_save_state(struct Uart *uart, struct UartState *state);
+// Sets the interrupt line again, after the PLIC has been restored
+void uart_restore_state(struct Uart *uart, const struct UartState *state);
+// Writes out everything buffered so far
+void uart_flush(struct Uart *uart);
+// Writes out the tx ring without taking any locks, from a signal handler.
+// Output that the I/O thread is writing at the same time may be repeated.
+void uart_flush_on_signal(struct Uart *uart);
+void uart_destroy(struct Uart *uart);
+#endif // UART_H
@@ -0,0 +1,552 @@
+// virtio-mmio transport version 2 with split virtqueues, see struct Virtio.
+#include "virtio.h"
+#include "mmu.h"
+#include "plic.h"
+#include <stdio.h>
+#include <string.h>
+
+#define VIRTIO_MMIO_MAGIC_VALUE 0x000
+#define VIRTIO_MMIO_VERSION 0x004
+#define VIRTIO_MMIO_DEVICE_ID 0x008
+#define VIRTIO_MMIO_VENDOR_ID 0x00C
+#define VIRTIO_MMIO_DEVICE_FEATURES 0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES 0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL 0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX 0x034
+#define VIRTIO_MMIO_QUEUE_NUM 0x038
+#define VIRTIO_MMIO_QUEUE_READY 0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY 0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK 0x064
+#define VIRTIO_MMIO_STATUS 0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW 0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH 0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW 0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH 0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW 0x0A0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH 0x0A4
+#define VIRTIO_MMIO_CONFIG_GENERATION 0x0FC
+#define VIRTIO_MMIO_CONFIG 0x100
+
+// "virt" in little endian
+#define VIRTIO_MAGIC 0x74726976
+#define VIRTIO_VERSION 2
+#define VIRTIO_VENDOR_ID 0
+
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_NEEDS_RESET 64
+
+#define VIRTIO_INTERRUPT_USED 1
+#define VIRTIO_INTERRUPT_CONFIG 2
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+struct VirtqDesc {
+  u64 addr;
+  u32 len;
+  u16 flags;
+  u16 next;
+};
+
+// Host address of guest RAM, NULL if the range is not all in RAM
+static u8 *guest_ram(const struct Virtio *virtio, u64 address, u64 length) {
+  const struct Memory *mem = virtio->mem;
+  if (!ram_contains(mem, address, length)) {
+    return NULL;
+  }
+  return mem->ram + (address - mem->ram_base);
+}
+
+// The rings are checked when the queue is made ready
+static u16 *avail_ring(const struct Virtio *virtio,
+                       const struct VirtioQueueState *q) {
+  return (u16 *)guest_ram(virtio, q->driver, 0);
+}
+
+static u8 *used_ring(const struct Virtio *virtio,
+                     const struct VirtioQueueState *q) {
+  return guest_ram(virtio, q->device, 0);
+}
+
+// The fields the driver and the device use for VIRTIO_F_RING_EVENT_IDX
+// follow the rings
+static u16 *used_event(const struct Virtio *virtio,
+                       const struct VirtioQueueState *q) {
+  return avail_ring(virtio, q) + 2 + q->num;
+}
+
+static u16 *avail_event(const struct Virtio *virtio,
+                        const struct VirtioQueueState *q) {
+  return (u16 *)(used_ring(virtio, q) + 2 * sizeof(u16) +
+                 (u64)q->num * 2 * sizeof(u32));
+}
+
+static bool event_idx(const struct Virtio *virtio) {
+  return virtio->state.driver_features & VIRTIO_F_RING_EVENT_IDX;
+}
+
+// Has the index moved past event since it was old, in free running indices
+static bool need_event(u16 event, u16 index, u16 old) {
+  return (u16)(index - event - 1) < (u16)(index - old);
+}
+
+static void update_interrupt(struct Virtio *virtio) {
+  plic_set_level(virtio->plic, virtio->irq,
+                 0 != virtio->state.interrupt_status);
+}
+
+static void reset(struct Virtio *virtio) {
+  memset(&virtio->state, 0, sizeof(virtio->state));
+  virtio->reset_pending = false;
+  update_interrupt(virtio);
+}
+
+// The driver broke the rules, it has to reset the device
+static void fail(struct Virtio *virtio) {
+  virtio->state.status |= VIRTIO_STATUS_NEEDS_RESET;
+  if (virtio->state.status & VIRTIO_STATUS_DRIVER_OK) {
+    virtio->state.interrupt_status |= VIRTIO_INTERRUPT_CONFIG;
+    update_interrupt(virtio);
+  }
+}
+
+static bool queue_valid(const struct Virtio *virtio,
+                        const struct VirtioQueueState *q) {
+  // The size has to be a power of 2 for the free running indices
+  if (0 == q->num || q->num > VIRTIO_QUEUE_SIZE || (q->num & (q->num - 1))) {
+    return false;
+  }
+  u64 desc_size = (u64)q->num * sizeof(struct VirtqDesc);
+  u64 avail_size = 2 * sizeof(u16) + (u64)q->num * sizeof(u16) + sizeof(u16);
+  u64 used_size =
+      2 * sizeof(u16) + (u64)q->num * 2 * sizeof(u32) + sizeof(u16);
+  return 0 == q->desc % 16 && 0 == q->driver % 2 && 0 == q->device % 4 &&
+         guest_ram(virtio, q->desc, desc_size) &&
+         guest_ram(virtio, q->driver, avail_size) &&
+         guest_ram(virtio, q->device, used_size);
+}
+
+static u64 set_half(u64 old, bool high, u64 value) {
+  if (high) {
+    return (old & 0xFFFFFFFFULL) | (value << 32);
+  }
+  return (old & ~0xFFFFFFFFULL) | (value & 0xFFFFFFFFULL);
+}
+
+static u64 virtio_read(void *opaque, u64 offset, u8 length) {
+  struct Virtio *virtio = opaque;
+  u64 value = 0;
+  pthread_mutex_lock(&virtio->lock);
+  if (offset >= VIRTIO_MMIO_CONFIG) {
+    value = virtio->read_config(virtio->opaque, offset - VIRTIO_MMIO_CONFIG,
+                                length);
+    pthread_mutex_unlock(&virtio->lock);
+    return value;
+  }
+  if (sizeof(u32) != length) {
+    pthread_mutex_unlock(&virtio->lock);
+    return 0;
+  }
+  struct VirtioState *s = &virtio->state;
+  struct VirtioQueueState *q = &s->queues[s->queue_sel];
+  bool queue_exists = s->queue_sel < virtio->num_queues;
+  switch (offset) {
+  case VIRTIO_MMIO_MAGIC_VALUE:
+    value = VIRTIO_MAGIC;
+    break;
+  case VIRTIO_MMIO_VERSION:
+    value = VIRTIO_VERSION;
+    break;
+  case VIRTIO_MMIO_DEVICE_ID:
+    value = virtio->device_id;
+    break;
+  case VIRTIO_MMIO_VENDOR_ID:
+    value = VIRTIO_VENDOR_ID;
+    break;
+  case VIRTIO_MMIO_DEVICE_FEATURES:
+    if (s->device_features_sel < 2) {
+      value = (u32)(virtio->device_features >> (32 * s->device_features_sel));
+    }
+    break;
+  case VIRTIO_MMIO_QUEUE_NUM_MAX:
+    value = queue_exists ? VIRTIO_QUEUE_SIZE : 0;
+    break;
+  case VIRTIO_MMIO_QUEUE_READY:
+    value = queue_exists ? q->ready : 0;
+    break;
+  case VIRTIO_MMIO_INTERRUPT_STATUS:
+    value = s->interrupt_status;
+    break;
+  case VIRTIO_MMIO_STATUS:
+    value = s->status;
+    break;
+  case VIRTIO_MMIO_CONFIG_GENERATION:
+    value = 0;
+    break;
+  }
+  pthread_mutex_unlock(&virtio->lock);
+  return value;
+}
+
+static void write_status(struct Virtio *virtio, u32 value) {
+  struct VirtioState *s = &virtio->state;
+  if (0 == value) {
+    // Reads of status return the old value until the requests in flight are
+    // done, which is how the driver waits for the reset
+    if (virtio->in_flight) {
+      virtio->reset_pending = true;
+    } else {
+      reset(virtio);
+    }
+    return;
+  }
+  // The features are only accepted if the driver understood the device
+  if ((value & VIRTIO_STATUS_FEATURES_OK) &&
+      !(s->status & VIRTIO_STATUS_FEATURES_OK) &&
+      ((s->driver_features & ~virtio->device_features) ||
+       !(s->driver_features & VIRTIO_F_VERSION_1))) {
+    value &= ~VIRTIO_STATUS_FEATURES_OK;
+  }
+  s->status = value;
+  if (value & VIRTIO_STATUS_DRIVER_OK) {
+    for (u32 i = 0; i < virtio->num_queues; i++) {
+      virtio->notify(virtio->opaque, i);
+    }
+  }
+}
+
+static void virtio_write(void *opaque, u64 offset, u64 value, u8 length) {
+  struct Virtio *virtio = opaque;
+  // The configuration space is read-only for the devices there are
+  if (sizeof(u32) != length || offset >= VIRTIO_MMIO_CONFIG) {
+    return;
+  }
+  pthread_mutex_lock(&virtio->lock);
+  struct VirtioState *s = &virtio->state;
+  struct VirtioQueueState *q = &s->queues[s->queue_sel];
+  // The queue registers may only change while the queue is not ready
+  bool queue_writable = s->queue_sel < virtio->num_queues && !q->ready;
+  switch (offset) {
+  case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+    s->device_features_sel = value;
+    break;
+  case VIRTIO_MMIO_DRIVER_FEATURES:
+    if (s->driver_features_sel < 2 &&
+        !(s->status & VIRTIO_STATUS_FEATURES_OK)) {
+      s->driver_features =
+          set_half(s->driver_features, 1 == s->driver_features_sel, value);
+    }
+    break;
+  case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+    s->driver_features_sel = value;
+    break;
+  case VIRTIO_MMIO_QUEUE_SEL:
+    if (value < VIRTIO_MAX_QUEUES) {
+      s->queue_sel = value;
+    }
+    break;
+  case VIRTIO_MMIO_QUEUE_NUM:
+    if (queue_writable) {
+      q->num = value;
+    }
+    break;
+  case VIRTIO_MMIO_QUEUE_READY:
+    if (s->queue_sel >= virtio->num_queues) {
+      break;
+    }
+    if (0 == (value & 1)) {
+      q->ready = 0;
+    } else if (!q->ready) {
+      if (queue_valid(virtio, q)) {
+        q->ready = 1;
+      } else {
+        fail(virtio);
+      }
+    }
+    break;
+  case VIRTIO_MMIO_QUEUE_NOTIFY:
+    if (value < virtio->num_queues) {
+      virtio->notify(virtio->opaque, value);
+    }
+    break;
+  case VIRTIO_MMIO_INTERRUPT_ACK:
+    s->interrupt_status &= ~value;
+    update_interrupt(virtio);
+    break;
+  case VIRTIO_MMIO_STATUS:
+    write_status(virtio, value);
+    break;
+  case VIRTIO_MMIO_QUEUE_DESC_LOW:
+  case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+    if (queue_writable) {
+      q->desc =
+          set_half(q->desc, VIRTIO_MMIO_QUEUE_DESC_HIGH == offset, value);
+    }
+    break;
+  case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+  case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+    if (queue_writable) {
+      q->driver =
+          set_half(q->driver, VIRTIO_MMIO_QUEUE_DRIVER_HIGH == offset, value);
+    }
+    break;
+  case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+  case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+    if (queue_writable) {
+      q->device =
+          set_half(q->device, VIRTIO_MMIO_QUEUE_DEVICE_HIGH == offset, value);
+    }
+    break;
+  }
+  pthread_mutex_unlock(&virtio->lock);
+}
+
+bool virtio_init(struct Virtio *virtio, struct Memory *mem, u64 base,
+                 struct Plic *plic, u32 irq, u32 device_id,
+                 u64 device_features, u32 num_queues) {
+  pthread_mutex_init(&virtio->lock, NULL);
+  pthread_cond_init(&virtio->idle, NULL);
+  virtio->mem = mem;
+  virtio->plic = plic;
+  virtio->irq = irq;
+  virtio->device_id = device_id;
+  virtio->device_features = device_features | VIRTIO_F_RING_EVENT_IDX;
+  virtio->num_queues = num_queues;
+  virtio->in_flight = 0;
+  virtio->paused = false;
+  virtio->reset_pending = false;
+  memset(&virtio->state, 0, sizeof(virtio->state));
+  struct Device device = {
+      .name = "virtio",
+      .base = base,
+      .size = VIRTIO_SIZE,
+      .opaque = virtio,
+      .read = virtio_read,
+      .write = virtio_write,
+  };
+  return memory_add_device(mem, &device);
+}
+
+bool virtio_pop(struct Virtio *virtio, u32 queue, struct VirtioChain *chain) {
+  struct VirtioState *s = &virtio->state;
+  struct VirtioQueueState *q = &s->queues[queue];
+  if (virtio->paused || virtio->reset_pending || !q->ready ||
+      (s->status & VIRTIO_STATUS_NEEDS_RESET) ||
+      !(s->status & VIRTIO_STATUS_DRIVER_OK)) {
+    return false;
+  }
+  const u16 *avail = avail_ring(virtio, q);
+  // The entry is only read after the index that published it
+  u16 avail_idx = __atomic_load_n(&avail[1], __ATOMIC_ACQUIRE);
+  if (avail_idx == q->last_avail) {
+    if (!event_idx(virtio)) {
+      return false;
+    }
+    // Asks for a notification for the next chain. The driver may have made
+    // one available before it saw that, so the index is checked again.
+    u16 *event = avail_event(virtio, q);
+    __atomic_store_n(event, q->last_avail, __ATOMIC_SEQ_CST);
+    u64 offset = (u8 *)event - used_ring(virtio, q);
+    memory_mark_dirty(virtio->mem, q->device + offset, sizeof(*event));
+    memory_invalidate_code(virtio->mem, q->device + offset, sizeof(*event));
+    avail_idx = __atomic_load_n(&avail[1], __ATOMIC_SEQ_CST);
+    if (avail_idx == q->last_avail) {
+      return false;
+    }
+  }
+  if ((u16)(avail_idx - q->last_avail) > q->num) {
+    fail(virtio);
+    return false;
+  }
+  u16 head = avail[2 + q->last_avail % q->num];
+  const struct VirtqDesc *table =
+      (const struct VirtqDesc *)guest_ram(virtio, q->desc, 0);
+  chain->head = head;
+  chain->num_readable = 0;
+  chain->num_buffers = 0;
+  u16 index = head;
+  for (;;) {
+    // A chain longer than the table has a loop
+    if (index >= q->num || chain->num_buffers == q->num) {
+      fail(virtio);
+      return false;
+    }
+    struct VirtqDesc desc;
+    memcpy(&desc, &table[index], sizeof(desc));
+    struct VirtioBuffer *buffer = &chain->buffers[chain->num_buffers];
+    buffer->host = guest_ram(virtio, desc.addr, desc.len);
+    buffer->guest = desc.addr;
+    buffer->length = desc.len;
+    // Indirect descriptors are not offered
+    bool writable = desc.flags & VIRTQ_DESC_F_WRITE;
+    if (!buffer->host || (!writable && chain->num_readable !=
+                                           chain->num_buffers)) {
+      fail(virtio);
+      return false;
+    }
+    chain->num_buffers++;
+    if (!writable) {
+      chain->num_readable++;
+    }
+    if (!(desc.flags & VIRTQ_DESC_F_NEXT)) {
+      break;
+    }
+    index = desc.next;
+  }
+  q->last_avail++;
+  virtio->in_flight++;
+  return true;
+}
+
+void virtio_push(struct Virtio *virtio, u32 queue,
+                 const struct VirtioChain *chain, u32 written) {
+  struct VirtioQueueState *q = &virtio->state.queues[queue];
+  virtio->in_flight--;
+  // After a reset the rings belong to the driver again
+  if (virtio->reset_pending) {
+    if (0 == virtio->in_flight) {
+      reset(virtio);
+      pthread_cond_broadcast(&virtio->idle);
+    }
+    return;
+  }
+  u8 *used = used_ring(virtio, q);
+  u32 element[2] = {chain->head, written};
+  u64 offset = 2 * sizeof(u16) + (u64)(q->used_idx % q->num) * sizeof(element);
+  memcpy(used + offset, element, sizeof(element));
+  q->used_idx++;
+  // The element has to be visible before the index that publishes it
+  __atomic_store_n((u16 *)used + 1, q->used_idx, __ATOMIC_RELEASE);
+  memory_mark_dirty(virtio->mem, q->device, offset + sizeof(element));
+  memory_invalidate_code(virtio->mem, q->device, offset + sizeof(element));
+  if (0 == virtio->in_flight) {
+    pthread_cond_broadcast(&virtio->idle);
+  }
+}
+
+void virtio_notify(struct Virtio *virtio, u32 queue) {
+  struct VirtioQueueState *q = &virtio->state.queues[queue];
+  if (q->signalled_used == q->used_idx) {
+    return;
+  }
+  u16 old = q->signalled_used;
+  q->signalled_used = q->used_idx;
+  const u16 *avail = avail_ring(virtio, q);
+  if (event_idx(virtio)) {
+    // The driver may be setting used_event after it looked at the index
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    u16 event = __atomic_load_n(used_event(virtio, q), __ATOMIC_ACQUIRE);
+    if (!need_event(event, q->used_idx, old)) {
+      return;
+    }
+  } else if (__atomic_load_n(&avail[0], __ATOMIC_ACQUIRE) &
+             VIRTQ_AVAIL_F_NO_INTERRUPT) {
+    return;
+  }
+  virtio->state.interrupt_status |= VIRTIO_INTERRUPT_USED;
+  update_interrupt(virtio);
+}
+
+u64 virtio_chain_read(const struct VirtioChain *chain, u64 offset, void *dst,
+                      u64 length) {
+  u64 copied = 0;
+  for (u32 i = 0; i < chain->num_readable && copied < length; i++) {
+    const struct VirtioBuffer *buffer = &chain->buffers[i];
+    if (offset >= buffer->length) {
+      offset -= buffer->length;
+      continue;
+    }
+    u64 n = buffer->length - offset;
+    if (n > length - copied) {
+      n = length - copied;
+    }
+    memcpy((u8 *)dst + copied, buffer->host + offset, n);
+    copied += n;
+    offset = 0;
+  }
+  return copied;
+}
+
+u64 virtio_chain_write(struct Virtio *virtio, const struct VirtioChain *chain,
+                       u64 offset, const void *src, u64 length) {
+  u64 copied = 0;
+  for (u32 i = chain->num_readable; i < chain->num_buffers && copied < length;
+       i++) {
+    const struct VirtioBuffer *buffer = &chain->buffers[i];
+    if (offset >= buffer->length) {
+      offset -= buffer->length;
+      continue;
+    }
+    u64 n = buffer->length - offset;
+    if (n > length - copied) {
+      n = length - copied;
+    }
+    memcpy(buffer->host + offset, (const u8 *)src + copied, n);
+    // Like any other write to RAM
+    memory_mark_dirty(virtio->mem, buffer->guest + offset, n);
+    memory_invalidate_code(virtio->mem, buffer->guest + offset, n);
+    copied += n;
+    offset = 0;
+  }
+  return copied;
+}
+
+u64 virtio_chain_readable(const struct VirtioChain *chain) {
+  u64 length = 0;
+  for (u32 i = 0; i < chain->num_readable; i++) {
+    length += chain->buffers[i].length;
+  }
+  return length;
+}
+
+u64 virtio_chain_writable(const struct VirtioChain *chain) {
+  u64 length = 0;
+  for (u32 i = chain->num_readable; i < chain->num_buffers; i++) {
+    length += chain->buffers[i].length;
+  }
+  return length;
+}
+
+void virtio_pause(struct Virtio *virtio) {
+  pthread_mutex_lock(&virtio->lock);
+  virtio->paused = true;
+  while (virtio->in_flight) {
+    pthread_cond_wait(&virtio->idle, &virtio->lock);
+  }
+  pthread_mutex_unlock(&virtio->lock);
+}
+
+void virtio_resume(struct Virtio *virtio) {
+  pthread_mutex_lock(&virtio->lock);
+  virtio->paused = false;
+  // Requests may have been left in the rings
+  for (u32 i = 0; i < virtio->num_queues; i++) {
+    virtio->notify(virtio->opaque, i);
+  }
+  pthread_mutex_unlock(&virtio->lock);
+}
+
+void virtio_save_state(struct Virtio *virtio, struct VirtioState *state) {
+  pthread_mutex_lock(&virtio->lock);
+  *state = virtio->state;
+  pthread_mutex_unlock(&virtio->lock);
+}
+
+void virtio_restore_state(struct Virtio *virtio,
+                          const struct VirtioState *state) {
+  pthread_mutex_lock(&virtio->lock);
+  virtio->state = *state;
+  virtio->reset_pending = false;
+  update_interrupt(virtio);
+  pthread_mutex_unlock(&virtio->lock);
+}
+
+void virtio_destroy(struct Virtio *virtio) {
+  pthread_cond_destroy(&virtio->idle);
+  pthread_mutex_destroy(&virtio->lock);
+}
@@ -0,0 +1,135 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+#include "mmu.h"
+#include "plic.h"
+#include "types.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+// Slots of the virtio-mmio devices, at the same addresses as on the QEMU virt
+// machine
+#define VIRTIO_BASE 0x10001000
+#define VIRTIO_SIZE 0x1000
+
+#define VIRTIO_ID_NET 1
+#define VIRTIO_ID_BLOCK 2
+
+// Offered by the transport for every device
+#define VIRTIO_F_RING_EVENT_IDX (1ULL << 29)
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+
+#define VIRTIO_QUEUE_SIZE 256
+#define VIRTIO_MAX_QUEUES 2
+
+// A split virtqueue as configured by the driver, which owns the rings in
+// guest RAM. The indices are free running like in the rings.
+struct VirtioQueueState {
+  u32 num;
+  u32 ready;
+  u64 desc;
+  u64 driver;
+  u64 device;
+  u16 last_avail;
+  u16 used_idx;
+  // used_idx when the driver was last notified
+  u16 signalled_used;
+};
+
+// Registers of the transport as seen by the guest, for snapshots
+struct VirtioState {
+  u32 status;
+  u32 device_features_sel;
+  u32 driver_features_sel;
+  u32 queue_sel;
+  u64 driver_features;
+  u32 interrupt_status;
+  struct VirtioQueueState queues[VIRTIO_MAX_QUEUES];
+};
+
+// A buffer of a descriptor chain, mapped to the host
+struct VirtioBuffer {
+  u8 *host;
+  u64 guest;
+  u32 length;
+};
+
+// A descriptor chain taken from the available ring. The buffers the device
+// reads come first, followed by the ones it writes.
+struct VirtioChain {
+  u16 head;
+  u32 num_readable;
+  u32 num_buffers;
+  struct VirtioBuffer buffers[VIRTIO_QUEUE_SIZE];
+};
+
+// The virtio-mmio transport, which is shared by the devices. The device runs
+// the requests on its own threads: they take chains with virtio_pop(), work
+// on the buffers without the lock and hand them back with virtio_push(), so
+// the hart that notified a queue never waits for a request.
+struct Virtio {
+  // Protects everything here, the device may use it for its own state
+  pthread_mutex_t lock;
+  // Signalled when the last request in flight has been pushed
+  pthread_cond_t idle;
+  struct Memory *mem;
+  struct Plic *plic;
+  u32 irq;
+  u32 device_id;
+  u64 device_features;
+  u32 num_queues;
+  // Requests taken but not pushed yet
+  u32 in_flight;
+  // Set by virtio_pause(), virtio_pop() takes nothing while it is
+  bool paused;
+  // The driver reset the device while requests were in flight, the reset
+  // completes once they are all pushed
+  bool reset_pending;
+  void *opaque;
+  // Called with the lock held when the driver notifies a queue and when the
+  // device is resumed
+  void (*notify)(void *opaque, u32 queue);
+  // Reads the device specific configuration space
+  u64 (*read_config)(void *opaque, u64 offset, u8 length);
+  struct VirtioState state;
+};
+
+// Sets up the transport at base, device_features has to include
+// VIRTIO_F_VERSION_1. The callbacks and opaque are set by the device.
+bool virtio_init(struct Virtio *virtio, struct Memory *mem, u64 base,
+                 struct Plic *plic, u32 irq, u32 device_id,
+                 u64 device_features, u32 num_queues);
+
+// virtio_pop(), virtio_push() and virtio_notify() must be called with the
+// lock held.
+//
+// Takes the next chain from the available ring, returns false if there is
+// none or the queue is not running. With VIRTIO_F_RING_EVENT_IDX the driver
+// only notifies the queue again once it ran empty.
+bool virtio_pop(struct Virtio *virtio, u32 queue, struct VirtioChain *chain);
+// Puts the chain into the used ring with the number of bytes written to it
+void virtio_push(struct Virtio *virtio, u32 queue,
+                 const struct VirtioChain *chain, u32 written);
+// Interrupts the driver if anything was pushed since the last time, unless
+// it asked not to be or, with VIRTIO_F_RING_EVENT_IDX, not yet
+void virtio_notify(struct Virtio *virtio, u32 queue);
+
+// Copy from and to the chain, starting at offset into the readable or the
+// writable buffers. Return the number of bytes copied, which is less than
+// length if the buffers end first.
+u64 virtio_chain_read(const struct VirtioChain *chain, u64 offset, void *dst,
+                      u64 length);
+u64 virtio_chain_write(struct Virtio *virtio, const struct VirtioChain *chain,
+                       u64 offset, const void *src, u64 length);
+// Total length of the readable and the writable buffers
+u64 virtio_chain_readable(const struct VirtioChain *chain);
+u64 virtio_chain_writable(const struct VirtioChain *chain);
+
+// Waits for the requests in flight and stops taking new ones, which is
+// needed before the state is saved or restored and before RAM is reset
+void virtio_pause(struct Virtio *virtio);
+void virtio_resume(struct Virtio *virtio);
+void virtio_save_state(struct Virtio *virtio, struct VirtioState *state);
+void virtio_restore_state(struct Virtio *virtio,
+                          const struct VirtioState *state);
+void virtio_destroy(struct Virtio *virtio);
+#endif // VIRTIO_H
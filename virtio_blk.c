@@ -0,0 +1,225 @@
+// virtio block device, see struct VirtioBlk.
+#include "virtio_blk.h"
+#include "virtio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define VIRTIO_BLK_F_RO (1ULL << 5)
+#define VIRTIO_BLK_F_FLUSH (1ULL << 9)
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_GET_ID 8
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VIRTIO_BLK_ID_BYTES 20
+#define VIRTIO_BLK_ID "r5-virtio-blk"
+
+// Every request starts with this and ends with a status byte
+struct VirtioBlkHeader {
+  u32 type;
+  u32 reserved;
+  u64 sector;
+};
+
+// Offset into the image of a transfer, false if it does not fit
+static bool disk_range(const struct VirtioBlk *blk, u64 sector, u64 length,
+                       u64 *offset) {
+  if (length % VIRTIO_BLK_SECTOR_SIZE ||
+      sector > blk->size / VIRTIO_BLK_SECTOR_SIZE) {
+    return false;
+  }
+  *offset = sector * VIRTIO_BLK_SECTOR_SIZE;
+  return length <= blk->size - *offset;
+}
+
+// Runs the request without the lock and returns the number of bytes written
+// to the chain. The data is copied straight between the image and the
+// buffers.
+static u32 handle_request(struct VirtioBlk *blk,
+                          const struct VirtioChain *chain) {
+  struct Virtio *virtio = &blk->virtio;
+  u64 writable = virtio_chain_writable(chain);
+  // There is no room for the status, so the request cannot even fail
+  if (0 == writable) {
+    return 0;
+  }
+  struct VirtioBlkHeader header;
+  u8 status = VIRTIO_BLK_S_OK;
+  u64 written = 0;
+  u64 offset;
+  if (sizeof(header) !=
+      virtio_chain_read(chain, 0, &header, sizeof(header))) {
+    status = VIRTIO_BLK_S_IOERR;
+  } else if (VIRTIO_BLK_T_IN == header.type) {
+    if (disk_range(blk, header.sector, writable - 1, &offset)) {
+      written = virtio_chain_write(virtio, chain, 0, blk->disk + offset,
+                                   writable - 1);
+    } else {
+      status = VIRTIO_BLK_S_IOERR;
+    }
+  } else if (VIRTIO_BLK_T_OUT == header.type) {
+    u64 length = virtio_chain_readable(chain) - sizeof(header);
+    if (!blk->read_only &&
+        disk_range(blk, header.sector, length, &offset)) {
+      virtio_chain_read(chain, sizeof(header), blk->disk + offset, length);
+    } else {
+      status = VIRTIO_BLK_S_IOERR;
+    }
+  } else if (VIRTIO_BLK_T_FLUSH == header.type) {
+    if (!blk->copy_on_write && !blk->read_only &&
+        -1 == msync(blk->disk, blk->size, MS_SYNC)) {
+      status = VIRTIO_BLK_S_IOERR;
+    }
+  } else if (VIRTIO_BLK_T_GET_ID == header.type) {
+    char id[VIRTIO_BLK_ID_BYTES] = VIRTIO_BLK_ID;
+    u64 length = writable - 1 < sizeof(id) ? writable - 1 : sizeof(id);
+    written = virtio_chain_write(virtio, chain, 0, id, length);
+  } else {
+    status = VIRTIO_BLK_S_UNSUPP;
+  }
+  virtio_chain_write(virtio, chain, writable - 1, &status, sizeof(status));
+  return written + sizeof(status);
+}
+
+static void *worker_thread(void *opaque) {
+  struct VirtioBlk *blk = opaque;
+  struct Virtio *virtio = &blk->virtio;
+  struct VirtioChain chain;
+  pthread_mutex_lock(&virtio->lock);
+  while (blk->running) {
+    if (virtio_pop(virtio, 0, &chain)) {
+      pthread_mutex_unlock(&virtio->lock);
+      u32 written = handle_request(blk, &chain);
+      pthread_mutex_lock(&virtio->lock);
+      virtio_push(virtio, 0, &chain, written);
+      continue;
+    }
+    // The queue is empty and the last worker to finish interrupts the driver
+    // once for all requests that completed since it was last empty
+    if (0 == virtio->in_flight) {
+      virtio_notify(virtio, 0);
+    }
+    pthread_cond_wait(&blk->work, &virtio->lock);
+  }
+  pthread_mutex_unlock(&virtio->lock);
+  return NULL;
+}
+
+static void blk_notify(void *opaque, u32 queue) {
+  struct VirtioBlk *blk = opaque;
+  (void)queue;
+  pthread_cond_broadcast(&blk->work);
+}
+
+static u64 blk_read_config(void *opaque, u64 offset, u8 length) {
+  struct VirtioBlk *blk = opaque;
+  // Only the capacity in sectors is there
+  u64 capacity = blk->size / VIRTIO_BLK_SECTOR_SIZE;
+  u64 value = 0;
+  if (offset < sizeof(capacity) && length <= sizeof(capacity) - offset) {
+    memcpy(&value, (u8 *)&capacity + offset, length);
+  }
+  return value;
+}
+
+bool virtio_blk_init(struct VirtioBlk *blk, struct Memory *mem, u64 base,
+                     struct Plic *plic, u32 irq, const char *path,
+                     bool copy_on_write) {
+  blk->running = false;
+  blk->copy_on_write = copy_on_write;
+  blk->read_only = false;
+  // A copy on write image is never written to
+  blk->fd = open(path, copy_on_write ? O_RDONLY : O_RDWR);
+  if (-1 == blk->fd && !copy_on_write && (EACCES == errno || EROFS == errno)) {
+    blk->read_only = true;
+    blk->fd = open(path, O_RDONLY);
+  }
+  if (-1 == blk->fd) {
+    perror("open");
+    return false;
+  }
+  struct stat st;
+  if (-1 == fstat(blk->fd, &st)) {
+    perror("fstat");
+    close(blk->fd);
+    return false;
+  }
+  blk->size = st.st_size;
+  if (blk->size < VIRTIO_BLK_SECTOR_SIZE) {
+    fprintf(stderr, "%s is smaller than a sector\n", path);
+    close(blk->fd);
+    return false;
+  }
+  int prot = blk->read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+  blk->disk = mmap(NULL, blk->size, prot,
+                   copy_on_write ? MAP_PRIVATE : MAP_SHARED, blk->fd, 0);
+  if (MAP_FAILED == blk->disk) {
+    perror("mmap");
+    close(blk->fd);
+    return false;
+  }
+  u64 features = VIRTIO_F_VERSION_1 | VIRTIO_BLK_F_FLUSH;
+  if (blk->read_only) {
+    features |= VIRTIO_BLK_F_RO;
+  }
+  pthread_cond_init(&blk->work, NULL);
+  if (!virtio_init(&blk->virtio, mem, base, plic, irq, VIRTIO_ID_BLOCK,
+                   features, 1)) {
+    return false;
+  }
+  blk->virtio.opaque = blk;
+  blk->virtio.notify = blk_notify;
+  blk->virtio.read_config = blk_read_config;
+  return true;
+}
+
+static void stop_workers(struct VirtioBlk *blk, u32 num_workers) {
+  pthread_mutex_lock(&blk->virtio.lock);
+  blk->running = false;
+  pthread_cond_broadcast(&blk->work);
+  pthread_mutex_unlock(&blk->virtio.lock);
+  for (u32 i = 0; i < num_workers; i++) {
+    pthread_join(blk->workers[i], NULL);
+  }
+}
+
+bool virtio_blk_start(struct VirtioBlk *blk) {
+  blk->running = true;
+  for (u32 i = 0; i < VIRTIO_BLK_WORKERS; i++) {
+    int rc = pthread_create(&blk->workers[i], NULL, worker_thread, blk);
+    if (0 != rc) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      stop_workers(blk, i);
+      return false;
+    }
+  }
+  return true;
+}
+
+void virtio_blk_reset_disk(struct VirtioBlk *blk) {
+  // Dropping the private pages of the mapping brings back the image
+  if (blk->copy_on_write &&
+      -1 == madvise(blk->disk, blk->size, MADV_DONTNEED)) {
+    perror("madvise");
+  }
+}
+
+void virtio_blk_destroy(struct VirtioBlk *blk) {
+  if (blk->running) {
+    stop_workers(blk, VIRTIO_BLK_WORKERS);
+  }
+  virtio_destroy(&blk->virtio);
+  pthread_cond_destroy(&blk->work);
+  munmap(blk->disk, blk->size);
+  close(blk->fd);
+}
@@ -0,0 +1,44 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+#include "mmu.h"
+#include "plic.h"
+#include "types.h"
+#include "virtio.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+// Requests in flight at the same time, each on its own thread
+#define VIRTIO_BLK_WORKERS 4
+
+// virtio block device backed by a disk image. The image is mapped into the
+// emulator, so requests are a single copy between the mapping and guest RAM
+// done by the workers, and the host page cache does the actual I/O.
+// The driver is interrupted once all requests it made available are done.
+struct VirtioBlk {
+  struct Virtio virtio;
+  // Signalled with the lock of virtio when there may be new requests
+  pthread_cond_t work;
+  pthread_t workers[VIRTIO_BLK_WORKERS];
+  bool running;
+  int fd;
+  u8 *disk;
+  u64 size;
+  bool read_only;
+  // Writes stay in the emulator instead of going to the image, see
+  // virtio_blk_reset_disk()
+  bool copy_on_write;
+};
+
+// Maps the image at path, privately if copy_on_write is set
+bool virtio_blk_init(struct VirtioBlk *blk, struct Memory *mem, u64 base,
+                     struct Plic *plic, u32 irq, const char *path,
+                     bool copy_on_write);
+// The workers do not survive a fork, so they are started by the process
+// running the harts
+bool virtio_blk_start(struct VirtioBlk *blk);
+// Drops everything written to a copy on write image, the device has to be
+// paused
+void virtio_blk_reset_disk(struct VirtioBlk *blk);
+void virtio_blk_destroy(struct VirtioBlk *blk);
+#endif // VIRTIO_BLK_H
@@ -0,0 +1,346 @@
+// virtio network device, see struct VirtioNet.
+#include "virtio_net.h"
+#include "virtio.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define VIRTIO_NET_F_MAC (1ULL << 5)
+
+#define VIRTIO_NET_RX 0
+#define VIRTIO_NET_TX 1
+
+// Frames moved per queue before the I/O thread looks at the other one
+#define VIRTIO_NET_BATCH VIRTIO_QUEUE_SIZE
+
+// Comes before every frame in the buffers. It is all zero without any of the
+// offloads, which are not offered, except that a received frame always
+// takes a single chain.
+struct VirtioNetHeader {
+  u8 flags;
+  u8 gso_type;
+  u16 hdr_len;
+  u16 gso_size;
+  u16 csum_start;
+  u16 csum_offset;
+  u16 num_buffers;
+};
+
+// Must be called with the lock held
+static void wake_io_thread(struct VirtioNet *net) {
+  if (net->wake_pending) {
+    return;
+  }
+  net->wake_pending = true;
+  u8 c = 0;
+  write(net->wake_pipe[1], &c, 1);
+}
+
+// Drops frames that do not fit
+static void send_frame(struct VirtioNet *net, u32 length) {
+  if (!net->framed) {
+    sendto(net->tx_fd, net->tx_frame, length, MSG_DONTWAIT,
+           (const struct sockaddr *)&net->peer, sizeof(net->peer));
+    return;
+  }
+  // Writes of up to PIPE_BUF bytes to a pipe are never split, so the reader
+  // always finds whole frames
+  u8 record[sizeof(u32) + VIRTIO_NET_MAX_FRAME];
+  memcpy(record, &length, sizeof(length));
+  memcpy(record + sizeof(length), net->tx_frame, length);
+  write(net->tx_fd, record, sizeof(length) + length);
+}
+
+// Fills rx_frame, returns false if there is nothing to receive
+static bool receive_frame(struct VirtioNet *net) {
+  if (!net->framed) {
+    for (;;) {
+      ssize_t rc = recv(net->rx_fd, net->rx_frame, sizeof(net->rx_frame),
+                        MSG_DONTWAIT | MSG_TRUNC);
+      if (rc <= 0) {
+        return false;
+      }
+      if ((size_t)rc <= sizeof(net->rx_frame)) {
+        net->rx_length = rc;
+        return true;
+      }
+    }
+  }
+  for (;;) {
+    u32 length;
+    if (sizeof(length) != read(net->rx_fd, &length, sizeof(length))) {
+      return false;
+    }
+    // The rest of the record is already in the pipe
+    if (length <= sizeof(net->rx_frame)) {
+      if ((ssize_t)length != read(net->rx_fd, net->rx_frame, length)) {
+        return false;
+      }
+      net->rx_length = length;
+      return true;
+    }
+    while (length > 0) {
+      u32 n = length < sizeof(net->rx_frame) ? length : sizeof(net->rx_frame);
+      if (read(net->rx_fd, net->rx_frame, n) <= 0) {
+        return false;
+      }
+      length -= n;
+    }
+  }
+}
+
+// Returns true if it stopped before the queue was empty. The driver does not
+// notify the queue again then.
+static bool transmit(struct VirtioNet *net) {
+  struct Virtio *virtio = &net->virtio;
+  struct VirtioChain chain;
+  u32 sent = 0;
+  pthread_mutex_lock(&virtio->lock);
+  while (sent < VIRTIO_NET_BATCH &&
+         virtio_pop(virtio, VIRTIO_NET_TX, &chain)) {
+    pthread_mutex_unlock(&virtio->lock);
+    u64 length = virtio_chain_readable(&chain);
+    if (length >= sizeof(struct VirtioNetHeader) &&
+        length - sizeof(struct VirtioNetHeader) <= VIRTIO_NET_MAX_FRAME) {
+      length -= sizeof(struct VirtioNetHeader);
+      virtio_chain_read(&chain, sizeof(struct VirtioNetHeader), net->tx_frame,
+                        length);
+      send_frame(net, length);
+    }
+    pthread_mutex_lock(&virtio->lock);
+    virtio_push(virtio, VIRTIO_NET_TX, &chain, 0);
+    sent++;
+  }
+  virtio_notify(virtio, VIRTIO_NET_TX);
+  pthread_mutex_unlock(&virtio->lock);
+  return VIRTIO_NET_BATCH == sent;
+}
+
+// A frame that does not fit into the chain is cut short, which does not
+// happen with a driver that follows the spec. Frames left over after a batch
+// are still in the backend, which wakes the I/O thread up again.
+static void receive(struct VirtioNet *net) {
+  struct Virtio *virtio = &net->virtio;
+  struct VirtioChain chain;
+  struct VirtioNetHeader header = {0, 0, 0, 0, 0, 0, 1};
+  for (u32 i = 0; i < VIRTIO_NET_BATCH; i++) {
+    if (0 == net->rx_length && !receive_frame(net)) {
+      break;
+    }
+    pthread_mutex_lock(&virtio->lock);
+    bool popped = virtio_pop(virtio, VIRTIO_NET_RX, &chain);
+    pthread_mutex_unlock(&virtio->lock);
+    // The frame waits for the driver to make buffers available
+    if (!popped) {
+      break;
+    }
+    u64 written = virtio_chain_write(virtio, &chain, 0, &header,
+                                     sizeof(header));
+    written += virtio_chain_write(virtio, &chain, sizeof(header),
+                                  net->rx_frame, net->rx_length);
+    net->rx_length = 0;
+    pthread_mutex_lock(&virtio->lock);
+    virtio_push(virtio, VIRTIO_NET_RX, &chain, written);
+    pthread_mutex_unlock(&virtio->lock);
+  }
+  pthread_mutex_lock(&virtio->lock);
+  virtio_notify(virtio, VIRTIO_NET_RX);
+  pthread_mutex_unlock(&virtio->lock);
+}
+
+static void *net_io_thread(void *opaque) {
+  struct VirtioNet *net = opaque;
+  for (;;) {
+    pthread_mutex_lock(&net->virtio.lock);
+    bool running = net->running;
+    pthread_mutex_unlock(&net->virtio.lock);
+    if (!running) {
+      break;
+    }
+    bool tx_pending = transmit(net);
+    receive(net);
+
+    struct pollfd fds[2] = {
+        {.fd = net->wake_pipe[0], .events = POLLIN},
+        {.fd = net->rx_fd, .events = POLLIN},
+    };
+    // Stop polling the backend while a frame waits for buffers
+    nfds_t nfds = net->rx_length ? 1 : 2;
+    int rc = poll(fds, nfds, tx_pending ? 0 : -1);
+    if (rc > 0 && (fds[0].revents & POLLIN)) {
+      u8 drain[64];
+      read(net->wake_pipe[0], drain, sizeof(drain));
+      pthread_mutex_lock(&net->virtio.lock);
+      net->wake_pending = false;
+      pthread_mutex_unlock(&net->virtio.lock);
+    }
+  }
+  return NULL;
+}
+
+static void net_notify(void *opaque, u32 queue) {
+  struct VirtioNet *net = opaque;
+  (void)queue;
+  wake_io_thread(net);
+}
+
+static u64 net_read_config(void *opaque, u64 offset, u8 length) {
+  struct VirtioNet *net = opaque;
+  // Only the MAC address is there
+  u64 value = 0;
+  if (offset < sizeof(net->mac) && length <= sizeof(net->mac) - offset) {
+    memcpy(&value, net->mac + offset, length);
+  }
+  return value;
+}
+
+static bool set_address(struct sockaddr_un *address, const char *path) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    fprintf(stderr, "%s is too long for a socket\n", path);
+    return false;
+  }
+  strcpy(address->sun_path, path);
+  return true;
+}
+
+static bool open_socket(struct VirtioNet *net, const char *local,
+                        const char *peer) {
+  struct sockaddr_un address;
+  if (!set_address(&address, local) || !set_address(&net->peer, peer)) {
+    return false;
+  }
+  net->rx_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (-1 == net->rx_fd) {
+    perror("socket");
+    return false;
+  }
+  // Left behind by an earlier run
+  unlink(local);
+  if (-1 == bind(net->rx_fd, (const struct sockaddr *)&address,
+                 sizeof(address))) {
+    perror("bind");
+    close(net->rx_fd);
+    return false;
+  }
+  net->tx_fd = net->rx_fd;
+  net->framed = false;
+  return true;
+}
+
+// Opening a FIFO for reading and writing does not wait for the other end
+static bool open_pipes(struct VirtioNet *net, const char *in,
+                       const char *out) {
+  net->rx_fd = open(in, O_RDWR | O_NONBLOCK);
+  if (-1 == net->rx_fd) {
+    perror("open");
+    return false;
+  }
+  net->tx_fd = open(out, O_RDWR | O_NONBLOCK);
+  if (-1 == net->tx_fd) {
+    perror("open");
+    close(net->rx_fd);
+    return false;
+  }
+  net->framed = true;
+  return true;
+}
+
+// Splits "kind:first,second" into its parts in buffer
+static bool parse_backend(const char *backend, char *buffer, u64 size,
+                          const char **kind, const char **first,
+                          const char **second) {
+  if (strlen(backend) >= size) {
+    return false;
+  }
+  strcpy(buffer, backend);
+  char *colon = strchr(buffer, ':');
+  char *comma = colon ? strchr(colon, ',') : NULL;
+  if (!comma || colon + 1 == comma || '\0' == comma[1]) {
+    return false;
+  }
+  *colon = *comma = '\0';
+  *kind = buffer;
+  *first = colon + 1;
+  *second = comma + 1;
+  return true;
+}
+
+bool virtio_net_init(struct VirtioNet *net, struct Memory *mem, u64 base,
+                     struct Plic *plic, u32 irq, const char *backend) {
+  char buffer[4096];
+  const char *kind, *first, *second;
+  if (!parse_backend(backend, buffer, sizeof(buffer), &kind, &first,
+                     &second)) {
+    fprintf(stderr, "Bad network backend %s\n", backend);
+    return false;
+  }
+  bool ok;
+  if (0 == strcmp(kind, "unix")) {
+    ok = open_socket(net, first, second);
+  } else if (0 == strcmp(kind, "pipe")) {
+    ok = open_pipes(net, first, second);
+  } else {
+    fprintf(stderr, "Bad network backend %s\n", backend);
+    return false;
+  }
+  if (!ok) {
+    return false;
+  }
+  // Locally administered, FNV-1a of the local path for the rest
+  u32 hash = 2166136261U;
+  for (const char *c = first; *c; c++) {
+    hash = (hash ^ (u8)*c) * 16777619U;
+  }
+  u8 mac[6] = {0x02, 'r', '5', hash >> 16, hash >> 8, hash};
+  memcpy(net->mac, mac, sizeof(mac));
+  net->rx_length = 0;
+  net->running = false;
+  net->wake_pending = false;
+  if (-1 == pipe(net->wake_pipe)) {
+    perror("pipe");
+    return false;
+  }
+  fcntl(net->wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(net->wake_pipe[1], F_SETFL, O_NONBLOCK);
+  if (!virtio_init(&net->virtio, mem, base, plic, irq, VIRTIO_ID_NET,
+                   VIRTIO_F_VERSION_1 | VIRTIO_NET_F_MAC, 2)) {
+    return false;
+  }
+  net->virtio.opaque = net;
+  net->virtio.notify = net_notify;
+  net->virtio.read_config = net_read_config;
+  return true;
+}
+
+bool virtio_net_start(struct VirtioNet *net) {
+  net->running = true;
+  int rc = pthread_create(&net->io_thread, NULL, net_io_thread, net);
+  if (0 != rc) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+    net->running = false;
+    return false;
+  }
+  return true;
+}
+
+void virtio_net_destroy(struct VirtioNet *net) {
+  if (net->running) {
+    pthread_mutex_lock(&net->virtio.lock);
+    net->running = false;
+    wake_io_thread(net);
+    pthread_mutex_unlock(&net->virtio.lock);
+    pthread_join(net->io_thread, NULL);
+  }
+  virtio_destroy(&net->virtio);
+  close(net->wake_pipe[0]);
+  close(net->wake_pipe[1]);
+  if (net->tx_fd != net->rx_fd) {
+    close(net->tx_fd);
+  }
+  close(net->rx_fd);
+}
@@ -0,0 +1,60 @@
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+#include "mmu.h"
+#include "plic.h"
+#include "types.h"
+#include "virtio.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/un.h>
+
+// The slot after the disk
+#define VIRTIO_NET_BASE (VIRTIO_BASE + VIRTIO_SIZE)
+
+// Ethernet frame without the FCS, with a VLAN tag
+#define VIRTIO_NET_MAX_FRAME 1518
+
+// virtio network device that exchanges Ethernet frames with a local backend
+// instead of the host network:
+//
+//   unix:LOCAL,PEER  a datagram socket bound to LOCAL, which sends to PEER
+//   pipe:IN,OUT      reads from IN and writes to OUT, usually FIFOs, with
+//                    the length of every frame in a u32 in host byte order
+//                    in front of it
+//
+// Two emulators are connected by swapping the paths. Frames that cannot be
+// sent right away are dropped like on a real network, so a peer that stops
+// reading never stops the guest.
+//
+// A single I/O thread moves the frames. It sends and receives everything
+// there is before it interrupts the driver, and with VIRTIO_F_RING_EVENT_IDX
+// the driver only notifies queues that ran empty.
+struct VirtioNet {
+  struct Virtio virtio;
+  pthread_t io_thread;
+  bool running;
+  // Written to wake the I/O thread up when a queue is notified
+  int wake_pipe[2];
+  bool wake_pending;
+  int rx_fd;
+  int tx_fd;
+  // Set for pipes, which need the length of the frames
+  bool framed;
+  // Where the socket sends to
+  struct sockaddr_un peer;
+  u8 mac[6];
+  // A frame that was received while the driver had no buffers for it
+  u8 rx_frame[VIRTIO_NET_MAX_FRAME];
+  u32 rx_length;
+  u8 tx_frame[VIRTIO_NET_MAX_FRAME];
+};
+
+// Opens the backend, see struct VirtioNet for the syntax. The MAC address is
+// derived from the local path, so connected emulators have different ones.
+bool virtio_net_init(struct VirtioNet *net, struct Memory *mem, u64 base,
+                     struct Plic *plic, u32 irq, const char *backend);
+// The I/O thread does not survive a fork, so it is started by the process
+// running the harts
+bool virtio_net_start(struct VirtioNet *net);
+void virtio_net_destroy(struct VirtioNet *net);
+#endif // VIRTIO_NET_H